@@ -0,0 +1,272 @@
+#include "BrickStore.h"
+
+#include <helper_math.h>
+#include <algorithm>
+#include <iostream>
+
+static const int brickVoxels = BRICK_STORE_BRICK_SIZE * BRICK_STORE_BRICK_SIZE * BRICK_STORE_BRICK_SIZE;
+
+BrickStore::BrickStore(const char* brickFile, int3 _size, float3 _spacing, size_t memoryBudget)
+{
+	size = _size;
+	spacing = _spacing;
+	gridSize = make_int3((size.x + BRICK_STORE_BRICK_SIZE - 1) / BRICK_STORE_BRICK_SIZE,
+		(size.y + BRICK_STORE_BRICK_SIZE - 1) / BRICK_STORE_BRICK_SIZE,
+		(size.z + BRICK_STORE_BRICK_SIZE - 1) / BRICK_STORE_BRICK_SIZE);
+	int numBricks = gridSize.x * gridSize.y * gridSize.z;
+	capacity = std::max((int)(memoryBudget / (brickVoxels * sizeof(float))), 1);
+
+	file.open(brickFile, std::ios::binary);
+	if (!file.is_open()){
+		std::cout << "brick file " << brickFile << " cannot be opened" << std::endl;
+	}
+
+	pageTable.resize(numBricks);
+	lruPos.resize(numBricks);
+	queued.resize(numBricks, 0);
+	prefetchThread = std::thread(&BrickStore::prefetchLoop, this);
+}
+
+BrickStore::~BrickStore()
+{
+	{
+		std::unique_lock<std::mutex> lock(mtx);
+		stopping = true;
+	}
+	cvPrefetch.notify_all();
+	prefetchThread.join();
+}
+
+bool BrickStore::convertRawFile(const char* rawFile, int3 size, const char* brickFile)
+{
+	std::ifstream in(rawFile, std::ios::binary);
+	std::ofstream out(brickFile, std::ios::binary);
+	if (!in.is_open() || !out.is_open()){
+		std::cout << "cannot convert " << rawFile << " into bricks" << std::endl;
+		return false;
+	}
+	const int B = BRICK_STORE_BRICK_SIZE;
+	int3 gridSize = make_int3((size.x + B - 1) / B, (size.y + B - 1) / B, (size.z + B - 1) / B);
+	std::vector<float> row(size.x);
+	std::vector<float> bricks(gridSize.x * brickVoxels);
+
+	//one row of bricks along x at a time, which are consecutive in the file
+	for (int bz = 0; bz < gridSize.z; bz++){
+		for (int by = 0; by < gridSize.y; by++){
+			std::fill(bricks.begin(), bricks.end(), 0.0f);
+			for (int k = 0; k < B && bz * B + k < size.z; k++){
+				for (int j = 0; j < B && by * B + j < size.y; j++){
+					std::streamoff offset = ((std::streamoff)(bz * B + k) * size.y + (by * B + j)) * size.x * sizeof(float);
+					in.seekg(offset);
+					in.read((char*)&(row[0]), size.x * sizeof(float));
+					for (int x = 0; x < size.x; x++){
+						bricks[(x / B) * brickVoxels + (k * B + j) * B + x % B] = row[x];
+					}
+				}
+			}
+			out.write((const char*)&(bricks[0]), bricks.size() * sizeof(float));
+		}
+	}
+	return in.good() && out.good();
+}
+
+BrickStore::BrickData BrickStore::load(int id)
+{
+	std::shared_ptr<std::vector<float>> data = std::make_shared<std::vector<float>>(brickVoxels);
+	std::unique_lock<std::mutex> lock(fileMtx);
+	file.seekg((std::streamoff)id * brickVoxels * sizeof(float));
+	file.read((char*)&((*data)[0]), brickVoxels * sizeof(float));
+	return data;
+}
+
+//needs mtx
+void BrickStore::touch(int id)
+{
+	lru.splice(lru.begin(), lru, lruPos[id]);
+}
+
+BrickStore::BrickData BrickStore::insert(int id, BrickData data)
+{
+	std::unique_lock<std::mutex> lock(mtx);
+	//another thread may have loaded the same brick meanwhile
+	if (pageTable[id] != 0){
+		touch(id);
+		return pageTable[id];
+	}
+	if (numResident >= capacity){
+		int victim = lru.back();
+		lru.pop_back();
+		pageTable[victim] = 0;
+		numResident--;
+	}
+	pageTable[id] = data;
+	lru.push_front(id);
+	lruPos[id] = lru.begin();
+	numResident++;
+	numLoads++;
+	return data;
+}
+
+BrickStore::BrickData BrickStore::getBrick(int id)
+{
+	{
+		std::unique_lock<std::mutex> lock(mtx);
+		if (pageTable[id] != 0){
+			touch(id);
+			numHits++;
+			return pageTable[id];
+		}
+	}
+	return insert(id, load(id));
+}
+
+BrickStore::BrickData BrickStore::getBrickIfResident(int id)
+{
+	std::unique_lock<std::mutex> lock(mtx);
+	if (pageTable[id] != 0)
+		touch(id);
+	return pageTable[id];
+}
+
+float BrickStore::getVoxel(int x, int y, int z)
+{
+	const int B = BRICK_STORE_BRICK_SIZE;
+	BrickData b = getBrick(brickIndex(make_int3(x / B, y / B, z / B)));
+	return (*b)[((z % B) * B + y % B) * B + x % B];
+}
+
+void BrickStore::requestRegion(int3 voxelMin, int3 voxelMax)
+{
+	const int B = BRICK_STORE_BRICK_SIZE;
+	int3 bMin = clamp(make_int3(voxelMin.x / B, voxelMin.y / B, voxelMin.z / B), make_int3(0, 0, 0), gridSize - 1);
+	int3 bMax = clamp(make_int3(voxelMax.x / B, voxelMax.y / B, voxelMax.z / B), make_int3(0, 0, 0), gridSize - 1);
+	for (int k = bMin.z; k <= bMax.z; k++){
+		for (int j = bMin.y; j <= bMax.y; j++){
+			for (int i = bMin.x; i <= bMax.x; i++){
+				getBrick(brickIndex(make_int3(i, j, k)));
+			}
+		}
+	}
+}
+
+//bricks are given with their priority, smaller first. they are queued before the bricks of the older requests, which become stale as the view
+//or the tunnel moves. at most capacity bricks are queued, so that the prefetch does not evict its own bricks, and the oldest requests are dropped first
+void BrickStore::enqueue(std::vector<std::pair<float, int>> &bricks)
+{
+	std::sort(bricks.begin(), bricks.end());
+	{
+		std::unique_lock<std::mutex> lock(mtx);
+		std::deque<int> q;
+		int n = std::min((int)bricks.size(), capacity);
+		for (int i = 0; i < n; i++){
+			int id = bricks[i].second;
+			if (pageTable[id] == 0 && queued[id] != 2){
+				queued[id] = 2; //in the new request
+				q.push_back(id);
+			}
+		}
+		for (int i = 0; i < prefetchQueue.size(); i++){
+			int id = prefetchQueue[i];
+			if (queued[id] == 2)
+				continue;
+			if (q.size() < capacity)
+				q.push_back(id);
+			else
+				queued[id] = 0;
+		}
+		for (int i = 0; i < q.size(); i++)
+			queued[q[i]] = 1;
+		prefetchQueue.swap(q);
+	}
+	cvPrefetch.notify_one();
+}
+
+void BrickStore::prefetchFrustum(const float modelview[16], const float projection[16])
+{
+	const int B = BRICK_STORE_BRICK_SIZE;
+	std::vector<std::pair<float, int>> bricks;
+	for (int k = 0; k < gridSize.z; k++){
+		for (int j = 0; j < gridSize.y; j++){
+			for (int i = 0; i < gridSize.x; i++){
+				//the brick is culled only when all its corners are outside of the same clip plane
+				int outside[6] = { 0, 0, 0, 0, 0, 0 };
+				float minDepth = 1e30f;
+				for (int c = 0; c < 8; c++){
+					float3 p = make_float3((i + (c & 1)) * B, (j + ((c >> 1) & 1)) * B, (k + (c >> 2)) * B) * spacing;
+					float4 e = make_float4(
+						modelview[0] * p.x + modelview[4] * p.y + modelview[8] * p.z + modelview[12],
+						modelview[1] * p.x + modelview[5] * p.y + modelview[9] * p.z + modelview[13],
+						modelview[2] * p.x + modelview[6] * p.y + modelview[10] * p.z + modelview[14],
+						1.0f);
+					float4 clip = make_float4(
+						projection[0] * e.x + projection[4] * e.y + projection[8] * e.z + projection[12],
+						projection[1] * e.x + projection[5] * e.y + projection[9] * e.z + projection[13],
+						projection[2] * e.x + projection[6] * e.y + projection[10] * e.z + projection[14],
+						projection[3] * e.x + projection[7] * e.y + projection[11] * e.z + projection[15]);
+					outside[0] += clip.x < -clip.w;
+					outside[1] += clip.x > clip.w;
+					outside[2] += clip.y < -clip.w;
+					outside[3] += clip.y > clip.w;
+					outside[4] += clip.z < -clip.w;
+					outside[5] += clip.z > clip.w;
+					minDepth = fminf(minDepth, -e.z);
+				}
+				bool culled = false;
+				for (int p = 0; p < 6; p++)
+					culled = culled || outside[p] == 8;
+				if (!culled)
+					bricks.push_back(std::make_pair(minDepth, brickIndex(make_int3(i, j, k))));
+			}
+		}
+	}
+	enqueue(bricks);
+}
+
+void BrickStore::prefetchTunnel(float3 tunnelStart, float3 tunnelEnd, float radius)
+{
+	const int B = BRICK_STORE_BRICK_SIZE;
+	float3 end = tunnelEnd + (tunnelEnd - tunnelStart);
+	float3 axis = end - tunnelStart;
+	float len2 = fmaxf(dot(axis, axis), 1e-6f);
+	//half diagonal of a brick, so that a brick is taken when any part of it may be within radius
+	float reach = radius + 0.5f * length(make_float3(B, B, B) * spacing);
+
+	std::vector<std::pair<float, int>> bricks;
+	for (int k = 0; k < gridSize.z; k++){
+		for (int j = 0; j < gridSize.y; j++){
+			for (int i = 0; i < gridSize.x; i++){
+				float3 center = (make_float3(i, j, k) + 0.5f) * B * spacing;
+				float t = clamp(dot(center - tunnelStart, axis) / len2, 0.0f, 1.0f);
+				float d = length(center - (tunnelStart + axis * t));
+				if (d <= reach)
+					bricks.push_back(std::make_pair(t, brickIndex(make_int3(i, j, k))));
+			}
+		}
+	}
+	enqueue(bricks);
+}
+
+void BrickStore::prefetchLoop()
+{
+	while (true){
+		int id;
+		{
+			std::unique_lock<std::mutex> lock(mtx);
+			cvPrefetch.wait(lock, [this]{ return stopping || !prefetchQueue.empty(); });
+			if (stopping)
+				return;
+			id = prefetchQueue.front();
+			prefetchQueue.pop_front();
+			queued[id] = 0;
+			if (pageTable[id] != 0)
+				continue;
+		}
+		insert(id, load(id));
+	}
+}
+
+size_t BrickStore::GetResidentBytes()
+{
+	std::unique_lock<std::mutex> lock(mtx);
+	return (size_t)numResident * brickVoxels * sizeof(float);
+}
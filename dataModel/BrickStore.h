@@ -0,0 +1,96 @@
+#ifndef BRICK_STORE_H
+#define BRICK_STORE_H
+
+#include <memory>
+#include <vector>
+#include <list>
+#include <deque>
+#include <string>
+#include <fstream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <vector_types.h>
+
+//edge length in voxels of a brick of the store
+#define BRICK_STORE_BRICK_SIZE 32
+
+/*
+out-of-core volume, stored on disk as bricks of BRICK_STORE_BRICK_SIZE^3 floats, for volumes that do not fit in memory as Volume::values.
+the page table maps every brick to its resident data, if any. the resident bricks are kept in an lru cache limited by a memory budget,
+and a brick is read from the file on its first request after being evicted.
+a background thread loads the bricks queued by the prefetch functions, along the view frustum or along the deformation tunnel.
+the bricks of the latest prefetch are loaded first, and the older requests still queued are dropped beyond the capacity of the cache.
+all functions can be called from several threads at the same time.
+the data of a brick is shared, so a brick handed out stays valid for its user even if it is evicted meanwhile
+*/
+class BrickStore
+{
+public:
+	typedef std::shared_ptr<const std::vector<float>> BrickData;
+
+	//brickFile is written by convertRawFile(). memoryBudget is the size of the resident bricks, in bytes
+	BrickStore(const char* brickFile, int3 _size, float3 _spacing, size_t memoryBudget);
+	~BrickStore();
+
+	//converts a raw file of floats, x fastest as written by Volume::saveRawToFile(), into the bricked layout.
+	//the bricks at the border are padded with 0. only one row of bricks is held in memory at a time
+	static bool convertRawFile(const char* rawFile, int3 size, const char* brickFile);
+
+	int3 GetSize(){ return size; }
+	float3 GetSpacing(){ return spacing; }
+	int3 GetBrickGridSize(){ return gridSize; }
+	int brickIndex(int3 brick){ return (brick.z * gridSize.y + brick.y) * gridSize.x + brick.x; }
+
+	//the data of the brick, loaded from the file if it is not resident. blocks until loaded
+	BrickData getBrick(int id);
+	//0 if the brick is not resident
+	BrickData getBrickIfResident(int id);
+	//the voxel must be inside the volume
+	float getVoxel(int x, int y, int z);
+
+	//make the bricks overlapping the voxel range [voxelMin, voxelMax] resident before returning
+	void requestRegion(int3 voxelMin, int3 voxelMax);
+	//queue the bricks inside the view frustum for the background thread, nearest to the eye first.
+	//the matrices are column major, as given to Renderable::draw(), and map the local coordinates of the volume (voxel * spacing)
+	void prefetchFrustum(const float modelview[16], const float projection[16]);
+	//queue the bricks within radius of the tunnel, in local coordinates, nearest to tunnelStart first.
+	//the tunnel is extended beyond tunnelEnd by its own length, since the camera moves along it
+	void prefetchTunnel(float3 tunnelStart, float3 tunnelEnd, float radius);
+
+	//statistics
+	size_t GetResidentBytes();
+	std::atomic<int> numLoads{ 0 };
+	std::atomic<int> numHits{ 0 };
+
+private:
+	int3 size, gridSize;
+	float3 spacing;
+	int capacity; //max number of resident bricks
+
+	std::ifstream file;
+	std::mutex fileMtx;
+
+	//page table and lru list, guarded by mtx. the front of the lru list is the most recently used brick
+	std::mutex mtx;
+	std::vector<BrickData> pageTable;
+	std::list<int> lru;
+	std::vector<std::list<int>::iterator> lruPos;
+	int numResident = 0;
+
+	//prefetch queue, guarded by mtx. the front is loaded first
+	std::deque<int> prefetchQueue;
+	std::vector<char> queued; //per brick, 1 if in prefetchQueue
+	std::condition_variable cvPrefetch;
+	bool stopping = false;
+	std::thread prefetchThread;
+
+	BrickData load(int id);
+	BrickData insert(int id, BrickData data);
+	void touch(int id);
+	void enqueue(std::vector<std::pair<float, int>> &bricks);
+	void prefetchLoop();
+};
+
+#endif //BRICK_STORE_H
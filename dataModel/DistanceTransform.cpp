@@ -0,0 +1,141 @@
+#include "DistanceTransform.h"
+#include "ThreadPool.h"
+
+#include <cfloat>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+
+void DistanceTransform::transformLine(float* line, int n, float w, int* v, float* z, float* f)
+{
+	for (int q = 0; q < n; q++)
+		f[q] = line[q];
+
+	//lower envelope of the parabolas of the samples that have a feature along the previous axes.
+	//the samples without one are left out, so that no arithmetic is done on FLT_MAX
+	int k = -1;
+	for (int q = 0; q < n; q++){
+		if (f[q] == FLT_MAX)
+			continue;
+		float xq = q * w;
+		if (k < 0){
+			k = 0;
+			v[0] = q;
+			z[0] = -FLT_MAX;
+			z[1] = FLT_MAX;
+			continue;
+		}
+		float s;
+		while (true){
+			float xv = v[k] * w;
+			s = ((f[q] + xq * xq) - (f[v[k]] + xv * xv)) / (2 * (xq - xv));
+			if (s > z[k] || k == 0)
+				break;
+			k--;
+		}
+		k++;
+		v[k] = q;
+		z[k] = s;
+		z[k + 1] = FLT_MAX;
+	}
+	if (k < 0)
+		return;
+
+	k = 0;
+	for (int q = 0; q < n; q++){
+		float xq = q * w;
+		while (z[k + 1] < xq)
+			k++;
+		float d = xq - v[k] * w;
+		line[q] = d * d + f[v[k]];
+	}
+}
+
+void DistanceTransform::computeSquared(const char* feature, int3 size, float3 spacing, float* sqDist)
+{
+	const int nx = size.x, ny = size.y, nz = size.z;
+	const size_t sliceSize = (size_t)nx * ny;
+	const int maxLen = std::max(nx, std::max(ny, nz));
+
+	//x pass, from the feature: 0 on a feature, FLT_MAX elsewhere. one task per z slice
+	ThreadPool::global().parallelFor(nz, [&](int k){
+		std::vector<int> v(maxLen);
+		std::vector<float> z(maxLen + 1), f(maxLen);
+		for (int j = 0; j < ny; j++){
+			float* line = sqDist + k * sliceSize + (size_t)j * nx;
+			const char* ft = feature + k * sliceSize + (size_t)j * nx;
+			for (int i = 0; i < nx; i++)
+				line[i] = ft[i] ? 0.0f : FLT_MAX;
+			transformLine(line, nx, spacing.x, v.data(), z.data(), f.data());
+		}
+	});
+
+	//y pass. the strided lines are gathered into a contiguous buffer
+	ThreadPool::global().parallelFor(nz, [&](int k){
+		std::vector<int> v(maxLen);
+		std::vector<float> z(maxLen + 1), f(maxLen), line(ny);
+		for (int i = 0; i < nx; i++){
+			float* p = sqDist + k * sliceSize + i;
+			for (int j = 0; j < ny; j++)
+				line[j] = p[(size_t)j * nx];
+			transformLine(line.data(), ny, spacing.y, v.data(), z.data(), f.data());
+			for (int j = 0; j < ny; j++)
+				p[(size_t)j * nx] = line[j];
+		}
+	});
+
+	//z pass. one task per y row, so that a task walks consecutive x
+	ThreadPool::global().parallelFor(ny, [&](int j){
+		std::vector<int> v(maxLen);
+		std::vector<float> z(maxLen + 1), f(maxLen), line(nz);
+		for (int i = 0; i < nx; i++){
+			float* p = sqDist + (size_t)j * nx + i;
+			for (int k = 0; k < nz; k++)
+				line[k] = p[k * sliceSize];
+			transformLine(line.data(), nz, spacing.z, v.data(), z.data(), f.data());
+			for (int k = 0; k < nz; k++)
+				p[k * sliceSize] = line[k];
+		}
+	});
+}
+
+void DistanceTransform::compute(const char* feature, int3 size, float3 spacing, float* dist)
+{
+	computeSquared(feature, size, spacing, dist);
+	const size_t sliceSize = (size_t)size.x * size.y;
+	ThreadPool::global().parallelFor(size.z, [&](int k){
+		for (size_t p = k * sliceSize; p < (k + 1) * sliceSize; p++){
+			if (dist[p] != FLT_MAX)
+				dist[p] = sqrtf(dist[p]);
+		}
+	});
+}
+
+void DistanceTransform::computeFromOpacity(const float* values, int3 size, float3 spacing, const float4* transferFunc, int tfSize, float densityThr, float* dist)
+{
+	const size_t sliceSize = (size_t)size.x * size.y;
+	std::vector<char> feature(sliceSize * size.z);
+	ThreadPool::global().parallelFor(size.z, [&](int k){
+		for (size_t p = k * sliceSize; p < (k + 1) * sliceSize; p++){
+			float u = values[p] * tfSize - 0.5f;
+			int i0 = (int)floorf(u);
+			float a = u - i0;
+			int i1 = std::min(std::max(i0 + 1, 0), tfSize - 1);
+			i0 = std::min(std::max(i0, 0), tfSize - 1);
+			float opacity = (1 - a) * transferFunc[i0].w + a * transferFunc[i1].w;
+			feature[p] = opacity > densityThr;
+		}
+	});
+	compute(feature.data(), size, spacing, dist);
+}
+
+void DistanceTransform::computeFromLabels(const unsigned short* labels, int3 size, float3 spacing, float* dist)
+{
+	const size_t sliceSize = (size_t)size.x * size.y;
+	std::vector<char> feature(sliceSize * size.z);
+	ThreadPool::global().parallelFor(size.z, [&](int k){
+		for (size_t p = k * sliceSize; p < (k + 1) * sliceSize; p++)
+			feature[p] = labels[p] != 0;
+	});
+	compute(feature.data(), size, spacing, dist);
+}
@@ -0,0 +1,33 @@
+#ifndef DISTANCE_TRANSFORM_H
+#define DISTANCE_TRANSFORM_H
+
+#include <vector_types.h>
+
+/*
+exact euclidean distance transform of a binary volume, by one pass of 1D lower envelopes of parabolas per axis
+(Felzenszwalb and Huttenlocher, Distance Transforms of Sampled Functions). linear in the number of voxels.
+each pass is parallel over the lines of the pass on ThreadPool::global(), so it must not be called from inside a task of the pool.
+distances are in local units, i.e. voxel offsets scaled by the spacing of each axis
+*/
+class DistanceTransform
+{
+public:
+	//squared distance from every voxel to the nearest voxel with feature[i] != 0, x fastest.
+	//voxels have FLT_MAX if there is no feature at all
+	static void computeSquared(const char* feature, int3 size, float3 spacing, float* sqDist);
+	//the distance itself
+	static void compute(const char* feature, int3 size, float3 spacing, float* dist);
+
+	//distance to the voxels whose opacity is above densityThr. transferFunc is the host copy of the table of RayCastingParameters::d_transferFunc,
+	//read the same as by tex1D() on a normalized, linearly filtered and clamped texture
+	static void computeFromOpacity(const float* values, int3 size, float3 spacing, const float4* transferFunc, int tfSize, float densityThr, float* dist);
+	//distance to the labelled voxels, i.e. the ones with a label other than 0
+	static void computeFromLabels(const unsigned short* labels, int3 size, float3 spacing, float* dist);
+
+private:
+	//in place on a line of n samples of the squared distance along the previous axes, with samples w apart.
+	//v, z and f are work buffers of n, n+1 and n elements
+	static void transformLine(float* line, int n, float w, int* v, float* z, float* f);
+};
+
+#endif //DISTANCE_TRANSFORM_H
@@ -20,6 +20,7 @@ void Particle::init(std::vector<float4>  &_pos, std::vector<float> &_val)
 	val = _val;
 	numParticles = pos.size();
 	updateMaxMinValAndPos();
+	markChanged();
 }
 
 void Particle::updateMaxMinValAndPos()
@@ -83,6 +84,7 @@ void Particle::initForRendering(float s, float b)
 	hasInitedForRendering = true;
 	glyphSizeScale.assign(numParticles, s);
 	glyphBright.assign(numParticles, b);
+	markChanged();
 }
 
 
@@ -147,6 +149,25 @@ void Particle::reset()
 		glyphSizeScale.assign(numParticles, 1.0f);
 		glyphBright.assign(numParticles, 1.0f);
 	}
+	markChanged();
+}
+
+const std::vector<unsigned int>& Particle::GetChangeVersions()
+{
+	int numBlocks = (numParticles + PARTICLE_CHANGE_BLOCK - 1) / PARTICLE_CHANGE_BLOCK;
+	if (changeVersions.size() != numBlocks)
+		changeVersions.resize(numBlocks, 0);
+	return changeVersions;
+}
+
+void Particle::markChanged(int start, int end)
+{
+	GetChangeVersions();
+	changeCount++;
+	start = std::max(start, 0);
+	end = std::min(end, numParticles);
+	for (int b = start / PARTICLE_CHANGE_BLOCK; b * PARTICLE_CHANGE_BLOCK < end; b++)
+		changeVersions[b] = changeCount;
 }
 // !!! NOTE: result is not meaningful when no feature is loaded. Need to deal with this situation when calling this function. when no feature is loaded, return false 
 bool Particle::findClosetFeature(float3 aim, float3 & result, int & resid)
@@ -13,6 +13,9 @@
 #include <cuda_runtime.h>
 #include <helper_cuda.h>
 
+//number of particles per block of the change tracking of the rendering data
+const int PARTICLE_CHANGE_BLOCK = 1024;
+
 class Particle
 {
 public:
@@ -59,6 +62,12 @@ public:
 	void initForRendering(float s = 1.0f, float b = 1.0f);
 	std::vector<float> glyphBright;
 	std::vector<float> glyphSizeScale;
+	//change tracking of pos, glyphBright and glyphSizeScale, for the renderers that keep a gpu copy of them.
+	//whoever writes them reports the changed range [start, end), which bumps the version of the blocks of PARTICLE_CHANGE_BLOCK particles in it.
+	//a renderer uploads only the blocks whose version differs from the one it uploaded last
+	void markChanged(int start, int end);
+	void markChanged(){ markChanged(0, numParticles); }
+	const std::vector<unsigned int>& GetChangeVersions();
 	//used for feature freezing / snapping
 	bool isFreezingFeature = false;
 	bool isPickingFeature = false;
@@ -77,7 +86,8 @@ public:
 	void createSyntheticData(float3 _posMin, float3 _posMax, int N);
 
 private:
-
+	std::vector<unsigned int> changeVersions;
+	unsigned int changeCount = 0;
 };
 
 #endif
\ No newline at end of file
@@ -235,6 +235,7 @@ void PolyMesh::copyFrom(std::shared_ptr<PolyMesh> target, bool useParticle)
 		particle->feature = target->particle->feature;
 		particle->featureMin = target->particle->featureMin;
 		particle->featureMax = target->particle->featureMax;
+		particle->markChanged();
 
 		//do not need the following!!! the original PolyMesh has already changed the vertices!!!
 		//for the same reason, find_center_and_range will not work correctly
@@ -288,6 +289,7 @@ void PolyMesh::doShift(float3 shift)
 		}
 		particle->posMin += shift;
 		particle->posMax += shift;
+		particle->markChanged();
 	}
 }
 
@@ -0,0 +1,129 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+
+/*
+a small persistent pool of cpu worker threads, used by the cpu paths (offline/headless processing) that need data parallelism.
+the only supported pattern is parallelFor(), which blocks the caller until all tasks are done.
+the calling thread also works on the tasks. parallelFor() is not reentrant: do not call it from inside a task of the same pool
+*/
+class ThreadPool
+{
+public:
+	ThreadPool(int numThreads = 0)
+	{
+		if (numThreads <= 0){
+			numThreads = std::thread::hardware_concurrency();
+			if (numThreads <= 0)
+				numThreads = 1;
+		}
+		nextTask = 0;
+		//the calling thread is one of the workers
+		for (int i = 0; i < numThreads - 1; i++){
+			workers.push_back(std::thread(&ThreadPool::workerLoop, this));
+		}
+	};
+
+	~ThreadPool()
+	{
+		{
+			std::unique_lock<std::mutex> lock(mtx);
+			stopping = true;
+		}
+		cvStart.notify_all();
+		for (int i = 0; i < workers.size(); i++){
+			workers[i].join();
+		}
+	};
+
+	int size(){ return workers.size() + 1; }
+
+	//run func(i) for every i in [0, n). tasks are handed out dynamically, so uneven task costs are balanced
+	void parallelFor(int n, const std::function<void(int)> &func)
+	{
+		if (n <= 0)
+			return;
+		if (workers.size() == 0 || n == 1){
+			for (int i = 0; i < n; i++)
+				func(i);
+			return;
+		}
+
+		std::unique_lock<std::mutex> callLock(callMtx);
+		{
+			std::unique_lock<std::mutex> lock(mtx);
+			job = &func;
+			numTasks = n;
+			nextTask = 0;
+			numBusy = workers.size();
+			generation++;
+		}
+		cvStart.notify_all();
+
+		runTasks(func);
+
+		std::unique_lock<std::mutex> lock(mtx);
+		cvDone.wait(lock, [this]{ return numBusy == 0; });
+		job = 0;
+	};
+
+	//a process-wide pool, created on first use
+	static ThreadPool& global()
+	{
+		static ThreadPool pool;
+		return pool;
+	};
+
+private:
+	std::vector<std::thread> workers;
+
+	std::mutex callMtx; //serializes concurrent parallelFor() calls from different threads
+	std::mutex mtx;
+	std::condition_variable cvStart, cvDone;
+
+	const std::function<void(int)> *job = 0;
+	int numTasks = 0;
+	std::atomic<int> nextTask;
+	int numBusy = 0;
+	unsigned int generation = 0;
+	bool stopping = false;
+
+	void runTasks(const std::function<void(int)> &func)
+	{
+		int i;
+		while ((i = nextTask.fetch_add(1)) < numTasks){
+			func(i);
+		}
+	}
+
+	void workerLoop()
+	{
+		unsigned int seen = 0;
+		while (true){
+			const std::function<void(int)> *curJob;
+			{
+				std::unique_lock<std::mutex> lock(mtx);
+				cvStart.wait(lock, [&]{ return stopping || generation != seen; });
+				if (stopping)
+					return;
+				seen = generation;
+				curJob = job;
+			}
+
+			runTasks(*curJob);
+
+			std::unique_lock<std::mutex> lock(mtx);
+			numBusy--;
+			if (numBusy == 0)
+				cvDone.notify_all();
+		}
+	}
+};
+
+#endif
@@ -30,6 +30,7 @@ void TimeVaryingParticleDeformerManager::resetPolyMeshes()
 		//polyMeshes[i]->reset();
 		polyMeshes[i]->particle->posOrig = polyMeshesOri[i]->particle->posOrig;
 		polyMeshes[i]->particle->pos = polyMeshes[i]->particle->posOrig;
+		polyMeshes[i]->particle->markChanged();
 	}
 }
 
@@ -130,6 +131,7 @@ bool TimeVaryingParticleDeformerManager::process(float* modelview, float* projec
 				polyMesh->particle->pos[i] = polyMesh->particle->posOrig[i];
 			}
 		}
+		polyMesh->particle->markChanged();
 	}
 
 	positionBasedDeformProcessor->particleDataUpdated();
@@ -0,0 +1,204 @@
+#include "TimeVaryingVolume.h"
+#include "ThreadPool.h"
+
+#include <helper_math.h>
+#include <algorithm>
+
+TimeVaryingVolume::TimeVaryingVolume(std::shared_ptr<Volume> _volume, float _tolerance)
+{
+	volume = _volume;
+	tolerance = _tolerance;
+	const int B = TIME_VARYING_BRICK_SIZE;
+	int3 size = volume->size;
+	gridSize = make_int3((size.x + B - 1) / B, (size.y + B - 1) / B, (size.z + B - 1) / B);
+	first.assign(volume->values, volume->values + size.x * size.y * size.z);
+	last = first;
+}
+
+void TimeVaryingVolume::brickRange(int b, int3 &origin, int3 &extent)
+{
+	const int B = TIME_VARYING_BRICK_SIZE;
+	int3 size = volume->size;
+	origin = make_int3(b % gridSize.x, (b / gridSize.x) % gridSize.y, b / (gridSize.x * gridSize.y)) * B;
+	extent = make_int3(std::min(B, size.x - origin.x), std::min(B, size.y - origin.y), std::min(B, size.z - origin.z));
+}
+
+void TimeVaryingVolume::encode(const float* values, Delta &d)
+{
+	int3 size = volume->size;
+	int numBricks = gridSize.x * gridSize.y * gridSize.z;
+	std::vector<float> maxDiff(numBricks);
+
+	ThreadPool::global().parallelFor(numBricks, [&](int b){
+		int3 o, e;
+		brickRange(b, o, e);
+		float m = 0;
+		for (int k = o.z; k < o.z + e.z; k++){
+			for (int j = o.y; j < o.y + e.y; j++){
+				int row = (k * size.y + j) * size.x;
+				for (int i = o.x; i < o.x + e.x; i++){
+					m = std::max(m, fabsf(values[row + i] - last[row + i]));
+				}
+			}
+		}
+		maxDiff[b] = m;
+	});
+
+	//the changed bricks are stored in brick order
+	d.changed.resize(numBricks);
+	std::vector<int> offsets(numBricks, 0), scaleIdx(numBricks, -1);
+	int numValues = 0;
+	for (int b = 0; b < numBricks; b++){
+		d.changed[b] = maxDiff[b] > tolerance;
+		if (d.changed[b]){
+			int3 o, e;
+			brickRange(b, o, e);
+			offsets[b] = numValues;
+			numValues += e.x * e.y * e.z;
+			scaleIdx[b] = d.scales.size();
+			d.scales.push_back(maxDiff[b] / 32767.0f);
+		}
+	}
+	d.values.resize(numValues);
+
+	ThreadPool::global().parallelFor(numBricks, [&](int b){
+		if (!d.changed[b])
+			return;
+		int3 o, e;
+		brickRange(b, o, e);
+		float scale = d.scales[scaleIdx[b]];
+		short* q = &(d.values[offsets[b]]);
+		for (int k = o.z; k < o.z + e.z; k++){
+			for (int j = o.y; j < o.y + e.y; j++){
+				int row = (k * size.y + j) * size.x;
+				for (int i = o.x; i < o.x + e.x; i++){
+					*q = (short)roundf((values[row + i] - last[row + i]) / scale);
+					//keep the decoded value as the reference of the next delta
+					last[row + i] += *q * scale;
+					q++;
+				}
+			}
+		}
+	});
+}
+
+void TimeVaryingVolume::decode(const Delta &d, float* values)
+{
+	int3 size = volume->size;
+	int numBricks = gridSize.x * gridSize.y * gridSize.z;
+	std::vector<int> offsets(numBricks, 0), scaleIdx(numBricks, -1);
+	int numValues = 0, c = 0;
+	for (int b = 0; b < numBricks; b++){
+		if (d.changed[b]){
+			int3 o, e;
+			brickRange(b, o, e);
+			offsets[b] = numValues;
+			numValues += e.x * e.y * e.z;
+			scaleIdx[b] = c++;
+		}
+	}
+
+	ThreadPool::global().parallelFor(numBricks, [&](int b){
+		if (!d.changed[b])
+			return;
+		int3 o, e;
+		brickRange(b, o, e);
+		float scale = d.scales[scaleIdx[b]];
+		const short* q = &(d.values[offsets[b]]);
+		for (int k = o.z; k < o.z + e.z; k++){
+			for (int j = o.y; j < o.y + e.y; j++){
+				int row = (k * size.y + j) * size.x;
+				for (int i = o.x; i < o.x + e.x; i++){
+					values[row + i] += *q * scale;
+					q++;
+				}
+			}
+		}
+	});
+}
+
+void TimeVaryingVolume::addTimestep(const float* values)
+{
+	deltas.push_back(Delta());
+	encode(values, deltas.back());
+}
+
+//one copy per run of changed bricks along x
+std::vector<std::pair<int3, int3>> TimeVaryingVolume::upload(const std::vector<char> &changed)
+{
+	std::vector<std::pair<int3, int3>> regions;
+	const int B = TIME_VARYING_BRICK_SIZE;
+	int3 size = volume->size;
+	lastUploadBytes = 0;
+	for (int k = 0; k < gridSize.z; k++){
+		for (int j = 0; j < gridSize.y; j++){
+			int i = 0;
+			while (i < gridSize.x){
+				int b = (k * gridSize.y + j) * gridSize.x + i;
+				if (!changed[b]){
+					i++;
+					continue;
+				}
+				int runEnd = i;
+				while (runEnd + 1 < gridSize.x && changed[b + runEnd + 1 - i])
+					runEnd++;
+				int3 origin = make_int3(i, j, k) * B;
+				int3 extent = make_int3(std::min((runEnd + 1) * B, size.x) - origin.x, std::min(B, size.y - origin.y), std::min(B, size.z - origin.z));
+				if (volume->volumeCuda.content != 0)
+					volume->volumeCuda.VolumeCUDA_updateRegion(volume->values, size, origin, extent);
+				if (volume->originSaved && volume->volumeCudaOri.content != 0)
+					volume->volumeCudaOri.VolumeCUDA_updateRegion(volume->values, size, origin, extent);
+				lastUploadBytes += (size_t)extent.x * extent.y * extent.z * sizeof(float) * (volume->originSaved ? 2 : 1);
+				regions.push_back(std::make_pair(origin, origin + extent - 1));
+				i = runEnd + 1;
+			}
+		}
+	}
+	totalUploadBytes += lastUploadBytes;
+	return regions;
+}
+
+std::vector<std::pair<int3, int3>> TimeVaryingVolume::setTimestep(int t)
+{
+	t = std::min(std::max(t, 0), GetNumTimesteps() - 1);
+	if (t == curT){
+		lastUploadBytes = 0;
+		return std::vector<std::pair<int3, int3>>();
+	}
+
+	int numBricks = gridSize.x * gridSize.y * gridSize.z;
+	if (t == curT + 1){
+		decode(deltas[curT], volume->values);
+	}
+	else{
+		std::copy(first.begin(), first.end(), volume->values);
+		for (int s = 0; s < t; s++)
+			decode(deltas[s], volume->values);
+	}
+
+	//the bricks differing between the two timesteps are the ones changed by any delta in between
+	std::vector<char> changed(numBricks, 0);
+	for (int s = std::min(curT, t); s < std::max(curT, t); s++){
+		for (int b = 0; b < numBricks; b++)
+			changed[b] |= deltas[s].changed[b];
+	}
+	curT = t;
+	return upload(changed);
+}
+
+size_t TimeVaryingVolume::GetEncodedBytes()
+{
+	size_t bytes = 0;
+	for (int s = 0; s < deltas.size(); s++){
+		bytes += deltas[s].changed.size() + deltas[s].scales.size() * sizeof(float) + deltas[s].values.size() * sizeof(short);
+	}
+	return bytes;
+}
+
+float TimeVaryingVolume::GetChangedFraction(int t)
+{
+	if (t <= 0 || t >= GetNumTimesteps())
+		return 0;
+	const std::vector<char> &changed = deltas[t - 1].changed;
+	return (float)std::count(changed.begin(), changed.end(), 1) / changed.size();
+}
@@ -0,0 +1,65 @@
+#ifndef TIME_VARYING_VOLUME_H
+#define TIME_VARYING_VOLUME_H
+
+#include <memory>
+#include <vector>
+#include <utility>
+#include "Volume.h"
+
+//edge length in voxels of a brick of the delta encoding
+#define TIME_VARYING_BRICK_SIZE 16
+
+/*
+time-varying volume stored as the first timestep plus one delta per following timestep.
+a delta flags every brick as changed or unchanged, and keeps the changed bricks as 16 bit quantized differences to the previous timestep, with one scale per brick.
+a brick whose values all changed by at most tolerance is unchanged. the deltas are taken against the decoded previous timestep, so the error does not accumulate over time.
+setTimestep() decodes into volume->values and uploads only the changed bricks to volume->volumeCuda (and volumeCudaOri if saved).
+the changed bricks are returned as voxel ranges, e.g. for MacroCellGrid::update(), so the empty space information of the unchanged bricks is kept
+*/
+class TimeVaryingVolume
+{
+public:
+	//volume holds the first timestep in its values, and is decoded into in place
+	TimeVaryingVolume(std::shared_ptr<Volume> _volume, float _tolerance = 0);
+
+	//append the next timestep, of the same size as the volume
+	void addTimestep(const float* values);
+	int GetNumTimesteps(){ return deltas.size() + 1; }
+	int GetTimestep(){ return curT; }
+
+	//decode timestep t into the volume and upload its changed bricks. stepping forward applies one delta; other jumps decode again from the first timestep.
+	//returns the voxel ranges [min, max] (inclusive) that were uploaded, one per run of changed bricks along x
+	std::vector<std::pair<int3, int3>> setTimestep(int t);
+
+	std::shared_ptr<Volume> GetVolume(){ return volume; }
+	int3 GetBrickGridSize(){ return gridSize; }
+
+	//statistics
+	size_t lastUploadBytes = 0; //host to device bytes of the last setTimestep()
+	size_t totalUploadBytes = 0;
+	size_t GetEncodedBytes(); //memory of the deltas
+	float GetChangedFraction(int t); //fraction of the bricks changed from timestep t-1 to t
+
+private:
+	struct Delta
+	{
+		std::vector<char> changed; //per brick
+		std::vector<float> scales; //per changed brick
+		std::vector<short> values; //the voxels of the changed bricks, brick after brick
+	};
+
+	std::shared_ptr<Volume> volume;
+	float tolerance;
+	int3 gridSize;
+	int curT = 0;
+	std::vector<float> first; //values of the first timestep
+	std::vector<float> last; //decoded values of the last added timestep, the reference of the next delta
+	std::vector<Delta> deltas; //deltas[t - 1] goes from timestep t - 1 to t
+
+	void brickRange(int b, int3 &origin, int3 &extent);
+	void encode(const float* values, Delta &d);
+	void decode(const Delta &d, float* values);
+	std::vector<std::pair<int3, int3>> upload(const std::vector<char> &changed);
+};
+
+#endif //TIME_VARYING_VOLUME_H
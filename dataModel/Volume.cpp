@@ -1,7 +1,9 @@
 #include <Volume.h>
+#include "ThreadPool.h"
 #include <iostream>
 
 #include <fstream>
+#include <vector>
 #include <cuda_runtime.h>
 #include <helper_cuda.h>
 #include <helper_math.h>
@@ -25,6 +27,7 @@ void VolumeCUDA::VolumeCUDA_init(int3 _size, float *volumeVoxelValues, int allow
 	}
 
 	checkCudaErrors(cudaMalloc3DArray(&content, &channelDesc, size, allowStore ? cudaArraySurfaceLoadStore : 0));
+	contentVersion++;
 
 	// copy data to 3D array
 	if (volumeVoxelValues){
@@ -56,6 +59,7 @@ void VolumeCUDA::VolumeCUDA_init(int3 _size, unsigned short *volumeVoxelValues,
 	}
 
 	checkCudaErrors(cudaMalloc3DArray(&content, &channelDesc, size, allowStore ? cudaArraySurfaceLoadStore : 0));
+	contentVersion++;
 
 	// copy data to 3D array
 	if (volumeVoxelValues){
@@ -99,6 +103,7 @@ void VolumeCUDA::VolumeCUDA_init(int3 _size, int *volumeVoxelValues, int allowSt
 	}
 
 	checkCudaErrors(cudaMalloc3DArray(&content, &channelDesc, size, allowStore ? cudaArraySurfaceLoadStore : 0));
+	contentVersion++;
 
 	// copy data to 3D array
 	if (volumeVoxelValues){
@@ -129,6 +134,7 @@ void VolumeCUDA::VolumeCUDA_contentUpdate(unsigned short *volumeVoxelValues, int
 	if (content == 0){
 		std::cout << "error!!!!!" << std::endl;
 	}
+	contentVersion++;
 
 	if (numChannels == 4)
 	{
@@ -153,17 +159,52 @@ void VolumeCUDA::VolumeCUDA_contentUpdate(unsigned short *volumeVoxelValues, int
 		checkCudaErrors(cudaMemcpy3D(&copyParams));
 	}
 	else{
-		unsigned short *temp = new unsigned short[size.width*size.height*size.depth];
-		memset(temp, 0, sizeof(unsigned short)*size.width*size.height*size.depth);
-
+		//a cuda array cannot be memset, so the zeros are set once on the device and copied with a single copy, instead of from a host zero volume
+		cudaPitchedPtr zeros;
+		checkCudaErrors(cudaMalloc3D(&zeros, make_cudaExtent(size.width*sizeof(unsigned short)* numChannels, size.height, size.depth)));
+		checkCudaErrors(cudaMemset3D(zeros, 0, make_cudaExtent(size.width*sizeof(unsigned short)* numChannels, size.height, size.depth)));
 		cudaMemcpy3DParms copyParams = { 0 };
-		copyParams.srcPtr = make_cudaPitchedPtr(temp, size.width*sizeof(unsigned short)* numChannels, size.width, size.height);
+		copyParams.srcPtr = zeros;
 		copyParams.dstArray = content;
 		copyParams.extent = size;
-		copyParams.kind = cudaMemcpyHostToDevice;
+		copyParams.kind = cudaMemcpyDeviceToDevice;
 		checkCudaErrors(cudaMemcpy3D(&copyParams));
-		delete[] temp;
+		checkCudaErrors(cudaFree(zeros.ptr));
+	}
+}
+
+void VolumeCUDA::VolumeCUDA_updateRegion(const float *volumeVoxelValues, int3 valuesSize, int3 regionOrigin, int3 regionSize, int numChannels)
+{
+	if (content == 0){
+		std::cout << "error!!!!!" << std::endl;
+		return;
 	}
+	cudaMemcpy3DParms copyParams = { 0 };
+	copyParams.srcPtr = make_cudaPitchedPtr((void*)volumeVoxelValues, valuesSize.x*sizeof(VolumeType)* numChannels, valuesSize.x, valuesSize.y);
+	//the x position is in bytes for the linear memory, and in elements for the array
+	copyParams.srcPos = make_cudaPos(regionOrigin.x*sizeof(VolumeType)* numChannels, regionOrigin.y, regionOrigin.z);
+	copyParams.dstArray = content;
+	copyParams.dstPos = make_cudaPos(regionOrigin.x, regionOrigin.y, regionOrigin.z);
+	copyParams.extent = make_cudaExtent(regionSize.x, regionSize.y, regionSize.z);
+	copyParams.kind = cudaMemcpyHostToDevice;
+	checkCudaErrors(cudaMemcpy3D(&copyParams));
+}
+
+void VolumeCUDA::VolumeCUDA_readRegion(float *volumeVoxelValues, int3 valuesSize, int3 regionOrigin, int3 regionSize, int numChannels) const
+{
+	if (content == 0){
+		std::cout << "error!!!!!" << std::endl;
+		return;
+	}
+	cudaMemcpy3DParms copyParams = { 0 };
+	copyParams.srcArray = content;
+	copyParams.srcPos = make_cudaPos(regionOrigin.x, regionOrigin.y, regionOrigin.z);
+	copyParams.dstPtr = make_cudaPitchedPtr(volumeVoxelValues, valuesSize.x*sizeof(VolumeType)* numChannels, valuesSize.x, valuesSize.y);
+	//same as in VolumeCUDA_updateRegion(), the x position of the linear memory is in bytes
+	copyParams.dstPos = make_cudaPos(regionOrigin.x*sizeof(VolumeType)* numChannels, regionOrigin.y, regionOrigin.z);
+	copyParams.extent = make_cudaExtent(regionSize.x, regionSize.y, regionSize.z);
+	copyParams.kind = cudaMemcpyDeviceToHost;
+	checkCudaErrors(cudaMemcpy3D(&copyParams));
 }
 
 VolumeCUDA::~VolumeCUDA()
@@ -224,6 +265,7 @@ void Volume::reset(){
 		copyParams.extent = volumeCuda.size;
 		copyParams.kind = cudaMemcpyDeviceToDevice;
 		checkCudaErrors(cudaMemcpy3D(&copyParams));
+		volumeCuda.contentVersion++;
 	}
 }
 
@@ -272,34 +314,7 @@ void Volume::computeGradient()
 
 void Volume::computeGradient(float* &f)
 {
-	//note!! this function stores the gradient in float4 tuples, because it is preparing to copy the data to cudaArray, which does not support float3 well
-
-	f = new float[size.x*size.y*size.z*4];
-	
-	for (int z= 0; z < size.z; z++){
-		for (int y = 0; y < size.y; y++){
-			for (int x = 0; x < size.x; x++){
-				int ind = (z*size.y*size.x + y*size.x + x) * 4;
-
-				int indz1 = z - 2, indz2 = z + 2;
-				if (indz1 < 0)	indz1 = 0;
-				if (indz2 > size.z - 1) indz2 = size.z - 1;
-				f[ind + 2] = (values[indz2*size.y*size.x + y*size.x + x] - values[indz1*size.y*size.x + y*size.x + x]) / (indz2 - indz1);
-
-				int indy1 = y - 2, indy2 = y + 2;
-				if (indy1 < 0)	indy1 = 0;
-				if (indy2 > size.y - 1) indy2 = size.y - 1;
-				f[ind + 1] = (values[z*size.y*size.x + indy2*size.x + x] - values[z*size.y*size.x + indy1*size.x + x]) / (indy2 - indy1);
-
-				int indx1 = x - 2, indx2 = x + 2;
-				if (indx1 < 0)	indx1 = 0;
-				if (indx2 > size.x - 1) indx2 = size.x - 1;
-				f[ind] = (values[z*size.y*size.x + y*size.x + indx2] - values[z*size.y*size.x + y*size.x + indx1]) / (indx2 - indx1);
-
-				f[ind + 3] = 0;
-			}
-		}
-	}
+	computeGradient(values, size, f);
 }
 
 void Volume::computeGradient(float* input, int3 size, float* &f)
@@ -308,7 +323,7 @@ void Volume::computeGradient(float* input, int3 size, float* &f)
 
 	f = new float[size.x*size.y*size.z * 4];
 
-	for (int z = 0; z < size.z; z++){
+	ThreadPool::global().parallelFor(size.z, [&](int z){
 		for (int y = 0; y < size.y; y++){
 			for (int x = 0; x < size.x; x++){
 				int ind = (z*size.y*size.x + y*size.x + x) * 4;
@@ -331,15 +346,25 @@ void Volume::computeGradient(float* input, int3 size, float* &f)
 				f[ind + 3] = 0;
 			}
 		}
-	}
+	});
 }
 
-
 void Volume::computeBilateralFiltering(float* &res, float sigs, float sigr)
 {
 	res = new float[size.x*size.y*size.z];
 
-	for (int z = 0; z < size.z; z++){
+	//the spatial weights of the 3x3x3 neighborhood are the same for all voxels
+	double spatialWeights[27];
+	for (int zz = -1; zz <= 1; zz++){
+		for (int yy = -1; yy <= 1; yy++){
+			for (int xx = -1; xx <= 1; xx++){
+				spatialWeights[(zz + 1) * 9 + (yy + 1) * 3 + xx + 1] = exp(-(xx*xx + yy*yy + zz*zz) / sigs);
+			}
+		}
+	}
+
+	//the slices are filtered in parallel
+	ThreadPool::global().parallelFor(size.z, [&](int z){
 		for (int y = 0; y < size.y; y++){
 			for (int x = 0; x < size.x; x++){
 				int ind = z*size.y*size.x + y*size.x + x;
@@ -347,7 +372,6 @@ void Volume::computeBilateralFiltering(float* &res, float sigs, float sigr)
 				float IP = values[ind];
 
 				double sum = 0, sumwp = 0;				
-				//float sum = 0, sumwp = 0;
 
 				for (int zz = -1; zz <= 1; zz++){
 					for (int yy = -1; yy <= 1; yy++){
@@ -357,8 +381,7 @@ void Volume::computeBilateralFiltering(float* &res, float sigs, float sigr)
 								int ind2 = zq*size.y*size.x + yq*size.x + xq;
 								float IQ = values[ind2];
 
-								double gq = exp(-(xx*xx + yy*yy + zz*zz) / sigs)*exp(-(IP - IQ) / sigr);
-								//float gq = exp(-(xx*xx + yy*yy + zz*zz) / sigs - (IP - IQ) / sigr);
+								double gq = spatialWeights[(zz + 1) * 9 + (yy + 1) * 3 + xx + 1] * exp(-(IP - IQ) * (IP - IQ) / sigr);
 								sumwp += gq;
 								sum += gq*IQ;
 							}
@@ -372,7 +395,7 @@ void Volume::computeBilateralFiltering(float* &res, float sigs, float sigr)
 					res[ind] = 0;
 			}
 		}
-	}
+	});
 }
 
 inline float gaus(float x, float delta){ //let mu is 0
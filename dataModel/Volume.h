@@ -22,11 +22,18 @@ public:
 	cudaExtent size;
 	cudaArray *content = 0;
 	cudaChannelFormatDesc channelDesc;
+	//incremented whenever the whole content is replaced, so the data derived from it (e.g. a MacroCellGrid) can tell it is stale.
+	//VolumeCUDA_updateRegion() and the deformation processors that track their changed region do not increment it
+	unsigned int contentVersion = 0;
 	
 	void VolumeCUDA_init(int3 _size, float *volumeVoxelValues, int allowStore, int numChannels = 1);
 	void VolumeCUDA_init(int3 _size, unsigned short *volumeVoxelValues, int allowStore, int numChannels = 1);
 	void VolumeCUDA_init(int3 _size, int*volumeVoxelValues, int allowStore, int numChannels = 1);	
 	void VolumeCUDA_contentUpdate(unsigned short *volumeVoxelValues, int allowStore, int numChannels = 1);
+	//copy the box [regionOrigin, regionOrigin + regionSize) of a host volume of valuesSize voxels into the same box of the array
+	void VolumeCUDA_updateRegion(const float *volumeVoxelValues, int3 valuesSize, int3 regionOrigin, int3 regionSize, int numChannels = 1);
+	//the reverse, copy the box of the array into the same box of a host volume of valuesSize voxels
+	void VolumeCUDA_readRegion(float *volumeVoxelValues, int3 valuesSize, int3 regionOrigin, int3 regionSize, int numChannels = 1) const;
 
 
 	~VolumeCUDA();
@@ -92,7 +99,9 @@ public:
 	void computeGradient();
 	void computeGradient(float* &f);
 	void computeGradient(float* input, int3 size, float* &f);
-	void computeBilateralFiltering(float* &res, float sigs, float sigr); //see Structure-Aware Viewpoint Selection for Volume Visualization
+	//see Structure-Aware Viewpoint Selection for Volume Visualization. 3x3x3 filter, the weight of a neighbor q of p is
+	//exp(-|p-q|^2/sigs) * exp(-(I(p)-I(q))^2/sigr), i.e. sigs and sigr are 2*sigma^2 of the spatial and the range gaussian
+	void computeBilateralFiltering(float* &res, float sigs, float sigr);
 
 	void saveRawToFile(const char *);
 
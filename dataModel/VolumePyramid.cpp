@@ -0,0 +1,125 @@
+#include "VolumePyramid.h"
+#include "ThreadPool.h"
+
+#include <helper_math.h>
+
+#include <algorithm>
+#include <vector>
+
+VolumePyramid::VolumePyramid(std::shared_ptr<Volume> _volume, int numLevels)
+{
+	numLevels = std::min(std::max(numLevels, 1), VOLUME_PYRAMID_MAX_LEVELS);
+	levels.push_back(_volume);
+	for (int l = 1; l < numLevels; l++){
+		const Volume* fine = levels[l - 1].get();
+		if (fine->size.x < 2 && fine->size.y < 2 && fine->size.z < 2)
+			break;
+		std::shared_ptr<Volume> coarse = std::make_shared<Volume>();
+		coarse->setSize(make_int3((fine->size.x + 1) / 2, (fine->size.y + 1) / 2, (fine->size.z + 1) / 2));
+		coarse->dataOrigin = _volume->dataOrigin;
+		//same mapping as the downsampling, and as the ray caster, which reads level l at the position in voxels of level 0 divided by 2^l
+		coarse->spacing = fine->spacing * 2.0f;
+		levels.push_back(coarse);
+	}
+	build();
+}
+
+VolumePyramid::~VolumePyramid()
+{
+	//~Volume() does not free the values
+	for (int l = 1; l < levels.size(); l++){
+		delete[] levels[l]->values;
+		levels[l]->values = 0;
+		delete[] levels[l]->gradient;
+		levels[l]->gradient = 0;
+	}
+}
+
+void VolumePyramid::downsample(const float* fineValues, int3 fineOrigin, int3 fineBoxSize, int3 fineSize, Volume* coarse, int3 coarseMin, int3 coarseMax)
+{
+	int3 fs = fineSize, cs = coarse->size;
+	ThreadPool::global().parallelFor(coarseMax.z - coarseMin.z + 1, [&](int zz){
+		int z = coarseMin.z + zz;
+		int z1 = std::min(2 * z + 1, fs.z - 1);
+		for (int y = coarseMin.y; y <= coarseMax.y; y++){
+			int y1 = std::min(2 * y + 1, fs.y - 1);
+			for (int x = coarseMin.x; x <= coarseMax.x; x++){
+				int x1 = std::min(2 * x + 1, fs.x - 1);
+				//the last voxel of an odd sized dimension only averages the fine voxels that exist
+				float sum = 0;
+				int count = 0;
+				for (int k = 2 * z; k <= z1; k++){
+					for (int j = 2 * y; j <= y1; j++){
+						for (int i = 2 * x; i <= x1; i++){
+							sum += fineValues[((size_t)(k - fineOrigin.z) * fineBoxSize.y + (j - fineOrigin.y)) * fineBoxSize.x + (i - fineOrigin.x)];
+							count++;
+						}
+					}
+				}
+				coarse->values[((size_t)z * cs.y + y) * cs.x + x] = sum / count;
+			}
+		}
+	});
+}
+
+void VolumePyramid::build()
+{
+	for (int l = 1; l < levels.size(); l++){
+		const Volume* fine = levels[l - 1].get();
+		downsample(fine->values, make_int3(0, 0, 0), fine->size, fine->size, levels[l].get(), make_int3(0, 0, 0), levels[l]->size - 1);
+	}
+}
+
+void VolumePyramid::updateRegion(int3 voxelMin, int3 voxelMax)
+{
+	std::vector<float> level0Box;
+	for (int l = 1; l < levels.size(); l++){
+		const Volume* fine = levels[l - 1].get();
+		Volume* coarse = levels[l].get();
+		voxelMin = clamp(voxelMin, make_int3(0, 0, 0), fine->size - 1);
+		voxelMax = clamp(voxelMax, make_int3(0, 0, 0), fine->size - 1);
+		if (voxelMin.x > voxelMax.x || voxelMin.y > voxelMax.y || voxelMin.z > voxelMax.z)
+			return;
+		int3 coarseMin = voxelMin / 2, coarseMax = voxelMax / 2;
+		int3 fineOrigin = coarseMin * 2;
+		int3 fineBoxSize = min(coarseMax * 2 + 2, fine->size) - fineOrigin;
+
+		if (l == 1 && fine->volumeCuda.content != 0){
+			//only the box of level 0 is read back
+			level0Box.resize((size_t)fineBoxSize.x * fineBoxSize.y * fineBoxSize.z);
+			cudaMemcpy3DParms copyParams = { 0 };
+			copyParams.srcArray = fine->volumeCuda.content;
+			copyParams.srcPos = make_cudaPos(fineOrigin.x, fineOrigin.y, fineOrigin.z);
+			copyParams.dstPtr = make_cudaPitchedPtr(&(level0Box[0]), fineBoxSize.x * sizeof(float), fineBoxSize.x, fineBoxSize.y);
+			copyParams.extent = make_cudaExtent(fineBoxSize.x, fineBoxSize.y, fineBoxSize.z);
+			copyParams.kind = cudaMemcpyDeviceToHost;
+			checkCudaErrors(cudaMemcpy3D(&copyParams));
+			downsample(&(level0Box[0]), fineOrigin, fineBoxSize, fine->size, coarse, coarseMin, coarseMax);
+		}
+		else{
+			downsample(fine->values, make_int3(0, 0, 0), fine->size, fine->size, coarse, coarseMin, coarseMax);
+		}
+		if (coarse->volumeCuda.content != 0)
+			coarse->volumeCuda.VolumeCUDA_updateRegion(coarse->values, coarse->size, coarseMin, coarseMax - coarseMin + 1);
+
+		voxelMin = coarseMin;
+		voxelMax = coarseMax;
+	}
+}
+
+void VolumePyramid::initVolumeCuda(int finestLevel)
+{
+	for (int l = 1; l < levels.size(); l++){
+		if (l < finestLevel)
+			levels[l]->volumeCuda.VolumeCUDA_deinit();
+		else
+			levels[l]->initVolumeCuda();
+	}
+}
+
+void VolumePyramid::computeGradient()
+{
+	for (int l = 0; l < levels.size(); l++){
+		levels[l]->computeGradient();
+	}
+}
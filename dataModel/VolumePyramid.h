@@ -0,0 +1,45 @@
+#ifndef VOLUME_PYRAMID_H
+#define VOLUME_PYRAMID_H
+
+#include <memory>
+#include <vector>
+#include "Volume.h"
+
+//the ray caster binds at most this many levels, including the full resolution one
+#define VOLUME_PYRAMID_MAX_LEVELS 4
+
+/*
+mip pyramid of a volume. level 0 is the given volume itself, and each coarser level averages 2x2x2 voxels of the previous one,
+so level l holds about 8^l times less data. each level is a Volume with its own values, volumeCuda and gradient.
+voxel i of level l covers the voxels [2i, 2i + 2) of level l - 1, so a position c in voxels of level 0 is c / 2^l in voxels of level l,
+and the spacing of level l is the one of level 0 times 2^l. for an odd size, the last voxel of the coarser level reaches half a voxel beyond the box of level 0.
+the coarse levels are built on the cpu thread pool
+*/
+class VolumePyramid
+{
+public:
+	VolumePyramid(std::shared_ptr<Volume> _volume, int numLevels = 3);
+	~VolumePyramid();
+
+	//rebuild the coarse levels after the values of level 0 changed
+	void build();
+	//rebuild the coarse voxels covering the voxel range [voxelMin, voxelMax] of level 0, and upload them if the level is on the device.
+	//level 0 is read from its volumeCuda if it is on the device, since a deformation only changes that one, else from its values
+	void updateRegion(int3 voxelMin, int3 voxelMax);
+	//upload the coarse levels from finestLevel on to their volumeCuda, and release the coarse levels finer than finestLevel. level 0 is uploaded by its owner
+	void initVolumeCuda(int finestLevel = 1);
+	//compute Volume::gradient of every level on the cpu
+	void computeGradient();
+
+	int GetNumLevels(){ return levels.size(); }
+	std::shared_ptr<Volume> GetLevel(int l){ return levels[l]; }
+
+private:
+	std::vector<std::shared_ptr<Volume>> levels;
+
+	//average the fine voxels of the coarse voxels [coarseMin, coarseMax] into coarse->values. fineValues holds the box of fine voxels
+	//from fineOrigin of fineBoxSize voxels, out of a fine volume of fineSize voxels
+	static void downsample(const float* fineValues, int3 fineOrigin, int3 fineBoxSize, int3 fineSize, Volume* coarse, int3 coarseMin, int3 coarseMax);
+};
+
+#endif //VOLUME_PYRAMID_H
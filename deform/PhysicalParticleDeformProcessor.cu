@@ -198,6 +198,7 @@ bool PhysicalParticleDeformProcessor::process(float* modelview, float* projectio
 			else if (l->type == TYPE_CIRCLE){
 				UpdatePointCoordsAndBright_UniformMesh(particle, &(particle->glyphBright[0]), modelview);
 			}
+			particle->markChanged();
 			meshDeformer->meshJustDeformed = false;
 			return true;
 		}
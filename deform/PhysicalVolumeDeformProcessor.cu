@@ -248,6 +248,7 @@ bool PhysicalVolumeDeformProcessor::process(float* modelview, float* projection,
 		d_updateVolumebyModelGrid << <gridSize2, blockSize2 >> >(size, meshDeformer->GetXDev(), meshDeformer->GetXDevOri(), meshDeformer->GetTetDev(), meshDeformer->GetTetNumber(), volume->spacing);
 
 		checkCudaErrors(cudaUnbindTexture(volumeTexInput));
+		volume->volumeCuda.contentVersion++; //the whole volume is written
 		meshDeformer->meshJustDeformed = false;
 		return true;
 	}
@@ -5,10 +5,12 @@
 #include "Volume.h"
 #include "PolyMesh.h"
 #include "Particle.h"
+#include "DistanceTransform.h"
 
 #include <cuda_runtime.h>
 #include <helper_cuda.h>
 #include <helper_math.h>
+#include <cfloat>
 
 
 #include <thrust/transform_reduce.h>
@@ -114,6 +116,7 @@ void PositionBasedDeformProcessor::polyMeshDataUpdated()
 void PositionBasedDeformProcessor::volumeDataUpdated()
 //only for changing rendering parameter
 {
+	properDistance.clear();
 	if (systemState != ORIGINAL && isActive){
 		//std::cout << "camera BAD in new original data" << std::endl;
 		if (!atProperLocation(matrixMgr->getEyeInLocal(), true)){
@@ -210,6 +213,7 @@ void PositionBasedDeformProcessor::resetData()
 {
 	if (dataType == VOLUME){
 		volume->reset();
+		setDeformedRegion(false, make_int3(0, 0, 0), make_int3(0, 0, 0));
 	}
 	else if (dataType == MESH){
 		poly->reset();
@@ -255,13 +259,9 @@ void PositionBasedDeformProcessor::computeTunnelInfo(float3 centerPoint)
 		}
 
 		tunnelStart = centerPoint;
-		while (atProperLocation(tunnelStart, true)){
-			tunnelStart += tunnelAxis*step;
-		}
+		tunnelStart += tunnelAxis*step*searchProperChange(tunnelStart, tunnelAxis, step, stepsInRange(tunnelStart, tunnelAxis*step) + 1, false);
 		tunnelEnd = tunnelStart + tunnelAxis*step;
-		while (!atProperLocation(tunnelEnd, true)){
-			tunnelEnd += tunnelAxis*step;
-		}
+		tunnelEnd += tunnelAxis*step*searchProperChange(tunnelEnd, tunnelAxis, step, stepsInRange(tunnelEnd, tunnelAxis*step) + 1, true);
 	}
 	else{
 		//when this funciton is called, suppose we already know that centerPoint is inWall
@@ -276,13 +276,9 @@ void PositionBasedDeformProcessor::computeTunnelInfo(float3 centerPoint)
 		}
 
 		tunnelEnd = centerPoint + tunnelAxis*step;
-		while (!atProperLocation(tunnelEnd, true)){
-			tunnelEnd += tunnelAxis*step;
-		}
+		tunnelEnd += tunnelAxis*step*searchProperChange(tunnelEnd, tunnelAxis, step, stepsInRange(tunnelEnd, tunnelAxis*step) + 1, true);
 		tunnelStart = centerPoint;
-		while (!atProperLocation(tunnelStart, true)){
-			tunnelStart -= tunnelAxis*step;
-		}
+		tunnelStart -= tunnelAxis*step*searchProperChange(tunnelStart, -tunnelAxis, step, stepsInRange(tunnelStart, -tunnelAxis*step) + 1, true);
 	}
 }
 
@@ -306,30 +302,25 @@ void PositionBasedDeformProcessor::adjustTunnelEnds()
 	else{
 		float3 tunnelAxis = normalize(tunnelEnd - tunnelStart);
 
+		//each end is moved by one line search along the axis, instead of one proper location check per step
 		tunnelEnd -= tunnelAxis*step; //originally should be improper
-		if (atProperLocation(tunnelEnd, true)){//should shorten
-			while (atProperLocation(tunnelEnd, true) && dot(tunnelEnd - tunnelStart, tunnelAxis)>0){
-				tunnelEnd -= tunnelAxis*step;
-			}
+		if (atProperLocation(tunnelEnd, true)){//should shorten, while the end is proper and still beyond the start
+			int n = lineStepsAhead(tunnelStart, tunnelEnd, -tunnelAxis, step);
+			tunnelEnd -= tunnelAxis*step*searchProperChange(tunnelEnd, -tunnelAxis, step, n, false);
 			tunnelEnd += tunnelAxis*step; //one step backwards
 		}
 		else{
-			while (!atProperLocation(tunnelEnd, true)){
-				tunnelEnd += tunnelAxis*step;
-			}
+			tunnelEnd += tunnelAxis*step*searchProperChange(tunnelEnd, tunnelAxis, step, stepsInRange(tunnelEnd, tunnelAxis*step) + 1, true);
 		}
 
 		tunnelStart += tunnelAxis*step;//originally should be improper
 		if (atProperLocation(tunnelStart, true)){//should shorten
-			while (atProperLocation(tunnelStart, true) && dot(tunnelEnd - tunnelStart, tunnelAxis)>0){
-				tunnelStart += tunnelAxis*step;
-			}
+			int n = lineStepsAhead(tunnelEnd, tunnelStart, tunnelAxis, step);
+			tunnelStart += tunnelAxis*step*searchProperChange(tunnelStart, tunnelAxis, step, n, false);
 			tunnelStart -= tunnelAxis*step;
 		}
 		else{
-			while (!atProperLocation(tunnelStart, true)){
-				tunnelStart -= tunnelAxis*step;
-			}
+			tunnelStart -= tunnelAxis*step*searchProperChange(tunnelStart, -tunnelAxis, step, stepsInRange(tunnelStart, -tunnelAxis*step) + 1, true);
 		}
 	}
 }
@@ -355,35 +346,37 @@ void PositionBasedDeformProcessor::adjustTunnelEndsLastTunnel()
 		lastTunnelStart, lastTunnelEnd;
 		float3 tunnelAxis = normalize(lastTunnelEnd - lastTunnelStart);
 
+		//each end is moved by one line search along the axis, instead of one proper location check per step
 		lastTunnelEnd -= tunnelAxis*step; //originally should be improper
-		if (atProperLocation(lastTunnelEnd, true)){//should shorten
-			while (atProperLocation(lastTunnelEnd, true) && dot(lastTunnelEnd - lastTunnelStart, tunnelAxis)>0){
-				lastTunnelEnd -= tunnelAxis*step;
-			}
+		if (atProperLocation(lastTunnelEnd, true)){//should shorten, while the end is proper and still beyond the start
+			int n = lineStepsAhead(lastTunnelStart, lastTunnelEnd, -tunnelAxis, step);
+			lastTunnelEnd -= tunnelAxis*step*searchProperChange(lastTunnelEnd, -tunnelAxis, step, n, false);
 			lastTunnelEnd += tunnelAxis*step; //one step backwards
 		}
 		else{
-			while (!atProperLocation(lastTunnelEnd, true)){
-				lastTunnelEnd += tunnelAxis*step;
-			}
+			lastTunnelEnd += tunnelAxis*step*searchProperChange(lastTunnelEnd, tunnelAxis, step, stepsInRange(lastTunnelEnd, tunnelAxis*step) + 1, true);
 		}
 
 		lastTunnelStart += tunnelAxis*step;//originally should be improper
 		if (atProperLocation(lastTunnelStart, true)){//should shorten
-			while (atProperLocation(lastTunnelStart, true) && dot(lastTunnelEnd - lastTunnelStart, tunnelAxis)>0){
-				lastTunnelStart += tunnelAxis*step;
-			}
+			int n = lineStepsAhead(lastTunnelEnd, lastTunnelStart, tunnelAxis, step);
+			lastTunnelStart += tunnelAxis*step*searchProperChange(lastTunnelStart, tunnelAxis, step, n, false);
 			lastTunnelStart -= tunnelAxis*step;
 		}
 		else{
-			while (!atProperLocation(lastTunnelStart, true)){
-				lastTunnelStart -= tunnelAxis*step;
-			}
+			lastTunnelStart -= tunnelAxis*step*searchProperChange(lastTunnelStart, -tunnelAxis, step, stepsInRange(lastTunnelStart, -tunnelAxis*step) + 1, true);
 		}
 	}
 }
 
 
+//number of the points from + dir*step*i, from i = 0, that are still ahead of the other end, i.e. dot(from + dir*step*i - other, -dir) > 0
+int PositionBasedDeformProcessor::lineStepsAhead(float3 other, float3 from, float3 dir, float step)
+{
+	float l = dot(from - other, -dir);
+	return l > 0 ? (int)ceilf(l / step) : 0;
+}
+
 bool PositionBasedDeformProcessor::sameTunnel(){
 	float thr = 0.00001;
 	if (shapeModel == CUBOID){
@@ -409,43 +402,91 @@ bool PositionBasedDeformProcessor::inRange(float3 v)
 	return v.x >= minPos.x && v.x < maxPos.x && v.y >= minPos.y && v.y < maxPos.y &&v.z >= minPos.z && v.z < maxPos.z;
 }
 
-__global__ void
-d_posInSafePositionOfVolume(float3 pos, int3 dims, float3 spacing, bool* atProper, float densityThr, int checkRadius)
+//returns false if the original values are not on the host, e.g. for an out-of-core volume
+bool PositionBasedDeformProcessor::buildProperDistance()
+{
+	if (volume->values == 0 || rcp == 0 || rcp->d_transferFunc == 0)
+		return false;
+	if (properDistance.size() > 0 && properDistanceThr == densityThr)
+		return true;
+
+	cudaChannelFormatDesc desc;
+	cudaExtent extent;
+	unsigned int flags;
+	checkCudaErrors(cudaArrayGetInfo(&desc, &extent, &flags, rcp->d_transferFunc));
+	std::vector<float4> transferFunc(extent.width);
+	checkCudaErrors(cudaMemcpyFromArray(&(transferFunc[0]), rcp->d_transferFunc, 0, 0, sizeof(float4)* extent.width, cudaMemcpyDeviceToHost));
+
+	//in voxels, the same unit as checkRadius
+	properDistance.resize((size_t)volume->size.x * volume->size.y * volume->size.z);
+	DistanceTransform::computeFromOpacity(volume->values, volume->size, make_float3(1, 1, 1), &(transferFunc[0]), extent.width, densityThr, &(properDistance[0]));
+	properDistanceThr = densityThr;
+	return true;
+}
+
+//FLT_MAX outside of the volume, where every position is proper
+float PositionBasedDeformProcessor::properDistanceAt(float3 pos)
+{
+	float3 ind = pos / volume->spacing;
+	if (ind.x < 0 || ind.y < 0 || ind.z < 0 || ind.x >= volume->size.x || ind.y >= volume->size.y || ind.z >= volume->size.z){
+		return FLT_MAX;
+	}
+	int3 v = make_int3(ind);
+	return properDistance[((size_t)v.z * volume->size.y + v.y) * volume->size.x + v.x];
+}
+
+__device__ bool
+d_isSafePositionOfVolume(float3 pos, int3 dims, float3 spacing, float densityThr, int checkRadius)
 {
 	float3 ind = pos / spacing;
 	if (checkRadius == 1){
 		if (ind.x >= 0 && ind.x < dims.x && ind.y >= 0 && ind.y < dims.y && ind.z >= 0 && ind.z < dims.z) {
 			float4 col = tex1D(transferTex2, tex3D(volumePointTexture, ind.x, ind.y, ind.z));
 
-			if (col.w <= densityThr)
-				*atProper = true;
-			else
-				*atProper = false;
+			return col.w <= densityThr;
 		}
 		else{
-			*atProper = true;
+			return true;
 		}
 	}
 	else{
-		float r = checkRadius - 1;
-		int xstart = max(0.0, ind.x - r), xend = min(dims.x - 1.0, ind.x + r);
-		int ystart = max(0.0, ind.y - r), yend = min(dims.y - 1.0, ind.y + r);
-		int zstart = max(0.0, ind.z - r), zend = min(dims.z - 1.0, ind.z + r);
+		//the voxels within the ball of radius r around the voxel of pos, the same as the lookup in PositionBasedDeformProcessor::properDistance
+		int r = checkRadius - 1;
+		int3 v = make_int3((int)floorf(ind.x), (int)floorf(ind.y), (int)floorf(ind.z));
+		int xstart = max(0, v.x - r), xend = min(dims.x - 1, v.x + r);
+		int ystart = max(0, v.y - r), yend = min(dims.y - 1, v.y + r);
+		int zstart = max(0, v.z - r), zend = min(dims.z - 1, v.z + r);
 		for (int i = xstart; i <= xend; i++){
 			for (int j = ystart; j <= yend; j++){
 				for (int k = zstart; k <= zend; k++){
-					float4 col = tex1D(transferTex2, tex3D(volumePointTexture, ind.x, ind.y, ind.z));
+					if ((i - v.x)*(i - v.x) + (j - v.y)*(j - v.y) + (k - v.z)*(k - v.z) > r*r)
+						continue;
+					float4 col = tex1D(transferTex2, tex3D(volumePointTexture, i + 0.5, j + 0.5, k + 0.5));
 					if (col.w > densityThr){
-						*atProper = false;
-						return;
+						return false;
 					}
 				}
 			}
 		}
-		*atProper = true;
+		return true;
 	}
 }
 
+__global__ void
+d_posInSafePositionOfVolume(float3 pos, int3 dims, float3 spacing, bool* atProper, float densityThr, int checkRadius)
+{
+	*atProper = d_isSafePositionOfVolume(pos, dims, spacing, densityThr, checkRadius);
+}
+
+//one thread per point start + stepVec*i of a line search
+__global__ void
+d_posInSafePositionOfVolumeBatch(float3 start, float3 stepVec, int n, int3 dims, float3 spacing, bool* atProper, float densityThr, int checkRadius)
+{
+	int i = blockDim.x * blockIdx.x + threadIdx.x;
+	if (i >= n)	return;
+	atProper[i] = d_isSafePositionOfVolume(start + stepVec*i, dims, spacing, densityThr, checkRadius);
+}
+
 struct functor_dis
 {
 	float3 pos;
@@ -667,6 +708,10 @@ bool PositionBasedDeformProcessor::atProperLocation(float3 pos, bool useOriData)
 	}
 
 	if (dataType == VOLUME){
+		if (useOriData && buildProperDistance()){
+			return properDistanceAt(pos) > checkRadius - 1;
+		}
+
 		cudaChannelFormatDesc channelFloat4 = cudaCreateChannelDesc<float4>();
 		checkCudaErrors(cudaBindTextureToArray(transferTex2, rcp->d_transferFunc, channelFloat4));
 
@@ -759,6 +804,73 @@ bool PositionBasedDeformProcessor::atProperLocation(float3 pos, bool useOriData)
 
 }
 
+int PositionBasedDeformProcessor::stepsInRange(float3 start, float3 stepVec)
+{
+	const int maxSteps = 1 << 20; //in case of a zero step
+	int n = 0;
+	while (n < maxSteps && inRange(start + stepVec*n)){
+		n++;
+	}
+	return n;
+}
+
+int PositionBasedDeformProcessor::searchProperChange(float3 start, float3 dir, float step, int maxSteps, bool wantProper)
+{
+	float3 stepVec = dir*step;
+	if (dataType == VOLUME && buildProperDistance()){
+		//a point at distance d from the data, in voxels, has no data within d - (checkRadius - 1) - sqrt(3) voxels around its position,
+		//the sqrt(3) covering the rounding of the positions to voxels. the points of the line within that distance are proper as well
+		const float minSpacing = fminf(volume->spacing.x, fminf(volume->spacing.y, volume->spacing.z));
+		int i = 0;
+		while (i < maxSteps){
+			float3 pos = start + stepVec*i;
+			float d = inRange(pos) ? properDistanceAt(pos) : FLT_MAX;
+			bool proper = d > checkRadius - 1;
+			if (proper == wantProper){
+				return i;
+			}
+			int skip = 1;
+			if (proper && d != FLT_MAX){
+				skip = max((int)((d - (checkRadius - 1) - 1.75f) * minSpacing / step), 1);
+			}
+			i += skip;
+		}
+		return maxSteps;
+	}
+	else if (dataType == VOLUME){
+		//all the points in one launch
+		if (maxSteps <= 0){
+			return maxSteps;
+		}
+		cudaChannelFormatDesc channelFloat4 = cudaCreateChannelDesc<float4>();
+		checkCudaErrors(cudaBindTextureToArray(transferTex2, rcp->d_transferFunc, channelFloat4));
+		checkCudaErrors(cudaBindTextureToArray(volumePointTexture, volume->volumeCudaOri.content, volume->volumeCudaOri.channelDesc));
+		bool* d_atProper;
+		cudaMalloc(&d_atProper, sizeof(bool)* maxSteps);
+		int threadsPerBlock = 64;
+		int blocksPerGrid = (maxSteps + threadsPerBlock - 1) / threadsPerBlock;
+		d_posInSafePositionOfVolumeBatch << <blocksPerGrid, threadsPerBlock >> >(start, stepVec, maxSteps, volume->size, volume->spacing, d_atProper, densityThr, checkRadius);
+		std::vector<char> atProper(maxSteps);
+		cudaMemcpy(&(atProper[0]), d_atProper, sizeof(bool)* maxSteps, cudaMemcpyDeviceToHost);
+		cudaFree(d_atProper);
+		for (int i = 0; i < maxSteps; i++){
+			bool proper = !inRange(start + stepVec*i) || atProper[i];
+			if (proper == wantProper){
+				return i;
+			}
+		}
+		return maxSteps;
+	}
+	else{
+		for (int i = 0; i < maxSteps; i++){
+			if (atProperLocation(start + stepVec*i, true) == wantProper){
+				return i;
+			}
+		}
+		return maxSteps;
+	}
+}
+
 
 
 //////////////////////cut mesh////////////////////////////
@@ -1479,6 +1591,7 @@ void PositionBasedDeformProcessor::doParticleDeform(float degree)
 	}
 
 	thrust::copy(d_vec_posTarget.begin(), d_vec_posTarget.end(), &(particle->pos[0]));
+	particle->markChanged();
 	thrust::copy(d_vec_posTarget.begin(), d_vec_posTarget.end(), d_vec_lastFramePos.begin());
 
 	//	std::cout << "moved particles by: " << degree <<" with count "<<count<< std::endl;
@@ -1540,6 +1653,7 @@ void PositionBasedDeformProcessor::doParticleDeform2Tunnel(float degreeOpen, flo
 		functor_particleDeform_Cuboid(tunnelStart, tunnelEnd, degreeOpen, deformationScale, deformationScaleVertical, rectVerticalDir));
 
 	thrust::copy(d_vec_posTarget.begin(), d_vec_posTarget.end(), &(particle->pos[0]));
+	particle->markChanged();
 
 	//	std::cout << "moved particles by: " << degree <<" with count "<<count<< std::endl;
 	//	std::cout << "pos of region 0: " << particle->pos[0].x << " " << particle->pos[0].y << " " << particle->pos[0].z << std::endl;
@@ -1702,11 +1816,77 @@ d_deformVolume_CuboidModel(cudaExtent volumeSize, float3 start, float3 end, floa
 	return;
 }
 
+//bounding box in voxels of the part of the volume that can be changed by a tunnel
+void PositionBasedDeformProcessor::tunnelVoxelRange(float3 start, float3 end, int3 &voxelMin, int3 &voxelMax)
+{
+	float extent = (shapeModel == CIRCLE) ? radius : fmax(deformationScale, deformationScaleVertical);
+	float3 lo = (fminf(start, end) - extent) / volume->spacing;
+	float3 hi = (fmaxf(start, end) + extent) / volume->spacing;
+	//margin for the cubic interpolation
+	voxelMin = make_int3(max((int)floor(lo.x) - 2, 0), max((int)floor(lo.y) - 2, 0), max((int)floor(lo.z) - 2, 0));
+	voxelMax = make_int3(min((int)ceil(hi.x) + 2, volume->size.x - 1), min((int)ceil(hi.y) + 2, volume->size.y - 1), min((int)ceil(hi.z) + 2, volume->size.z - 1));
+}
+
+//the voxels that change are the ones of the new deformed region, plus the ones of the previous deformed region, which go back to their original values
+void PositionBasedDeformProcessor::setDeformedRegion(bool isDeformed, int3 voxelMin, int3 voxelMax)
+{
+	bool changed = false;
+	int3 changedVoxelMin, changedVoxelMax;
+	if (hasDeformedRegion){
+		changedVoxelMin = deformedVoxelMin;
+		changedVoxelMax = deformedVoxelMax;
+		changed = true;
+	}
+	if (isDeformed){
+		changedVoxelMin = changed ? min(changedVoxelMin, voxelMin) : voxelMin;
+		changedVoxelMax = changed ? max(changedVoxelMax, voxelMax) : voxelMax;
+		changed = true;
+	}
+	if (changed){
+		const int maxKeptChanges = 64;
+		if (volumeChanges.size() >= maxKeptChanges)
+			volumeChanges.erase(volumeChanges.begin());
+		VolumeChange c = { ++volumeChangeCount, changedVoxelMin, changedVoxelMax };
+		volumeChanges.push_back(c);
+	}
+	hasDeformedRegion = isDeformed;
+	deformedVoxelMin = voxelMin;
+	deformedVoxelMax = voxelMax;
+}
+
+bool PositionBasedDeformProcessor::getChangedVolumeRegion(unsigned int &seenCount, int3 &voxelMin, int3 &voxelMax)
+{
+	if (seenCount == volumeChangeCount)
+		return false;
+	if (volumeChanges.empty() || volumeChanges.front().count > seenCount + 1){
+		//some of the unseen changes are no longer kept
+		voxelMin = make_int3(0, 0, 0);
+		voxelMax = volume->size - 1;
+	}
+	else{
+		bool first = true;
+		for (int i = 0; i < volumeChanges.size(); i++){
+			const VolumeChange &c = volumeChanges[i];
+			if (c.count <= seenCount)
+				continue;
+			voxelMin = first ? c.voxelMin : min(voxelMin, c.voxelMin);
+			voxelMax = first ? c.voxelMax : max(voxelMax, c.voxelMax);
+			first = false;
+		}
+	}
+	seenCount = volumeChangeCount;
+	return true;
+}
+
 void PositionBasedDeformProcessor::doVolumeDeform(float degree)
 {
 	if (!deformData)
 		return;
 
+	int3 voxelMin, voxelMax;
+	tunnelVoxelRange(tunnelStart, tunnelEnd, voxelMin, voxelMax);
+	setDeformedRegion(true, voxelMin, voxelMax);
+
 	cudaExtent size = volume->volumeCuda.size;
 	unsigned int dim = 32;
 	dim3 blockSize(dim, dim, 1);
@@ -1726,6 +1906,11 @@ void PositionBasedDeformProcessor::doVolumeDeform(float degree)
 
 void PositionBasedDeformProcessor::doVolumeDeform2Tunnel(float degreeOpen, float degreeClose)
 {
+	int3 voxelMin, voxelMax, lastVoxelMin, lastVoxelMax;
+	tunnelVoxelRange(tunnelStart, tunnelEnd, voxelMin, voxelMax);
+	tunnelVoxelRange(lastTunnelStart, lastTunnelEnd, lastVoxelMin, lastVoxelMax);
+	setDeformedRegion(true, min(voxelMin, lastVoxelMin), max(voxelMax, lastVoxelMax));
+
 	cudaExtent size = volume->volumeCuda.size;
 	unsigned int dim = 32;
 	dim3 blockSize(dim, dim, 1);
@@ -70,7 +70,7 @@ public:
 
 
 	float densityThr = 0.01; //used for volume
-	int checkRadius = 1;  //used for volume. can combine with disThr?
+	int checkRadius = 1;  //used for volume. can combine with disThr? a position is proper if no voxel denser than densityThr is within checkRadius - 1 voxels
 	float disThr = 4.1;	//used for poly and particle
 	bool useDifThrForBack = false;
 
@@ -120,6 +120,8 @@ public:
 
 	float3 getTunnelStart(){ return tunnelStart; }
 	float3 getTunnelEnd(){ return tunnelEnd; }
+	//distance from the tunnel axis within which the data is moved, for the current shape model
+	float getTunnelExtent(){ return (shapeModel == CIRCLE) ? radius : std::max(deformationScale, deformationScaleVertical); }
 	float3 getRectVerticalDir(){ return rectVerticalDir; }
 
 	float r = 0; //degree of deformation
@@ -132,6 +134,13 @@ public:
 	void particleDataUpdated();
 	void polyMeshDataUpdated();
 
+	//number of changes of volume->volumeCuda made by the deformation so far
+	unsigned int GetVolumeChangeCount(){ return volumeChangeCount; }
+	//voxel range (inclusive) of volume->volumeCuda changed by the deformation since the change count seenCount, which is then set to the current count.
+	//returns false if nothing changed. each user of the volume keeps its own seenCount, to incrementally update the structures it built from the volume,
+	//such as the macro cell grid of a renderer
+	bool getChangedVolumeRegion(unsigned int &seenCount, int3 &voxelMin, int3 &voxelMax);
+
 	~PositionBasedDeformProcessor(){
 		if (d_vertexCoords) { cudaFree(d_vertexCoords); d_vertexCoords = 0; };
 		if (d_vertexCoords_init){ cudaFree(d_vertexCoords_init); d_vertexCoords_init = 0; };
@@ -163,6 +172,7 @@ private:
 	void computeTunnelInfo(float3 centerPoint);
 	void adjustTunnelEnds();
 	void adjustTunnelEndsLastTunnel();
+	int lineStepsAhead(float3 other, float3 from, float3 dir, float step);
 
 	bool sameTunnel();
 	//tunnel info
@@ -213,11 +223,37 @@ private:
 
 
 	std::shared_ptr<VolumeCUDA> volumeCudaIntermediate; //when mixing opening and closing, an intermediate volume is needed
+
+	//tracking of the changed part of the volume
+	bool hasDeformedRegion = false;
+	int3 deformedVoxelMin, deformedVoxelMax; //the part of volumeCuda that may differ from the original volume
+	struct VolumeChange
+	{
+		unsigned int count;
+		int3 voxelMin, voxelMax;
+	};
+	std::vector<VolumeChange> volumeChanges; //the most recent changes. a user that has not seen the older ones updates the whole volume
+	unsigned int volumeChangeCount = 0;
+	void tunnelVoxelRange(float3 start, float3 end, int3 &voxelMin, int3 &voxelMax);
+	void setDeformedRegion(bool isDeformed, int3 voxelMin, int3 voxelMax);
 	
 	bool inRange(float3 v); 
+	//distance in voxels from every voxel of the original volume to the nearest voxel denser than densityThr by the transfer function,
+	//so that the proper location check in the original data is one lookup. built from volume->values when first needed after the data,
+	//the transfer function or densityThr changed
+	std::vector<float> properDistance;
+	float properDistanceThr = -1;
+	bool buildProperDistance();
 	void resetData();
 	bool atProperLocation(float3 pos, bool useOriData); //useOriData = true: check if proper in original data; false: check if proper in deformed data (with a in-tunnel check at the beginning)
 	bool inFullExtentTunnel(float3 v);
+	float properDistanceAt(float3 pos);
+
+	//line search in the original data: the index of the first of the points start + dir*step*i, i in [0, maxSteps), which is proper if wantProper,
+	//or improper if not. maxSteps if there is none. a volume is searched by sphere tracing in properDistance, or else by one launch over all the points
+	int searchProperChange(float3 start, float3 dir, float step, int maxSteps, bool wantProper);
+	//number of the points start + stepVec*i from i = 0 that are in range. the point after them is proper, being out of range
+	int stepsInRange(float3 start, float3 stepVec);
 
 
 	
@@ -6,7 +6,14 @@
 #include <math_constants.h>
 #include <thrust/extrema.h>
 #include <thrust/sequence.h>
+#include <thrust/reduce.h>
+#include <thrust/functional.h>
+#include <thrust/iterator/counting_iterator.h>
+#include <thrust/iterator/transform_iterator.h>
+#include <thrust/iterator/discard_iterator.h>
+#include <algorithm>
 #include "Particle.h"
+#include "ThreadPool.h"
 
 //when using thrust::device_vector instead of thrust::device_vector,
 //the performance does not reduce much.
@@ -415,6 +422,29 @@ struct functor_ApproachTarget
 	}
 };
 
+//same as functor_ApproachTarget, and also records if anything of the particle changed
+struct functor_ApproachTargetAndRecordChange
+{
+	template<typename Tuple>
+	__device__ __host__ void operator() (Tuple t) {
+		float4 pos = thrust::get<0>(t);
+		float size = thrust::get<2>(t);
+		float bright = thrust::get<4>(t);
+		functor_ApproachTarget()(t);
+		float4 newPos = thrust::get<0>(t);
+		thrust::get<6>(t) = newPos.x != pos.x || newPos.y != pos.y || newPos.z != pos.z
+			|| thrust::get<2>(t) != size || thrust::get<4>(t) != bright;
+	}
+};
+
+struct functor_ChangeBlock
+{
+	__device__ __host__ int operator() (int i) const
+	{
+		return i / PARTICLE_CHANGE_BLOCK;
+	}
+};
+
 struct functor_Unproject
 {
 	matrix4x4 inv_mv, inv_pj;
@@ -483,6 +513,84 @@ void ScreenLensDisplaceProcessor::DisplacePoints(std::vector<float2>& pts, std::
 	}
 }
 
+//host side application of one displacement functor on a block of points, used by DisplacePointsBatch
+template<typename Functor>
+inline void DisplaceBlock(const Functor &f, functor_Object2Clip &toClip, const float4* pts, int start, int end, float2* outPos, float* outBright)
+{
+	Functor func = f;
+	for (int i = start; i < end; i++) {
+		float4 clipPos = toClip(pts[i]);
+		float size = 1.0f, brightness = 1.0f;
+		char feature = 0;
+		int id = i;
+		func(thrust::tie(outPos[i], clipPos, size, brightness, feature, id));
+		if (outBright != 0)
+			outBright[i] = brightness;
+	}
+}
+
+void ScreenLensDisplaceProcessor::DisplacePointsBatch(const float4* pts, int numPts, const std::vector<Lens*> &lenses, const float* modelviews, const float* projections, int numFrames, int winW, int winH, float2* screenPos, float* bright)
+{
+	//number of points processed by one task. big enough to amortize the per task lens setup
+	const int blockSize = 4096;
+	int numBlocks = iDivUp(numPts, blockSize);
+	int numLenses = lenses.size();
+
+	ThreadPool::global().parallelFor(numBlocks * numFrames, [&](int task){
+		int frame = task / numBlocks;
+		int start = (task % numBlocks) * blockSize;
+		int end = min(start + blockSize, numPts);
+
+		float mvArray[16], pjArray[16];
+		memcpy(mvArray, modelviews + 16 * frame, sizeof(float) * 16);
+		memcpy(pjArray, projections + 16 * frame, sizeof(float) * 16);
+		functor_Object2Clip toClip(matrix4x4(mvArray), matrix4x4(pjArray));
+		functor_Clip2Screen toScreen(winW, winH);
+
+		float2* outPos = screenPos + (size_t)frame * numPts;
+		float* outBright = bright == 0 ? 0 : bright + (size_t)frame * numPts;
+
+		for (int i = start; i < end; i++) {
+			outPos[i] = toScreen(toClip(pts[i]));
+			if (outBright != 0)
+				outBright[i] = 1.0f;
+		}
+
+		//same order as in Compute(): the lenses are applied one after another on the screen position.
+		//the functors are built once per lens and task, since the curve lens functor is large
+		for (int j = 0; j < numLenses; j++) {
+			Lens* lens = lenses[j];
+			float2 center = lens->GetCenterScreenPos(mvArray, pjArray, winW, winH);
+			float lensD = lens->GetClipDepth(mvArray, pjArray);
+			switch (lens->type) {
+			case LENS_TYPE::TYPE_CIRCLE:
+			{
+				CircleLens* l = (CircleLens*)lens;
+				DisplaceBlock(functor_Displace(center.x, center.y, l->radius, lensD, l->focusRatio, false, -1, -1),
+					toClip, pts, start, end, outPos, outBright);
+				break;
+			}
+			case LENS_TYPE::TYPE_LINE:
+			{
+				LineLens* l = (LineLens*)lens;
+				DisplaceBlock(functor_Displace_LineLens(center.x, center.y, l->lineLensInfo, lensD, false, -1, -1),
+					toClip, pts, start, end, outPos, outBright);
+				break;
+			}
+			case LENS_TYPE::TYPE_CURVE:
+			{
+				CurveLens* l = (CurveLens*)lens;
+				if (!l->isConstructing){
+					DisplaceBlock(functor_Displace_Curve(center.x, center.y, l->curveLensInfo, lensD, false, -1, -1),
+						toClip, pts, start, end, outPos, outBright);
+				}
+				break;
+			}
+			}
+		}
+	});
+}
+
 bool ScreenLensDisplaceProcessor::process(float* modelview, float* projection, int winW, int winH)
 {
 	if (!isActive)
@@ -646,6 +754,7 @@ void ScreenLensDisplaceProcessor::Compute(float* modelview, float* projection, i
 	thrust::copy(glyphSizeScale, glyphSizeScale + size, d_vec_glyphSizeScale.begin());
 	thrust::device_vector<float> d_vec_glyphBright(size);
 	thrust::copy(glyphBright, glyphBright + size, d_vec_glyphBright.begin());
+	thrust::device_vector<char> d_vec_changed(size);
 	
 	thrust::for_each(
 		thrust::make_zip_iterator(
@@ -655,7 +764,8 @@ void ScreenLensDisplaceProcessor::Compute(float* modelview, float* projection, i
 		d_vec_glyphSizeScale.begin(),
 		d_vec_glyphSizeTarget.begin(),
 		d_vec_glyphBright.begin(),
-		d_vec_glyphBrightTarget.begin()
+		d_vec_glyphBrightTarget.begin(),
+		d_vec_changed.begin()
 		)),
 		thrust::make_zip_iterator(
 		thrust::make_tuple(
@@ -664,12 +774,37 @@ void ScreenLensDisplaceProcessor::Compute(float* modelview, float* projection, i
 		d_vec_glyphSizeScale.end(),
 		d_vec_glyphSizeTarget.end(),
 		d_vec_glyphBright.end(),
-		d_vec_glyphBrightTarget.end()
+		d_vec_glyphBrightTarget.end(),
+		d_vec_changed.end()
 		)),
-		functor_ApproachTarget());
-	thrust::copy(d_vec_posCur.begin(), d_vec_posCur.end(), &(particle->pos[0]));
-	thrust::copy(d_vec_glyphSizeScale.begin(), d_vec_glyphSizeScale.end(), glyphSizeScale);
-	thrust::copy(d_vec_glyphBright.begin(), d_vec_glyphBright.end(), glyphBright);
+		functor_ApproachTargetAndRecordChange());
+
+	//only the blocks of particles that changed are copied back and reported to the renderers,
+	//so that a settled lens costs no upload
+	int numBlocks = (size + PARTICLE_CHANGE_BLOCK - 1) / PARTICLE_CHANGE_BLOCK;
+	thrust::device_vector<char> d_vec_blockChanged(numBlocks);
+	thrust::reduce_by_key(
+		thrust::make_transform_iterator(thrust::make_counting_iterator(0), functor_ChangeBlock()),
+		thrust::make_transform_iterator(thrust::make_counting_iterator(size), functor_ChangeBlock()),
+		d_vec_changed.begin(), thrust::make_discard_iterator(), d_vec_blockChanged.begin(),
+		thrust::equal_to<int>(), thrust::maximum<char>());
+	std::vector<char> blockChanged(numBlocks);
+	thrust::copy(d_vec_blockChanged.begin(), d_vec_blockChanged.end(), blockChanged.begin());
+	for (int b = 0; b < numBlocks;){
+		if (!blockChanged[b]){
+			b++;
+			continue;
+		}
+		int e = b;
+		while (e < numBlocks && blockChanged[e])
+			e++;
+		int start = b * PARTICLE_CHANGE_BLOCK, end = std::min(e * PARTICLE_CHANGE_BLOCK, size);
+		thrust::copy(d_vec_posCur.begin() + start, d_vec_posCur.begin() + end, &(particle->pos[start]));
+		thrust::copy(d_vec_glyphSizeScale.begin() + start, d_vec_glyphSizeScale.begin() + end, glyphSizeScale + start);
+		thrust::copy(d_vec_glyphBright.begin() + start, d_vec_glyphBright.begin() + end, glyphBright + start);
+		particle->markChanged(start, end);
+		b = e;
+	}
 }
 
 
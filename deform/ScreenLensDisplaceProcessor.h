@@ -43,6 +43,12 @@ public:
 
 	void DisplacePoints(std::vector<float2>& pts, std::vector<Lens*> lenses, float* modelview, float* projection, int winW, int winH); //used to draw the images of the deformed grid, used in Xin's PacificVis streamline paper
 
+	//batch version of DisplacePoints for offline figure / animation generation. evaluated on the cpu thread pool.
+	//pts are object space points. modelviews and projections store numFrames matrices of 16 floats each.
+	//the caller owns the output: screenPos needs numPts*numFrames elements, stored frame by frame; bright is optional.
+	//feeding a large point set in chunks, the output buffers can be reused across calls, no allocation happens per call
+	static void DisplacePointsBatch(const float4* pts, int numPts, const std::vector<Lens*> &lenses, const float* modelviews, const float* projections, int numFrames, int winW, int winH, float2* screenPos, float* bright = 0);
+
 	float3 findClosetGlyph(float3 aim, int &snappedGlyphId);
 
 };
@@ -256,6 +256,7 @@ bool LensLeapInteractor::SlotRightHandChanged(float3 thumpLeap, float3 indexLeap
 	
 	leapFingerIndicators->numParticles = 1;
 	leapFingerIndicators->pos[0] = markerPos;
+	leapFingerIndicators->markChanged(0, 1);
 	//if (ret){
 	//	actor->blendOthers = true;
 	//}
@@ -50,4 +50,5 @@ void BinaryParticleReader::OutputToParticleData(std::shared_ptr<Particle> v)
 	if (feature.size() > 0){
 		v->setFeature(feature);
 	}
+	v->markChanged();
 }
\ No newline at end of file
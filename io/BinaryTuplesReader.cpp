@@ -92,6 +92,7 @@ void BinaryTuplesReader::OutputToParticleDataArrays(std::vector<std::shared_ptr<
 		if (feature.size() > 0){
 			v[i]->setFeature(featureArrays[i]);
 		}
+		v[i]->markChanged();
 	}
 }
 
@@ -118,4 +119,5 @@ void BinaryTuplesReader::OutputToParticleData(std::shared_ptr<Particle> p)
 	if (feature.size() > 0){
 		p->setFeature(featureArrays[0]);
 	}
+	p->markChanged();
 }
\ No newline at end of file
@@ -4,6 +4,9 @@
 #include <vector_functions.h>
 #include <helper_math.h>
 #include  "eig3.h"
+#include "ThreadPool.h"
+
+#include <algorithm>
 
 #define EPS 1e-6
 
@@ -12,6 +15,25 @@ DTIVolumeReader::DTIVolumeReader(const char* filename)
 {
 }
 
+//number of cells per task of the thread pool
+static const int cellBlockSize = 4096;
+
+//fractional anisotropy from the tensor invariants, without the eigen decomposition.
+//sum of squared eigenvalues == squared frobenius norm, and the same holds for the deviatoric part
+inline float TensorFA(const float* t)
+{
+	const float c_3 = 1.0f / 3.0f;
+	const float c_2_3 = sqrt(3.0f / 2.0f);
+	float offDiag = t[1] * t[1] + t[2] * t[2] + t[3] * t[3] + t[5] * t[5] + t[6] * t[6] + t[7] * t[7];
+	float det = t[0] * t[0] + t[4] * t[4] + t[8] * t[8] + offDiag;
+	if (det < EPS)
+		return 0;
+	float v_avg = (t[0] + t[4] + t[8]) * c_3;
+	float v1_v = t[0] - v_avg, v2_v = t[4] - v_avg, v3_v = t[8] - v_avg;
+	return c_2_3 * sqrt(v1_v * v1_v + v2_v * v2_v + v3_v * v3_v + offDiag) / sqrt(det);
+}
+
+//computes the eigen vectors and values, and also the major components, the fractional anisotropy and the colors in the same pass
 void DTIVolumeReader::EigenAnalysis()
 {
 	//if it is already computed, return
@@ -20,44 +42,41 @@ void DTIVolumeReader::EigenAnalysis()
 	int nCells = dataSizes.x * dataSizes.y * dataSizes.z;
 	eigenvec = new float[9 * nCells];
 	eigenval = new float[3 * nCells];
+	if (nullptr == majorEigenvec)
+		majorEigenvec = new float3[nCells];
+	if (nullptr == fracAnis)
+		fracAnis = new float[nCells];
+	if (nullptr == colors)
+		colors = new float3[nCells];
 
-	for (int i = 0; i < nCells; i++) {
-		eigen_decomposition<float>((float*)data + 9 * i, eigenvec + 9 * i, eigenval + 3 * i);
-	}
+	const float scale = 1.0;
+	const float3 white = 0.2 * make_float3(1, 1, 1);
+	float* tensors = (float*)data;
+	ThreadPool::global().parallelFor((nCells + cellBlockSize - 1) / cellBlockSize, [&](int b){
+		int end = std::min((b + 1) * cellBlockSize, nCells);
+		for (int i = b * cellBlockSize; i < end; i++) {
+			eigen_decomposition<float>(tensors + 9 * i, eigenvec + 9 * i, eigenval + 3 * i);
+			majorEigenvec[i] = make_float3(eigenvec[i * 9], eigenvec[i * 9 + 1], eigenvec[i * 9 + 2]);
+			fracAnis[i] = TensorFA(tensors + 9 * i);
+			float3 c = majorEigenvec[i] * fracAnis[i];
+			colors[i] = make_float3(
+				abs(c.z) * scale,
+				abs(c.y) * scale,
+				abs(c.x) * scale)
+				+ white;
+		}
+	});
 }
 
 float3* DTIVolumeReader::GetMajorComponent()
 {
-	if (nullptr != majorEigenvec)
-		return majorEigenvec;
 	EigenAnalysis();
-
-	int nCells = dataSizes.x * dataSizes.y * dataSizes.z;
-	majorEigenvec = new float3[nCells];
-	for (int i = 0; i < nCells; i++) {
-		majorEigenvec[i] = make_float3(eigenvec[i * 9], eigenvec[i * 9 + 1], eigenvec[i * 9 + 2]);
-	}
 	return majorEigenvec;
 }
 
 float3* DTIVolumeReader::GetColors()
 {
-	if (nullptr != colors)
-		return colors;
-	const float scale = 1.0;
-	const float3 white = 0.2 * make_float3(1,1,1);
-	float3* a = GetMajorComponent();
-	float* b = GetFractionalAnisotropy();
-	int nCells = dataSizes.x * dataSizes.y * dataSizes.z;
-	colors = new float3[nCells];
-	for (int i = 0; i < nCells; i++) {
-		colors[i] = a[i] * b[i];
-		colors[i] = make_float3(
-			abs(colors[i].z) * scale,
-			abs(colors[i].y) * scale,
-			abs(colors[i].x) * scale)
-			+white;
-	}
+	EigenAnalysis();
 	return colors;
 }
 
@@ -69,30 +88,17 @@ float3* DTIVolumeReader::GetColors()
 
 float* DTIVolumeReader::GetFractionalAnisotropy()
 {
+	//the fractional anisotropy does not need the eigen decomposition
 	if (nullptr != fracAnis)
 		return fracAnis;
-	EigenAnalysis();
 	int nCells = dataSizes.x * dataSizes.y * dataSizes.z;
 	fracAnis = new float[nCells];
-	float v1, v2, v3, v_avg, v1_v, v2_v, v3_v, det;
-	float c_3 = 1.0f / 3.0f;
-	float c_2_3 = sqrt(3.0f / 2.0f);
-	for (int i = 0; i < nCells; i++) {
-		v1 = eigenval[i * 3];
-		v2 = eigenval[i * 3 + 1];
-		v3 = eigenval[i * 3 + 2];
-		v_avg = (v1 + v2 + v3) * c_3;
-		v1_v = v1 - v_avg;
-		v2_v = v2 - v_avg;
-		v3_v = v3 - v_avg;
-		det = v1 * v1 + v2 * v2 + v3 * v3;
-		if ( det < EPS)
-			fracAnis[i] = 0;
-		else
-			fracAnis[i] = c_2_3 
-			* sqrt(v1_v * v1_v + v2_v * v2_v + v3_v * v3_v)
-			/ sqrt(det);
-	}
+	float* tensors = (float*)data;
+	ThreadPool::global().parallelFor((nCells + cellBlockSize - 1) / cellBlockSize, [&](int b){
+		int end = std::min((b + 1) * cellBlockSize, nCells);
+		for (int i = b * cellBlockSize; i < end; i++)
+			fracAnis[i] = TensorFA(tensors + 9 * i);
+	});
 	return fracAnis;
 }
 
@@ -101,53 +107,75 @@ inline float4 float3To4(float3 v)
 	return make_float4(v.x, v.y, v.z, 1.0f);
 }
 
-void DTIVolumeReader::GetSamples(std::vector<float4>& _pos, std::vector<float>& _val)
+//indices of the cells on the sampling grid (every 4th cell in x and y) whose fractional anisotropy is above the threshold.
+//each slice is tested in parallel, and the result keeps the order of the serial loop over k, j, i
+void DTIVolumeReader::SelectSampleCells(float faThreshold, std::vector<int>& cells)
 {
-	float* b = GetFractionalAnisotropy();
-	int nCells = dataSizes.x * dataSizes.y * dataSizes.z;
-
-	for (int k = 0; k < dataSizes.z; k++){
-		for (int j = 0; j < dataSizes.y; j+=4) {
-			for (int i = 0; i < dataSizes.x; i+=4){
+	float* tensors = (float*)data;
+	std::vector<std::vector<int> > sliceCells(dataSizes.z);
+	ThreadPool::global().parallelFor(dataSizes.z, [&](int k){
+		for (int j = 0; j < dataSizes.y; j += 4) {
+			for (int i = 0; i < dataSizes.x; i += 4){
 				int idx = k * dataSizes.x * dataSizes.y + j * dataSizes.x + i;
-				if (b[idx] > 0.4) {
-					_pos.push_back(float3To4(GetDataPos(make_int3(i, j, k))));
-					_val.push_back(1.0f);
-					_val.push_back(*((float*)data + 9 * idx));
-					_val.push_back(*((float*)data + 9 * idx + 1));
-					_val.push_back(*((float*)data + 9 * idx + 2));
-					_val.push_back(*((float*)data + 9 * idx + 4));
-					_val.push_back(*((float*)data + 9 * idx + 5));
-					_val.push_back(*((float*)data + 9 * idx + 8));
-				}
+				float fa = (nullptr != fracAnis) ? fracAnis[idx] : TensorFA(tensors + 9 * idx);
+				if (fa > faThreshold)
+					sliceCells[k].push_back(idx);
 			}
 		}
-	}
+	});
+	int n = 0;
+	for (int k = 0; k < dataSizes.z; k++)
+		n += sliceCells[k].size();
+	cells.clear();
+	cells.reserve(n);
+	for (int k = 0; k < dataSizes.z; k++)
+		cells.insert(cells.end(), sliceCells[k].begin(), sliceCells[k].end());
 }
 
-void DTIVolumeReader::GetSamplesWithFeature(std::vector<float4>& _pos, std::vector<float>& _val, std::vector<char> &_feature)
+//appends position and the 7 tensor values (1, d0, d1, d2, d4, d5, d8) of the given cells. the outputs are allocated once
+void DTIVolumeReader::AppendSamples(const std::vector<int>& cells, std::vector<float4>& _pos, std::vector<float>& _val)
 {
-	float* b = GetFractionalAnisotropy();
-	int nCells = dataSizes.x * dataSizes.y * dataSizes.z;
-
-	for (int k = 0; k < dataSizes.z; k++){
-		for (int j = 0; j < dataSizes.y; j += 4) {
-			for (int i = 0; i < dataSizes.x; i += 4){
-				int idx = k * dataSizes.x * dataSizes.y + j * dataSizes.x + i;
-				if (b[idx] > 0.3 ){//|| (feature[idx]>0 && b[idx] > 0.2)) {
-					_pos.push_back(float3To4(GetDataPos(make_int3(i, j, k))));
-					_feature.push_back(feature[idx]);
-					_val.push_back(1.0f);
-					_val.push_back(*((float*)data + 9 * idx));
-					_val.push_back(*((float*)data + 9 * idx + 1));
-					_val.push_back(*((float*)data + 9 * idx + 2));
-					_val.push_back(*((float*)data + 9 * idx + 4));
-					_val.push_back(*((float*)data + 9 * idx + 5));
-					_val.push_back(*((float*)data + 9 * idx + 8));
-				}
-			}
+	float* tensors = (float*)data;
+	int n = cells.size();
+	int posStart = _pos.size(), valStart = _val.size();
+	_pos.resize(posStart + n);
+	_val.resize(valStart + 7 * n);
+	int dxy = dataSizes.x * dataSizes.y;
+	ThreadPool::global().parallelFor((n + cellBlockSize - 1) / cellBlockSize, [&](int b){
+		int end = std::min((b + 1) * cellBlockSize, n);
+		for (int s = b * cellBlockSize; s < end; s++) {
+			int idx = cells[s];
+			int k = idx / dxy, j = (idx % dxy) / dataSizes.x, i = idx % dataSizes.x;
+			_pos[posStart + s] = float3To4(GetDataPos(make_int3(i, j, k)));
+			float* t = tensors + 9 * idx;
+			float* v = &_val[valStart + 7 * s];
+			v[0] = 1.0f;
+			v[1] = t[0];
+			v[2] = t[1];
+			v[3] = t[2];
+			v[4] = t[4];
+			v[5] = t[5];
+			v[6] = t[8];
 		}
-	}
+	});
+}
+
+void DTIVolumeReader::GetSamples(std::vector<float4>& _pos, std::vector<float>& _val)
+{
+	std::vector<int> cells;
+	SelectSampleCells(0.4f, cells);
+	AppendSamples(cells, _pos, _val);
+}
+
+void DTIVolumeReader::GetSamplesWithFeature(std::vector<float4>& _pos, std::vector<float>& _val, std::vector<char> &_feature)
+{
+	std::vector<int> cells;
+	SelectSampleCells(0.3f, cells);//|| (feature[idx]>0 && b[idx] > 0.2)) {
+	AppendSamples(cells, _pos, _val);
+	int featureStart = _feature.size();
+	_feature.resize(featureStart + cells.size());
+	for (int s = 0; s < cells.size(); s++)
+		_feature[featureStart + s] = feature[cells[s]];
 }
 
 void DTIVolumeReader::OutputToParticleData(std::shared_ptr<Particle> v)
@@ -165,4 +193,5 @@ void DTIVolumeReader::OutputToParticleData(std::shared_ptr<Particle> v)
 
 	v->numParticles = v->pos.size();
 	v->updateMaxMinValAndPos();
+	v->markChanged();
 }
\ No newline at end of file
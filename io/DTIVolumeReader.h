@@ -35,6 +35,8 @@ public:
 
 private:
 	void EigenAnalysis();
+	void SelectSampleCells(float faThreshold, std::vector<int>& cells);
+	void AppendSamples(const std::vector<int>& cells, std::vector<float4>& _pos, std::vector<float>& _val);
 
 	float* eigenvec = nullptr;
 	float* eigenval = nullptr;
@@ -114,4 +114,5 @@ void SolutionParticleReader::OutputToParticleData(std::shared_ptr<Particle> v)
 
 	v->numParticles = pos.size();
 	v->updateMaxMinValAndPos();
+	v->markChanged();
 }
\ No newline at end of file
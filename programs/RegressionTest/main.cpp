@@ -0,0 +1,257 @@
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <cmath>
+#include <cstdlib>
+
+#include "Volume.h"
+#include "VolumeRendererCPU.h"
+#include "VolumeRenderableCUDAKernel.h"
+#include "myDefineRayCasting.h"
+#include <QMatrix4x4>
+#include <helper_math.h>
+#include <helper_cuda.h>
+
+//regression tests, run by ctest. the first argument chooses the test.
+//a test of an image compares it with a reference image, stored as raw RGBA8 with the first row at the bottom.
+//the other tests check their results directly and take no reference
+
+//a pixel differs when one of its channels differs by more than channelTolerance.
+//the test fails when more than maxDifferentPixels of the pixels differ, which allows for the rounding differences of other compilers
+static const int channelTolerance = 2;
+static const float maxDifferentPixels = 0.001f;
+
+static bool CompareWithReference(const std::vector<unsigned int> &image, const char* referenceFile, bool writeReference)
+{
+	if (writeReference){
+		std::ofstream out(referenceFile, std::ios::binary);
+		if (!out.is_open()){
+			std::cout << "reference " << referenceFile << " cannot be written" << std::endl;
+			return false;
+		}
+		out.write((const char*)image.data(), image.size() * sizeof(unsigned int));
+		std::cout << "wrote reference " << referenceFile << std::endl;
+		return true;
+	}
+
+	std::vector<unsigned int> reference(image.size());
+	std::ifstream in(referenceFile, std::ios::binary);
+	if (!in.read((char*)reference.data(), reference.size() * sizeof(unsigned int))){
+		std::cout << "reference " << referenceFile << " cannot be read, or has another size" << std::endl;
+		return false;
+	}
+
+	int numDifferent = 0, maxDiff = 0;
+	for (int i = 0; i < image.size(); i++){
+		int diff = 0;
+		for (int c = 0; c < 4; c++){
+			int a = (image[i] >> (8 * c)) & 0xFF, b = (reference[i] >> (8 * c)) & 0xFF;
+			diff = std::max(diff, std::abs(a - b));
+		}
+		maxDiff = std::max(maxDiff, diff);
+		numDifferent += diff > channelTolerance;
+	}
+	std::cout << numDifferent << " of " << image.size() << " pixels differ from the reference, max channel difference " << maxDiff << std::endl;
+	return numDifferent <= maxDifferentPixels * image.size();
+}
+
+//column major, as given to Renderable::draw()
+static void LookAtCenter(float3 center, float distance, float modelview[16])
+{
+	for (int i = 0; i < 16; i++)
+		modelview[i] = (i % 5 == 0);
+	modelview[12] = -center.x;
+	modelview[13] = -center.y;
+	modelview[14] = -center.z - distance;
+}
+
+static void Perspective(float fovy, float aspect, float zNear, float zFar, float projection[16])
+{
+	float f = 1.0f / tanf(fovy * 0.5f * 3.14159265f / 180.0f);
+	for (int i = 0; i < 16; i++)
+		projection[i] = 0;
+	projection[0] = f / aspect;
+	projection[5] = f;
+	projection[10] = (zFar + zNear) / (zNear - zFar);
+	projection[11] = -1;
+	projection[14] = 2 * zFar * zNear / (zNear - zFar);
+}
+
+//the ray casting scene of the image tests: the synthetic volume of two blobs with the default ray casting parameters,
+//seen from close to the first blob so that most of the pixels hit it
+static const int rayCastW = 160, rayCastH = 120;
+
+static std::shared_ptr<Volume> RayCastScene(float modelview[16], float projection[16])
+{
+	std::shared_ptr<Volume> volume = std::make_shared<Volume>();
+	volume->createSyntheticData();
+	LookAtCenter(make_float3(volume->size.x * 0.25f, volume->size.y * 0.5f, volume->size.z * 0.5f), 40, modelview);
+	Perspective(45, (float)rayCastW / rayCastH, 0.1f, 1000, projection);
+	return volume;
+}
+
+//VolumeRendererCPU gives the image of d_render(), stored as the reference by the gpuRayCast test
+static bool TestCpuRayCast(const char* referenceFile, bool writeReference)
+{
+	float modelview[16], projection[16];
+	std::shared_ptr<Volume> volume = RayCastScene(modelview, projection);
+
+	VolumeRendererCPU renderer(volume);
+	renderer.rcp = std::make_shared<RayCastingParameters>();
+
+	std::vector<unsigned int> image(rayCastW * rayCastH);
+	renderer.render(image.data(), rayCastW, rayCastH, modelview, projection);
+	bool ok = CompareWithReference(image, referenceFile, writeReference);
+
+	//the gradient on the fly gives the same image
+	if (ok && !writeReference){
+		renderer.useGradientOnTheFly = true;
+		renderer.render(image.data(), rayCastW, rayCastH, modelview, projection);
+		ok = CompareWithReference(image, referenceFile, false);
+	}
+	return ok;
+}
+
+//d_render() of the same scene, set up as in VolumeRenderableCUDA::draw() without empty space skipping and multi-resolution.
+//the reference of cpuRayCast is written with: RegressionTest gpuRayCast <reference> --write-reference
+static bool TestGpuRayCast(const char* referenceFile, bool writeReference)
+{
+	float modelview[16], projection[16];
+	std::shared_ptr<Volume> volume = RayCastScene(modelview, projection);
+	volume->initVolumeCuda();
+	RayCastingParameters rcp;
+
+	QMatrix4x4 q_modelview = QMatrix4x4(modelview).transposed();
+	QMatrix4x4 q_invMV = q_modelview.inverted();
+	QVector4D q_eye4 = q_invMV.map(QVector4D(0, 0, 0, 1));
+	float3 eyeInLocal = make_float3(q_eye4[0], q_eye4[1], q_eye4[2]);
+	QMatrix4x4 q_mvp = QMatrix4x4(projection).transposed() * q_modelview;
+	float MVMatrix[16], MVPMatrix[16], invMVMatrix[16], invMVPMatrix[16], NMatrix[9];
+	q_invMV.copyDataTo(invMVMatrix);
+	q_mvp.inverted().copyDataTo(invMVPMatrix);
+	q_mvp.copyDataTo(MVPMatrix);
+	q_modelview.copyDataTo(MVMatrix);
+	q_modelview.normalMatrix().copyDataTo(NMatrix);
+
+	VolumeRender_init();
+	VolumeRender_setConstants(MVMatrix, MVPMatrix, invMVMatrix, invMVPMatrix, NMatrix, &(volume->spacing), &rcp);
+	VolumeCUDA gradient;
+	gradient.VolumeCUDA_init(volume->size, (float*)0, 1, 4);
+	VolumeRender_computeGradient(&(volume->volumeCuda), &gradient);
+	VolumeRender_setGradient(&gradient);
+	VolumeRender_setGradientOnTheFly(false);
+	VolumeRender_setBrickLevels(0, make_int3(0, 0, 0));
+	VolumeRender_setVolume(&(volume->volumeCuda));
+
+	uint* d_output;
+	checkCudaErrors(cudaMalloc(&d_output, rayCastW * rayCastH * sizeof(uint)));
+	MacroCellOccupancy noSkipping = { 0, make_int3(0, 0, 0) };
+	VolumeRender_render(d_output, rayCastW, rayCastH, eyeInLocal, volume->size, noSkipping);
+	std::vector<unsigned int> image(rayCastW * rayCastH);
+	checkCudaErrors(cudaMemcpy(image.data(), d_output, image.size() * sizeof(uint), cudaMemcpyDeviceToHost));
+	checkCudaErrors(cudaFree(d_output));
+	VolumeRender_deinit();
+
+	return CompareWithReference(image, referenceFile, writeReference);
+}
+
+//read the whole array of a VolumeCUDA of one float channel back to the host
+static std::vector<float> ReadBack(const VolumeCUDA &volumeCuda)
+{
+	cudaExtent size = volumeCuda.size;
+	std::vector<float> values(size.width * size.height * size.depth);
+	cudaMemcpy3DParms copyParams = { 0 };
+	copyParams.srcArray = volumeCuda.content;
+	copyParams.dstPtr = make_cudaPitchedPtr(values.data(), size.width*sizeof(float), size.width, size.height);
+	copyParams.extent = size;
+	copyParams.kind = cudaMemcpyDeviceToHost;
+	checkCudaErrors(cudaMemcpy3D(&copyParams));
+	return values;
+}
+
+//VolumeCUDA_updateRegion() of a box not at the origin changes exactly that box of the array, VolumeCUDA_readRegion() reads it back,
+//and VolumeCUDA_contentUpdate() without values clears the array
+static bool TestVolumeUpdateRegion()
+{
+	const int3 size = make_int3(37, 21, 13);
+	const int3 origin = make_int3(5, 3, 2), extent = make_int3(20, 10, 6);
+	int n = size.x * size.y * size.z;
+	std::vector<float> initial(n), updated(n);
+	for (int i = 0; i < n; i++){
+		initial[i] = i;
+		updated[i] = -1 - i;
+	}
+
+	VolumeCUDA volumeCuda;
+	volumeCuda.VolumeCUDA_init(size, initial.data(), 0);
+	volumeCuda.VolumeCUDA_updateRegion(updated.data(), size, origin, extent);
+	std::vector<float> values = ReadBack(volumeCuda);
+
+	int numWrong = 0;
+	for (int k = 0; k < size.z; k++){
+		for (int j = 0; j < size.y; j++){
+			for (int i = 0; i < size.x; i++){
+				int idx = (k * size.y + j) * size.x + i;
+				bool inside = i >= origin.x && i < origin.x + extent.x && j >= origin.y && j < origin.y + extent.y && k >= origin.z && k < origin.z + extent.z;
+				numWrong += values[idx] != (inside ? updated[idx] : initial[idx]);
+			}
+		}
+	}
+	std::cout << numWrong << " of " << n << " voxels are wrong after the region update" << std::endl;
+
+	//reading the box back changes only the box of the host volume
+	std::vector<float> readBack(initial);
+	volumeCuda.VolumeCUDA_readRegion(readBack.data(), size, origin, extent);
+	int numWrongRead = 0;
+	for (int i = 0; i < n; i++)
+		numWrongRead += readBack[i] != values[i];
+	std::cout << numWrongRead << " of " << n << " voxels are wrong after reading the region back" << std::endl;
+
+	VolumeCUDA volumeCudaShort;
+	std::vector<unsigned short> ones(n, 1);
+	volumeCudaShort.VolumeCUDA_init(size, ones.data(), 0);
+	volumeCudaShort.VolumeCUDA_contentUpdate(0, 0);
+	std::vector<unsigned short> cleared(n, 1);
+	cudaMemcpy3DParms copyParams = { 0 };
+	copyParams.srcArray = volumeCudaShort.content;
+	copyParams.dstPtr = make_cudaPitchedPtr(cleared.data(), size.x*sizeof(unsigned short), size.x, size.y);
+	copyParams.extent = volumeCudaShort.size;
+	copyParams.kind = cudaMemcpyDeviceToHost;
+	checkCudaErrors(cudaMemcpy3D(&copyParams));
+	int numNotCleared = 0;
+	for (int i = 0; i < n; i++)
+		numNotCleared += cleared[i] != 0;
+	std::cout << numNotCleared << " of " << n << " voxels are not cleared by the content update" << std::endl;
+
+	return numWrong == 0 && numWrongRead == 0 && numNotCleared == 0;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 2){
+		std::cout << "usage: RegressionTest <test> [<reference file> [--write-reference]]" << std::endl;
+		return 1;
+	}
+	std::string test = argv[1];
+	bool writeReference = argc > 3 && std::string(argv[3]) == "--write-reference";
+
+	bool ok;
+	if (test == "cpuRayCast" || test == "gpuRayCast"){
+		if (argc < 3){
+			std::cout << "the test " << test << " needs a reference file" << std::endl;
+			return 1;
+		}
+		ok = test == "cpuRayCast" ? TestCpuRayCast(argv[2], writeReference) : TestGpuRayCast(argv[2], writeReference);
+	}
+	else if (test == "volumeUpdateRegion"){
+		ok = TestVolumeUpdateRegion();
+	}
+	else{
+		std::cout << "unknown test " << test << std::endl;
+		return 1;
+	}
+	std::cout << test << (ok ? " passed" : " FAILED") << std::endl;
+	return ok ? 0 : 1;
+}
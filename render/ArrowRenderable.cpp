@@ -7,6 +7,7 @@
 #include <windows.h>
 #endif
 #define qgl	QOpenGLContext::currentContext()->functions()
+#define gl44	QOpenGLContext::currentContext()->versionFunctions<QOpenGLFunctions_4_4_Core>()
 
 #include <QOpenGLFunctions>
 #include <QOpenGLVertexArrayObject>
@@ -15,6 +16,8 @@
 #include <helper_math.h>
 #include "ColorGradient.h"
 #include "Particle.h"
+#include "GlyphInstanceBuffer.h"
+#include <QOpenGLFunctions_4_4_Core>
 
 using namespace std;
 
@@ -62,6 +65,17 @@ GlyphRenderable(_particle)
 		}
 	}
 
+	//the rotations in the layout of the instance buffer
+	rotations3x3.resize(9 * particle->numParticles);
+	for (int i = 0; i < particle->numParticles; i++) {
+		const float* m = rotations[i].constData();
+		for (int c = 0; c < 3; c++) {
+			for (int r = 0; r < 3; r++) {
+				rotations3x3[9 * i + 3 * c + r] = m[4 * c + r];
+			}
+		}
+	}
+
 	ColorGradient cg;
 	cols.resize(particle->numParticles);
 	for (int i = 0; i < particle->numParticles; i++) {
@@ -78,37 +92,41 @@ void ArrowRenderable::LoadShaders(ShaderProgram*& shaderProg)
 	//shader is from https://www.packtpub.com/books/content/basics-glsl-40-shaders
 
 
+	//the per glyph position, rotation, color and brightness are read from the instance buffer
 	const char* vertexVS =
-		GLSL(
+		GLSL_GLYPH_INSTANCE(
 		in vec4 VertexPosition;
 		in vec4 VertexColor;
 		in vec3 VertexNormal;
 		smooth out vec3 tnorm;
 		out vec4 eyeCoords;
 		out vec4 fragColor;
+		flat out vec3 Ka;
+		flat out float Bright;
 
 		uniform mat4 ModelViewMatrix;
 		uniform mat3 NormalMatrix;
 		uniform mat4 ProjectionMatrix;
-		uniform mat4 SQRotMatrix;
 		uniform float Scale;
-
-		uniform vec3 Transform;
-
-		vec4 DivZ(vec4 v){
-			return vec4(v.x / v.w, v.y / v.w, v.z / v.w, 1.0f);
-		}
+		uniform int SnappedGlyphId;
 
 		void main()
 		{
+			GlyphInstance g = instances[GlyphId];
+			mat3 SQRotMatrix = mat3(g.rot[0].xyz, g.rot[1].xyz, g.rot[2].xyz);
+			Ka = (GlyphId == SnappedGlyphId) ? vec3(0.9) : g.colorBright.xyz;
+			Bright = g.colorBright.w;
+
 			mat4 MVP = ProjectionMatrix * ModelViewMatrix;
 			eyeCoords = ModelViewMatrix * VertexPosition;
-			tnorm = normalize(NormalMatrix * /*vec3(VertexPosition) + 0.001 * */VertexNormal);
+			tnorm = normalize(NormalMatrix * SQRotMatrix * /*vec3(VertexPosition) + 0.001 * */VertexNormal);
 			//gl_Position = MVP * (VertexPosition + vec4(Transform, 0.0));
+			vec4 v;
 			if (Scale<1)
-				gl_Position = MVP * vec4(vec3(DivZ(SQRotMatrix * (VertexPosition*vec4(Scale, Scale, Scale, 1.0)))) + Transform, 1.0);
+				v = VertexPosition*vec4(Scale, Scale, Scale, 1.0);
 			else
-				gl_Position = MVP * vec4(vec3(DivZ(SQRotMatrix * (VertexPosition*vec4(1.0, 1.0, Scale, 1.0)))) + Transform, 1.0);
+				v = VertexPosition*vec4(1.0, 1.0, Scale, 1.0);
+			gl_Position = MVP * vec4(SQRotMatrix * (v.xyz / v.w) + g.posScale.xyz, 1.0);
 			fragColor = VertexColor;
 		}
 	);
@@ -116,7 +134,7 @@ void ArrowRenderable::LoadShaders(ShaderProgram*& shaderProg)
 	const char* vertexFS =
 		GLSL(
 		uniform vec4 LightPosition; // Light position in eye coords.
-		uniform vec3 Ka; // Diffuse reflectivity
+		flat in vec3 Ka; // Diffuse reflectivity
 		uniform vec3 Kd; // Diffuse reflectivity
 		uniform vec3 Ks; // Diffuse reflectivity
 		uniform float Shininess;
@@ -125,7 +143,7 @@ void ArrowRenderable::LoadShaders(ShaderProgram*& shaderProg)
 		smooth in vec3 tnorm;
 		//layout(location = 0) 
 		out vec4 FragColor;
-		uniform float Bright;
+		flat in float Bright;
 
 		vec3 phongModel(vec3 a, vec4 position, vec3 normal) {
 			vec3 s = normalize(vec3(LightPosition - position));
@@ -154,7 +172,6 @@ void ArrowRenderable::LoadShaders(ShaderProgram*& shaderProg)
 	shaderProg->addAttribute("VertexColor");
 	shaderProg->addAttribute("VertexNormal");
 	shaderProg->addUniform("LightPosition");
-	shaderProg->addUniform("Ka");
 	shaderProg->addUniform("Kd");
 	shaderProg->addUniform("Ks");
 	shaderProg->addUniform("Shininess");
@@ -162,10 +179,8 @@ void ArrowRenderable::LoadShaders(ShaderProgram*& shaderProg)
 	shaderProg->addUniform("ModelViewMatrix");
 	shaderProg->addUniform("NormalMatrix");
 	shaderProg->addUniform("ProjectionMatrix");
-	shaderProg->addUniform("SQRotMatrix");
 	shaderProg->addUniform("Scale");
-	shaderProg->addUniform("Bright");
-	shaderProg->addUniform("Transform");
+	shaderProg->addUniform("SnappedGlyphId");
 }
 
 
@@ -207,6 +222,8 @@ void ArrowRenderable::init()
 	qgl->glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(unsigned int)* glyphMesh->GetNumIndices(), glyphMesh->GetIndices(), GL_STATIC_DRAW);
 	qgl->glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 
+	glyphInstances = std::make_shared<GlyphInstanceBuffer>();
+	glyphInstances->init(particle->numParticles);
 
 	initPickingDrawingObjects();
 
@@ -214,8 +231,6 @@ void ArrowRenderable::init()
 
 void ArrowRenderable::DrawWithoutProgram(float modelview[16], float projection[16], ShaderProgram* sp)
 {
-	int firstVertex = 0;
-	int firstIndex = 0;
 	qgl->glBindBuffer(GL_ARRAY_BUFFER, vbo_vert);
 	qgl->glVertexAttribPointer(sp->attribute("VertexPosition"), 4, GL_FLOAT, GL_FALSE, 0, NULL);
 	qgl->glEnableVertexAttribArray(sp->attribute("VertexPosition"));
@@ -228,51 +243,35 @@ void ArrowRenderable::DrawWithoutProgram(float modelview[16], float projection[1
 	qgl->glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, vbo_indices);
 
 
-	float* glyphSizeScale = &(particle->glyphSizeScale[0]);
-	float* glyphBright = &(particle->glyphBright[0]);
-	bool isFreezingFeature = particle->isFreezingFeature;
-	int snappedGlyphId = particle->snappedGlyphId;
-	int snappedFeatureId = particle->snappedFeatureId;
-
-	for (int i = 0; i < particle->numParticles; i++) {
-
-		float4 shift = particle->pos[i];
-
-		QMatrix4x4 q_modelview = QMatrix4x4(modelview);
-		q_modelview = q_modelview.transposed();
-		float3 cen = actor->DataCenter();
-		qgl->glUniform4f(sp->uniform("LightPosition"), 0, 0, std::max(std::max(cen.x, cen.y), cen.z) * 2, 1);
-
-		//float3 vec = vecs[i];
-		//float cosX = dot(vec, make_float3(1, 0, 0));
-		//float cosY = dot(vec, make_float3(0, 1, 0));
-		//qgl->glUniform3f(sp->uniform("Ka"), (cosY + 1) / 2, (cosX + 1) / 2, 1 - (cosX + 1) / 2);
-		//qgl->glUniform3f(sp->uniform("Ka"), 0.8f, 0.8f, 0.8f);
-		qgl->glUniform3f(sp->uniform("Kd"), 0.3f, 0.3f, 0.3f);
-		qgl->glUniform3f(sp->uniform("Ks"), 0.2f, 0.2f, 0.2f);
-		qgl->glUniform1f(sp->uniform("Shininess"), 5);
-		qgl->glUniform3fv(sp->uniform("Transform"), 1, &shift.x);
-		qgl->glUniformMatrix4fv(sp->uniform("ModelViewMatrix"), 1, GL_FALSE, modelview);
-		qgl->glUniformMatrix4fv(sp->uniform("ProjectionMatrix"), 1, GL_FALSE, projection);
-		//qgl->glUniformMatrix3fv(sp->uniform("NormalMatrix"), 1, GL_FALSE, q_modelview.normalMatrix().data());
-		qgl->glUniformMatrix3fv(sp->uniform("NormalMatrix"), 1, GL_FALSE, (q_modelview * rotations[i]).normalMatrix().data());
-		qgl->glUniformMatrix4fv(sp->uniform("SQRotMatrix"), 1, GL_FALSE, rotations[i].data());
-
-
-		float maxScaleInv = 8;
-		qgl->glUniform1f(sp->uniform("Bright"), glyphBright[i]);
-		//qgl->glUniform1f(sp->uniform("Scale"), val[i] / lMax * maxScaleInv);
-		qgl->glUniform1f(sp->uniform("Scale"), 3.0);
-
-		if (i != snappedGlyphId){
-			qgl->glUniform3fv(sp->uniform("Ka"), 1, &cols[i].x);
-		}
-		else{
-			qgl->glUniform3f(sp->uniform("Ka"), 0.9f, 0.9f, 0.9f);
-		}
-		glColor3f(1,1,0);
-		glDrawArrays(GL_TRIANGLES, 0, glyphMesh->GetNumVerts());
-	}
+	//only the glyphs changed since the last frame are written into the instance buffer
+	glyphInstances->update(particle.get(), cols.data(), rotations3x3.data());
+	glyphInstances->bind(0);
+
+	QMatrix4x4 q_modelview = QMatrix4x4(modelview);
+	q_modelview = q_modelview.transposed();
+	float3 cen = actor->DataCenter();
+	qgl->glUniform4f(sp->uniform("LightPosition"), 0, 0, std::max(std::max(cen.x, cen.y), cen.z) * 2, 1);
+	qgl->glUniform3f(sp->uniform("Kd"), 0.3f, 0.3f, 0.3f);
+	qgl->glUniform3f(sp->uniform("Ks"), 0.2f, 0.2f, 0.2f);
+	qgl->glUniform1f(sp->uniform("Shininess"), 5);
+	qgl->glUniformMatrix4fv(sp->uniform("ModelViewMatrix"), 1, GL_FALSE, modelview);
+	qgl->glUniformMatrix4fv(sp->uniform("ProjectionMatrix"), 1, GL_FALSE, projection);
+	qgl->glUniformMatrix3fv(sp->uniform("NormalMatrix"), 1, GL_FALSE, q_modelview.normalMatrix().data());
+	//qgl->glUniform1f(sp->uniform("Scale"), val[i] / lMax * maxScaleInv);
+	qgl->glUniform1f(sp->uniform("Scale"), 3.0);
+	qgl->glUniform1i(sp->uniform("SnappedGlyphId"), particle->snappedGlyphId);
+
+	auto functions44 = gl44;
+	functions44->glBindBuffer(GL_ARRAY_BUFFER, glyphInstances->GetIdBuffer());
+	functions44->glVertexAttribIPointer(GLYPH_ID_LOCATION, 1, GL_INT, 0, NULL);
+	functions44->glEnableVertexAttribArray(GLYPH_ID_LOCATION);
+	functions44->glVertexAttribDivisor(GLYPH_ID_LOCATION, 1);
+	functions44->glDrawArraysInstanced(GL_TRIANGLES, 0, glyphMesh->GetNumVerts(), particle->numParticles);
+	functions44->glVertexAttribDivisor(GLYPH_ID_LOCATION, 0);
+	functions44->glDisableVertexAttribArray(GLYPH_ID_LOCATION);
+	functions44->glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	glyphInstances->drawFinished();
 }
 
 
@@ -6,6 +6,7 @@
 class ShaderProgram;
 class QOpenGLVertexArrayObject;
 class GLArrow;
+class GlyphInstanceBuffer;
 
 
 class ArrowRenderable :public GlyphRenderable
@@ -29,6 +30,8 @@ private:
 
 	float lMax, lMin;
 	std::vector<QMatrix4x4> rotations;
+	std::vector<float> rotations3x3; //same as rotations, 9 floats per glyph in column major, as used by the instance buffer
+	std::shared_ptr<GlyphInstanceBuffer> glyphInstances;
 
 	std::vector<float4> verts;
 	std::vector<float3> normals;
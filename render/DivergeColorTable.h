@@ -0,0 +1,42 @@
+#ifndef DIVERGE_COLOR_TABLE_H
+#define DIVERGE_COLOR_TABLE_H
+
+//the diverging color map used by the ray casters. each item is (value, r, g, b).
+//shared by the cuda kernels (copied into constant memory) and the cpu ray caster
+#define DIVERGE_COLOR_TABLE_ITEMS 33
+#define DIVERGE_COLOR_TABLE \
+	0, 0.231372549, 0.298039216, 0.752941176, \
+	0.03125, 0.266666667, 0.352941176, 0.8, \
+	0.0625, 0.301960784, 0.407843137, 0.843137255, \
+	0.09375, 0.341176471, 0.458823529, 0.882352941, \
+	0.125, 0.384313725, 0.509803922, 0.917647059, \
+	0.15625, 0.423529412, 0.556862745, 0.945098039, \
+	0.1875, 0.466666667, 0.603921569, 0.968627451, \
+	0.21875, 0.509803922, 0.647058824, 0.984313725, \
+	0.25, 0.552941176, 0.690196078, 0.996078431, \
+	0.28125, 0.596078431, 0.725490196, 1, \
+	0.3125, 0.639215686, 0.760784314, 1, \
+	0.34375, 0.682352941, 0.788235294, 0.992156863, \
+	0.375, 0.721568627, 0.815686275, 0.976470588, \
+	0.40625, 0.760784314, 0.835294118, 0.956862745, \
+	0.4375, 0.8, 0.850980392, 0.933333333, \
+	0.46875, 0.835294118, 0.858823529, 0.901960784, \
+	0.5, 0.866666667, 0.866666667, 0.866666667, \
+	0.53125, 0.898039216, 0.847058824, 0.819607843, \
+	0.5625, 0.925490196, 0.82745098, 0.77254902, \
+	0.59375, 0.945098039, 0.8, 0.725490196, \
+	0.625, 0.960784314, 0.768627451, 0.678431373, \
+	0.65625, 0.968627451, 0.733333333, 0.62745098, \
+	0.6875, 0.968627451, 0.694117647, 0.580392157, \
+	0.71875, 0.968627451, 0.650980392, 0.529411765, \
+	0.75, 0.956862745, 0.603921569, 0.482352941, \
+	0.78125, 0.945098039, 0.552941176, 0.435294118, \
+	0.8125, 0.925490196, 0.498039216, 0.388235294, \
+	0.84375, 0.898039216, 0.439215686, 0.345098039, \
+	0.875, 0.870588235, 0.376470588, 0.301960784, \
+	0.90625, 0.835294118, 0.31372549, 0.258823529, \
+	0.9375, 0.796078431, 0.243137255, 0.219607843, \
+	0.96875, 0.752941176, 0.156862745, 0.184313725, \
+	1, 0.705882353, 0.015686275, 0.149019608
+
+#endif //DIVERGE_COLOR_TABLE_H
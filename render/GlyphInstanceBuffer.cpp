@@ -0,0 +1,159 @@
+#include "GlyphInstanceBuffer.h"
+
+//removing the following lines will cause runtime error
+#ifdef WIN32
+#include <windows.h>
+#endif
+#include <QOpenGLContext>
+#include <QOpenGLFunctions_4_4_Core>
+#include <vector_functions.h>
+#include <helper_math.h>
+#include <algorithm>
+#include <climits>
+#include "ThreadPool.h"
+#include "Particle.h"
+
+#define gl44	QOpenGLContext::currentContext()->versionFunctions<QOpenGLFunctions_4_4_Core>()
+
+//number of glyphs per dirty block, the same as the change tracking of the particle
+static const int instanceBlockSize = PARTICLE_CHANGE_BLOCK;
+
+//the normal matrix of the glyph, computed once per glyph instead of per vertex.
+//like QMatrix4x4::normalMatrix(), a singular matrix gives the identity
+static void setNormalRotation(GlyphInstance &g)
+{
+	float3 r0 = make_float3(g.rot[0]), r1 = make_float3(g.rot[1]), r2 = make_float3(g.rot[2]);
+	//the columns of the inverse transpose are the cross products of the other two columns, divided by the determinant
+	float3 n0 = cross(r1, r2), n1 = cross(r2, r0), n2 = cross(r0, r1);
+	float det = dot(r0, n0);
+	if (det == 0.0f) {
+		n0 = make_float3(1, 0, 0);
+		n1 = make_float3(0, 1, 0);
+		n2 = make_float3(0, 0, 1);
+		det = 1.0f;
+	}
+	g.normalRot[0] = make_float4(n0 / det, 0.0f);
+	g.normalRot[1] = make_float4(n1 / det, 0.0f);
+	g.normalRot[2] = make_float4(n2 / det, 0.0f);
+}
+
+GlyphInstanceBuffer::~GlyphInstanceBuffer()
+{
+	release();
+}
+
+void GlyphInstanceBuffer::release()
+{
+	if (QOpenGLContext::currentContext() == 0)
+		return;
+	if (fence != 0)
+		gl44->glDeleteSync((GLsync)fence);
+	if (ssbo != 0){
+		gl44->glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssbo);
+		gl44->glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
+		gl44->glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+		gl44->glDeleteBuffers(1, &ssbo);
+	}
+	if (vbo_ids != 0)
+		gl44->glDeleteBuffers(1, &vbo_ids);
+	fence = 0;
+	ssbo = 0;
+	vbo_ids = 0;
+	mapped = 0;
+}
+
+void GlyphInstanceBuffer::init(int n)
+{
+	//the storage is immutable, so a new glyph count needs new buffers
+	release();
+	num = n;
+	auto functions44 = gl44;
+
+	//immutable storage, mapped once for the life time of the buffer
+	GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+	functions44->glGenBuffers(1, &ssbo);
+	functions44->glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssbo);
+	functions44->glBufferStorage(GL_SHADER_STORAGE_BUFFER, std::max(n, 1) * sizeof(GlyphInstance), 0, flags);
+	mapped = (GlyphInstance*)functions44->glMapBufferRange(GL_SHADER_STORAGE_BUFFER, 0, std::max(n, 1) * sizeof(GlyphInstance), flags);
+	functions44->glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+	std::vector<int> ids(n);
+	for (int i = 0; i < n; i++)
+		ids[i] = i;
+	functions44->glGenBuffers(1, &vbo_ids);
+	functions44->glBindBuffer(GL_ARRAY_BUFFER, vbo_ids);
+	functions44->glBufferData(GL_ARRAY_BUFFER, n * sizeof(int), ids.data(), GL_STATIC_DRAW);
+	functions44->glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	invalidate();
+}
+
+void GlyphInstanceBuffer::invalidate()
+{
+	//no version of the particle is UINT_MAX, so every block differs
+	uploadedVersions.assign((num + instanceBlockSize - 1) / instanceBlockSize, UINT_MAX);
+}
+
+void GlyphInstanceBuffer::update(Particle* particle, const float3* colors, const float* rotations)
+{
+	const std::vector<unsigned int> &versions = particle->GetChangeVersions();
+	int numBlocks = uploadedVersions.size();
+
+	//the blocks changed since the last update. there is one version per block, so a frame without changes costs no per glyph work
+	dirtyBlocks.clear();
+	for (int b = 0; b < numBlocks; b++){
+		if (b >= versions.size() || versions[b] != uploadedVersions[b])
+			dirtyBlocks.push_back(b);
+	}
+	lastUpdateBytes = 0;
+	if (dirtyBlocks.empty())
+		return;
+
+	//the gpu may still read the buffer for the previous frame
+	if (fence != 0){
+		gl44->glClientWaitSync((GLsync)fence, GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+		gl44->glDeleteSync((GLsync)fence);
+		fence = 0;
+	}
+
+	//write the instance data of the dirty blocks into the mapped buffer
+	const float4* pos = particle->pos.data();
+	const float* glyphSizeScale = particle->glyphSizeScale.data();
+	const float* glyphBright = particle->glyphBright.data();
+	ThreadPool::global().parallelFor(dirtyBlocks.size(), [&](int k){
+		int start = dirtyBlocks[k] * instanceBlockSize;
+		int end = std::min(start + instanceBlockSize, num);
+		for (int i = start; i < end; i++) {
+			GlyphInstance &g = mapped[i];
+			g.posScale = make_float4(pos[i].x, pos[i].y, pos[i].z, glyphSizeScale[i]);
+			if (colors != 0)
+				g.colorBright = make_float4(colors[i].x, colors[i].y, colors[i].z, glyphBright[i]);
+			else
+				g.colorBright = make_float4(0.8f, 0.8f, 0.8f, glyphBright[i]);
+			for (int c = 0; c < 3; c++) {
+				if (rotations != 0)
+					g.rot[c] = make_float4(rotations[9 * i + 3 * c], rotations[9 * i + 3 * c + 1], rotations[9 * i + 3 * c + 2], 0.0f);
+				else
+					g.rot[c] = make_float4(c == 0, c == 1, c == 2, 0.0f);
+			}
+			setNormalRotation(g);
+		}
+	});
+	for (int b : dirtyBlocks){
+		uploadedVersions[b] = b < versions.size() ? versions[b] : UINT_MAX;
+		lastUpdateBytes += (std::min((b + 1) * instanceBlockSize, num) - b * instanceBlockSize) * sizeof(GlyphInstance);
+	}
+}
+
+void GlyphInstanceBuffer::bind(unsigned int bindingPoint)
+{
+	gl44->glBindBufferBase(GL_SHADER_STORAGE_BUFFER, bindingPoint, ssbo);
+}
+
+void GlyphInstanceBuffer::drawFinished()
+{
+	auto functions44 = gl44;
+	if (fence != 0)
+		functions44->glDeleteSync((GLsync)fence);
+	fence = functions44->glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
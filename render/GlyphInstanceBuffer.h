@@ -0,0 +1,69 @@
+#ifndef GLYPH_INSTANCE_BUFFER_H
+#define GLYPH_INSTANCE_BUFFER_H
+
+#include <vector>
+#include <vector_types.h>
+
+class Particle;
+
+//attribute location of the per instance glyph id
+const int GLYPH_ID_LOCATION = 7;
+
+//same as the GLSL macro of the glyph renderables, plus the declaration of the instance buffer and of the glyph id attribute
+#define GLSL_GLYPH_INSTANCE(shader) "#version 440\n" \
+	"struct GlyphInstance { vec4 posScale; vec4 colorBright; vec4 rot[3]; vec4 normalRot[3]; };\n" \
+	"layout(std430, binding = 0) readonly buffer GlyphInstances { GlyphInstance instances[]; };\n" \
+	"layout(location = 7) in int GlyphId;\n" #shader
+
+//per glyph data used by instanced glyph rendering. the layout matches the std430 struct GlyphInstance in the glyph shaders
+struct GlyphInstance
+{
+	float4 posScale; //xyz: position, w: glyphSizeScale
+	float4 colorBright; //xyz: color, w: glyphBright
+	float4 rot[3]; //columns of the 3x3 orientation (and shape) matrix of the glyph. w is unused
+	float4 normalRot[3]; //columns of the inverse transpose of rot, identity if rot is singular. w is unused
+};
+
+/*
+gpu resident per glyph data for instanced rendering, stored in a persistently mapped shader storage buffer.
+update() only writes the blocks of glyphs reported as changed by Particle::markChanged() since the last update, on the cpu thread pool,
+after waiting for the draw calls that still read the buffer.
+a second buffer holds the identity list of glyph ids, which can be bound as the per instance attribute "GlyphId"
+*/
+class GlyphInstanceBuffer
+{
+public:
+	~GlyphInstanceBuffer();
+
+	//needs a current gl context of version 4.4. can be called again when the number of glyphs changes
+	void init(int n);
+
+	//colors and rotations may be 0. rotations hold 9 floats per glyph, column major
+	void update(Particle* particle, const float3* colors, const float* rotations);
+	//all glyphs are written by the next update(). for changes of the colors or rotations, which are not tracked by the particle
+	void invalidate();
+
+	void bind(unsigned int bindingPoint);
+	//call after the draw calls that read the buffer
+	void drawFinished();
+
+	unsigned int GetIdBuffer(){ return vbo_ids; }
+	int GetNum(){ return num; }
+
+	//number of bytes written into the mapped buffer by the last update(). for profiling
+	size_t lastUpdateBytes = 0;
+
+private:
+	int num = 0;
+	unsigned int ssbo = 0;
+	unsigned int vbo_ids = 0;
+	GlyphInstance* mapped = 0;
+	void* fence = 0;
+
+	std::vector<unsigned int> uploadedVersions; //the Particle::GetChangeVersions() of each block at its last upload
+	std::vector<int> dirtyBlocks;
+
+	void release();
+};
+
+#endif //GLYPH_INSTANCE_BUFFER_H
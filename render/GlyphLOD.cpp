@@ -0,0 +1,89 @@
+#include "GlyphLOD.h"
+#include "TransformFunc.h"
+#include "ThreadPool.h"
+
+#include <algorithm>
+
+void GlyphLOD::select(const std::vector<float4> &pos, const std::vector<float> &glyphSizeScale, const std::vector<float> &glyphBright,
+	float objectRadius, float modelview[16], float projection[16], int winW, int winH, int snappedGlyphId)
+{
+	int n = pos.size();
+	levels.resize(n);
+
+	const int blockSize = 8192;
+	int numBlocks = iDivUp(n, blockSize);
+	blockCounts.assign(numBlocks * GLYPH_LOD_NUM, 0);
+
+	//the radius in pixels of a sphere of radius 1 at distance w is about projection[5] * winH / 2 / w
+	float pixelScale = projection[5] * winH * 0.5f;
+
+	//pass 1: choose a level per glyph, and count the glyphs of each level in each block
+	ThreadPool::global().parallelFor(numBlocks, [&](int b){
+		int start = b * blockSize;
+		int end = std::min(start + blockSize, n);
+		int* counts = &blockCounts[b * GLYPH_LOD_NUM];
+		for (int i = start; i < end; i++) {
+			float r = objectRadius * glyphSizeScale[i];
+			if (i == snappedGlyphId)
+				r *= 2;
+			float4 p = make_float4(pos[i].x, pos[i].y, pos[i].z, 1.0f);
+			float4 clip = mat4mulvec4(projection, mat4mulvec4(modelview, p));
+
+			char lod;
+			if (clip.w <= 0){
+				lod = LOD_CULLED;
+			}
+			else {
+				float pixelRadius = r * pixelScale / clip.w;
+				//clip space radius, used to keep glyphs that are partially inside the view frustum
+				float clipRadius = 2.0f * pixelRadius / winH;
+				float x = clip.x / clip.w, y = clip.y / clip.w, z = clip.z / clip.w;
+				//the snapped glyph is only culled outside of the view, so that its highlight is kept at any distance
+				if (x < -1 - clipRadius || x > 1 + clipRadius || y < -1 - clipRadius || y > 1 + clipRadius || z < -1 || z > 1
+					|| (pixelRadius < cullRadius && i != snappedGlyphId)){
+					lod = LOD_CULLED;
+				}
+				else {
+					if (pixelRadius > fullMeshRadius)
+						lod = LOD_FULL;
+					else if (pixelRadius > pointRadius)
+						lod = LOD_LOW;
+					else
+						lod = LOD_POINT;
+					if (glyphBright[i] < dimBright && i != snappedGlyphId && lod < LOD_POINT)
+						lod++;
+				}
+			}
+			levels[i] = lod;
+			if (lod != LOD_CULLED)
+				counts[lod]++;
+		}
+	});
+
+	//exclusive scan of the block counts, giving the write offset of each block in each list
+	for (int l = 0; l < GLYPH_LOD_NUM; l++) {
+		int sum = 0;
+		for (int b = 0; b < numBlocks; b++) {
+			int c = blockCounts[b * GLYPH_LOD_NUM + l];
+			blockCounts[b * GLYPH_LOD_NUM + l] = sum;
+			sum += c;
+		}
+		numInstances[l] = sum;
+		if (instances[l].size() < sum)
+			instances[l].resize(sum);
+	}
+
+	//pass 2: scatter the glyph ids into the per level lists
+	ThreadPool::global().parallelFor(numBlocks, [&](int b){
+		int start = b * blockSize;
+		int end = std::min(start + blockSize, n);
+		int offsets[GLYPH_LOD_NUM];
+		for (int l = 0; l < GLYPH_LOD_NUM; l++)
+			offsets[l] = blockCounts[b * GLYPH_LOD_NUM + l];
+		for (int i = start; i < end; i++) {
+			char lod = levels[i];
+			if (lod != LOD_CULLED)
+				instances[lod][offsets[lod]++] = i;
+		}
+	});
+}
@@ -0,0 +1,48 @@
+#ifndef GLYPH_LOD_H
+#define GLYPH_LOD_H
+
+#include <vector>
+#include <vector_types.h>
+
+enum GLYPH_LOD{
+	LOD_FULL,
+	LOD_LOW,
+	LOD_POINT,
+	LOD_CULLED,
+};
+const int GLYPH_LOD_NUM = 3; //number of drawn levels. culled glyphs are not stored in any list
+
+/*
+per frame level of detail selection for glyph renderables.
+each glyph gets a level from its projected radius in pixels, which is then lowered for glyphs darkened by a lens (glyphBright),
+since they contribute little to the image. the selection and the compaction into per level lists run on the cpu thread pool.
+*/
+class GlyphLOD
+{
+public:
+	//pixel radius thresholds
+	float fullMeshRadius = 6.0f; //glyphs larger than this use the full mesh
+	float pointRadius = 2.0f; //glyphs smaller than this become point sprites
+	float cullRadius = 0.3f; //glyphs smaller than this are not drawn
+	float dimBright = 0.3f; //glyphs darker than this are drawn one level coarser
+
+	//objectRadius is the object space radius of a glyph with glyphSizeScale == 1.
+	//the snapped glyph is selected with its highlighted size and is never culled for being small
+	void select(const std::vector<float4> &pos, const std::vector<float> &glyphSizeScale, const std::vector<float> &glyphBright,
+		float objectRadius, float modelview[16], float projection[16], int winW, int winH, int snappedGlyphId = -1);
+
+	//compacted glyph ids of one level, in increasing order
+	const std::vector<int>& GetInstances(GLYPH_LOD lod) { return instances[lod]; }
+	int GetNumInstances(GLYPH_LOD lod) { return numInstances[lod]; }
+
+	//the level of each glyph chosen by the last select()
+	const std::vector<char>& GetLevels() { return levels; }
+
+private:
+	std::vector<char> levels;
+	std::vector<int> instances[GLYPH_LOD_NUM];
+	int numInstances[GLYPH_LOD_NUM];
+	std::vector<int> blockCounts; //per block and per level counts, used for the compaction
+};
+
+#endif //GLYPH_LOD_H
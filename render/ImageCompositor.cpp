@@ -0,0 +1,41 @@
+#include "ImageCompositor.h"
+#include "ThreadPool.h"
+
+#include <algorithm>
+
+void ImageCompositor::composite(const float4* front, const unsigned int* backColor, const float* backDepth, unsigned int* output,
+	int imageW, int imageH, float backOpacityScale, float backBrightness)
+{
+	int tilesX = (imageW + tileSize - 1) / tileSize;
+	int tilesY = (imageH + tileSize - 1) / tileSize;
+	const float inv255 = 1.0f / 255.0f;
+
+	ThreadPool::global().parallelFor(tilesX * tilesY, [&](int tile){
+		int x0 = (tile % tilesX) * tileSize;
+		int y0 = (tile / tilesX) * tileSize;
+		int x1 = std::min(x0 + tileSize, imageW);
+		int y1 = std::min(y0 + tileSize, imageH);
+
+		for (int y = y0; y < y1; y++){
+			const float4* f = front + y * imageW;
+			const unsigned int* bc = backColor + y * imageW;
+			const float* bd = backDepth + y * imageW;
+			unsigned int* o = output + y * imageW;
+			for (int x = x0; x < x1; x++){
+				unsigned int c = bc[x];
+				//background pixels of the back layer are transparent
+				float a = std::min((float)(c >> 24) * inv255 * backOpacityScale, 1.0f) * (bd[x] < 1.0f ? 1.0f : 0.0f);
+				float w = (1.0f - f[x].w) * a;
+				float r = f[x].x + w * (float)(c & 0xff) * inv255 * backBrightness;
+				float g = f[x].y + w * (float)((c >> 8) & 0xff) * inv255 * backBrightness;
+				float b = f[x].z + w * (float)((c >> 16) & 0xff) * inv255 * backBrightness;
+				float alpha = f[x].w + (1.0f - f[x].w) * a;
+				r = std::min(std::max(r, 0.0f), 1.0f);
+				g = std::min(std::max(g, 0.0f), 1.0f);
+				b = std::min(std::max(b, 0.0f), 1.0f);
+				alpha = std::min(std::max(alpha, 0.0f), 1.0f);
+				o[x] = ((unsigned int)(alpha * 255) << 24) | ((unsigned int)(b * 255) << 16) | ((unsigned int)(g * 255) << 8) | (unsigned int)(r * 255);
+			}
+		}
+	});
+}
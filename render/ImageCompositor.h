@@ -0,0 +1,25 @@
+#ifndef IMAGE_COMPOSITOR_H
+#define IMAGE_COMPOSITOR_H
+
+#include <vector_types.h>
+
+/*
+host version of the blending done by VolumeRender_renderWithDepthInput(), for headless use or when both layers come from cpu renderers.
+the front layer is a premultiplied rgba image of the volume, as given by VolumeRendererCPU::renderLayer() with the depth of the back layer as depth limit,
+so the volume only holds the samples in front of the back layer. the back layer is an rgba8 image with its window depth per pixel,
+e.g. read back from the opaque geometry or rendered by another cpu renderer. pixels with depth 1 are background and stay transparent.
+the image is split into tiles which are composited on the cpu thread pool. the inner loop over a row has no branches, so the compiler can vectorize it
+*/
+class ImageCompositor
+{
+public:
+	//edge length in pixels of a tile
+	int tileSize = 64;
+
+	//output = front + (1 - front.a) * back, written as rgba8. output may be the same buffer as backColor, then no extra image is needed.
+	//backOpacityScale and backBrightness play the role of densityBonus and brightness of the gpu blending
+	void composite(const float4* front, const unsigned int* backColor, const float* backDepth, unsigned int* output,
+		int imageW, int imageH, float backOpacityScale = 1.0f, float backBrightness = 1.0f);
+};
+
+#endif //IMAGE_COMPOSITOR_H
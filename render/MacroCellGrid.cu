@@ -0,0 +1,212 @@
+#include "MacroCellGrid.h"
+#include "Volume.h"
+#include "TransformFunc.h"
+
+#include <helper_cuda.h>
+#include <helper_math.h>
+#include <algorithm>
+
+texture<float, 3, cudaReadModeElementType>  macroCellVolumeTex;
+
+__device__ float2 macroCellMinMax(int x, int y, int z)
+{
+	//a trilinear sample inside the cell reads the voxels from one before the cell to the first one after the cell.
+	//voxels outside of the volume read 0 by the border address mode, the same as in the ray casters
+	float vMin = 1e30f, vMax = -1e30f;
+	for (int k = z * MACRO_CELL_SIZE - 1; k <= (z + 1) * MACRO_CELL_SIZE; k++){
+		for (int j = y * MACRO_CELL_SIZE - 1; j <= (y + 1) * MACRO_CELL_SIZE; j++){
+			for (int i = x * MACRO_CELL_SIZE - 1; i <= (x + 1) * MACRO_CELL_SIZE; i++){
+				float v = tex3D(macroCellVolumeTex, i + 0.5, j + 0.5, k + 0.5);
+				vMin = fminf(vMin, v);
+				vMax = fmaxf(vMax, v);
+			}
+		}
+	}
+	return make_float2(vMin, vMax);
+}
+
+__global__ void d_computeMacroCellMinMax(float2* minMax, int3 gridSize, int3 cellMin, int3 cellMax)
+{
+	int x = blockIdx.x*blockDim.x + threadIdx.x + cellMin.x;
+	int y = blockIdx.y*blockDim.y + threadIdx.y + cellMin.y;
+	int z = blockIdx.z*blockDim.z + threadIdx.z + cellMin.z;
+
+	if (x > cellMax.x || y > cellMax.y || z > cellMax.z)
+		return;
+	minMax[(z * gridSize.y + y) * gridSize.x + x] = macroCellMinMax(x, y, z);
+}
+
+//one thread per cell of the list
+__global__ void d_computeMacroCellMinMaxList(float2* minMax, int3 gridSize, const int* cells, int numCells)
+{
+	int i = blockIdx.x*blockDim.x + threadIdx.x;
+	if (i >= numCells)
+		return;
+	int idx = cells[i];
+	int x = idx % gridSize.x, y = (idx / gridSize.x) % gridSize.y, z = idx / (gridSize.x * gridSize.y);
+	minMax[idx] = macroCellMinMax(x, y, z);
+}
+
+//one thread per word of the bitmap
+__global__ void d_computeMacroCellOccupancy(const float2* minMax, int numCells, unsigned int* occupancy, float transFuncP1, float transFuncP2)
+{
+	int w = blockIdx.x*blockDim.x + threadIdx.x;
+	if (w * 32 >= numCells)
+		return;
+
+	unsigned int bits = 0;
+	for (int b = 0; b < 32 && w * 32 + b < numCells; b++){
+		float2 mm = minMax[w * 32 + b];
+		//the opacity clamp((v - transFuncP2) / (transFuncP1 - transFuncP2), 0, 1) is positive somewhere in [min, max]
+		bool occupied = (transFuncP1 > transFuncP2) ? (mm.y > transFuncP2) : (mm.x < transFuncP2);
+		if (occupied)
+			bits |= (1u << b);
+	}
+	occupancy[w] = bits;
+}
+
+MacroCellGrid::~MacroCellGrid()
+{
+	release();
+}
+
+void MacroCellGrid::release()
+{
+	if (d_minMax != 0)
+		checkCudaErrors(cudaFree(d_minMax));
+	if (d_occupancy != 0)
+		checkCudaErrors(cudaFree(d_occupancy));
+	if (d_cellList != 0)
+		checkCudaErrors(cudaFree(d_cellList));
+	d_minMax = 0;
+	d_occupancy = 0;
+	d_cellList = 0;
+	cellListCapacity = 0;
+}
+
+void MacroCellGrid::build(const VolumeCUDA* volume)
+{
+	int3 size = make_int3(volume->size.width, volume->size.height, volume->size.depth);
+	if (d_minMax == 0 || size.x != volumeSize.x || size.y != volumeSize.y || size.z != volumeSize.z){
+		release();
+		volumeSize = size;
+		gridSize = make_int3(iDivUp(size.x, MACRO_CELL_SIZE), iDivUp(size.y, MACRO_CELL_SIZE), iDivUp(size.z, MACRO_CELL_SIZE));
+		int numCells = gridSize.x * gridSize.y * gridSize.z;
+		checkCudaErrors(cudaMalloc(&d_minMax, sizeof(float2)* numCells));
+		checkCudaErrors(cudaMalloc(&d_occupancy, sizeof(unsigned int)* iDivUp(numCells, 32)));
+	}
+	computeMinMax(volume, make_int3(0, 0, 0), gridSize - 1);
+}
+
+//a voxel also belongs to the apron of the neighboring cells
+void MacroCellGrid::cellRange(int3 voxelMin, int3 voxelMax, int3 &cellMin, int3 &cellMax)
+{
+	cellMin = make_int3(
+		std::max((voxelMin.x - 1) / MACRO_CELL_SIZE, 0),
+		std::max((voxelMin.y - 1) / MACRO_CELL_SIZE, 0),
+		std::max((voxelMin.z - 1) / MACRO_CELL_SIZE, 0));
+	cellMax = make_int3(
+		std::min((voxelMax.x + 1) / MACRO_CELL_SIZE, gridSize.x - 1),
+		std::min((voxelMax.y + 1) / MACRO_CELL_SIZE, gridSize.y - 1),
+		std::min((voxelMax.z + 1) / MACRO_CELL_SIZE, gridSize.z - 1));
+}
+
+void MacroCellGrid::update(const VolumeCUDA* volume, int3 voxelMin, int3 voxelMax)
+{
+	if (d_minMax == 0){
+		build(volume);
+		return;
+	}
+	int3 cellMin, cellMax;
+	cellRange(voxelMin, voxelMax, cellMin, cellMax);
+	if (cellMin.x > cellMax.x || cellMin.y > cellMax.y || cellMin.z > cellMax.z)
+		return;
+	computeMinMax(volume, cellMin, cellMax);
+}
+
+void MacroCellGrid::update(const VolumeCUDA* volume, const std::vector<std::pair<int3, int3>> &voxelRanges)
+{
+	if (d_minMax == 0){
+		build(volume);
+		return;
+	}
+	if (voxelRanges.empty())
+		return;
+	if (voxelRanges.size() == 1){
+		update(volume, voxelRanges[0].first, voxelRanges[0].second);
+		return;
+	}
+
+	//the cells of all the ranges, each once
+	int numCells = gridSize.x * gridSize.y * gridSize.z;
+	std::vector<char> marked(numCells, 0);
+	std::vector<int> cells;
+	for (int r = 0; r < voxelRanges.size(); r++){
+		int3 cellMin, cellMax;
+		cellRange(voxelRanges[r].first, voxelRanges[r].second, cellMin, cellMax);
+		for (int z = cellMin.z; z <= cellMax.z; z++){
+			for (int y = cellMin.y; y <= cellMax.y; y++){
+				for (int x = cellMin.x; x <= cellMax.x; x++){
+					int idx = (z * gridSize.y + y) * gridSize.x + x;
+					if (!marked[idx]){
+						marked[idx] = 1;
+						cells.push_back(idx);
+					}
+				}
+			}
+		}
+	}
+	if (cells.empty())
+		return;
+	if (cells.size() > cellListCapacity){
+		if (d_cellList != 0)
+			checkCudaErrors(cudaFree(d_cellList));
+		cellListCapacity = cells.size();
+		checkCudaErrors(cudaMalloc(&d_cellList, sizeof(int)* cellListCapacity));
+	}
+	checkCudaErrors(cudaMemcpy(d_cellList, &(cells[0]), sizeof(int)* cells.size(), cudaMemcpyHostToDevice));
+
+	bindVolume(volume);
+	int blockSize = 128;
+	d_computeMacroCellMinMaxList << <iDivUp(cells.size(), blockSize), blockSize >> >(d_minMax, gridSize, d_cellList, cells.size());
+	checkCudaErrors(cudaUnbindTexture(macroCellVolumeTex));
+	occupancyDirty = true;
+}
+
+void MacroCellGrid::bindVolume(const VolumeCUDA* volume)
+{
+	macroCellVolumeTex.normalized = false;
+	macroCellVolumeTex.filterMode = cudaFilterModePoint;
+	macroCellVolumeTex.addressMode[0] = cudaAddressModeBorder;
+	macroCellVolumeTex.addressMode[1] = cudaAddressModeBorder;
+	macroCellVolumeTex.addressMode[2] = cudaAddressModeBorder;
+	checkCudaErrors(cudaBindTextureToArray(macroCellVolumeTex, volume->content, volume->channelDesc));
+}
+
+void MacroCellGrid::computeMinMax(const VolumeCUDA* volume, int3 cellMin, int3 cellMax)
+{
+	bindVolume(volume);
+
+	int3 n = cellMax - cellMin + 1;
+	dim3 blockSize(8, 8, 4);
+	dim3 gridSizeCuda(iDivUp(n.x, blockSize.x), iDivUp(n.y, blockSize.y), iDivUp(n.z, blockSize.z));
+	d_computeMacroCellMinMax << <gridSizeCuda, blockSize >> >(d_minMax, gridSize, cellMin, cellMax);
+
+	checkCudaErrors(cudaUnbindTexture(macroCellVolumeTex));
+	occupancyDirty = true;
+}
+
+void MacroCellGrid::updateOccupancy(float transFuncP1, float transFuncP2)
+{
+	if (!occupancyDirty && transFuncP1 == lastTransFuncP1 && transFuncP2 == lastTransFuncP2)
+		return;
+
+	int numCells = gridSize.x * gridSize.y * gridSize.z;
+	int numWords = iDivUp(numCells, 32);
+	int blockSize = 256;
+	d_computeMacroCellOccupancy << <iDivUp(numWords, blockSize), blockSize >> >(d_minMax, numCells, d_occupancy, transFuncP1, transFuncP2);
+
+	lastTransFuncP1 = transFuncP1;
+	lastTransFuncP2 = transFuncP2;
+	occupancyDirty = false;
+}
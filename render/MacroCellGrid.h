@@ -0,0 +1,73 @@
+#ifndef MACRO_CELL_GRID_H
+#define MACRO_CELL_GRID_H
+
+#include <vector_types.h>
+#include <vector_functions.h>
+#include <vector>
+#include <utility>
+
+class VolumeCUDA;
+
+//edge length in voxels of a macro cell
+#define MACRO_CELL_SIZE 8
+
+//the occupancy of a grid as read by the ray casting kernels, passed by value to each launch. a null occupancy disables the skipping
+struct MacroCellOccupancy
+{
+	const unsigned int* occupancy;
+	int3 gridSize;
+};
+
+/*
+min/max grid over macro cells of the volume, plus an occupancy bitmap of the cells for the current transfer function, used for empty space skipping.
+the min/max of a cell also covers the one voxel apron read by trilinear interpolation, and the zero border of the volume texture,
+so a sample anywhere inside an empty cell is guaranteed to have zero opacity.
+the grid is built on the gpu from the content of a VolumeCUDA, so it also follows the deformed volume. after a deformation only the cells of the changed region are rebuilt
+*/
+class MacroCellGrid
+{
+public:
+	~MacroCellGrid();
+
+	//build the whole grid. also needed when the size of the volume changed
+	void build(const VolumeCUDA* volume);
+	//rebuild the cells overlapping the voxel range [voxelMin, voxelMax] (inclusive)
+	void update(const VolumeCUDA* volume, int3 voxelMin, int3 voxelMax);
+	//rebuild the cells overlapping any of the voxel ranges, with a single launch over the list of these cells
+	void update(const VolumeCUDA* volume, const std::vector<std::pair<int3, int3>> &voxelRanges);
+
+	//recompute the occupancy bitmap when the transfer function or the min/max changed since the last call
+	void updateOccupancy(float transFuncP1, float transFuncP2);
+
+	bool isBuilt(){ return d_minMax != 0; }
+	int3 GetGridSize(){ return gridSize; }
+	//one bit per cell, in x-fastest order of the cells. a set bit means the cell may be visible
+	const unsigned int* GetOccupancy(){ return d_occupancy; }
+	MacroCellOccupancy GetOccupancyForRendering(){
+		MacroCellOccupancy o = { d_occupancy, gridSize };
+		return o;
+	}
+	//device memory of the min/max grid and of the bitmap
+	size_t GetMemoryBytes(){
+		int numCells = gridSize.x * gridSize.y * gridSize.z;
+		return d_minMax == 0 ? 0 : numCells * sizeof(float2) + (numCells + 31) / 32 * sizeof(unsigned int);
+	}
+
+private:
+	int3 volumeSize = make_int3(0, 0, 0);
+	int3 gridSize = make_int3(0, 0, 0);
+	float2* d_minMax = 0;
+	unsigned int* d_occupancy = 0;
+	int* d_cellList = 0; //cells rebuilt by the update of several ranges
+	size_t cellListCapacity = 0;
+
+	bool occupancyDirty = true;
+	float lastTransFuncP1 = 0, lastTransFuncP2 = 0;
+
+	void release();
+	void cellRange(int3 voxelMin, int3 voxelMax, int3 &cellMin, int3 &cellMax);
+	void bindVolume(const VolumeCUDA* volume);
+	void computeMinMax(const VolumeCUDA* volume, int3 cellMin, int3 cellMax);
+};
+
+#endif //MACRO_CELL_GRID_H
@@ -0,0 +1,58 @@
+#include "PreIntegrationTable.h"
+#include "ThreadPool.h"
+
+#include <helper_math.h>
+#include <algorithm>
+
+//same as tex1D() on a normalized texture with linear filtering and clamp address mode
+static float4 LookupLinear(const float4* t, int n, float u)
+{
+	float x = u * n - 0.5f;
+	int i0 = (int)floorf(x);
+	float f = x - i0;
+	int a = std::min(std::max(i0, 0), n - 1);
+	int b = std::min(std::max(i0 + 1, 0), n - 1);
+	return t[a] * (1 - f) + t[b] * f;
+}
+
+void BuildPreIntegrationTable(const float4* transferFunc, int numColors, std::vector<float4> &table, int tableSize, int integrationSteps)
+{
+	//same as d_integrate_trapezoidal(), which sums the trapezoids up to each entry in the same order, so computed as a running sum
+	std::vector<float4> integral(integrationSteps);
+	float incr = 1.0 / float(integrationSteps - 1);
+	float4 lastval = LookupLinear(transferFunc, numColors, 0);
+	float4 outclr = make_float4(0, 0, 0, 0);
+	float cur = incr;
+	for (int x = 0; x < integrationSteps; x++){
+		float to = float(x) * incr;
+		while (cur < to + incr * 0.5){
+			float4 val = LookupLinear(transferFunc, numColors, cur);
+			outclr += (lastval + val) / 2.0f;
+			lastval = val;
+			cur += incr;
+		}
+		integral[x] = outclr;
+	}
+
+	//same as d_preintegrate()
+	table.resize(tableSize * tableSize);
+	float steps = float(integrationSteps);
+	ThreadPool::global().parallelFor(tableSize, [&](int y){
+		float sy = float(y) / float(tableSize);
+		for (int x = 0; x < tableSize; x++){
+			float sx = float(x) / float(tableSize);
+			float smax = std::max(sx, sy);
+			float smin = std::min(sx, sy);
+
+			float4 iv;
+			if (x != y){
+				float fracc = 1.0 / ((smax - smin)*steps);
+				iv = (LookupLinear(integral.data(), integrationSteps, smax) - LookupLinear(integral.data(), integrationSteps, smin))*fracc;
+			}
+			else{
+				iv = LookupLinear(transferFunc, numColors, smin);
+			}
+			table[y * tableSize + x] = iv;
+		}
+	});
+}
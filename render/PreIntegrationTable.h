@@ -0,0 +1,20 @@
+#ifndef PRE_INTEGRATION_TABLE_H
+#define PRE_INTEGRATION_TABLE_H
+
+#include <vector>
+#include <vector_types.h>
+
+//size of the 2D pre-integration table, and number of samples of the integrated transfer function
+#define VOLUMERENDER_TF_PREINTSIZE    1024
+#define VOLUMERENDER_TF_PREINTSTEPS   1024
+
+/*
+host version of updatePreIntTabelNew(), for headless use or to check the gpu tables.
+transferFunc holds numColors rgba entries over [0, 1], sampled with linear interpolation like the normalized transfer function texture.
+the table has tableSize*tableSize entries, with x the sample at the front of the ray segment and y the sample at its back, as read by tex2DLayered(transferLayerPreintTex, sample, lastSample, 0).
+the rows are computed on the cpu thread pool
+*/
+void BuildPreIntegrationTable(const float4* transferFunc, int numColors, std::vector<float4> &table,
+	int tableSize = VOLUMERENDER_TF_PREINTSIZE, int integrationSteps = VOLUMERENDER_TF_PREINTSTEPS);
+
+#endif //PRE_INTEGRATION_TABLE_H
@@ -9,13 +9,18 @@
 #include "windows.h"
 #endif
 #define qgl	QOpenGLContext::currentContext()->functions()
+#define gl44	QOpenGLContext::currentContext()->versionFunctions<QOpenGLFunctions_4_4_Core>()
 
 #include <QOpenGLFunctions>
 #include <QOpenGLVertexArrayObject>
 #include "ShaderProgram.h"
 #include "Particle.h"
+#include "GlyphInstanceBuffer.h"
+#include "ThreadPool.h"
+#include <QOpenGLFunctions_4_4_Core>
 
 #include <memory>
+#include <algorithm>
 
 using namespace std;
 
@@ -26,30 +31,33 @@ void SQRenderable::LoadShaders(ShaderProgram*& shaderProg)
 	//shader is from https://www.packtpub.com/books/content/basics-glsl-40-shaders
 
 
+	//the per glyph position, shape matrix and brightness are read from the instance buffer
 	const char* vertexVS =
-		GLSL(
+		GLSL_GLYPH_INSTANCE(
 		layout(location = 0) in vec4 VertexPosition;
 		layout(location = 1) in vec3 VertexNormal;
 		smooth out vec3 tnorm;
 		out vec4 eyeCoords;
+		flat out vec3 Ka;
+		flat out float Bright;
 
 		uniform mat4 ModelViewMatrix;
 		uniform mat3 NormalMatrix;
 		uniform mat4 ProjectionMatrix;
-		uniform mat4 SQRotMatrix;
-		uniform vec3 Transform;
-		uniform float Scale;
-
-		vec4 DivZ(vec4 v){
-			return vec4(v.x / v.w, v.y / v.w, v.z / v.w, 1.0f);
-		}
+		uniform float GlyphSizeAdjust; //glyphSizeAdjust is used when a particle is picked or highlighted, change its size?
 
 		void main()
 		{
+			GlyphInstance g = instances[GlyphId];
+			mat3 SQRotMatrix = mat3(g.rot[0].xyz, g.rot[1].xyz, g.rot[2].xyz);
+			float Scale = g.posScale.w * (1 - GlyphSizeAdjust) + GlyphSizeAdjust;
+			Ka = g.colorBright.xyz;
+			Bright = g.colorBright.w;
+
 			mat4 MVP = ProjectionMatrix * ModelViewMatrix;
 			eyeCoords = ModelViewMatrix * VertexPosition;
-			tnorm = normalize(NormalMatrix * /*vec3(VertexPosition) + 0.001 * */VertexNormal);
-			gl_Position = MVP * vec4(vec3(DivZ(SQRotMatrix * VertexPosition)) * 1000 * Scale + Transform, 1.0);
+			tnorm = normalize(NormalMatrix * mat3(g.normalRot[0].xyz, g.normalRot[1].xyz, g.normalRot[2].xyz) * VertexNormal);
+			gl_Position = MVP * vec4(SQRotMatrix * (VertexPosition.xyz / VertexPosition.w) * 1000 * Scale + g.posScale.xyz, 1.0);
 		}
 	);
 
@@ -57,14 +65,14 @@ void SQRenderable::LoadShaders(ShaderProgram*& shaderProg)
 		GLSL(
 
 		uniform vec4 LightPosition; // Light position in eye coords.
-		uniform vec3 Ka; // Diffuse reflectivity
+		flat in vec3 Ka; // Diffuse reflectivity
 		uniform vec3 Kd; // Diffuse reflectivity
 		uniform vec3 Ks; // Diffuse reflectivity
 		uniform float Shininess;
 		in vec4 eyeCoords;
 		smooth in vec3 tnorm;
 		out vec4 FragColor; //layout(location = 0) out vec4 FragColor;
-		uniform float Bright;
+		flat in float Bright;
 
 		vec3 phongModel(vec3 a, vec4 position, vec3 normal) {
 			vec3 s = normalize(vec3(LightPosition - position));
@@ -91,7 +99,6 @@ void SQRenderable::LoadShaders(ShaderProgram*& shaderProg)
 	shaderProg->addAttribute("VertexPosition");
 	shaderProg->addAttribute("VertexNormal");
 	shaderProg->addUniform("LightPosition");
-	shaderProg->addUniform("Ka");
 	shaderProg->addUniform("Kd");
 	shaderProg->addUniform("Ks");
 	shaderProg->addUniform("Shininess");
@@ -99,12 +106,7 @@ void SQRenderable::LoadShaders(ShaderProgram*& shaderProg)
 	shaderProg->addUniform("ModelViewMatrix");
 	shaderProg->addUniform("NormalMatrix");
 	shaderProg->addUniform("ProjectionMatrix");
-	shaderProg->addUniform("SQRotMatrix");
-	
-
-	shaderProg->addUniform("Transform");
-	shaderProg->addUniform("Scale");
-	shaderProg->addUniform("Bright");
+	shaderProg->addUniform("GlyphSizeAdjust");
 }
 
 void SQRenderable::init()
@@ -117,31 +119,50 @@ void SQRenderable::init()
 	//m_vao->bind();
 
 	qgl->glGenBuffers(1, &vbo_vert);
-	qgl->glBindBuffer(GL_ARRAY_BUFFER, vbo_vert);
-	qgl->glVertexAttribPointer(glProg->attribute("VertexPosition"), 4, GL_FLOAT, GL_FALSE, 0, NULL);
-	qgl->glBufferData(GL_ARRAY_BUFFER, verts.size() * sizeof(float) * 4, &verts[0].x, GL_STATIC_DRAW);
-	qgl->glBindBuffer(GL_ARRAY_BUFFER, 0);
-	qgl->glEnableVertexAttribArray(glProg->attribute("VertexPosition"));
-
 	qgl->glGenBuffers(1, &vbo_normals);
+	qgl->glGenBuffers(1, &vbo_indices);
+	qgl->glGenBuffers(1, &vbo_commands);
+	qgl->glGenBuffers(1, &vbo_sorted_ids);
+	glyphInstances = std::make_shared<GlyphInstanceBuffer>();
+	UploadBuffers();
+
+	initPickingDrawingObjects();
+
+	//m_vao->release();
+}
+
+void SQRenderable::UploadBuffers()
+{
+	//the vertex and index buffers only hold the distinct meshes of the cache
+	qgl->glBindBuffer(GL_ARRAY_BUFFER, vbo_vert);
+	qgl->glBufferData(GL_ARRAY_BUFFER, verts.size() * sizeof(float) * 4, verts.data(), GL_STATIC_DRAW);
 	qgl->glBindBuffer(GL_ARRAY_BUFFER, vbo_normals);
-	qgl->glVertexAttribPointer(glProg->attribute("VertexNormal"), 3, GL_FLOAT, GL_FALSE, 0, NULL);
-	qgl->glBufferData(GL_ARRAY_BUFFER, normals.size() * sizeof(float) * 3, &normals[0].x, GL_STATIC_DRAW);
+	qgl->glBufferData(GL_ARRAY_BUFFER, normals.size() * sizeof(float) * 3, normals.data(), GL_STATIC_DRAW);
+	qgl->glBindBuffer(GL_ARRAY_BUFFER, vbo_sorted_ids);
+	qgl->glBufferData(GL_ARRAY_BUFFER, sortedGlyphIds.size() * sizeof(int), sortedGlyphIds.data(), GL_STATIC_DRAW);
 	qgl->glBindBuffer(GL_ARRAY_BUFFER, 0);
-	qgl->glEnableVertexAttribArray(glProg->attribute("VertexNormal"));
 
-	qgl->glGenBuffers(1, &vbo_indices);
 	qgl->glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, vbo_indices);
-	qgl->glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(unsigned int) * indices.size(), &indices[0], GL_STATIC_DRAW);
+	qgl->glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(unsigned int) * indices.size(), indices.data(), GL_STATIC_DRAW);
 	qgl->glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 
-	initPickingDrawingObjects();
+	qgl->glBindBuffer(GL_DRAW_INDIRECT_BUFFER, vbo_commands);
+	qgl->glBufferData(GL_DRAW_INDIRECT_BUFFER, commands.size() * sizeof(DrawElementsIndirectCommand), commands.data(), GL_STATIC_DRAW);
+	qgl->glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
 
-	//m_vao->release();
+	if (glyphInstances->GetNum() != particle->pos.size() || particle->pos.size() == 0)
+		glyphInstances->init(particle->pos.size());
+	else
+		glyphInstances->invalidate(); //the rotations are not tracked by the particle
+
+	buffersDirty = false;
 }
 
 void SQRenderable::DrawWithoutProgram(float modelview[16], float projection[16], ShaderProgram* sp)
 {
+	if (buffersDirty)
+		UploadBuffers();
+
 
 	qgl->glBindBuffer(GL_ARRAY_BUFFER, vbo_vert);
 	qgl->glVertexAttribPointer(glProg->attribute("VertexPosition"), 4, GL_FLOAT, GL_FALSE, 0, NULL);
@@ -153,78 +174,39 @@ void SQRenderable::DrawWithoutProgram(float modelview[16], float projection[16],
 
 	qgl->glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, vbo_indices);
 
-	int firstVertex = 0;
-	int firstIndex = 0;
-
-	for (int i = 0; i < particle->pos.size(); i++) {
-		glPushMatrix();
-		//m_vao->bind();
-
-		QMatrix4x4 q_modelview = QMatrix4x4(modelview);
-		q_modelview = q_modelview.transposed();
-
-		float3 cen = actor->DataCenter();
-		qgl->glUniform4f(glProg->uniform("LightPosition"), 0, 0, std::max(std::max(cen.x, cen.y), cen.z) * 2, 1);
-		
-		/*if (i == snappedGlyphId)
-			qgl->glUniform3f(glProg->uniform("Ka"), 1.0f, 1.0f, 0.3f);
-		else if (isFreezingFeature && snappedFeatureId <= 0 && feature[i] > 0){
-			qgl->glUniform3f(glProg->uniform("Ka"), 1.0f, 0.3f, 1.0f);
-		}
-		else if (snappedFeatureId>0 && feature[i] > 0){
-			int isFeature = (feature[i] / ((int)pow(2, snappedFeatureId - 1))) % 2;
-			if (isFeature)
-				qgl->glUniform3f(glProg->uniform("Ka"), 0.3f, 1.0f, 1.0f);
-			else
-				qgl->glUniform3f(glProg->uniform("Ka"), 0.8f, 0.8f, 0.8f);
-			//float kar = 0.3f, kag = 0.3f, kab = 0.3f;
-			//if (feature[i] == 1)
-			//	kab = 1.0f;
-			//else if (feature[i] == 2)
-			//	kag = 1.0f;
-			//else if (feature[i] == 3)
-			//	kar = 1.0f;
-			//if (feature[i] == snappedFeatureId){
-			//	kar += 0.3f, kag += 0.3f, kab += 0.3f;
-			//}
-			//qgl->glUniform3f(glProg->uniform("Ka"), kar, kag, kab);
-		}
-		else*/
-			qgl->glUniform3f(glProg->uniform("Ka"), 0.8f, 0.8f, 0.8f);
-
-
-		qgl->glUniform3f(glProg->uniform("Kd"), 0.3f, 0.3f, 0.3f);
-		qgl->glUniform3f(glProg->uniform("Ks"), 0.2f, 0.2f, 0.2f);
-		qgl->glUniform1f(glProg->uniform("Shininess"), 1);
-
-		qgl->glUniform1f(glProg->uniform("Bright"), particle->glyphBright[i]);
-		qgl->glUniform3fv(glProg->uniform("Transform"), 1, &particle->pos[i].x);
+	//only the glyphs changed since the last frame are written into the instance buffer
+	glyphInstances->update(particle.get(), 0, rotations3x3.data());
+	glyphInstances->bind(0);
+
+	QMatrix4x4 q_modelview = QMatrix4x4(modelview);
+	q_modelview = q_modelview.transposed();
+
+	float3 cen = actor->DataCenter();
+	qgl->glUniform4f(glProg->uniform("LightPosition"), 0, 0, std::max(std::max(cen.x, cen.y), cen.z) * 2, 1);
+	qgl->glUniform3f(glProg->uniform("Kd"), 0.3f, 0.3f, 0.3f);
+	qgl->glUniform3f(glProg->uniform("Ks"), 0.2f, 0.2f, 0.2f);
+	qgl->glUniform1f(glProg->uniform("Shininess"), 1);
+	qgl->glUniform1f(glProg->uniform("GlyphSizeAdjust"), 1.0f);
+	//the data() returns array in column major, so there is no need to do transpose.
+	qgl->glUniformMatrix4fv(glProg->uniform("ModelViewMatrix"), 1, GL_FALSE, q_modelview.data());
+	qgl->glUniformMatrix4fv(glProg->uniform("ProjectionMatrix"), 1, GL_FALSE, projection);
+	qgl->glUniformMatrix3fv(glProg->uniform("NormalMatrix"), 1, GL_FALSE, q_modelview.normalMatrix().data());
+
+	//all glyphs are drawn by one call, with one instanced command per shared mesh.
+	//the base instance of a command points to the ids of its glyphs in the sorted id list
+	auto functions44 = gl44;
+	functions44->glBindBuffer(GL_ARRAY_BUFFER, vbo_sorted_ids);
+	functions44->glVertexAttribIPointer(GLYPH_ID_LOCATION, 1, GL_INT, 0, NULL);
+	functions44->glEnableVertexAttribArray(GLYPH_ID_LOCATION);
+	functions44->glVertexAttribDivisor(GLYPH_ID_LOCATION, 1);
+	functions44->glBindBuffer(GL_DRAW_INDIRECT_BUFFER, vbo_commands);
+	functions44->glMultiDrawElementsIndirect(GL_TRIANGLE_STRIP, GL_UNSIGNED_INT, NULL, commands.size(), 0);
+	functions44->glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+	functions44->glVertexAttribDivisor(GLYPH_ID_LOCATION, 0);
+	functions44->glDisableVertexAttribArray(GLYPH_ID_LOCATION);
+
+	glyphInstances->drawFinished();
 
-		float glyphSizeAdjust = 1.0f;//glyphSizeAdjust is used when a particle is picked or highlighted, change its size?
-		qgl->glUniform1f(glProg->uniform("Scale"), particle->glyphSizeScale[i] * (1 - glyphSizeAdjust) + glyphSizeAdjust);// 1);///*sphereSize[i] * */glyphSizeScale[i]);
-		//the data() returns array in column major, so there is no need to do transpose.
-		qgl->glUniformMatrix4fv(glProg->uniform("ModelViewMatrix"), 1, GL_FALSE, q_modelview.data());
-		qgl->glUniformMatrix4fv(glProg->uniform("ProjectionMatrix"), 1, GL_FALSE, projection);
-		//TODO: Not entirely sure about the correctness of the normal matrix, but it works
-		qgl->glUniformMatrix3fv(glProg->uniform("NormalMatrix"), 1, GL_FALSE, (q_modelview * rotations[i]).normalMatrix().data());
-		qgl->glUniformMatrix4fv(glProg->uniform("SQRotMatrix"), 1, GL_FALSE, rotations[i].data());
-
-		qgl->glBindBuffer(GL_ARRAY_BUFFER, vbo_vert);
-		qgl->glVertexAttribPointer(glProg->attribute("VertexPosition"), 4, GL_FLOAT,
-			GL_FALSE, sizeof(float4), (char*)NULL + firstVertex * sizeof(float4));
-		qgl->glBindBuffer(GL_ARRAY_BUFFER, vbo_normals);
-		qgl->glVertexAttribPointer(glProg->attribute("VertexNormal"), 3, GL_FLOAT,
-			GL_TRUE, sizeof(float3), (char*)NULL + firstVertex * sizeof(float3));
-		qgl->glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, vbo_indices);
-
-		glDrawElements(GL_TRIANGLE_STRIP, nIndices[i], GL_UNSIGNED_INT, (char*)NULL + firstIndex * sizeof(unsigned int));
-
-		//m_vao->release();
-		glPopMatrix();
-
-		firstVertex += nVerts[i];
-		firstIndex += nIndices[i];
-	}
 	qgl->glBindBuffer(GL_ARRAY_BUFFER, 0);
 	qgl->glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 }
@@ -243,22 +225,25 @@ void SQRenderable::draw(float modelview[16], float projection[16])
 
 }
 
-void SQRenderable::UpdateData()
-{
+//superquadric exponents are rounded to multiples of this value, so that similar tensors share a mesh
+static const double abcQuantum = 0.05;
 
+inline int QuantizeExponent(double v)
+{
+	return (int)floor(v / abcQuantum + 0.5);
 }
 
-SQRenderable::SQRenderable(std::shared_ptr<Particle> p) :
-GlyphRenderable(p)
-//SQRenderable::SQRenderable(vector<float4> _pos, vector<float> _val) :
-//GlyphRenderable(_pos)
+void SQRenderable::UpdateData()
 {
-	//deal with it later
-	//sphereColor.assign(particle->numParticles, make_float3(1.0f, 1.0f, 1.0f));
-	//setColorMap(COLOR_MAP::RDYIGN);
-
-	/* input variables */
-	for (int i = 0; i < p->pos.size(); i++) {
+	std::shared_ptr<Particle> p = particle;
+	int n = p->pos.size();
+	ThreadPool& pool = ThreadPool::global();
+
+	//pass 1: eigen analysis, quantized shape and transform of each glyph
+	std::vector<unsigned int> keys(n);
+	rotations.resize(n);
+	rotations3x3.resize(9 * n);
+	pool.parallelFor(n, [&](int i){
 		double ten[7] = { p->valTuple[7 * i], p->valTuple[7 * i + 1], p->valTuple[7 * i + 2],
 			p->valTuple[7 * i + 3], p->valTuple[7 * i + 4], p->valTuple[7 * i + 5], p->valTuple[7 * i + 6] }; /* tensor coefficients */
 		double eps = 1e-4; /* small value >0; defines the smallest tensor
@@ -277,29 +262,8 @@ GlyphRenderable(p)
 			abc[1] = weight*abc[1] + (1 - weight);
 			abc[2] = weight*abc[2] + (1 - weight);
 		}
-
-		/* input variable */
-		int glyphRes = 20; /* controls how fine the tesselation will be */
-
-		/* example code starts here */
-		limnPolyData *lpd = limnPolyDataNew();
-		limnPolyDataSpiralBetterquadric(lpd, (1 << limnPolyDataInfoNorm),
-			abc[0], abc[1], abc[2], 0.0,
-			2 * glyphRes, glyphRes);
-		limnPolyDataVertexNormals(lpd);
-
-		for (int j = 0; j < lpd->xyzwNum; j++) {
-			verts.push_back(make_float4(lpd->xyzw[4 * j], 
-				lpd->xyzw[4 * j + 1], lpd->xyzw[4 * j + 2], lpd->xyzw[4 * j + 3]));
-			normals.push_back(make_float3(lpd->norm[3 * j],
-				lpd->norm[3 * j + 1], lpd->norm[3 * j + 2]));
-		}
-		nVerts.push_back(lpd->xyzwNum);
-
-		for (int j = 0; j < lpd->indxNum; j++) {
-			indices.push_back(lpd->indx[j]);
-		}
-		nIndices.push_back(lpd->indxNum);
+		//10 bits per exponent. the exponents are in [1, 3] with gamma 3
+		keys[i] = (QuantizeExponent(abc[0]) & 0x3FF) | ((QuantizeExponent(abc[1]) & 0x3FF) << 10) | ((QuantizeExponent(abc[2]) & 0x3FF) << 20);
 
 		double absevals[3];
 		for (int k = 0; k<3; k++)
@@ -323,13 +287,155 @@ GlyphRenderable(p)
 		}
 		double gltrans[16];
 		ELL_4M_TRANSPOSE(gltrans, trans); /* OpenGL expects column-major format */
-		QMatrix4x4 rot = QMatrix4x4(
-			gltrans[0], gltrans[4], gltrans[8], gltrans[12], 
-			gltrans[1], gltrans[5], gltrans[9], gltrans[13], 
-			gltrans[2], gltrans[6], gltrans[10], gltrans[14], 
+		rotations[i] = QMatrix4x4(
+			gltrans[0], gltrans[4], gltrans[8], gltrans[12],
+			gltrans[1], gltrans[5], gltrans[9], gltrans[13],
+			gltrans[2], gltrans[6], gltrans[10], gltrans[14],
 			gltrans[3], gltrans[7], gltrans[11], gltrans[15]);
-		rotations.push_back(rot);
+		for (int c = 0; c < 3; c++) {
+			for (int r = 0; r < 3; r++) {
+				rotations3x3[9 * i + 3 * c + r] = gltrans[4 * c + r];
+			}
+		}
+	});
+
+	//assign a mesh to each glyph. meshes not in the cache yet are appended
+	numUpdates++;
+	int numCachedMeshes = meshes.size();
+	std::vector<unsigned int> newKeys;
+	glyphMeshIds.resize(n);
+	for (int i = 0; i < n; i++) {
+		std::map<unsigned int, int>::iterator it = meshCache.find(keys[i]);
+		if (it == meshCache.end()){
+			it = meshCache.insert(std::make_pair(keys[i], (int)meshes.size())).first;
+			meshes.push_back(SQMesh());
+			meshes.back().key = keys[i];
+			newKeys.push_back(keys[i]);
+		}
+		glyphMeshIds[i] = it->second;
+		meshes[it->second].lastUsed = numUpdates;
+	}
+
+	//pass 2: tessellate the new meshes
+	std::vector<std::vector<float4> > newVerts(newKeys.size());
+	std::vector<std::vector<float3> > newNormals(newKeys.size());
+	std::vector<std::vector<unsigned int> > newIndices(newKeys.size());
+	pool.parallelFor(newKeys.size(), [&](int m){
+		unsigned int key = newKeys[m];
+		double a = (key & 0x3FF) * abcQuantum;
+		double b = ((key >> 10) & 0x3FF) * abcQuantum;
+		double c = ((key >> 20) & 0x3FF) * abcQuantum;
+
+		/* input variable */
+		int glyphRes = 20; /* controls how fine the tesselation will be */
+
+		limnPolyData *lpd = limnPolyDataNew();
+		limnPolyDataSpiralBetterquadric(lpd, (1 << limnPolyDataInfoNorm),
+			a, b, c, 0.0,
+			2 * glyphRes, glyphRes);
+		limnPolyDataVertexNormals(lpd);
+
+		for (int j = 0; j < lpd->xyzwNum; j++) {
+			newVerts[m].push_back(make_float4(lpd->xyzw[4 * j],
+				lpd->xyzw[4 * j + 1], lpd->xyzw[4 * j + 2], lpd->xyzw[4 * j + 3]));
+			newNormals[m].push_back(make_float3(lpd->norm[3 * j],
+				lpd->norm[3 * j + 1], lpd->norm[3 * j + 2]));
+		}
+		newIndices[m].assign(lpd->indx, lpd->indx + lpd->indxNum);
+		limnPolyDataNix(lpd);
+	});
+	for (int m = 0; m < newKeys.size(); m++) {
+		SQMesh& mesh = meshes[numCachedMeshes + m];
+		mesh.firstVertex = verts.size();
+		mesh.numVerts = newVerts[m].size();
+		mesh.firstIndex = indices.size();
+		mesh.numIndices = newIndices[m].size();
+		verts.insert(verts.end(), newVerts[m].begin(), newVerts[m].end());
+		normals.insert(normals.end(), newNormals[m].begin(), newNormals[m].end());
+		indices.insert(indices.end(), newIndices[m].begin(), newIndices[m].end());
 	}
+
+	if (meshes.size() > maxCachedMeshes)
+		EvictMeshes();
+
+	//group the glyphs by mesh (counting sort), one instanced draw command per used mesh
+	std::vector<int> meshCounts(meshes.size() + 1, 0);
+	for (int i = 0; i < n; i++)
+		meshCounts[glyphMeshIds[i] + 1]++;
+	for (int m = 0; m < meshes.size(); m++)
+		meshCounts[m + 1] += meshCounts[m];
+	commands.clear();
+	for (int m = 0; m < meshes.size(); m++) {
+		int count = meshCounts[m + 1] - meshCounts[m];
+		if (count == 0)
+			continue;
+		DrawElementsIndirectCommand cmd;
+		cmd.count = meshes[m].numIndices;
+		cmd.instanceCount = count;
+		cmd.firstIndex = meshes[m].firstIndex;
+		cmd.baseVertex = meshes[m].firstVertex;
+		cmd.baseInstance = meshCounts[m];
+		commands.push_back(cmd);
+	}
+	sortedGlyphIds.resize(n);
+	for (int i = 0; i < n; i++)
+		sortedGlyphIds[meshCounts[glyphMeshIds[i]]++] = i;
+
+	buffersDirty = true;
+}
+
+void SQRenderable::EvictMeshes()
+{
+	//keep the most recently used meshes. the ones used by the current update have the latest stamp, so they are always kept
+	std::vector<int> order(meshes.size());
+	for (int m = 0; m < meshes.size(); m++)
+		order[m] = m;
+	std::stable_sort(order.begin(), order.end(), [&](int a, int b){ return meshes[a].lastUsed > meshes[b].lastUsed; });
+	int numKept = maxCachedMeshes;
+	while (numKept < order.size() && meshes[order[numKept]].lastUsed == numUpdates)
+		numKept++;
+
+	//compact the kept meshes into new buffers, in their old order
+	std::vector<char> kept(meshes.size(), 0);
+	for (int k = 0; k < numKept; k++)
+		kept[order[k]] = 1;
+	std::vector<int> newId(meshes.size(), -1);
+	std::vector<SQMesh> newMeshes;
+	std::vector<float4> newVerts;
+	std::vector<float3> newNormals;
+	std::vector<unsigned int> newIndices;
+	meshCache.clear();
+	for (int m = 0; m < meshes.size(); m++) {
+		if (!kept[m])
+			continue;
+		SQMesh mesh = meshes[m];
+		newVerts.insert(newVerts.end(), verts.begin() + mesh.firstVertex, verts.begin() + mesh.firstVertex + mesh.numVerts);
+		newNormals.insert(newNormals.end(), normals.begin() + mesh.firstVertex, normals.begin() + mesh.firstVertex + mesh.numVerts);
+		newIndices.insert(newIndices.end(), indices.begin() + mesh.firstIndex, indices.begin() + mesh.firstIndex + mesh.numIndices);
+		mesh.firstVertex = newVerts.size() - mesh.numVerts;
+		mesh.firstIndex = newIndices.size() - mesh.numIndices;
+		newId[m] = newMeshes.size();
+		meshCache[mesh.key] = newMeshes.size();
+		newMeshes.push_back(mesh);
+	}
+	meshes.swap(newMeshes);
+	verts.swap(newVerts);
+	normals.swap(newNormals);
+	indices.swap(newIndices);
+	for (int i = 0; i < glyphMeshIds.size(); i++)
+		glyphMeshIds[i] = newId[glyphMeshIds[i]];
+}
+
+SQRenderable::SQRenderable(std::shared_ptr<Particle> p) :
+GlyphRenderable(p)
+//SQRenderable::SQRenderable(vector<float4> _pos, vector<float> _val) :
+//GlyphRenderable(_pos)
+{
+	//deal with it later
+	//sphereColor.assign(particle->numParticles, make_float3(1.0f, 1.0f, 1.0f));
+	//setColorMap(COLOR_MAP::RDYIGN);
+
+	UpdateData();
 }
 
 void SQRenderable::initPickingDrawingObjects()
@@ -3,22 +3,59 @@
 
 #include "GlyphRenderable.h"
 #include <memory>
+#include <map>
 
 class ShaderProgram;
 class QOpenGLVertexArrayObject;
+class GlyphInstanceBuffer;
+
+//same layout as the command of glMultiDrawElementsIndirect
+struct DrawElementsIndirectCommand
+{
+	unsigned int count;
+	unsigned int instanceCount;
+	unsigned int firstIndex;
+	int baseVertex;
+	unsigned int baseInstance;
+};
+
+//a superquadric mesh in the shared vertex and index buffers
+struct SQMesh
+{
+	int firstVertex = 0, numVerts = 0;
+	int firstIndex = 0, numIndices = 0;
+	unsigned int key = 0; //quantized exponents
+	int lastUsed = 0; //the last UpdateData() that used the mesh
+};
+
 class SQRenderable :public GlyphRenderable
 {
 	//std::vector < float > val; // the 7 floating point number tensor values.
+	//meshes of the distinct quantized superquadric exponents seen so far. kept when the data is updated,
+	//up to maxCachedMeshes, beyond which the least recently used ones are dropped
 	std::vector<float4> verts;
-	std::vector<int> nVerts;
 	std::vector<float3> normals;
 	std::vector<unsigned int> indices;
-	std::vector<int> nIndices;
+	std::map<unsigned int, int> meshCache; //quantized exponents -> index in meshes
+	std::vector<SQMesh> meshes;
+	int numUpdates = 0;
+	void EvictMeshes();
+
+	std::vector<int> glyphMeshIds; //mesh of each glyph
+	std::vector<int> sortedGlyphIds; //glyph ids grouped by mesh
+	std::vector<DrawElementsIndirectCommand> commands; //one instanced command per used mesh
+	bool buffersDirty = true;
+	void UploadBuffers();
+
 	std::vector<QMatrix4x4> rotations;
+	std::vector<float> rotations3x3; //same as rotations, 9 floats per glyph in column major, as used by the instance buffer
 
 	unsigned int vbo_vert;
 	unsigned int vbo_indices;
 	unsigned int vbo_normals;
+	unsigned int vbo_commands; //indirect draw commands
+	unsigned int vbo_sorted_ids;
+	std::shared_ptr<GlyphInstanceBuffer> glyphInstances;
 
 public:
 	//SQRenderable(std::vector<float4> _pos, std::vector < float > _val);
@@ -26,7 +63,9 @@ public:
 	void init() override;
 	virtual void DrawWithoutProgram(float modelview[16], float projection[16], ShaderProgram* sp) override;
 	void draw(float modelview[16], float projection[16]) override;
-	void UpdateData();// override;
+	void UpdateData();// override; //recompute the glyphs after particle->pos or particle->valTuple changed
+
+	int maxCachedMeshes = 2048; //the meshes used by the current data are kept even beyond it
 
 
 protected:
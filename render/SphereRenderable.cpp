@@ -15,12 +15,16 @@
 #include <windows.h>
 #endif
 #define qgl	QOpenGLContext::currentContext()->functions()
+#define gl44	QOpenGLContext::currentContext()->versionFunctions<QOpenGLFunctions_4_4_Core>()
 //using namespace std;
 
 #include <QOpenGLFunctions>
 #include <QOpenGLVertexArrayObject>
 #include "ShaderProgram.h"
 #include "GLSphere.h"
+#include "GlyphLOD.h"
+#include "GlyphInstanceBuffer.h"
+#include <QOpenGLFunctions_4_4_Core>
 #include <helper_math.h>
 #include <ColorGradient.h>
 #include "Particle.h"
@@ -33,6 +37,7 @@
 SphereRenderable::SphereRenderable(std::shared_ptr<Particle> _particle)
 : GlyphRenderable(_particle)
 {
+	glyphLOD = std::make_shared<GlyphLOD>();
 	sphereColor.assign(particle->numParticles, make_float3(1.0f, 1.0f, 1.0f));
 	setColorMap(COLOR_MAP::RDYIGN);
 }
@@ -57,6 +62,9 @@ void SphereRenderable::setColorMap(COLOR_MAP cm, bool isReversed)
 			cg.getColorAtValue(valScaled, sphereColor[i].x, sphereColor[i].y, sphereColor[i].z);
 		}
 	}
+	//the colors are not tracked by the particle
+	if (glyphInstances != 0)
+		glyphInstances->invalidate();
 }
 
 void SphereRenderable::init()
@@ -67,11 +75,18 @@ void SphereRenderable::init()
     m_vao->create();
 
 	glyphMesh = std::make_shared<GLSphere>(1, 8);
+	glyphMeshLow = std::make_shared<GLSphere>(1, 2);
 	
     m_vao->bind();
     LoadShaders(glProg);
+	LoadPointShaders(glPointProg);
 
-	GenVertexBuffer(glyphMesh->GetNumVerts(), glyphMesh->GetVerts());
+	GenVertexBuffer(glyphMesh->GetNumVerts(), glyphMesh->GetVerts(), vbo_vert);
+	GenVertexBuffer(glyphMeshLow->GetNumVerts(), glyphMeshLow->GetVerts(), vbo_vert_low);
+	qgl->glGenBuffers(1, &vbo_lod_ids);
+
+	glyphInstances = std::make_shared<GlyphInstanceBuffer>();
+	glyphInstances->init(particle->numParticles);
 
 
 	initPickingDrawingObjects();
@@ -82,33 +97,44 @@ void SphereRenderable::LoadShaders(ShaderProgram*& shaderProg)
 #define GLSL(shader) "#version 440\n" #shader
 	//shader is from https://www.packtpub.com/books/content/basics-glsl-40-shaders
 
+	//the per glyph position, size, color and brightness are read from the instance buffer
 	const char* vertexVS =
-		GLSL(
+		GLSL_GLYPH_INSTANCE(
 		layout(location = 0) in vec3 VertexPosition;
 		//layout(location = 1) in vec3 VertexNormal;
 		smooth out vec3 tnorm;
 		out vec4 eyeCoords;
+		flat out vec3 Ka;
+		flat out float Bright;
 
 		uniform mat4 ModelViewMatrix;
 		uniform mat3 NormalMatrix;
 		uniform mat4 ProjectionMatrix;
 
-		uniform vec3 Transform;
-		uniform float Scale;
+		uniform int SnappedGlyphId;
 		
 		void main()
 		{
+			GlyphInstance g = instances[GlyphId];
+			float Scale = g.posScale.w;
+			Ka = g.colorBright.xyz;
+			if (GlyphId == SnappedGlyphId){
+				Scale = Scale * 2;
+				Ka = vec3(0.95);
+			}
+			Bright = g.colorBright.w;
+
 			mat4 MVP = ProjectionMatrix * ModelViewMatrix;
 			eyeCoords = ModelViewMatrix * vec4(VertexPosition, 1.0);
 			tnorm = normalize(NormalMatrix * VertexPosition);
-			gl_Position = MVP * vec4(VertexPosition * (Scale * 0.08) + Transform, 1.0);
+			gl_Position = MVP * vec4(VertexPosition * (Scale * 0.08) + g.posScale.xyz, 1.0);
 		}
 	);
 
 	const char* vertexFS =
 		GLSL(
 		uniform vec4 LightPosition; // Light position in eye coords.
-		uniform vec3 Ka; // Diffuse reflectivity
+		flat in vec3 Ka; // Diffuse reflectivity
 		uniform vec3 Kd; // Diffuse reflectivity
 		uniform vec3 Ks; // Diffuse reflectivity
 		uniform float Shininess;
@@ -116,7 +142,7 @@ void SphereRenderable::LoadShaders(ShaderProgram*& shaderProg)
 		smooth in vec3 tnorm;
 		//layout(location = 0) 
 		out	vec4 FragColor;
-		uniform float Bright;
+		flat in float Bright;
 
 		vec3 phongModel(vec3 a, vec4 position, vec3 normal) {
 			vec3 s = normalize(vec3(LightPosition - position));
@@ -143,7 +169,6 @@ void SphereRenderable::LoadShaders(ShaderProgram*& shaderProg)
 
 	shaderProg->addAttribute("VertexPosition");
 	shaderProg->addUniform("LightPosition");
-	shaderProg->addUniform("Ka");
 	shaderProg->addUniform("Kd");
 	shaderProg->addUniform("Ks");
 	shaderProg->addUniform("Shininess");
@@ -152,19 +177,71 @@ void SphereRenderable::LoadShaders(ShaderProgram*& shaderProg)
 	shaderProg->addUniform("NormalMatrix");
 	shaderProg->addUniform("ProjectionMatrix");
 
-	shaderProg->addUniform("Transform");
-	shaderProg->addUniform("Scale");
-	shaderProg->addUniform("Bright");
+	shaderProg->addUniform("SnappedGlyphId");
 }
 
 
 
-void SphereRenderable::GenVertexBuffer(int nv, float* vertex)
+void SphereRenderable::LoadPointShaders(ShaderProgram*& shaderProg)
+{
+	//shader for the point sprite level of detail. the sphere is faked by the distance to the sprite center
+	const char* vertexVS =
+		GLSL_GLYPH_INSTANCE(
+		uniform mat4 ModelViewMatrix;
+		uniform mat4 ProjectionMatrix;
+		uniform float PixelScale; //projection[5] * window height / 2
+		uniform int SnappedGlyphId;
+		flat out vec3 Ka;
+		flat out float Bright;
+
+		void main()
+		{
+			GlyphInstance g = instances[GlyphId];
+			float Scale = g.posScale.w;
+			Ka = g.colorBright.xyz;
+			//the same highlight of the snapped glyph as for the meshes
+			if (GlyphId == SnappedGlyphId){
+				Scale = Scale * 2;
+				Ka = vec3(0.95);
+			}
+			vec4 eye = ModelViewMatrix * vec4(g.posScale.xyz, 1.0);
+			gl_Position = ProjectionMatrix * eye;
+			//the same radius as in the vertex shader of the meshes
+			gl_PointSize = max(2.0 * Scale * 0.08 * PixelScale / max(-eye.z, 0.000001), 1.0);
+			Bright = g.colorBright.w;
+		}
+	);
+
+	const char* vertexFS =
+		GLSL(
+		flat in vec3 Ka;
+		flat in float Bright;
+		out vec4 FragColor;
+
+		void main() {
+			vec2 d = gl_PointCoord * 2.0 - vec2(1.0);
+			float r2 = dot(d, d);
+			if (r2 > 1.0)
+				discard;
+			FragColor = vec4(Bright * Ka * (0.5 + 0.5 * sqrt(1.0 - r2)), 1.0);
+		}
+	);
+
+	shaderProg = new ShaderProgram;
+	shaderProg->initFromStrings(vertexVS, vertexFS);
+
+	shaderProg->addUniform("ModelViewMatrix");
+	shaderProg->addUniform("ProjectionMatrix");
+	shaderProg->addUniform("PixelScale");
+	shaderProg->addUniform("SnappedGlyphId");
+}
+
+void SphereRenderable::GenVertexBuffer(int nv, float* vertex, unsigned int &vbo)
 {
 	//m_vao->bind();
 
-	qgl->glGenBuffers(1, &vbo_vert);
-	qgl->glBindBuffer(GL_ARRAY_BUFFER, vbo_vert);
+	qgl->glGenBuffers(1, &vbo);
+	qgl->glBindBuffer(GL_ARRAY_BUFFER, vbo);
 	qgl->glVertexAttribPointer(glProg->attribute("VertexPosition"), 3, GL_FLOAT, GL_FALSE, 0, NULL);
 	qgl->glBufferData(GL_ARRAY_BUFFER, nv * sizeof(float) * 3, vertex, GL_STATIC_DRAW);
 	qgl->glBindBuffer(GL_ARRAY_BUFFER, 0);
@@ -174,60 +251,108 @@ void SphereRenderable::GenVertexBuffer(int nv, float* vertex)
 }
 
 
+void SphereRenderable::DrawGlyphs(unsigned int idBuffer, int first, int num, int numVerts)
+{
+	if (num == 0)
+		return;
+	auto functions44 = gl44;
+	functions44->glBindBuffer(GL_ARRAY_BUFFER, idBuffer);
+	functions44->glVertexAttribIPointer(GLYPH_ID_LOCATION, 1, GL_INT, 0, (char*)NULL + first * sizeof(int));
+	functions44->glEnableVertexAttribArray(GLYPH_ID_LOCATION);
+	functions44->glVertexAttribDivisor(GLYPH_ID_LOCATION, 1);
+	functions44->glDrawArraysInstanced(GL_QUADS, 0, numVerts, num);
+	functions44->glVertexAttribDivisor(GLYPH_ID_LOCATION, 0);
+	functions44->glDisableVertexAttribArray(GLYPH_ID_LOCATION);
+}
+
+void SphereRenderable::DrawPointSprites(int first, int num, float modelview[16], float projection[16])
+{
+	if (num == 0)
+		return;
+	int2 winSize = actor->GetWindowSize();
+
+	glEnable(GL_PROGRAM_POINT_SIZE);
+	glPointProg->use();
+	qgl->glUniformMatrix4fv(glPointProg->uniform("ModelViewMatrix"), 1, GL_FALSE, modelview);
+	qgl->glUniformMatrix4fv(glPointProg->uniform("ProjectionMatrix"), 1, GL_FALSE, projection);
+	qgl->glUniform1f(glPointProg->uniform("PixelScale"), projection[5] * winSize.y * 0.5f);
+	qgl->glUniform1i(glPointProg->uniform("SnappedGlyphId"), particle->snappedGlyphId);
+
+	auto functions44 = gl44;
+	functions44->glBindBuffer(GL_ARRAY_BUFFER, vbo_lod_ids);
+	functions44->glVertexAttribIPointer(GLYPH_ID_LOCATION, 1, GL_INT, 0, (char*)NULL + first * sizeof(int));
+	functions44->glEnableVertexAttribArray(GLYPH_ID_LOCATION);
+	functions44->glVertexAttribDivisor(GLYPH_ID_LOCATION, 1);
+	functions44->glDrawArraysInstanced(GL_POINTS, 0, 1, num);
+	functions44->glVertexAttribDivisor(GLYPH_ID_LOCATION, 0);
+	functions44->glDisableVertexAttribArray(GLYPH_ID_LOCATION);
+	functions44->glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	glPointProg->disable();
+	glDisable(GL_PROGRAM_POINT_SIZE);
+}
+
 void SphereRenderable::DrawWithoutProgram(float modelview[16], float projection[16], ShaderProgram* sp)
 {
+	//only the glyphs changed since the last frame are written into the instance buffer
+	glyphInstances->update(particle.get(), sphereColor.data(), 0);
+	glyphInstances->bind(0);
+
 	//glBindBuffer(GL_ARRAY_BUFFER, vbo_vert), glVertexAttribPointer,glEnableVertexAttribArray, glDisableVertexAttribArray, and glBindBuffer(GL_ARRAY_BUFFER, 0) cannot be commented since they are used by VR!!!!!!!!!!!!
+	m_vao->bind();
 	qgl->glBindBuffer(GL_ARRAY_BUFFER, vbo_vert);
 	qgl->glVertexAttribPointer(glProg->attribute("VertexPosition"), 3, GL_FLOAT, GL_FALSE, 0, NULL);
 	qgl->glEnableVertexAttribArray(glProg->attribute("VertexPosition"));
-	m_vao->bind();
 
-	float* glyphSizeScale = &(particle->glyphSizeScale[0]);
-	float* glyphBright = &(particle->glyphBright[0]);
-	bool isFreezingFeature = particle->isFreezingFeature;
-	int snappedGlyphId = particle->snappedGlyphId;
-	int snappedFeatureId = particle->snappedFeatureId;
-
-	for (int i = 0; i < particle->numParticles; i++) {
-		glPushMatrix();
-
-		float4 shift = particle->pos[i];
-
-		QMatrix4x4 q_modelview = QMatrix4x4(modelview);
-		q_modelview = q_modelview.transposed();
-		float3 cen = actor->DataCenter();
-		qgl->glUniform4f(glProg->uniform("LightPosition"), 0, 0, std::max(std::max(cen.x, cen.y), cen.z) * 2, 1);
-
-		if (snappedGlyphId != i){
-			qgl->glUniform3fv(glProg->uniform("Ka"), 1, &sphereColor[i].x);
-			qgl->glUniform1f(glProg->uniform("Scale"), glyphSizeScale[i]);
-		}
-		else{
-			qgl->glUniform3f(glProg->uniform("Ka"), 0.95f, 0.95f, 0.95f);
-			qgl->glUniform1f(glProg->uniform("Scale"), glyphSizeScale[i] * 2);
-		}
-
-		qgl->glUniform3f(glProg->uniform("Kd"), 0.3f, 0.3f, 0.3f);
-		qgl->glUniform3f(glProg->uniform("Ks"), 0.2f, 0.2f, 0.2f);
-		qgl->glUniform1f(glProg->uniform("Shininess"), 5);
-		qgl->glUniform3fv(glProg->uniform("Transform"), 1, &shift.x);
-
-		qgl->glUniform1f(glProg->uniform("Bright"), glyphBright[i]);
-		qgl->glUniformMatrix4fv(glProg->uniform("ModelViewMatrix"), 1, GL_FALSE, modelview);
-		qgl->glUniformMatrix4fv(glProg->uniform("ProjectionMatrix"), 1, GL_FALSE, projection);
-		qgl->glUniformMatrix3fv(glProg->uniform("NormalMatrix"), 1, GL_FALSE, q_modelview.normalMatrix().data());
-
-		glDrawArrays(GL_QUADS, 0, glyphMesh->GetNumVerts());
-		//glDrawElements(GL_TRIANGLES, glyphMesh->numElements, GL_UNSIGNED_INT, glyphMesh->indices);
-		//m_vao->release();
-		glPopMatrix();
+	QMatrix4x4 q_modelview = QMatrix4x4(modelview);
+	q_modelview = q_modelview.transposed();
+	float3 cen = actor->DataCenter();
+	qgl->glUniform4f(glProg->uniform("LightPosition"), 0, 0, std::max(std::max(cen.x, cen.y), cen.z) * 2, 1);
+	qgl->glUniform3f(glProg->uniform("Kd"), 0.3f, 0.3f, 0.3f);
+	qgl->glUniform3f(glProg->uniform("Ks"), 0.2f, 0.2f, 0.2f);
+	qgl->glUniform1f(glProg->uniform("Shininess"), 5);
+	qgl->glUniformMatrix4fv(glProg->uniform("ModelViewMatrix"), 1, GL_FALSE, modelview);
+	qgl->glUniformMatrix4fv(glProg->uniform("ProjectionMatrix"), 1, GL_FALSE, projection);
+	qgl->glUniformMatrix3fv(glProg->uniform("NormalMatrix"), 1, GL_FALSE, q_modelview.normalMatrix().data());
+	qgl->glUniform1i(glProg->uniform("SnappedGlyphId"), particle->snappedGlyphId);
+
+	int numFull = 0, numLow = 0, numPoint = 0;
+	if (!useLOD){
+		DrawGlyphs(glyphInstances->GetIdBuffer(), 0, particle->numParticles, glyphMesh->GetNumVerts());
+	}
+	else{
+		int2 winSize = actor->GetWindowSize();
+		glyphLOD->select(particle->pos, particle->glyphSizeScale, particle->glyphBright, 0.08f,
+			modelview, projection, winSize.x, winSize.y, particle->snappedGlyphId);
+		numFull = glyphLOD->GetNumInstances(LOD_FULL);
+		numLow = glyphLOD->GetNumInstances(LOD_LOW);
+		numPoint = glyphLOD->GetNumInstances(LOD_POINT);
+
+		//the three id lists are stored one after another
+		qgl->glBindBuffer(GL_ARRAY_BUFFER, vbo_lod_ids);
+		qgl->glBufferData(GL_ARRAY_BUFFER, std::max(numFull + numLow + numPoint, 1) * sizeof(int), NULL, GL_STREAM_DRAW);
+		qgl->glBufferSubData(GL_ARRAY_BUFFER, 0, numFull * sizeof(int), glyphLOD->GetInstances(LOD_FULL).data());
+		qgl->glBufferSubData(GL_ARRAY_BUFFER, numFull * sizeof(int), numLow * sizeof(int), glyphLOD->GetInstances(LOD_LOW).data());
+		qgl->glBufferSubData(GL_ARRAY_BUFFER, (numFull + numLow) * sizeof(int), numPoint * sizeof(int), glyphLOD->GetInstances(LOD_POINT).data());
+
+		DrawGlyphs(vbo_lod_ids, 0, numFull, glyphMesh->GetNumVerts());
+
+		qgl->glBindBuffer(GL_ARRAY_BUFFER, vbo_vert_low);
+		qgl->glVertexAttribPointer(glProg->attribute("VertexPosition"), 3, GL_FLOAT, GL_FALSE, 0, NULL);
+		DrawGlyphs(vbo_lod_ids, numFull, numLow, glyphMeshLow->GetNumVerts());
 	}
-	m_vao->release();
-
 
 	qgl->glDisableVertexAttribArray(glProg->attribute("VertexPosition"));
 	qgl->glBindBuffer(GL_ARRAY_BUFFER, 0);
 
+	if (useLOD){
+		DrawPointSprites(numFull + numLow, numPoint, modelview, projection);
+		//the caller expects its program to be still in use
+		sp->use();
+	}
+	m_vao->release();
+
+	glyphInstances->drawFinished();
 }
 
 void SphereRenderable::draw(float modelview[16], float projection[16])
@@ -6,6 +6,8 @@
 class ShaderProgram;
 class QOpenGLVertexArrayObject;
 class GLSphere;
+class GlyphLOD;
+class GlyphInstanceBuffer;
 
 
 class SphereRenderable :public GlyphRenderable
@@ -18,16 +20,31 @@ public:
 
 	virtual void setColorMap(COLOR_MAP cm, bool isReversed = false) override;
 
+	bool useLOD = true; //choose full mesh, low poly mesh, point sprite, or culling for each glyph by its screen size and brightness
+
 protected:
 	void initPickingDrawingObjects();
 	void drawPicking(float modelview[16], float projection[16], bool isForGlyph);
 
 private:
 	std::vector<float3> sphereColor;
-	void GenVertexBuffer(int nv, float* vertex);
+	void GenVertexBuffer(int nv, float* vertex, unsigned int &vbo);
 	virtual void LoadShaders(ShaderProgram*& shaderProg) override;
 	unsigned int vbo_vert;
 	std::shared_ptr<GLSphere> glyphMesh;
+
+	//level of detail
+	unsigned int vbo_vert_low;
+	std::shared_ptr<GLSphere> glyphMeshLow;
+	std::shared_ptr<GlyphLOD> glyphLOD;
+	unsigned int vbo_lod_ids; //the glyph ids of the full, low poly and point sprite levels, one list after another
+	ShaderProgram* glPointProg = nullptr;
+	void LoadPointShaders(ShaderProgram*& shaderProg);
+
+	//instanced drawing
+	std::shared_ptr<GlyphInstanceBuffer> glyphInstances;
+	void DrawGlyphs(unsigned int idBuffer, int first, int num, int numVerts);
+	void DrawPointSprites(int first, int num, float modelview[16], float projection[16]);
     std::shared_ptr<QOpenGLVertexArrayObject> m_vao;
 };
 #endif //SPHERE_RENDERABLE_H
@@ -0,0 +1,16 @@
+#ifndef VOLUME_MEMORY_STATS_H
+#define VOLUME_MEMORY_STATS_H
+
+#include <cstddef>
+
+//memory held by a volume renderer, in bytes. for the gpu renderers it is device memory, for the cpu renderer host memory
+struct VolumeMemoryStats
+{
+	size_t volumeBytes = 0; //scalar values, including coarse pyramid levels
+	size_t gradientBytes = 0; //gradients used for shading
+	size_t auxiliaryBytes = 0; //acceleration structures and images
+
+	size_t total(){ return volumeBytes + gradientBytes + auxiliaryBytes; }
+};
+
+#endif //VOLUME_MEMORY_STATS_H
@@ -1,6 +1,7 @@
 #include <time.h>
 
 #include <vector>
+#include <algorithm>
 
 #include <QOpenGLVertexArrayObject>
 #include <QOpenGLFunctions_1_2>
@@ -20,19 +21,28 @@
 #include "VolumeRenderableCUDA.h"
 #include "VolumeRenderableCUDAKernel.h"
 #include "TransformFunc.h"
+#include "PositionBasedDeformProcessor.h"
 #include "myDefineRayCasting.h"
 
 
 VolumeRenderableCUDA::VolumeRenderableCUDA(std::shared_ptr<Volume> _volume)
 {
 	volume = _volume;
-	volumeCUDAGradient.VolumeCUDA_init(_volume->size, (float*)0, 1, 4);
+	//the gradient volume is allocated at the first draw that needs it
 }
 
 VolumeRenderableCUDA::~VolumeRenderableCUDA()
 {
 	VolumeRender_deinit();
 	deinitTextureAndCudaArrayOfScreen();
+	if (d_progressiveImage != 0)
+		checkCudaErrors(cudaFree(d_progressiveImage));
+	if (timerStart != 0)
+		checkCudaErrors(cudaEventDestroy(timerStart));
+	if (timerStop != 0)
+		checkCudaErrors(cudaEventDestroy(timerStop));
+	if (d_brickLevels != 0)
+		checkCudaErrors(cudaFree(d_brickLevels));
 	//cudaDeviceReset();
 };
 
@@ -45,6 +55,258 @@ void VolumeRenderableCUDA::init()
 }
 
 
+MacroCellOccupancy VolumeRenderableCUDA::prepareEmptySpaceSkipping()
+{
+	if (!useEmptySpaceSkipping){
+		MacroCellOccupancy none = { 0, make_int3(0, 0, 0) };
+		return none;
+	}
+	//the whole content was replaced, e.g. by Volume::reset() or a new timestep loaded as a whole
+	if (!macroCellGrid.isBuilt() || macroCellGridDirty || volume->volumeCuda.contentVersion != macroCellGridVersion){
+		macroCellGrid.build(&(volume->volumeCuda));
+		macroCellGridDirty = false;
+		macroCellGridVersion = volume->volumeCuda.contentVersion;
+	}
+	else{
+		macroCellGrid.update(&(volume->volumeCuda), dirtyRegions);
+	}
+	dirtyRegions.clear();
+	macroCellGrid.updateOccupancy(rcp->transFuncP1, rcp->transFuncP2);
+	return macroCellGrid.GetOccupancyForRendering();
+}
+
+void VolumeRenderableCUDA::volumeRegionsUpdated(const std::vector<std::pair<int3, int3>> &regions)
+{
+	if (regions.empty())
+		return;
+	dirtyRegions.insert(dirtyRegions.end(), regions.begin(), regions.end());
+	refinedSubsets = 0;
+	//the coarse levels of the changed bricks would otherwise still show the old data
+	if (pyramid != 0){
+		for (int i = 0; i < regions.size(); i++)
+			pyramid->updateRegion(regions[i].first, regions[i].second);
+		pyramidGradientsDirty = true;
+	}
+}
+
+void VolumeRenderableCUDA::setDeformProcessor(std::shared_ptr<PositionBasedDeformProcessor> p)
+{
+	positionBasedDeformProcessor = p;
+	//the changes made so far are covered by a rebuild
+	seenDeformChangeCount = (p == 0) ? 0 : p->GetVolumeChangeCount();
+	macroCellGridDirty = true;
+	refinedSubsets = 0;
+}
+
+//size of the content of a cuda array
+static size_t arrayBytes(const VolumeCUDA &v)
+{
+	if (v.content == 0)
+		return 0;
+	const cudaChannelFormatDesc &d = v.channelDesc;
+	return (size_t)(d.x + d.y + d.z + d.w) / 8 * v.size.width * v.size.height * v.size.depth;
+}
+
+VolumeMemoryStats VolumeRenderableCUDA::getMemoryStats()
+{
+	VolumeMemoryStats stats;
+	stats.volumeBytes = arrayBytes(volume->volumeCuda) + arrayBytes(volume->volumeCudaOri);
+	stats.gradientBytes = arrayBytes(volumeCUDAGradient);
+	if (pyramid != 0){
+		for (int l = 1; l < pyramid->GetNumLevels(); l++)
+			stats.volumeBytes += arrayBytes(pyramid->GetLevel(l)->volumeCuda);
+	}
+	for (int l = 0; l < pyramidGradients.size(); l++){
+		if (pyramidGradients[l] != 0)
+			stats.gradientBytes += arrayBytes(*pyramidGradients[l]);
+	}
+	stats.auxiliaryBytes = macroCellGrid.GetMemoryBytes() + brickLevels.size()
+		+ (d_progressiveImage == 0 ? 0 : (size_t)progressiveWidth * progressiveHeight * 4);
+	return stats;
+}
+
+void VolumeRenderableCUDA::prepareMultiResolution(float modelview[16], float projection[16], int winWidth, int winHeight)
+{
+	if (!useMultiResolution || pyramid == 0 || pyramid->GetNumLevels() < 2){
+		VolumeRender_setBrickLevels(0, make_int3(0, 0, 0));
+		anyCoarseBrick = false;
+		return;
+	}
+	int numLevels = pyramid->GetNumLevels();
+	int finestLevel = GetFinestLevel();
+
+	if (pyramidDirty || finestLevel != uploadedFinestLevel){
+		pyramid->initVolumeCuda(std::max(finestLevel, 1));
+		uploadedFinestLevel = finestLevel;
+		pyramidDirty = true;
+	}
+	pyramidGradients.resize(numLevels);
+	for (int l = 1; l < numLevels; l++){
+		if (useGradientOnTheFly || l < finestLevel){
+			pyramidGradients[l] = 0;
+		}
+		else if (pyramidDirty || pyramidGradientsDirty || pyramidGradients[l] == 0){
+			std::shared_ptr<Volume> level = pyramid->GetLevel(l);
+			if (pyramidGradients[l] == 0)
+				pyramidGradients[l] = std::make_shared<VolumeCUDA>();
+			pyramidGradients[l]->VolumeCUDA_init(level->size, (float*)0, 1, 4);
+			VolumeRender_computeGradient(&(level->volumeCuda), pyramidGradients[l].get());
+		}
+	}
+	pyramidDirty = false;
+	pyramidGradientsDirty = false;
+	anyCoarseBrick = false;
+	for (int l = std::max(finestLevel, 1); l < numLevels; l++){
+		VolumeRender_setPyramidLevel(l, &(pyramid->GetLevel(l)->volumeCuda), pyramidGradients[l].get());
+	}
+
+	//level of each brick, from the projected size of a voxel at the corner of the brick nearest to the eye.
+	//the matrices are column major
+	int3 size = volume->size;
+	float3 spacing = volume->spacing;
+	brickGridSize = make_int3(iDivUp(size.x, MULTIRES_BRICK_SIZE), iDivUp(size.y, MULTIRES_BRICK_SIZE), iDivUp(size.z, MULTIRES_BRICK_SIZE));
+	int numBricks = brickGridSize.x * brickGridSize.y * brickGridSize.z;
+	if (brickLevels.size() != numBricks){
+		brickLevels.resize(numBricks);
+		if (d_brickLevels != 0)
+			checkCudaErrors(cudaFree(d_brickLevels));
+		checkCudaErrors(cudaMalloc(&d_brickLevels, numBricks));
+	}
+	float voxelSize = fmaxf(fmaxf(spacing.x, spacing.y), spacing.z);
+	float pixelsPerUnit = projection[0] * winWidth / 2.0f;
+	for (int k = 0; k < brickGridSize.z; k++){
+		for (int j = 0; j < brickGridSize.y; j++){
+			for (int i = 0; i < brickGridSize.x; i++){
+				float w = 1e30f;
+				for (int c = 0; c < 8; c++){
+					float3 corner = make_float3(
+						std::min((i + (c & 1)) * MULTIRES_BRICK_SIZE, size.x),
+						std::min((j + ((c >> 1) & 1)) * MULTIRES_BRICK_SIZE, size.y),
+						std::min((k + (c >> 2)) * MULTIRES_BRICK_SIZE, size.z)) * spacing;
+					float zInEye = modelview[2] * corner.x + modelview[6] * corner.y + modelview[10] * corner.z + modelview[14];
+					w = fminf(w, projection[11] * zInEye + projection[15]);
+				}
+				int level = 0;
+				if (w > 0){
+					float voxelPixels = voxelSize * pixelsPerUnit / w;
+					level = clamp((int)floorf(log2f(1.0f / voxelPixels) + lodBias), 0, numLevels - 1);
+				}
+				level = std::max(level, finestLevel);
+				brickLevels[(k * brickGridSize.y + j) * brickGridSize.x + i] = level;
+				anyCoarseBrick |= level > 0;
+			}
+		}
+	}
+	checkCudaErrors(cudaMemcpy(d_brickLevels, &(brickLevels[0]), numBricks, cudaMemcpyHostToDevice));
+	VolumeRender_setBrickLevels(d_brickLevels, brickGridSize);
+}
+
+int VolumeRenderableCUDA::GetFinestLevel()
+{
+	if (!useMultiResolution || pyramid == 0 || pyramid->GetNumLevels() < 2 || blendPreviousImage)
+		return 0;
+	return clamp(finestResidentLevel, 0, pyramid->GetNumLevels() - 1);
+}
+
+bool VolumeRenderableCUDA::viewChanged(float modelview[16], float projection[16], int winWidth, int winHeight)
+{
+	const RayCastingParameters &r = *rcp;
+	bool changed = !hasLastView || winWidth != progressiveWidth || winHeight != progressiveHeight
+		|| !std::equal(modelview, modelview + 16, lastModelview) || !std::equal(projection, projection + 16, lastProjection)
+		|| r.la != lastRcp.la || r.ld != lastRcp.ld || r.ls != lastRcp.ls
+		|| r.transFuncP1 != lastRcp.transFuncP1 || r.transFuncP2 != lastRcp.transFuncP2
+		|| r.density != lastRcp.density || r.maxSteps != lastRcp.maxSteps || r.tstep != lastRcp.tstep
+		|| r.brightness != lastRcp.brightness || r.useColor != lastRcp.useColor;
+
+	std::copy(modelview, modelview + 16, lastModelview);
+	std::copy(projection, projection + 16, lastProjection);
+	lastRcp = r;
+	hasLastView = true;
+	return changed;
+}
+
+//the frames are timed without waiting for the gpu: the timing of a frame is read by a later frame once its stop event completed,
+//and no other frame is timed meanwhile. scale converts the time of the frame into the time of a full quality frame
+void VolumeRenderableCUDA::recordFrameTimer(float scale)
+{
+	checkCudaErrors(cudaEventRecord(timerStop));
+	timerScale = scale;
+	timerPending = true;
+}
+
+void VolumeRenderableCUDA::pollFrameTimer()
+{
+	if (!timerPending)
+		return;
+	cudaError_t e = cudaEventQuery(timerStop);
+	if (e == cudaErrorNotReady)
+		return;
+	checkCudaErrors(e);
+	float ms;
+	checkCudaErrors(cudaEventElapsedTime(&ms, timerStart, timerStop));
+	fullFrameMs = ms * timerScale;
+	timerPending = false;
+}
+
+void VolumeRenderableCUDA::renderProgressive(uint *d_output, int winWidth, int winHeight, float3 eyeInLocal, bool changed, MacroCellOccupancy cells)
+{
+	if (d_progressiveImage == 0 || winWidth != progressiveWidth || winHeight != progressiveHeight){
+		if (d_progressiveImage != 0)
+			checkCudaErrors(cudaFree(d_progressiveImage));
+		checkCudaErrors(cudaMalloc(&d_progressiveImage, winWidth*winHeight * 4));
+		checkCudaErrors(cudaMemset(d_progressiveImage, 0, winWidth*winHeight * 4));
+		progressiveWidth = winWidth;
+		progressiveHeight = winHeight;
+		changed = true;
+	}
+	if (timerStart == 0){
+		checkCudaErrors(cudaEventCreate(&timerStart));
+		checkCudaErrors(cudaEventCreate(&timerStop));
+	}
+	pollFrameTimer();
+
+	if (changed){
+		//coarsest stride whose predicted time fits the budget. a coarse frame casts 1/stride^2 of the rays, with 1/stride of the steps
+		int stride = 1;
+		if (fullFrameMs > 0){
+			while (stride < 8 && fullFrameMs / (stride * stride * stride) > frameBudgetMs)
+				stride *= 2;
+		}
+		else{
+			stride = 4; //no estimate yet
+		}
+
+		bool timed = !timerPending;
+		if (timed)
+			checkCudaErrors(cudaEventRecord(timerStart));
+		if (stride == 1)
+			VolumeRender_render(d_progressiveImage, winWidth, winHeight, eyeInLocal, volume->size, cells);
+		else
+			VolumeRender_renderCoarse(d_progressiveImage, winWidth, winHeight, eyeInLocal, volume->size, stride, stride, cells);
+		if (timed)
+			recordFrameTimer(stride * stride * stride);
+
+		refinedSubsets = (stride == 1) ? PROGRESSIVE_SUBSETS : 0;
+	}
+	else if (refinedSubsets < PROGRESSIVE_SUBSETS){
+		int numSubsets = PROGRESSIVE_SUBSETS - refinedSubsets;
+		if (fullFrameMs > 0)
+			numSubsets = std::min(numSubsets, std::max(1, (int)(frameBudgetMs / (fullFrameMs / PROGRESSIVE_SUBSETS))));
+
+		bool timed = !timerPending;
+		if (timed)
+			checkCudaErrors(cudaEventRecord(timerStart));
+		VolumeRender_renderRefine(d_progressiveImage, winWidth, winHeight, eyeInLocal, volume->size, refinedSubsets, numSubsets, cells);
+		if (timed)
+			recordFrameTimer((float)PROGRESSIVE_SUBSETS / numSubsets);
+
+		refinedSubsets += numSubsets;
+	}
+	//else converged, only display the image again
+
+	checkCudaErrors(cudaMemcpy(d_output, d_progressiveImage, winWidth*winHeight * 4, cudaMemcpyDeviceToDevice));
+}
+
 void VolumeRenderableCUDA::draw(float modelview[16], float projection[16])
 {
 	if (!visible)
@@ -110,12 +372,52 @@ void VolumeRenderableCUDA::draw(float modelview[16], float projection[16])
 	size_t num_bytes;
 	checkCudaErrors(cudaGraphicsResourceGetMappedPointer((void **)&d_output, &num_bytes,
 		cuda_pbo_resource));
-	checkCudaErrors(cudaMemset(d_output, 0, winWidth*winHeight * 4));
+	bool progressive = useProgressive && !blendPreviousImage;
+	if (!progressive)
+		checkCudaErrors(cudaMemset(d_output, 0, winWidth*winHeight * 4));
+
+	//a content replaced as a whole restarts the progressive rendering from a coarse image
+	bool dataChanged = false;
+	if (volume->volumeCuda.contentVersion != lastContentVersion){
+		lastContentVersion = volume->volumeCuda.contentVersion;
+		dataChanged = true;
+	}
+	//so does a change of the deformation, which also updates the macro cells of the changed region
+	int3 voxelMin, voxelMax;
+	if (positionBasedDeformProcessor != 0 && positionBasedDeformProcessor->getChangedVolumeRegion(seenDeformChangeCount, voxelMin, voxelMax)){
+		volumeRegionsUpdated(std::vector<std::pair<int3, int3>>(1, std::make_pair(voxelMin, voxelMax)));
+		dataChanged = true;
+	}
+	bool changed = progressive && (viewChanged(modelview, projection, winWidth, winHeight) || dataChanged);
+	MacroCellOccupancy cells = { 0, make_int3(0, 0, 0) };
 
 	if (volume != 0){
-		VolumeRender_computeGradient(&(volume->volumeCuda), &volumeCUDAGradient);
-		VolumeRender_setGradient(&volumeCUDAGradient);
-		VolumeRender_setVolume(&(volume->volumeCuda));
+		//with a coarser finest level, no sample reads level 0, which then does not need to be on the device
+		bool level0Resident = GetFinestLevel() == 0;
+		bool gradientOnTheFly = useGradientOnTheFly && !blendPreviousImage;
+		if (gradientOnTheFly || !level0Resident){
+			volumeCUDAGradient.VolumeCUDA_deinit();
+		}
+		else{
+			if (volumeCUDAGradient.content == 0)
+				volumeCUDAGradient.VolumeCUDA_init(volume->size, (float*)0, 1, 4);
+			VolumeRender_computeGradient(&(volume->volumeCuda), &volumeCUDAGradient);
+			VolumeRender_setGradient(&volumeCUDAGradient);
+		}
+		VolumeRender_setGradientOnTheFly(gradientOnTheFly);
+		prepareMultiResolution(modelview, projection, winWidth, winHeight); //before setting the volume, since computing the gradient of a level unbinds it
+		if (level0Resident){
+			VolumeRender_setVolume(&(volume->volumeCuda));
+			//the macro cells are built from level 0 with the apron of its samples. a sample of a coarser level reads farther,
+			//so the skipping is only used when every brick reads level 0
+			if (!anyCoarseBrick)
+				cells = prepareEmptySpaceSkipping();
+		}
+		else{
+			//rebuilt when level 0 is used again
+			macroCellGridDirty = true;
+			dirtyRegions.clear();
+		}
 	}
 	else {
 		std::cout << "data not well set for volume renderable" << std::endl;
@@ -126,8 +428,11 @@ void VolumeRenderableCUDA::draw(float modelview[16], float projection[16])
 	if (blendPreviousImage){
 		VolumeRender_renderWithDepthInput(d_output, winWidth, winHeight, rcp->density, rcp->brightness, eyeInLocal, volume->size, rcp->maxSteps, rcp->tstep, rcp->useColor, densityBonus);
 	}
+	else if (progressive){
+		renderProgressive(d_output, winWidth, winHeight, eyeInLocal, changed, cells);
+	}
 	else{
-		VolumeRender_render(d_output, winWidth, winHeight, eyeInLocal, volume->size);
+		VolumeRender_render(d_output, winWidth, winHeight, eyeInLocal, volume->size, cells);
 	}
 
 	checkCudaErrors(cudaGraphicsUnmapResources(1, &cuda_pbo_resource, 0));
@@ -2,14 +2,21 @@
 #define VOLUMERENDERABLECUDA_H
 
 #include "Volume.h"
+#include "VolumePyramid.h"
 #include "Renderable.h"
+#include "MacroCellGrid.h"
+#include "VolumeMemoryStats.h"
+#include "VolumeRenderableCUDAKernel.h"
 #include <memory>
+#include <vector>
+#include <utility>
 #include <QObject>
 #include <QOpenGLTexture>
 #include <QOpenGLFunctions>
 #include <QOpenGLShaderProgram>
 
 struct RayCastingParameters;
+class PositionBasedDeformProcessor;
 class VolumeRenderableCUDA :public Renderable//, protected QOpenGLFunctions
 {
 	Q_OBJECT
@@ -32,9 +39,82 @@ public:
 	std::shared_ptr<Volume> getVolume(){
 		return volume;
 	}
+
+	//skip the empty macro cells when ray casting. the grid is rebuilt when the content of the volume is replaced (VolumeCUDA::contentVersion),
+	//and follows the transfer function at each draw
+	bool useEmptySpaceSkipping = true;
+	//call when the content of the volume changed without a new contentVersion, e.g. written through a surface by a processor that does not report its region
+	void volumeContentUpdated(){ macroCellGridDirty = true; refinedSubsets = 0; }
+	//call when only the given voxel ranges [min, max] changed, e.g. by TimeVaryingVolume::setTimestep(). only the macro cells of these ranges are rebuilt
+	void volumeRegionsUpdated(const std::vector<std::pair<int3, int3>> &regions);
 	void setBlending(bool b, float d = 1.0){ blendPreviousImage = b; densityBonus = d; };
+	//when the volume is deformed by p, the region it changes is followed at each draw, to update the macro cells and restart the refinement
+	void setDeformProcessor(std::shared_ptr<PositionBasedDeformProcessor> p);
+
+	//progressive rendering. while the view or the ray casting parameters change, a coarse image (one ray per block of pixels, larger step) is rendered
+	//within frameBudgetMs. when they stop changing, the image is refined over the following frames, a few interleaved pixel subsets per frame,
+	//until every pixel is cast at full quality. not used together with blending
+	bool useProgressive = false;
+	float frameBudgetMs = 33;
+	void restartRefinement(){ refinedSubsets = 0; }
+	bool isConverged(){ return refinedSubsets >= PROGRESSIVE_SUBSETS; }
+
+	//multi-resolution ray casting: each brick of MULTIRES_BRICK_SIZE voxels reads the coarsest level of the pyramid
+	//whose voxels still cover about one pixel on the screen. a positive lodBias prefers coarser levels
+	void setPyramid(std::shared_ptr<VolumePyramid> p){ pyramid = p; pyramidDirty = true; }
+	bool useMultiResolution = false;
+	float lodBias = 0;
+	//the finest level kept on the device in multi-resolution ray casting. from 1 on, the bricks read at most that resolution, and neither level 0
+	//nor its gradient is used, so the owner can leave volume->volumeCuda empty for a volume larger than the device memory.
+	//empty space skipping, which is built from level 0, is not used while any brick reads a coarser level.
+	//the coarse levels of a region changed by volumeRegionsUpdated() or a deformation are rebuilt from level 0
+	int finestResidentLevel = 0;
+	int GetFinestLevel();
+	//call after the pyramid was rebuilt, to upload it again and recompute the gradients of its levels
+	void pyramidUpdated(){ pyramidDirty = true; }
+
+	//shade with central differences of the volume computed at each sample, and free the float4 gradient volume (16 bytes per voxel).
+	//not used together with blending
+	bool useGradientOnTheFly = false;
+
+	VolumeMemoryStats getMemoryStats();
 
 private:
+	std::shared_ptr<VolumePyramid> pyramid;
+	std::vector<std::shared_ptr<VolumeCUDA>> pyramidGradients;
+	bool pyramidDirty = false;
+	bool pyramidGradientsDirty = false;
+	bool anyCoarseBrick = false; //a brick of the last frame reads a level coarser than 0
+	int uploadedFinestLevel = -1;
+	std::vector<unsigned char> brickLevels;
+	unsigned char *d_brickLevels = 0;
+	int3 brickGridSize = make_int3(0, 0, 0);
+	void prepareMultiResolution(float modelview[16], float projection[16], int winWidth, int winHeight);
+
+	uint *d_progressiveImage = 0; //persistent image, since the pbo is mapped as write discard
+	int progressiveWidth = 0, progressiveHeight = 0;
+	int refinedSubsets = 0;
+	float fullFrameMs = -1; //estimated time of a full quality frame, from the timing of the previous frames
+	cudaEvent_t timerStart = 0, timerStop = 0;
+	bool timerPending = false; //the stop event was recorded and its timing not read yet
+	float timerScale = 1;
+	void recordFrameTimer(float scale);
+	void pollFrameTimer();
+	bool hasLastView = false;
+	float lastModelview[16], lastProjection[16];
+	RayCastingParameters lastRcp;
+	bool viewChanged(float modelview[16], float projection[16], int winWidth, int winHeight);
+	unsigned int lastContentVersion = 0;
+	std::shared_ptr<PositionBasedDeformProcessor> positionBasedDeformProcessor;
+	unsigned int seenDeformChangeCount = 0;
+	void renderProgressive(uint *d_output, int winWidth, int winHeight, float3 eyeInLocal, bool changed, MacroCellOccupancy cells);
+
+	MacroCellGrid macroCellGrid;
+	bool macroCellGridDirty = false;
+	unsigned int macroCellGridVersion = 0; //contentVersion of the volume the grid was built from
+	std::vector<std::pair<int3, int3>> dirtyRegions;
+	MacroCellOccupancy prepareEmptySpaceSkipping();
+
 	VolumeCUDA volumeCUDAGradient;
 
 	void initTextureAndCudaArrayOfScreen();
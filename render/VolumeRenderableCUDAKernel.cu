@@ -3,6 +3,9 @@
 #include <iostream>
 #include "TransformFunc.h"
 #include "myDefineRayCasting.h"
+#include "DivergeColorTable.h"
+#include "MacroCellGrid.h"
+#include "PreIntegrationTable.h"
 
 #include <stdlib.h>
 
@@ -10,9 +13,6 @@
 
 #include <cubicTex3D.cu>
 
-#define VOLUMERENDER_TF_PREINTSIZE    1024
-#define VOLUMERENDER_TF_PREINTSTEPS   1024
-
 
 // texture
 
@@ -20,6 +20,14 @@ texture<float, 3, cudaReadModeElementType>  volumeTexValueForRC;
 
 texture<float4, 3, cudaReadModeElementType>  volumeTexGradient;
 
+//coarse levels of the volume pyramid, for multi-resolution ray casting. level 0 is volumeTexValueForRC / volumeTexGradient
+texture<float, 3, cudaReadModeElementType>  volumeTexValueLevel1;
+texture<float, 3, cudaReadModeElementType>  volumeTexValueLevel2;
+texture<float, 3, cudaReadModeElementType>  volumeTexValueLevel3;
+texture<float4, 3, cudaReadModeElementType>  volumeTexGradientLevel1;
+texture<float4, 3, cudaReadModeElementType>  volumeTexGradientLevel2;
+texture<float4, 3, cudaReadModeElementType>  volumeTexGradientLevel3;
+
 texture<unsigned short, 3, cudaReadModeElementType>  volumeLabelValue;
 
 surface<void, cudaSurfaceType3D> volumeSurfaceOut;
@@ -50,41 +58,17 @@ __constant__ float3 spacing;
 
 __constant__ bool useLabel = false;
 
-__constant__ int numColorTableItems = 33;
-__constant__ float colorTable[33][4] = {
-	0, 0.231372549, 0.298039216, 0.752941176,
-	0.03125, 0.266666667, 0.352941176, 0.8,
-	0.0625, 0.301960784, 0.407843137, 0.843137255,
-	0.09375, 0.341176471, 0.458823529, 0.882352941,
-	0.125, 0.384313725, 0.509803922, 0.917647059,
-	0.15625, 0.423529412, 0.556862745, 0.945098039,
-	0.1875, 0.466666667, 0.603921569, 0.968627451,
-	0.21875, 0.509803922, 0.647058824, 0.984313725,
-	0.25, 0.552941176, 0.690196078, 0.996078431,
-	0.28125, 0.596078431, 0.725490196, 1,
-	0.3125, 0.639215686, 0.760784314, 1,
-	0.34375, 0.682352941, 0.788235294, 0.992156863,
-	0.375, 0.721568627, 0.815686275, 0.976470588,
-	0.40625, 0.760784314, 0.835294118, 0.956862745,
-	0.4375, 0.8, 0.850980392, 0.933333333,
-	0.46875, 0.835294118, 0.858823529, 0.901960784,
-	0.5, 0.866666667, 0.866666667, 0.866666667,
-	0.53125, 0.898039216, 0.847058824, 0.819607843,
-	0.5625, 0.925490196, 0.82745098, 0.77254902,
-	0.59375, 0.945098039, 0.8, 0.725490196,
-	0.625, 0.960784314, 0.768627451, 0.678431373,
-	0.65625, 0.968627451, 0.733333333, 0.62745098,
-	0.6875, 0.968627451, 0.694117647, 0.580392157,
-	0.71875, 0.968627451, 0.650980392, 0.529411765,
-	0.75, 0.956862745, 0.603921569, 0.482352941,
-	0.78125, 0.945098039, 0.552941176, 0.435294118,
-	0.8125, 0.925490196, 0.498039216, 0.388235294,
-	0.84375, 0.898039216, 0.439215686, 0.345098039,
-	0.875, 0.870588235, 0.376470588, 0.301960784,
-	0.90625, 0.835294118, 0.31372549, 0.258823529,
-	0.9375, 0.796078431, 0.243137255, 0.219607843,
-	0.96875, 0.752941176, 0.156862745, 0.184313725,
-	1, 0.705882353, 0.015686275, 0.149019608,
+//multi-resolution ray casting
+__constant__ bool useMultiResolution = false;
+__constant__ const unsigned char* c_brickLevel;
+__constant__ int3 c_brickGridSize;
+
+//shading from central differences of the scalar field, instead of the precomputed gradient volume
+__constant__ bool useGradientOnTheFly = false;
+
+__constant__ int numColorTableItems = DIVERGE_COLOR_TABLE_ITEMS;
+__constant__ float colorTable[DIVERGE_COLOR_TABLE_ITEMS][4] = {
+	DIVERGE_COLOR_TABLE
 };
 
 __device__ float3 GetColourDiverge(float v)
@@ -185,9 +169,22 @@ __device__ float3 GetColourColon(float v)
 
 
 /////NOTE!!! add code to delete them afterwards
-static cudaArray *d_transferArray = 0;
 static cudaArray *d_transferIntegrate = 0;
 
+//pre-integration tables of the recently used transfer functions, so that switching between presets does not recompute them.
+//an entry without key holds the table of the last call without transfer function parameters, and is always recomputed
+struct PreIntTableEntry
+{
+	bool hasKey;
+	float transFuncP1, transFuncP2;
+	bool useColor;
+	cudaArray *table;
+	unsigned int lastUse;
+};
+static std::vector<PreIntTableEntry> preIntTables;
+static int preIntTableCacheSize = 4;
+static unsigned int preIntTableUseCount = 0;
+
 texture<float4, 1, cudaReadModeElementType>           transferIntegrateTex;
 surface<void, 1>                                      transferIntegrateSurf;
 
@@ -295,10 +292,11 @@ d_preintegrate(float steps, cudaExtent extent, float transFuncP1, float transFun
 }
 
 
-void updatePreIntTabelNew(cudaArray *d_transferFunc)
+static void computePreIntTable(cudaArray *d_transferFunc, cudaArray *table)
 {
 	cudaChannelFormatDesc channelFloat4 = cudaCreateChannelDesc<float4>();
 	checkCudaErrors(cudaBindTextureToArray(transferTex, d_transferFunc, channelFloat4));
+	checkCudaErrors(cudaBindSurfaceToArray(transferLayerPreintSurf, table, channelFloat4));
 
 	{
 		cudaExtent extent = { VOLUMERENDER_TF_PREINTSTEPS, 0, 0 };
@@ -315,6 +313,70 @@ void updatePreIntTabelNew(cudaArray *d_transferFunc)
 	}
 }
 
+//returns the entry to hold a new table: a new array while the cache is not full, otherwise the least recently used entry
+static PreIntTableEntry& acquirePreIntTableEntry()
+{
+	for (int i = 0; i < preIntTables.size(); i++){
+		if (!preIntTables[i].hasKey)
+			return preIntTables[i];
+	}
+	if (preIntTables.size() < preIntTableCacheSize){
+		PreIntTableEntry e;
+		cudaChannelFormatDesc channelFloat4 = cudaCreateChannelDesc<float4>();
+		cudaExtent extent = { VOLUMERENDER_TF_PREINTSIZE, VOLUMERENDER_TF_PREINTSIZE, 1 };
+		checkCudaErrors(cudaMalloc3DArray(&(e.table), &channelFloat4, extent, cudaArrayLayered | cudaArraySurfaceLoadStore));
+		preIntTables.push_back(e);
+		return preIntTables.back();
+	}
+	int lru = 0;
+	for (int i = 1; i < preIntTables.size(); i++){
+		if (preIntTables[i].lastUse < preIntTables[lru].lastUse)
+			lru = i;
+	}
+	return preIntTables[lru];
+}
+
+void updatePreIntTabelNew(cudaArray *d_transferFunc, const RayCastingParameters *rcp)
+{
+	cudaChannelFormatDesc channelFloat4 = cudaCreateChannelDesc<float4>();
+	if (rcp != 0){
+		for (int i = 0; i < preIntTables.size(); i++){
+			PreIntTableEntry &e = preIntTables[i];
+			if (e.hasKey && e.transFuncP1 == rcp->transFuncP1 && e.transFuncP2 == rcp->transFuncP2 && e.useColor == rcp->useColor){
+				e.lastUse = ++preIntTableUseCount;
+				checkCudaErrors(cudaBindTextureToArray(transferLayerPreintTex, e.table, channelFloat4));
+				return;
+			}
+		}
+	}
+
+	PreIntTableEntry &e = acquirePreIntTableEntry();
+	e.hasKey = rcp != 0;
+	if (rcp != 0){
+		e.transFuncP1 = rcp->transFuncP1;
+		e.transFuncP2 = rcp->transFuncP2;
+		e.useColor = rcp->useColor;
+	}
+	e.lastUse = ++preIntTableUseCount;
+	computePreIntTable(d_transferFunc, e.table);
+	checkCudaErrors(cudaBindTextureToArray(transferLayerPreintTex, e.table, channelFloat4));
+}
+
+void VolumeRender_setPreIntTableCacheSize(int n)
+{
+	preIntTableCacheSize = max(n, 1);
+	//drop the least recently used tables beyond the new size
+	while (preIntTables.size() > preIntTableCacheSize){
+		int lru = 0;
+		for (int i = 1; i < preIntTables.size(); i++){
+			if (preIntTables[i].lastUse < preIntTables[lru].lastUse)
+				lru = i;
+		}
+		checkCudaErrors(cudaFreeArray(preIntTables[lru].table));
+		preIntTables.erase(preIntTables.begin() + lru);
+	}
+}
+
 
 void initPreIntTabel()
 {
@@ -324,10 +386,7 @@ void initPreIntTabel()
 	transferLayerPreintTex.addressMode[1] = cudaAddressModeClamp;
 
 	cudaChannelFormatDesc channelFloat4 = cudaCreateChannelDesc<float4>();
-	cudaExtent extent = { VOLUMERENDER_TF_PREINTSIZE, VOLUMERENDER_TF_PREINTSIZE, 1 };
-	checkCudaErrors(cudaMalloc3DArray(&d_transferArray, &channelFloat4, extent, cudaArrayLayered | cudaArraySurfaceLoadStore));
-	checkCudaErrors(cudaBindTextureToArray(transferLayerPreintTex, d_transferArray, channelFloat4));
-	checkCudaErrors(cudaBindSurfaceToArray(transferLayerPreintSurf, d_transferArray, channelFloat4));
+	//the tables themselves are allocated by updatePreIntTabelNew()
 
 	transferIntegrateTex.normalized = true;
 	transferIntegrateTex.filterMode = cudaFilterModeLinear;
@@ -420,7 +479,9 @@ void VolumeRender_init()
 
 void VolumeRender_deinit()
 {
-	checkCudaErrors(cudaFreeArray(d_transferArray));
+	for (int i = 0; i < preIntTables.size(); i++)
+		checkCudaErrors(cudaFreeArray(preIntTables[i].table));
+	preIntTables.clear();
 	checkCudaErrors(cudaFreeArray(d_transferIntegrate));
 }
 
@@ -488,13 +549,71 @@ __device__ float3 phongModel(float3 a, float3 pos_in_eye, float3 normal){
 }
 
 
-__global__ void d_render(uint *d_output, uint imageW, uint imageH, float3 eyeInLocal, int3 volumeSize)
+//number of steps the ray can skip from the sample at coord, which is 0 if the macro cell of coord may be visible.
+//the skipped samples are exactly the ones that fall strictly inside the empty cell, so the image is the same as without skipping,
+//as long as the samples read level 0, which the cells are built from. the renderable does not skip when a brick reads a coarser level.
+//called at every sample, it walks through the empty cells one by one, as a 3D DDA does
+__device__ int emptySpaceSkipSteps(const MacroCellOccupancy &cells, float3 coord, float3 stepInVoxel)
 {
-	uint x = blockIdx.x*blockDim.x + threadIdx.x;
-	uint y = blockIdx.y*blockDim.y + threadIdx.y;
+	int3 cell = make_int3(floorf(coord.x / MACRO_CELL_SIZE), floorf(coord.y / MACRO_CELL_SIZE), floorf(coord.z / MACRO_CELL_SIZE));
+	if (cell.x < 0 || cell.y < 0 || cell.z < 0 || cell.x >= cells.gridSize.x || cell.y >= cells.gridSize.y || cell.z >= cells.gridSize.z)
+		return 0;
+	int idx = (cell.z * cells.gridSize.y + cell.y) * cells.gridSize.x + cell.x;
+	if (cells.occupancy[idx >> 5] & (1u << (idx & 31)))
+		return 0;
+
+	//distance to the exit of the cell, in number of steps
+	float3 cellMin = make_float3(cell) * MACRO_CELL_SIZE;
+	float3 cellMax = cellMin + MACRO_CELL_SIZE;
+	float tx = stepInVoxel.x > 0 ? (cellMax.x - coord.x) / stepInVoxel.x : (stepInVoxel.x < 0 ? (cellMin.x - coord.x) / stepInVoxel.x : 1e30f);
+	float ty = stepInVoxel.y > 0 ? (cellMax.y - coord.y) / stepInVoxel.y : (stepInVoxel.y < 0 ? (cellMin.y - coord.y) / stepInVoxel.y : 1e30f);
+	float tz = stepInVoxel.z > 0 ? (cellMax.z - coord.z) / stepInVoxel.z : (stepInVoxel.z < 0 ? (cellMin.z - coord.z) / stepInVoxel.z : 1e30f);
+	float tExit = fminf(fminf(tx, ty), tz);
+	//a sample exactly on the exit face belongs to the next cell, so it is not skipped
+	return max((int)ceilf(tExit), 1);
+}
 
-	if ((x >= imageW) || (y >= imageH)) return;
+//central differences over 2 voxels on both sides, as d_computeGradient(), but of the interpolated field at c
+#define CENTRAL_DIFFERENCE(tex, c) (make_float3( \
+	tex3D(tex, c.x + 2.0f, c.y, c.z) - tex3D(tex, c.x - 2.0f, c.y, c.z), \
+	tex3D(tex, c.x, c.y + 2.0f, c.z) - tex3D(tex, c.x, c.y - 2.0f, c.z), \
+	tex3D(tex, c.x, c.y, c.z + 2.0f) - tex3D(tex, c.x, c.y, c.z - 2.0f)) * 0.25f)
 
+//value and gradient at coord (in voxels of level 0), read from the pyramid level chosen for the brick that contains coord.
+//the gradient of a coarse level is scaled to the voxel unit of level 0
+__device__ void sampleVolumeMultiResolution(float3 coord, float &sample, float3 &grad)
+{
+	int level = 0;
+	if (useMultiResolution){
+		int3 b = make_int3(floorf(coord.x / MULTIRES_BRICK_SIZE), floorf(coord.y / MULTIRES_BRICK_SIZE), floorf(coord.z / MULTIRES_BRICK_SIZE));
+		b = clamp(b, make_int3(0, 0, 0), c_brickGridSize - 1);
+		level = c_brickLevel[(b.z * c_brickGridSize.y + b.y) * c_brickGridSize.x + b.x];
+	}
+	if (level == 1){
+		float3 c = coord * 0.5f;
+		sample = tex3D(volumeTexValueLevel1, c.x, c.y, c.z);
+		grad = (useGradientOnTheFly ? CENTRAL_DIFFERENCE(volumeTexValueLevel1, c) : make_float3(tex3D(volumeTexGradientLevel1, c.x, c.y, c.z))) * 0.5f;
+	}
+	else if (level == 2){
+		float3 c = coord * 0.25f;
+		sample = tex3D(volumeTexValueLevel2, c.x, c.y, c.z);
+		grad = (useGradientOnTheFly ? CENTRAL_DIFFERENCE(volumeTexValueLevel2, c) : make_float3(tex3D(volumeTexGradientLevel2, c.x, c.y, c.z))) * 0.25f;
+	}
+	else if (level == 3){
+		float3 c = coord * 0.125f;
+		sample = tex3D(volumeTexValueLevel3, c.x, c.y, c.z);
+		grad = (useGradientOnTheFly ? CENTRAL_DIFFERENCE(volumeTexValueLevel3, c) : make_float3(tex3D(volumeTexGradientLevel3, c.x, c.y, c.z))) * 0.125f;
+	}
+	else{
+		sample = tex3D(volumeTexValueForRC, coord.x, coord.y, coord.z);
+		grad = useGradientOnTheFly ? CENTRAL_DIFFERENCE(volumeTexValueForRC, coord) : make_float3(tex3D(volumeTexGradient, coord.x, coord.y, coord.z));
+	}
+}
+
+//casts the ray through the point (u, v) of the near plane in clip space.
+//stepScale > 1 marches with a larger step, with opacity correction, for the coarse images of progressive rendering
+__device__ float4 castRay(float u, float v, float3 eyeInLocal, int3 volumeSize, float stepScale, const MacroCellOccupancy &cells)
+{
 	const float opacityThreshold = 0.95f;
 
 	const float3 boxMin = make_float3(0.0f, 0.0f, 0.0f);
@@ -503,10 +622,6 @@ __global__ void d_render(uint *d_output, uint imageW, uint imageH, float3 eyeInL
 	//const float3 boxMax = spacing*make_float3(256, 115, 256);//for NEK image
 
 
-	//pixel_Index = clamp( round(uv * num_Pixels - 0.5), 0, num_Pixels-1 );
-	float u = ((x + 0.5) / (float)imageW)*2.0f - 1.0f;
-	float v = ((y + 0.5) / (float)imageH)*2.0f - 1.0f;
-
 	Ray eyeRay;
 	eyeRay.o = eyeInLocal;
 	float4 pixelInClip = make_float4(u, v, -1.0f, 1.0f);
@@ -521,28 +636,41 @@ __global__ void d_render(uint *d_output, uint imageW, uint imageH, float3 eyeInL
 
 	if (tfar<tnear)//	if (!hit)
 	{
-		float4 sum = make_float4(0.0f, 0.0f, 0.0f, 1.0f);
-		d_output[y*imageW + x] = rgbaFloatToInt(sum);
-		return;
+		return make_float4(0.0f, 0.0f, 0.0f, 1.0f);
 	}
 
 	// march along ray from front to back, accumulating color
 	float4 sum = make_float4(0.0f);
 	float t = tnear;
 	float3 pos = eyeRay.o + eyeRay.d*tnear;
-	float3 step = eyeRay.d*tstep;
+	float curTstep = tstep * stepScale;
+	int curMaxSteps = maxSteps / stepScale;
+	float3 step = eyeRay.d*curTstep;
 	float lightingThr = 0.000001;
 
 	float fragDepth = 1.0;
 
 
-	for (int i = 0; i<maxSteps; i++)
+	for (int i = 0; i<curMaxSteps; i++)
 	{
 		float3 coord = pos / spacing;
-		float sample = tex3D(volumeTexValueForRC, coord.x, coord.y, coord.z);
+		if (cells.occupancy != 0){
+			int skip = emptySpaceSkipSteps(cells, coord, step / spacing);
+			if (skip > 0){
+				i += skip - 1;
+				t += curTstep * skip;
+				if (t > tfar)
+					break;
+				pos += step * skip;
+				continue;
+			}
+		}
+		float sample;
+		float3 grad;
+		sampleVolumeMultiResolution(coord, sample, grad);
 		float funcRes = clamp((sample - transFuncP2) / (transFuncP1 - transFuncP2), 0.0, 1.0);
 
-		float3 normalInWorld = make_float3(tex3D(volumeTexGradient, coord.x, coord.y, coord.z)) / spacing;
+		float3 normalInWorld = grad / spacing;
 
 		// lookup in transfer function texture
 		float4 col;
@@ -566,6 +694,8 @@ __global__ void d_render(uint *d_output, uint imageW, uint imageH, float3 eyeInL
 		}
 
 		col.w *= density;
+		if (stepScale != 1.0f)
+			col.w = 1.0f - pow(1.0f - fminf(col.w, 1.0f), stepScale);
 
 		// pre-multiply alpha
 		col.x *= col.w;
@@ -581,7 +711,7 @@ __global__ void d_render(uint *d_output, uint imageW, uint imageH, float3 eyeInL
 			break;
 		}
 
-		t += tstep;
+		t += curTstep;
 
 		if (t > tfar){
 			float4 posInClip = divW(mul(c_MVPMatrix, make_float4(pos, 1.0)));
@@ -593,16 +723,74 @@ __global__ void d_render(uint *d_output, uint imageW, uint imageH, float3 eyeInL
 	}
 
 	sum *= brightness;
-	d_output[y*imageW + x] = rgbaFloatToInt(sum);
+	return sum;
 }
 
+__global__ void d_render(uint *d_output, uint imageW, uint imageH, float3 eyeInLocal, int3 volumeSize, MacroCellOccupancy cells)
+{
+	uint x = blockIdx.x*blockDim.x + threadIdx.x;
+	uint y = blockIdx.y*blockDim.y + threadIdx.y;
+
+	if ((x >= imageW) || (y >= imageH)) return;
+
+	//pixel_Index = clamp( round(uv * num_Pixels - 0.5), 0, num_Pixels-1 );
+	float u = ((x + 0.5) / (float)imageW)*2.0f - 1.0f;
+	float v = ((y + 0.5) / (float)imageH)*2.0f - 1.0f;
 
-void VolumeRender_render(uint *d_output, uint imageW, uint imageH, float3 eyeInLocal, int3 volumeSize)
+	d_output[y*imageW + x] = rgbaFloatToInt(castRay(u, v, eyeInLocal, volumeSize, 1.0f, cells));
+}
+
+//coarse image for progressive rendering: one ray through the center of each stride x stride block, copied to the whole block
+__global__ void d_renderCoarse(uint *d_output, uint imageW, uint imageH, float3 eyeInLocal, int3 volumeSize, int stride, float stepScale, MacroCellOccupancy cells)
+{
+	uint bx = blockIdx.x*blockDim.x + threadIdx.x;
+	uint by = blockIdx.y*blockDim.y + threadIdx.y;
+
+	uint x0 = bx * stride, y0 = by * stride;
+	if ((x0 >= imageW) || (y0 >= imageH)) return;
+
+	float u = ((x0 + 0.5f * stride) / (float)imageW)*2.0f - 1.0f;
+	float v = ((y0 + 0.5f * stride) / (float)imageH)*2.0f - 1.0f;
+	uint c = rgbaFloatToInt(castRay(u, v, eyeInLocal, volumeSize, stepScale, cells));
+
+	for (uint y = y0; y < min(y0 + stride, imageH); y++){
+		for (uint x = x0; x < min(x0 + stride, imageW); x++){
+			d_output[y*imageW + x] = c;
+		}
+	}
+}
+
+//order of the pixels of a 4x4 block refined by progressive rendering (bayer matrix), so that each partial refinement is spread evenly
+__constant__ int2 c_refineOrder[PROGRESSIVE_SUBSETS] = {
+	{ 0, 0 }, { 2, 2 }, { 2, 0 }, { 0, 2 },
+	{ 1, 1 }, { 3, 3 }, { 3, 1 }, { 1, 3 },
+	{ 1, 0 }, { 3, 2 }, { 3, 0 }, { 1, 2 },
+	{ 0, 1 }, { 2, 3 }, { 2, 1 }, { 0, 3 }
+};
+
+//full quality rays for the pixel subsets [firstSubset, firstSubset + numSubsets) of every 4x4 block
+__global__ void d_renderRefine(uint *d_output, uint imageW, uint imageH, float3 eyeInLocal, int3 volumeSize, int firstSubset, int numSubsets, MacroCellOccupancy cells)
+{
+	uint bx = blockIdx.x*blockDim.x + threadIdx.x;
+	uint by = blockIdx.y*blockDim.y + threadIdx.y;
+	int k = blockIdx.z + firstSubset;
+
+	uint x = bx * 4 + c_refineOrder[k].x;
+	uint y = by * 4 + c_refineOrder[k].y;
+	if ((x >= imageW) || (y >= imageH)) return;
+
+	float u = ((x + 0.5) / (float)imageW)*2.0f - 1.0f;
+	float v = ((y + 0.5) / (float)imageH)*2.0f - 1.0f;
+	d_output[y*imageW + x] = rgbaFloatToInt(castRay(u, v, eyeInLocal, volumeSize, 1.0f, cells));
+}
+
+
+void VolumeRender_render(uint *d_output, uint imageW, uint imageH, float3 eyeInLocal, int3 volumeSize, MacroCellOccupancy cells)
 {
 	dim3 blockSize = dim3(16, 16, 1);
 	dim3 gridSize = dim3(iDivUp(imageW, blockSize.x), iDivUp(imageH, blockSize.y));
 
-	d_render << <gridSize, blockSize >> >(d_output, imageW, imageH, eyeInLocal, volumeSize);
+	d_render << <gridSize, blockSize >> >(d_output, imageW, imageH, eyeInLocal, volumeSize, cells);
 
 	//clean what was used
 
@@ -610,6 +798,22 @@ void VolumeRender_render(uint *d_output, uint imageW, uint imageH, float3 eyeInL
 	//checkCudaErrors(cudaUnbindTexture(volumeTexGradient));
 }
 
+void VolumeRender_renderCoarse(uint *d_output, uint imageW, uint imageH, float3 eyeInLocal, int3 volumeSize, int stride, float stepScale, MacroCellOccupancy cells)
+{
+	dim3 blockSize = dim3(16, 16, 1);
+	dim3 gridSize = dim3(iDivUp(iDivUp(imageW, stride), blockSize.x), iDivUp(iDivUp(imageH, stride), blockSize.y));
+
+	d_renderCoarse << <gridSize, blockSize >> >(d_output, imageW, imageH, eyeInLocal, volumeSize, stride, stepScale, cells);
+}
+
+void VolumeRender_renderRefine(uint *d_output, uint imageW, uint imageH, float3 eyeInLocal, int3 volumeSize, int firstSubset, int numSubsets, MacroCellOccupancy cells)
+{
+	dim3 blockSize = dim3(16, 16, 1);
+	dim3 gridSize = dim3(iDivUp(iDivUp(imageW, 4), blockSize.x), iDivUp(iDivUp(imageH, 4), blockSize.y), numSubsets);
+
+	d_renderRefine << <gridSize, blockSize >> >(d_output, imageW, imageH, eyeInLocal, volumeSize, firstSubset, numSubsets, cells);
+}
+
 
 __global__ void d_OmniVolumeRender(uint *d_output, uint imageW, uint imageH, float3 eyeInLocal, int3 volumeSize)
 {
@@ -914,7 +1118,7 @@ __global__ void d_render_immer_iso(uint *d_output, uint imageW, uint imageH, flo
 
 //the function is very similar with d_render(), except for more color map options specifically used by the deformation project
 //can be combined at a proper time
-__global__ void d_render_immer(uint *d_output, uint imageW, uint imageH,  float3 eyeInLocal, int3 volumeSize)
+__global__ void d_render_immer(uint *d_output, uint imageW, uint imageH,  float3 eyeInLocal, int3 volumeSize, MacroCellOccupancy cells)
 {
 	uint x = blockIdx.x*blockDim.x + threadIdx.x;
 	uint y = blockIdx.y*blockDim.y + threadIdx.y;
@@ -963,6 +1167,17 @@ __global__ void d_render_immer(uint *d_output, uint imageW, uint imageH,  float3
 	for (int i = 0; i<maxSteps; i++)
 	{
 		float3 coord = pos / spacing;
+		if (cells.occupancy != 0){
+			int skip = emptySpaceSkipSteps(cells, coord, step / spacing);
+			if (skip > 0){
+				i += skip - 1;
+				t += tstep * skip;
+				if (t > tfar)
+					break;
+				pos += step * skip;
+				continue;
+			}
+		}
 		float sample = tex3D(volumeTexValueForRC, coord.x, coord.y, coord.z);
 		float funcRes = clamp((sample - transFuncP2) / (transFuncP1 - transFuncP2), 0.0, 1.0);
 
@@ -1578,7 +1793,7 @@ __global__ void d_render_preint_coloringDeformedElement(uint *d_output, uint ima
 void VolumeRender_renderImmer(uint *d_output, uint imageW, uint imageH,
 	float3 eyeInLocal, int3 volumeSize, RayCastingParameters* rcp,
 	float3 tunnelStart, float3 tunnelEnd, float3 vertDir, float degree, float deformationscale, float deformationScaleVerticel, bool isColoringDeformedPart,
-	bool usePreInt, bool useSplineInterpolation, bool useCliping)
+	MacroCellOccupancy cells, bool usePreInt, bool useSplineInterpolation, bool useCliping)
 {
 	dim3 blockSize = dim3(16, 16, 1);
 	dim3 gridSize = dim3(iDivUp(imageW, blockSize.x), iDivUp(imageH, blockSize.y));
@@ -1597,7 +1812,7 @@ void VolumeRender_renderImmer(uint *d_output, uint imageW, uint imageH,
 		}
 	}
 	else{
-		d_render_immer << <gridSize, blockSize >> >(d_output, imageW, imageH, eyeInLocal, volumeSize);
+		d_render_immer << <gridSize, blockSize >> >(d_output, imageW, imageH, eyeInLocal, volumeSize, cells);
 		//d_render_immer_iso << <gridSize, blockSize >> >(d_output, imageW, imageH, eyeInLocal, volumeSize); //for Neghip
 	}
 
@@ -1657,6 +1872,56 @@ void VolumeRender_setGradient(const VolumeCUDA *gradVol)
 	checkCudaErrors(cudaBindTextureToArray(volumeTexGradient, gradVol->content, gradVol->channelDesc));
 }
 
+void VolumeRender_setGradientOnTheFly(bool b)
+{
+	checkCudaErrors(cudaMemcpyToSymbol(useGradientOnTheFly, &b, sizeof(bool)));
+}
+
+void VolumeRender_setPyramidLevel(int level, const VolumeCUDA *vol, const VolumeCUDA *gradVol)
+{
+	texture<float, 3, cudaReadModeElementType> *valueTex;
+	texture<float4, 3, cudaReadModeElementType> *gradientTex;
+	if (level == 1){
+		valueTex = &volumeTexValueLevel1;
+		gradientTex = &volumeTexGradientLevel1;
+	}
+	else if (level == 2){
+		valueTex = &volumeTexValueLevel2;
+		gradientTex = &volumeTexGradientLevel2;
+	}
+	else if (level == 3){
+		valueTex = &volumeTexValueLevel3;
+		gradientTex = &volumeTexGradientLevel3;
+	}
+	else{
+		std::cout << "pyramid level " << level << " not supported by the ray caster" << std::endl;
+		return;
+	}
+
+	//same settings as the level 0 textures
+	valueTex->normalized = false;
+	valueTex->filterMode = cudaFilterModeLinear;
+	gradientTex->normalized = false;
+	gradientTex->filterMode = cudaFilterModeLinear;
+	for (int i = 0; i < 3; i++){
+		valueTex->addressMode[i] = cudaAddressModeBorder;
+		gradientTex->addressMode[i] = cudaAddressModeBorder;
+	}
+	checkCudaErrors(cudaBindTextureToArray(*valueTex, vol->content, vol->channelDesc));
+	if (gradVol != 0)
+		checkCudaErrors(cudaBindTextureToArray(*gradientTex, gradVol->content, gradVol->channelDesc));
+}
+
+void VolumeRender_setBrickLevels(const unsigned char* d_brickLevel, int3 brickGridSize)
+{
+	bool use = d_brickLevel != 0;
+	checkCudaErrors(cudaMemcpyToSymbol(useMultiResolution, &use, sizeof(bool)));
+	if (use){
+		checkCudaErrors(cudaMemcpyToSymbol(c_brickLevel, &d_brickLevel, sizeof(const unsigned char*)));
+		checkCudaErrors(cudaMemcpyToSymbol(c_brickGridSize, &brickGridSize, sizeof(int3)));
+	}
+}
+
 //similar with d_render_immer. might be faster if directly use the result of d_render_immer
 __global__ void d_LabelProcessor(uint imageW, uint imageH, float density, float brightness, float3 eyeInLocal, int3 volumeSize, int maxSteps, float tstep, bool useColor,char* screenMark)
 {
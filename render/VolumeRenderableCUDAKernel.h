@@ -4,18 +4,34 @@
 #include <cuda_runtime.h>
 #include "Volume.h"
 #include "myDefineRayCasting.h"
+#include "MacroCellGrid.h"
 #include <memory>
 #include <vector>
 
 typedef unsigned int  uint;
 
+//number of pixel subsets (one pixel of each 4x4 block per subset) refined by progressive rendering
+#define PROGRESSIVE_SUBSETS 16
+
+//edge length, in voxels of level 0, of the bricks that choose their own pyramid level in multi-resolution ray casting
+#define MULTIRES_BRICK_SIZE 32
+
 extern "C" {
 	void VolumeRender_init();
 	void VolumeRender_deinit();
 	
-	void updatePreIntTabelNew(cudaArray *d_transferFunc);
-
-	void VolumeRender_render(uint *d_output, uint imageW, uint imageH, float3 eyeInLocal, int3 volumeSize);
+	//computes the pre-integration table of the transfer function and binds it for the pre-integrated renderers.
+	//when rcp is given, the tables are cached by its transfer function parameters (transFuncP1, transFuncP2, useColor),
+	//so d_transferFunc must be fully determined by them. the cache keeps the least recently used tables, 4 by default
+	void updatePreIntTabelNew(cudaArray *d_transferFunc, const RayCastingParameters *rcp = 0);
+	void VolumeRender_setPreIntTableCacheSize(int n);
+
+	//cells is the occupancy of a MacroCellGrid of the volume, used to skip empty space. a null occupancy disables the skipping
+	void VolumeRender_render(uint *d_output, uint imageW, uint imageH, float3 eyeInLocal, int3 volumeSize, MacroCellOccupancy cells);
+	//progressive rendering. the coarse pass casts one ray per stride x stride block with the step scaled by stepScale,
+	//the refine pass casts full quality rays for some of the PROGRESSIVE_SUBSETS pixel subsets
+	void VolumeRender_renderCoarse(uint *d_output, uint imageW, uint imageH, float3 eyeInLocal, int3 volumeSize, int stride, float stepScale, MacroCellOccupancy cells);
+	void VolumeRender_renderRefine(uint *d_output, uint imageW, uint imageH, float3 eyeInLocal, int3 volumeSize, int firstSubset, int numSubsets, MacroCellOccupancy cells);
 	void OmniVolumeRender_render(uint *d_output, uint imageW, uint imageH, float3 eyeInLocal, int3 volumeSize);
 
 	void VolumeRender_renderWithDepthInput(uint *d_output, uint imageW, uint imageH, float density, float brightness, float3 eyeInLocal, int3 volumeSize, int maxSteps, float tstep, bool useColor, float densityBonus);
@@ -24,7 +40,7 @@ extern "C" {
 	void VolumeRender_renderImmer(uint *d_output, uint imageW, uint imageH,
 		float3 eyeInLocal, int3 volumeSize, RayCastingParameters* rcp, 
 		float3 tunnelStart, float3 tunnelEnd, float3 vertDir, float degree, float deformationscale, float deformationScaleVerticel, bool isColoringDeformedPart,
-		bool usePreInt = false, bool useSplineInterpolation = false, bool useCliping = false);
+		MacroCellOccupancy cells, bool usePreInt = false, bool useSplineInterpolation = false, bool useCliping = false);
 
 	void VolumeRender_renderImmer_withPreBlend(uint *d_output, uint imageW, uint imageH,
 		float3 eyeInLocal, int3 volumeSize, RayCastingParameters* rcp, float densityBonus,
@@ -33,6 +49,13 @@ extern "C" {
 	void VolumeRender_setVolume(const VolumeCUDA *volume);
 	void VolumeRender_setGradient(const VolumeCUDA *volume);
 	void VolumeRender_setLabelVolume(const VolumeCUDA *volume);
+	//multi-resolution ray casting in d_render. binds the value and gradient of a coarse pyramid level (1 to 3),
+	//and the level chosen for each brick of MULTIRES_BRICK_SIZE voxels. pass 0 as d_brickLevel to always read level 0
+	void VolumeRender_setPyramidLevel(int level, const VolumeCUDA *volume, const VolumeCUDA *gradient);
+	void VolumeRender_setBrickLevels(const unsigned char* d_brickLevel, int3 brickGridSize);
+	//d_render shades with central differences of the volume computed at each sample, so no gradient volume needs to be set.
+	//the gradient of a pyramid level may then be 0
+	void VolumeRender_setGradientOnTheFly(bool b);
 
 
 	void VolumeRender_setConstants(float *MVMatrix, float *MVPMatrix, float *invMVMatrix, float *invMVPMatrix, float *NormalMatrix, float3* _spacing, RayCastingParameters* rcp);
@@ -62,7 +62,7 @@ void VolumeRenderableImmerCUDA::init()
 	VolumeRender_init(); //must be called before setting color table related variables
 
 	updateColorTable();
-	updatePreIntTabelNew(rcp->d_transferFunc);
+	updatePreIntTabelNew(rcp->d_transferFunc, rcp.get());
 
 	initTextureAndCudaArrayOfScreen();
 
@@ -291,6 +291,31 @@ void VolumeRenderableImmerCUDA::updateColorTable()
 }
 
 
+MacroCellOccupancy VolumeRenderableImmerCUDA::prepareEmptySpaceSkipping()
+{
+	if (!useEmptySpaceSkipping){
+		MacroCellOccupancy none = { 0, make_int3(0, 0, 0) };
+		return none;
+	}
+	//the whole content was replaced, e.g. by Volume::reset() when the deformation is switched off
+	if (!macroCellGrid.isBuilt() || macroCellGridDirty || volume->volumeCuda.contentVersion != macroCellGridVersion){
+		macroCellGrid.build(&(volume->volumeCuda));
+		macroCellGridDirty = false;
+		macroCellGridVersion = volume->volumeCuda.contentVersion;
+		//the region changed so far is covered by the rebuild
+		if (positionBasedDeformProcessor != 0)
+			seenDeformChangeCount = positionBasedDeformProcessor->GetVolumeChangeCount();
+	}
+	else{
+		//only the cells of the region changed by the deformation are rebuilt
+		int3 voxelMin, voxelMax;
+		if (positionBasedDeformProcessor != 0 && positionBasedDeformProcessor->getChangedVolumeRegion(seenDeformChangeCount, voxelMin, voxelMax))
+			macroCellGrid.update(&(volume->volumeCuda), voxelMin, voxelMax);
+	}
+	macroCellGrid.updateOccupancy(rcp->transFuncP1, rcp->transFuncP2);
+	return macroCellGrid.GetOccupancyForRendering();
+}
+
 void VolumeRenderableImmerCUDA::draw(float modelview[16], float projection[16])
 {
 	if (!visible)
@@ -357,10 +382,12 @@ void VolumeRenderableImmerCUDA::draw(float modelview[16], float projection[16])
 		cuda_pbo_resource));
 	checkCudaErrors(cudaMemset(d_output, 0, winWidth*winHeight * 4));
 
+	MacroCellOccupancy cells = { 0, make_int3(0, 0, 0) };
 	if (volume != 0){
 		VolumeRender_computeGradient(&(volume->volumeCuda), &volumeCUDAGradient);
 		VolumeRender_setGradient(&volumeCUDAGradient);
 		VolumeRender_setVolume(&(volume->volumeCuda));
+		cells = prepareEmptySpaceSkipping();
 	}
 	else {
 		std::cout << "data not well set for volume renderable" << std::endl;
@@ -389,7 +416,7 @@ void VolumeRenderableImmerCUDA::draw(float modelview[16], float projection[16])
 		//VolumeRender_renderImmer(d_output, winWidth, winHeight, eyeInLocal, volume->size, rcp.get(), positionBasedDeformProcessor.get(), usePreInt, useSplineInterpolation, useClipRendering);
 		VolumeRender_renderImmer(d_output, winWidth, winHeight, eyeInLocal, volume->size, rcp.get(),
 			positionBasedDeformProcessor->getTunnelStart(), positionBasedDeformProcessor->getTunnelEnd(), positionBasedDeformProcessor->getRectVerticalDir(), positionBasedDeformProcessor->r, positionBasedDeformProcessor->getDeformationScale(), positionBasedDeformProcessor->getDeformationScaleVertical(), positionBasedDeformProcessor->isColoringDeformedPart,
-			usePreInt, useSplineInterpolation, useClipRendering);
+			cells, usePreInt, useSplineInterpolation, useClipRendering);
 	}
 
 	checkCudaErrors(cudaGraphicsUnmapResources(1, &cuda_pbo_resource, 0));
@@ -521,7 +548,7 @@ void VolumeRenderableImmerCUDA::resize(int width, int height)
 void VolumeRenderableImmerCUDA::preIntTableNeedUpdate()
 {
 	updateColorTable();
-	updatePreIntTabelNew(rcp->d_transferFunc);
+	updatePreIntTabelNew(rcp->d_transferFunc, rcp.get());
 }
 
 
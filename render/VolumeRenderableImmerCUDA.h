@@ -3,6 +3,7 @@
 
 #include "Volume.h"
 #include "Renderable.h"
+#include "MacroCellGrid.h"
 #include <memory>
 #include <QObject>
 #include <QOpenGLTexture>
@@ -28,6 +29,7 @@ public:
 
 	void setVolume(std::shared_ptr<Volume> v, bool needMoreChange = false){
 		volume = v;
+		macroCellGridDirty = true;
 		if (needMoreChange){
 			//todo in the future;
 		}
@@ -58,6 +60,12 @@ public:
 		return volume;
 	}
 
+	//skip the empty macro cells when ray casting. the grid is rebuilt when the content of the volume is replaced (VolumeCUDA::contentVersion),
+	//updated over the region changed by the deformation processor, and follows the transfer function at each draw
+	bool useEmptySpaceSkipping = true;
+	//call when the content of the volume changed without a new contentVersion, other than by the deformation processor
+	void volumeContentUpdated(){ macroCellGridDirty = true; }
+
 	void setBlending(bool b, float d = 1.0){ blendPreviousImage = b; densityBonus = d; };
 
 	void startClipRendering(std::shared_ptr<Volume> channelVolume);
@@ -69,6 +77,12 @@ public:
 	void updateColorTableold(); //may not be a good design. should be placed into RCP
 
 private:
+	MacroCellGrid macroCellGrid;
+	bool macroCellGridDirty = false;
+	unsigned int macroCellGridVersion = 0; //contentVersion of the volume the grid was built from
+	unsigned int seenDeformChangeCount = 0; //PositionBasedDeformProcessor::GetVolumeChangeCount() the grid follows
+	MacroCellOccupancy prepareEmptySpaceSkipping();
+
 	bool useClipRendering = false;
 
 	VolumeCUDA volumeCUDAGradient;
@@ -0,0 +1,562 @@
+#include "VolumeRendererCPU.h"
+#include "Volume.h"
+#include "myDefineRayCasting.h"
+#include "DivergeColorTable.h"
+#include "TransformFunc.h"
+#include "ThreadPool.h"
+#include "BrickStore.h"
+
+#include <helper_math.h>
+#include <QMatrix4x4>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <mutex>
+
+static const float colorTable[DIVERGE_COLOR_TABLE_ITEMS][4] = {
+	DIVERGE_COLOR_TABLE
+};
+
+//number of rays of one row traced together
+static const int packetSize = 8;
+
+//trilinear interpolation of the value and of the gradient, sharing the weights.
+//same as an unnormalized cuda texture with linear filtering and border address mode, i.e., texels outside of the volume are 0
+inline void SampleVolume(const float* values, const float4* grad, int3 size, float3 coord, float &sample, float3 &g)
+{
+	float x = coord.x - 0.5f, y = coord.y - 0.5f, z = coord.z - 0.5f;
+	int x0 = (int)floorf(x), y0 = (int)floorf(y), z0 = (int)floorf(z);
+	float fx = x - x0, fy = y - y0, fz = z - z0;
+
+	sample = 0;
+	g = make_float3(0.0f);
+	for (int c = 0; c < 8; c++) {
+		int xi = x0 + (c & 1), yi = y0 + ((c >> 1) & 1), zi = z0 + (c >> 2);
+		if (xi < 0 || yi < 0 || zi < 0 || xi >= size.x || yi >= size.y || zi >= size.z)
+			continue;
+		float w = ((c & 1) ? fx : 1 - fx) * ((c & 2) ? fy : 1 - fy) * ((c & 4) ? fz : 1 - fz);
+		int idx = (zi * size.y + yi) * size.x + xi;
+		sample += w * values[idx];
+		g += w * make_float3(grad[idx]);
+	}
+}
+
+//samples the volume in memory, with the precomputed gradient
+struct InCoreSampler
+{
+	const float* values;
+	const float4* grad;
+	int3 size;
+	void sample(float3 coord, float &s, float3 &g){ SampleVolume(values, grad, size, coord, s, g); }
+};
+
+//voxels of Volume::values
+struct InMemoryVoxels
+{
+	const float* values;
+	int3 size;
+	float voxel(int x, int y, int z){ return values[(z * size.y + y) * size.x + x]; }
+};
+
+//voxels of the out-of-core volume of a brick store. the last used brick is kept, so one accessor must be used by only one thread
+struct BrickedVoxels
+{
+	BrickStore* store;
+	int lastBrick = -1;
+	BrickStore::BrickData data;
+
+	float voxel(int x, int y, int z)
+	{
+		const int B = BRICK_STORE_BRICK_SIZE;
+		int id = store->brickIndex(make_int3(x / B, y / B, z / B));
+		if (id != lastBrick){
+			data = store->getBrick(id);
+			lastBrick = id;
+		}
+		return (*data)[((z % B) * B + y % B) * B + x % B];
+	}
+};
+
+//samples without a gradient volume: the gradients of the 8 voxels around the sample are computed on the fly,
+//by the same central differences as updateGradient(), so the result is the same as with InCoreSampler
+template <class Voxels>
+struct OnTheFlyGradientSampler
+{
+	Voxels voxels;
+	int3 size;
+
+	void sample(float3 coord, float &s, float3 &g)
+	{
+		float x = coord.x - 0.5f, y = coord.y - 0.5f, z = coord.z - 0.5f;
+		int x0 = (int)floorf(x), y0 = (int)floorf(y), z0 = (int)floorf(z);
+		float fx = x - x0, fy = y - y0, fz = z - z0;
+
+		s = 0;
+		g = make_float3(0.0f);
+		for (int c = 0; c < 8; c++) {
+			int xi = x0 + (c & 1), yi = y0 + ((c >> 1) & 1), zi = z0 + (c >> 2);
+			if (xi < 0 || yi < 0 || zi < 0 || xi >= size.x || yi >= size.y || zi >= size.z)
+				continue;
+			float w = ((c & 1) ? fx : 1 - fx) * ((c & 2) ? fy : 1 - fy) * ((c & 4) ? fz : 1 - fz);
+			s += w * voxels.voxel(xi, yi, zi);
+
+			int x1 = std::max(xi - 2, 0), x2 = std::min(xi + 2, size.x - 1);
+			int y1 = std::max(yi - 2, 0), y2 = std::min(yi + 2, size.y - 1);
+			int z1 = std::max(zi - 2, 0), z2 = std::min(zi + 2, size.z - 1);
+			float3 gv = make_float3(0.0f);
+			if (x2 > x1)
+				gv.x = (voxels.voxel(x2, yi, zi) - voxels.voxel(x1, yi, zi)) / (x2 - x1);
+			if (y2 > y1)
+				gv.y = (voxels.voxel(xi, y2, zi) - voxels.voxel(xi, y1, zi)) / (y2 - y1);
+			if (z2 > z1)
+				gv.z = (voxels.voxel(xi, yi, z2) - voxels.voxel(xi, yi, z1)) / (z2 - z1);
+			g += w * gv;
+		}
+	}
+};
+
+//the matrices below are row major, as copied by QMatrix4x4::copyDataTo()
+inline float4 mulRowMajor(const float m[16], float4 v)
+{
+	return make_float4(
+		m[0] * v.x + m[1] * v.y + m[2] * v.z + m[3] * v.w,
+		m[4] * v.x + m[5] * v.y + m[6] * v.z + m[7] * v.w,
+		m[8] * v.x + m[9] * v.y + m[10] * v.z + m[11] * v.w,
+		m[12] * v.x + m[13] * v.y + m[14] * v.z + m[15] * v.w);
+}
+
+inline unsigned int rgbaFloatToInt(float4 rgba)
+{
+	rgba.x = clamp(rgba.x, 0.0f, 1.0f);
+	rgba.y = clamp(rgba.y, 0.0f, 1.0f);
+	rgba.z = clamp(rgba.z, 0.0f, 1.0f);
+	rgba.w = clamp(rgba.w, 0.0f, 1.0f);
+	return ((unsigned int)(rgba.w * 255) << 24) | ((unsigned int)(rgba.z * 255) << 16) | ((unsigned int)(rgba.y * 255) << 8) | (unsigned int)(rgba.x * 255);
+}
+
+VolumeRendererCPU::VolumeRendererCPU(std::shared_ptr<Volume> _volume)
+{
+	volume = _volume;
+}
+
+void VolumeRendererCPU::setPrefetchTunnel(float3 start, float3 end, float radius)
+{
+	tunnelStart = start;
+	tunnelEnd = end;
+	tunnelRadius = radius;
+}
+
+void VolumeRendererCPU::updateGradient()
+{
+	//same central differences as d_computeGradient()
+	int3 size = volume->size;
+	const float* values = volume->values;
+	gradient.resize(size.x * size.y * size.z);
+	ThreadPool::global().parallelFor(size.z, [&](int z){
+		int indz1 = std::max(z - 2, 0), indz2 = std::min(z + 2, size.z - 1);
+		for (int y = 0; y < size.y; y++){
+			int indy1 = std::max(y - 2, 0), indy2 = std::min(y + 2, size.y - 1);
+			for (int x = 0; x < size.x; x++){
+				int indx1 = std::max(x - 2, 0), indx2 = std::min(x + 2, size.x - 1);
+				float4 g = make_float4(0.0f);
+				if (indx2 > indx1)
+					g.x = (values[(z*size.y + y)*size.x + indx2] - values[(z*size.y + y)*size.x + indx1]) / (indx2 - indx1);
+				if (indy2 > indy1)
+					g.y = (values[(z*size.y + indy2)*size.x + x] - values[(z*size.y + indy1)*size.x + x]) / (indy2 - indy1);
+				if (indz2 > indz1)
+					g.z = (values[(indz2*size.y + y)*size.x + x] - values[(indz1*size.y + y)*size.x + x]) / (indz2 - indz1);
+				gradient[(z*size.y + y)*size.x + x] = g;
+			}
+		}
+	});
+}
+
+//state shared by all the rows of one image
+struct RenderSetup
+{
+	int imageW, imageH;
+	int3 volumeSize;
+	float3 spacing;
+	float3 eyeInLocal;
+	float MVMatrix[16];
+	float MVPMatrix[16];
+	float invMVPMatrix[16];
+	float NMatrix[9];
+	RayCastingParameters r;
+	const float* depthLimit; //may be 0
+	unsigned int* output; //one of output and layer is 0
+	float4* layer;
+	int firstRow; //row of the image stored first in output or layer
+};
+
+//structure of arrays state of the rays of a packet. as members of one struct, the compiler knows the arrays do not overlap
+struct RayPacket
+{
+	float px[packetSize], py[packetSize], pz[packetSize];
+	float stepX[packetSize], stepY[packetSize], stepZ[packetSize];
+	float t[packetSize], tfar[packetSize];
+	float sumR[packetSize], sumG[packetSize], sumB[packetSize], sumA[packetSize];
+	int active[packetSize];
+	bool missed[packetSize];
+	//value and gradient read at the current positions
+	float sample[packetSize], gx[packetSize], gy[packetSize], gz[packetSize];
+};
+
+//shading and compositing of one step of all the rays of a packet, after their samples are read.
+//the loops over the lanes have no branches, the inactive lanes are masked by selects, so the compiler can vectorize them.
+//the math is the one of castRay() in d_render(), with the lighting of phongModel()
+static void ShadePacket(const RenderSetup &s, RayPacket &k)
+{
+	const RayCastingParameters &r = s.r;
+	const float lightingThr = 0.000001;
+	const float3 light_in_eye = make_float3(0.0, 0.0, 200.0);
+	//local copies, which the compiler knows are not changed by the stores to the packet
+	float mv[12], nm[9];
+	std::copy(s.MVMatrix, s.MVMatrix + 12, mv);
+	std::copy(s.NMatrix, s.NMatrix + 9, nm);
+	const float3 spacing = s.spacing;
+	const float la = r.la, ld = r.ld, ls = r.ls, density = r.density;
+	const float p1 = r.transFuncP1, p2 = r.transFuncP2;
+
+	float ccR[packetSize], ccG[packetSize], ccB[packetSize], funcRes[packetSize];
+	for (int l = 0; l < packetSize; l++){
+		float f = (k.sample[l] - p2) / (p1 - p2);
+		f = f < 0.0f ? 0.0f : f;
+		funcRes[l] = f > 1.0f ? 1.0f : f;
+	}
+	if (r.useColor){
+		//diverging color map. the table entry is found by counting the entries below the value, instead of the search of GetColourDiverge() in the kernel.
+		//reading the entries is a gather, which stays scalar without avx2
+		int pos[packetSize];
+		for (int l = 0; l < packetSize; l++){
+			int p = 0;
+			for (int i = 1; i < DIVERGE_COLOR_TABLE_ITEMS - 1; i++)
+				p += colorTable[i][0] < funcRes[l];
+			pos[l] = p;
+		}
+		for (int l = 0; l < packetSize; l++){
+			const float* c0 = colorTable[pos[l]];
+			const float* c1 = colorTable[pos[l] + 1];
+			float ratio = (funcRes[l] - c0[0]) / (c1[0] - c0[0]);
+			ccR[l] = ratio*(c1[1] - c0[1]) + c0[1];
+			ccG[l] = ratio*(c1[2] - c0[2]) + c0[2];
+			ccB[l] = ratio*(c1[3] - c0[3]) + c0[3];
+		}
+	}
+	else{
+		for (int l = 0; l < packetSize; l++)
+			ccR[l] = ccG[l] = ccB[l] = funcRes[l];
+	}
+
+	for (int l = 0; l < packetSize; l++){
+		float nwx = k.gx[l] / spacing.x, nwy = k.gy[l] / spacing.y, nwz = k.gz[l] / spacing.z;
+		float normalLen = sqrtf(nwx * nwx + nwy * nwy + nwz * nwz);
+		bool lit = normalLen > lightingThr;
+
+		//position and normal in eye space
+		float ex = mv[0] * k.px[l] + mv[1] * k.py[l] + mv[2] * k.pz[l] + mv[3];
+		float ey = mv[4] * k.px[l] + mv[5] * k.py[l] + mv[6] * k.pz[l] + mv[7];
+		float ez = mv[8] * k.px[l] + mv[9] * k.py[l] + mv[10] * k.pz[l] + mv[11];
+		float nx = nm[0] * nwx + nm[1] * nwy + nm[2] * nwz;
+		float ny = nm[3] * nwx + nm[4] * nwy + nm[5] * nwz;
+		float nz = nm[6] * nwx + nm[7] * nwy + nm[8] * nwz;
+		float lenN = sqrtf(nx * nx + ny * ny + nz * nz);
+		float invN = 1.0f / (lenN > lightingThr ? lenN : lightingThr);
+		nx *= invN; ny *= invN; nz *= invN;
+
+		//phong lighting, with the light at light_in_eye
+		float sx = light_in_eye.x - ex, sy = light_in_eye.y - ey, sz = light_in_eye.z - ez;
+		float invS = 1.0f / sqrtf(sx * sx + sy * sy + sz * sz);
+		sx *= invS; sy *= invS; sz *= invS;
+		float lenV = sqrtf(ex * ex + ey * ey + ez * ez);
+		float invV = 1.0f / (lenV > lightingThr ? lenV : lightingThr);
+		float vx = -ex * invV, vy = -ey * invV, vz = -ez * invV;
+		float sDotN = sx * nx + sy * ny + sz * nz;
+		//reflect(-s, n)
+		float rx = 2 * sDotN * nx - sx, ry = 2 * sDotN * ny - sy, rz = 2 * sDotN * nz - sz;
+		float rDotV = fabsf(rx * vx + ry * vy + rz * vz);
+		float spec = rDotV * rDotV * rDotV * rDotV * rDotV; //Shininess 5
+		float shade = lit ? la + fabsf(sDotN) * ld + spec * ls : la;
+
+		float alpha = funcRes[l] * density;
+		float w = k.active[l] ? (1.0f - k.sumA[l]) * alpha : 0.0f;
+		// pre-multiplied "over" operator for front-to-back blending
+		k.sumR[l] += ccR[l] * shade * w;
+		k.sumG[l] += ccG[l] * shade * w;
+		k.sumB[l] += ccB[l] * shade * w;
+		k.sumA[l] += w;
+	}
+}
+
+//the rays of a packet march together, in steps of two phases: the samples of the active rays are read one ray after the other,
+//since the volume and brick accessors are scalar gathers, then ShadePacket() shades and composites all the lanes in vectorizable loops
+template <class Sampler>
+static void RenderRow(int y, Sampler &sampler, const RenderSetup &s)
+{
+	const RayCastingParameters &r = s.r;
+	const int imageW = s.imageW, imageH = s.imageH;
+	const float3 spacing = s.spacing;
+	const float3 eyeInLocal = s.eyeInLocal;
+
+	const float opacityThreshold = 0.95f;
+	const float3 boxMin = make_float3(0.0f, 0.0f, 0.0f);
+	const float3 boxMax = spacing*make_float3(s.volumeSize);
+	const float tstep = r.tstep;
+	int packetsPerRow = iDivUp(imageW, packetSize);
+
+	RayPacket k;
+	for (int p = 0; p < packetsPerRow; p++) {
+		int x0 = p * packetSize;
+		int numLanes = std::min(packetSize, imageW - x0);
+
+		//the lanes past the end of the row are inactive
+		for (int l = 0; l < packetSize; l++) {
+			k.active[l] = 0;
+			k.missed[l] = true;
+			k.px[l] = eyeInLocal.x; k.py[l] = eyeInLocal.y; k.pz[l] = eyeInLocal.z;
+			k.stepX[l] = k.stepY[l] = k.stepZ[l] = 0;
+			k.t[l] = k.tfar[l] = 0;
+			k.sumR[l] = k.sumG[l] = k.sumB[l] = 0;
+			k.sumA[l] = 1;
+			k.sample[l] = k.gx[l] = k.gy[l] = k.gz[l] = 0;
+		}
+		int numActive = 0;
+
+		for (int l = 0; l < numLanes; l++) {
+			float u = ((x0 + l + 0.5) / (float)imageW)*2.0f - 1.0f;
+			float v = ((y + 0.5) / (float)imageH)*2.0f - 1.0f;
+			float4 pixelInWorld4 = mulRowMajor(s.invMVPMatrix, make_float4(u, v, -1.0f, 1.0f));
+			float3 pixelInWorld = make_float3(pixelInWorld4) / pixelInWorld4.w;
+			float3 dir = normalize(pixelInWorld - eyeInLocal);
+
+			//intersect the ray with the box of the volume
+			float3 invR = make_float3(1.0f) / dir;
+			float3 tbot = invR * (boxMin - eyeInLocal);
+			float3 ttop = invR * (boxMax - eyeInLocal);
+			float3 tmin = fminf(ttop, tbot);
+			float3 tmax = fmaxf(ttop, tbot);
+			float tnear = fmaxf(fmaxf(tmin.x, tmin.y), fmaxf(tmin.x, tmin.z));
+			float tfar = fminf(fminf(tmax.x, tmax.y), fminf(tmax.x, tmax.z));
+
+			if (tnear < 0.0f) tnear = 0.01f;     // clamp to near plane according to the projection matrix
+
+			k.missed[l] = tfar < tnear;
+			if (k.missed[l])
+				continue;
+			k.active[l] = 1;
+			numActive++;
+			k.sumA[l] = 0;
+			k.t[l] = tnear;
+			k.tfar[l] = tfar;
+			float3 pos = eyeInLocal + dir*tnear;
+			float3 step = dir*tstep;
+			k.px[l] = pos.x; k.py[l] = pos.y; k.pz[l] = pos.z;
+			k.stepX[l] = step.x; k.stepY[l] = step.y; k.stepZ[l] = step.z;
+		}
+
+		// march along the rays from front to back, accumulating color
+		for (int i = 0; i < r.maxSteps && numActive > 0; i++) {
+			for (int l = 0; l < numLanes; l++) {
+				if (!k.active[l])
+					continue;
+				float3 pos = make_float3(k.px[l], k.py[l], k.pz[l]);
+				if (s.depthLimit != 0){
+					//stop at the depth of the opaque layer, which is composited behind the volume
+					float4 posInClip = mulRowMajor(s.MVPMatrix, make_float4(pos, 1.0f));
+					if (posInClip.z / posInClip.w / 2.0f + 0.5f > s.depthLimit[y*imageW + x0 + l]){
+						k.active[l] = 0;
+						continue;
+					}
+				}
+				float3 g;
+				sampler.sample(pos / spacing, k.sample[l], g);
+				k.gx[l] = g.x; k.gy[l] = g.y; k.gz[l] = g.z;
+			}
+
+			ShadePacket(s, k);
+
+			// exit early if opaque, or when leaving the volume
+			numActive = 0;
+			for (int l = 0; l < packetSize; l++) {
+				float tNext = k.t[l] + tstep;
+				int go = k.active[l] & (k.sumA[l] <= opacityThreshold) & (tNext <= k.tfar[l]);
+				k.t[l] = k.active[l] ? tNext : k.t[l];
+				k.px[l] = go ? k.px[l] + k.stepX[l] : k.px[l];
+				k.py[l] = go ? k.py[l] + k.stepY[l] : k.py[l];
+				k.pz[l] = go ? k.pz[l] + k.stepZ[l] : k.pz[l];
+				k.active[l] = go;
+				numActive += go;
+			}
+		}
+
+		for (int l = 0; l < numLanes; l++) {
+			float4 sum = make_float4(k.sumR[l], k.sumG[l], k.sumB[l], k.sumA[l]);
+			if (s.layer != 0){
+				//premultiplied, and transparent where the ray missed the volume
+				s.layer[(y - s.firstRow)*imageW + x0 + l] = k.missed[l] ? make_float4(0.0f) : make_float4(make_float3(sum) * r.brightness, sum.w);
+			}
+			else{
+				//the rays that missed the volume are not scaled by the brightness, as in d_render()
+				s.output[(y - s.firstRow)*imageW + x0 + l] = rgbaFloatToInt(k.missed[l] ? sum : sum * r.brightness);
+			}
+		}
+	}
+}
+
+void VolumeRendererCPU::render(unsigned int* output, int imageW, int imageH, float modelview[16], float projection[16])
+{
+	renderImpl(output, 0, 0, imageW, imageH, modelview, projection);
+}
+
+void VolumeRendererCPU::renderLayer(float4* layer, int imageW, int imageH, float modelview[16], float projection[16], const float* depthLimit)
+{
+	renderImpl(0, layer, depthLimit, imageW, imageH, modelview, projection);
+}
+
+void VolumeRendererCPU::renderImpl(unsigned int* output, float4* layer, const float* depthLimit, int imageW, int imageH, float modelview[16], float projection[16])
+{
+	RenderSetup s;
+	prepare(s, imageW, imageH, modelview, projection);
+	s.output = output;
+	s.layer = layer;
+	s.depthLimit = depthLimit;
+	ThreadPool::global().parallelFor(imageH, [&](int y){
+		renderRow(s, y);
+	});
+}
+
+void VolumeRendererCPU::prepare(RenderSetup &s, int imageW, int imageH, float modelview[16], float projection[16])
+{
+	s.imageW = imageW;
+	s.imageH = imageH;
+	s.output = 0;
+	s.layer = 0;
+	s.depthLimit = 0;
+	s.firstRow = 0;
+	if (brickStore != 0){
+		s.volumeSize = brickStore->GetSize();
+		s.spacing = brickStore->GetSpacing();
+		//the latest prefetch is loaded first, so the frustum is queued after the tunnel
+		if (tunnelRadius > 0)
+			brickStore->prefetchTunnel(tunnelStart, tunnelEnd, tunnelRadius);
+		brickStore->prefetchFrustum(modelview, projection);
+	}
+	else{
+		s.volumeSize = volume->size;
+		s.spacing = volume->spacing;
+		if (useGradientOnTheFly)
+			std::vector<float4>().swap(gradient);
+		else if (gradient.size() != s.volumeSize.x * s.volumeSize.y * s.volumeSize.z)
+			updateGradient();
+	}
+
+	QMatrix4x4 q_modelview = QMatrix4x4(modelview).transposed();
+	QMatrix4x4 q_invMV = q_modelview.inverted();
+	QVector4D q_eye4 = q_invMV.map(QVector4D(0, 0, 0, 1));
+	s.eyeInLocal = make_float3(q_eye4[0], q_eye4[1], q_eye4[2]);
+
+	QMatrix4x4 q_projection = QMatrix4x4(projection).transposed();
+	QMatrix4x4 q_mvp = q_projection*q_modelview;
+	QMatrix4x4 q_invMVP = q_mvp.inverted();
+
+	q_invMVP.copyDataTo(s.invMVPMatrix); //copyDataTo() automatically copy in row-major order
+	q_mvp.copyDataTo(s.MVPMatrix);
+	q_modelview.copyDataTo(s.MVMatrix);
+	q_modelview.normalMatrix().copyDataTo(s.NMatrix);
+	s.r = *rcp;
+}
+
+//only reads the volume and the gradient, so it can run for several images at the same time
+void VolumeRendererCPU::renderRow(const RenderSetup &s, int y)
+{
+	if (brickStore != 0){
+		OnTheFlyGradientSampler<BrickedVoxels> sampler;
+		sampler.voxels.store = brickStore.get();
+		sampler.size = s.volumeSize;
+		RenderRow(y, sampler, s);
+	}
+	else if (useGradientOnTheFly){
+		OnTheFlyGradientSampler<InMemoryVoxels> sampler;
+		sampler.voxels.values = volume->values;
+		sampler.voxels.size = s.volumeSize;
+		sampler.size = s.volumeSize;
+		RenderRow(y, sampler, s);
+	}
+	else{
+		InCoreSampler sampler = { volume->values, gradient.data(), s.volumeSize };
+		RenderRow(y, sampler, s);
+	}
+}
+
+bool VolumeRendererCPU::renderPanorama(const char* filePrefix, int faceSize, float modelview[16], int bandRows)
+{
+	static const char* faceNames[6] = { "front", "back", "left", "right", "up", "down" };
+	//rotation in eye space that turns each face to the viewing direction -z of the eye
+	static const float faceRotations[6][4] = {
+		{ 0, 0, 1, 0 }, { 180, 0, 1, 0 }, { -90, 0, 1, 0 }, { 90, 0, 1, 0 }, { -90, 1, 0, 0 }, { 90, 1, 0, 0 } };
+
+	QMatrix4x4 q_projection;
+	q_projection.perspective(90, 1, 0.1f, 1000.0f);
+	float projection[16];
+	q_projection.transposed().copyDataTo(projection); //column major
+
+	//all faces are set up before any ray is cast, so the gradient is computed once and then only read
+	std::vector<RenderSetup> setups(6);
+	std::vector<std::ofstream> files(6);
+	std::vector<std::mutex> fileMtx(6);
+	for (int f = 0; f < 6; f++){
+		QMatrix4x4 q_face;
+		q_face.rotate(faceRotations[f][0], faceRotations[f][1], faceRotations[f][2], faceRotations[f][3]);
+		float faceModelview[16];
+		(q_face * QMatrix4x4(modelview).transposed()).transposed().copyDataTo(faceModelview);
+		prepare(setups[f], faceSize, faceSize, faceModelview, projection);
+
+		std::string fileName = std::string(filePrefix) + "_" + faceNames[f] + ".raw";
+		files[f].open(fileName.c_str(), std::ios::binary);
+		if (!files[f].is_open()){
+			std::cout << "panorama file " << fileName << " cannot be opened" << std::endl;
+			return false;
+		}
+	}
+
+	//one task per band of rows of a face. each task renders into its own band image and writes it at its place in the file of the face,
+	//so only one band per thread is held in memory
+	bandRows = std::max(bandRows, 1);
+	int bandsPerFace = iDivUp(faceSize, bandRows);
+	ThreadPool::global().parallelFor(6 * bandsPerFace, [&](int task){
+		int f = task / bandsPerFace;
+		int y0 = (task % bandsPerFace) * bandRows;
+		int y1 = std::min(y0 + bandRows, faceSize);
+		std::vector<unsigned int> band((y1 - y0) * faceSize);
+		RenderSetup s = setups[f];
+		s.output = band.data();
+		s.firstRow = y0;
+		for (int y = y0; y < y1; y++)
+			renderRow(s, y);
+
+		std::unique_lock<std::mutex> lock(fileMtx[f]);
+		files[f].seekp((std::streamoff)y0 * faceSize * sizeof(unsigned int));
+		files[f].write((const char*)band.data(), band.size() * sizeof(unsigned int));
+	});
+
+	bool good = true;
+	for (int f = 0; f < 6; f++){
+		files[f].close();
+		good = good && !files[f].fail();
+	}
+	return good;
+}
+
+VolumeMemoryStats VolumeRendererCPU::getMemoryStats()
+{
+	VolumeMemoryStats stats;
+	if (brickStore != 0){
+		stats.volumeBytes = brickStore->GetResidentBytes();
+	}
+	else{
+		stats.volumeBytes = (size_t)volume->size.x * volume->size.y * volume->size.z * sizeof(float);
+	}
+	stats.gradientBytes = gradient.size() * sizeof(float4);
+	return stats;
+}
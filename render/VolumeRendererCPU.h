@@ -0,0 +1,70 @@
+#ifndef VOLUME_RENDERER_CPU_H
+#define VOLUME_RENDERER_CPU_H
+
+#include <memory>
+#include <vector>
+#include <vector_types.h>
+#include "VolumeMemoryStats.h"
+
+class Volume;
+class BrickStore;
+struct RayCastingParameters;
+struct RenderSetup;
+
+/*
+cpu ray caster over Volume::values, for headless rendering (thumbnails, batch animations) on nodes without cuda or opengl.
+it follows d_render() of VolumeRenderableCUDAKernel.cu: the same transfer function, diverging color map, phong lighting from the gradient,
+density, tstep / maxSteps and early termination at 0.95 opacity. the samples are trilinearly interpolated with the border rule of the cuda textures.
+rays are traced in packets of neighboring pixels of one row, stored as structure of arrays, and the rows are distributed on the cpu thread pool.
+at each step the samples of the packet are read one ray after the other, then the shading and compositing of all the rays are branch free loops
+over the lanes, which the compiler vectorizes (see render/CMakeLists.txt for the flags gcc needs).
+when a brick store is set, the volume is read from it instead of from Volume::values, loading the bricks on demand.
+the gradient is then computed on the fly, which can also be chosen for an in-memory volume to save the float4 gradient (4x the memory of the values)
+*/
+class VolumeRendererCPU
+{
+public:
+	VolumeRendererCPU(std::shared_ptr<Volume> _volume);
+
+	std::shared_ptr<RayCastingParameters> rcp;
+	//out-of-core volume to render instead of the values of the volume. may be 0
+	std::shared_ptr<BrickStore> brickStore;
+	//compute the gradient at each sample instead of keeping the gradient volume. the image is the same
+	bool useGradientOnTheFly = false;
+
+	//tunnel of a deformation in local coordinates, e.g. from PositionBasedDeformProcessor::getTunnelStart(), getTunnelEnd() and getTunnelExtent().
+	//with a brick store, each image also queues the bricks along the tunnel and ahead of it, where the camera moves next,
+	//before the bricks of the view frustum, which are loaded first. a radius of 0 (the default) turns it off
+	void setPrefetchTunnel(float3 start, float3 end, float radius);
+
+	VolumeMemoryStats getMemoryStats();
+
+	//modelview and projection are column major, as given to Renderable::draw().
+	//output holds imageW*imageH pixels, packed as RGBA8 in the same way as the pixel buffer of VolumeRender_render()
+	void render(unsigned int* output, int imageW, int imageH, float modelview[16], float projection[16]);
+	//renders a layer for ImageCompositor: premultiplied rgba, with the brightness applied and 0 where the rays miss the volume.
+	//depthLimit (may be 0) holds the window depth of an opaque layer for each pixel, at which the rays stop
+	void renderLayer(float4* layer, int imageW, int imageH, float modelview[16], float projection[16], const float* depthLimit = 0);
+
+	//offline 360 degree panorama from the eye of modelview. the six cube faces (front, back, left, right, up, down of the eye) have a 90 degree field of view,
+	//and are written as faceSize*faceSize RGBA8 raw files <filePrefix>_<face>.raw, first row at the bottom as in render().
+	//the faces are rendered at the same time, in bands of bandRows rows which are written to the files as soon as they are done,
+	//so the memory used does not grow with faceSize. returns false if a file cannot be written
+	bool renderPanorama(const char* filePrefix, int faceSize, float modelview[16], int bandRows = 16);
+
+	//recompute the gradient after the volume values changed. render() computes it once if it was never computed
+	void updateGradient();
+
+	std::shared_ptr<Volume> getVolume(){ return volume; }
+
+private:
+	std::shared_ptr<Volume> volume;
+	void renderImpl(unsigned int* output, float4* layer, const float* depthLimit, int imageW, int imageH, float modelview[16], float projection[16]);
+	void prepare(RenderSetup &s, int imageW, int imageH, float modelview[16], float projection[16]);
+	void renderRow(const RenderSetup &s, int y);
+	std::vector<float4> gradient;
+	float3 tunnelStart, tunnelEnd;
+	float tunnelRadius = 0;
+};
+
+#endif //VOLUME_RENDERER_CPU_H
@@ -0,0 +1,140 @@
+#include "SkeletonViewGenerator.h"
+#include "DistanceTransform.h"
+#include "ThreadPool.h"
+#include "Particle.h"
+#include "Volume.h"
+
+#include <helper_math.h>
+#include <algorithm>
+#include <map>
+#include <cfloat>
+#include <iostream>
+#include <cmath>
+
+std::vector<std::shared_ptr<Particle>> SkeletonViewGenerator::generate(std::shared_ptr<Volume> v)
+{
+	return generate(v->values, v->size, v->spacing);
+}
+
+std::vector<std::shared_ptr<Particle>> SkeletonViewGenerator::generate(const float* values, int3 size, float3 spacing)
+{
+	const int nx = size.x, ny = size.y, nz = size.z;
+	const size_t n = (size_t)nx * ny * nz;
+	auto idx = [&](int i, int j, int k){ return ((size_t)k * ny + j) * nx + i; };
+
+	//distance of the free space to the data
+	std::vector<char> dense(n);
+	ThreadPool::global().parallelFor(nz, [&](int k){
+		for (size_t p = idx(0, 0, k); p < idx(0, 0, k + 1); p++)
+			dense[p] = values[p] >= densityThr;
+	});
+	std::vector<float> dist(n);
+	DistanceTransform::computeSquared(dense.data(), size, spacing, dist.data());
+
+	//ridge voxels: the distance is a max along at least minRidgeDirections of the 13 directions to the 26 neighbors, not lower than either
+	//neighbor and higher than one of them. along a tube only its own direction is not a max, while a voxel off the center is a max only along
+	//the directions inside the plane through the axis. a voxel outside of the volume counts as equal, so that the faces of the volume do not become ridges
+	const int3 dirs[13] = { { 1, 0, 0 }, { 0, 1, 0 }, { 0, 0, 1 }, { 1, 1, 0 }, { 1, -1, 0 }, { 1, 0, 1 }, { 1, 0, -1 },
+	{ 0, 1, 1 }, { 0, 1, -1 }, { 1, 1, 1 }, { 1, 1, -1 }, { 1, -1, 1 }, { 1, -1, -1 } };
+	const int minRidgeDirections = 7;
+	const float minSqRadius = minRadius * minRadius;
+	std::vector<char> ridge(n, 0);
+	ThreadPool::global().parallelFor(nz, [&](int k){
+		for (int j = 0; j < ny; j++){
+			for (int i = 0; i < nx; i++){
+				size_t p = idx(i, j, k);
+				float d = dist[p];
+				if (dense[p] || d < minSqRadius || d == FLT_MAX)
+					continue;
+				int numMax = 0;
+				for (int e = 0; e < 13; e++){
+					float side[2];
+					for (int sgn = 0; sgn < 2; sgn++){
+						int3 q = make_int3(i, j, k) + (sgn ? -1 : 1) * dirs[e];
+						bool inside = q.x >= 0 && q.y >= 0 && q.z >= 0 && q.x < nx && q.y < ny && q.z < nz;
+						side[sgn] = inside ? dist[idx(q.x, q.y, q.z)] : d;
+					}
+					numMax += side[0] <= d && side[1] <= d && (side[0] < d || side[1] < d);
+				}
+				ridge[p] = numMax >= minRidgeDirections;
+			}
+		}
+	});
+
+	//branches, by a flood fill over the ridge voxels
+	std::vector<std::vector<size_t>> branches;
+	std::vector<size_t> stack;
+	for (size_t p = 0; p < n; p++){
+		if (!ridge[p])
+			continue;
+		std::vector<size_t> branch;
+		ridge[p] = 0;
+		stack.push_back(p);
+		while (!stack.empty()){
+			size_t q = stack.back();
+			stack.pop_back();
+			branch.push_back(q);
+			int i = q % nx, j = (q / nx) % ny, k = q / ((size_t)nx * ny);
+			for (int c = std::max(k - 1, 0); c <= std::min(k + 1, nz - 1); c++){
+				for (int b = std::max(j - 1, 0); b <= std::min(j + 1, ny - 1); b++){
+					for (int a = std::max(i - 1, 0); a <= std::min(i + 1, nx - 1); a++){
+						size_t r = idx(a, b, c);
+						if (ridge[r]){
+							ridge[r] = 0;
+							stack.push_back(r);
+						}
+					}
+				}
+			}
+		}
+		if (branch.size() >= minBranchVoxels)
+			branches.push_back(branch);
+	}
+	std::sort(branches.begin(), branches.end(), [](const std::vector<size_t> &a, const std::vector<size_t> &b){ return a.size() > b.size(); });
+
+	//views are picked from the voxels of a branch farthest from the data first, skipping the voxels closer than sampleStep to a picked one.
+	//the picked views are kept in cells of sampleStep voxels, so only the 27 cells around a voxel are checked
+	const int step = std::max(sampleStep, 1);
+	auto cellOf = [&](int3 v){ return idx(v.x / step, v.y / step, v.z / step); };
+	auto voxelOf = [&](size_t q){ return make_int3(q % nx, (q / nx) % ny, q / ((size_t)nx * ny)); };
+	std::vector<std::shared_ptr<Particle>> res;
+	for (int bi = 0; bi < branches.size(); bi++){
+		std::vector<size_t> &branch = branches[bi];
+		std::stable_sort(branch.begin(), branch.end(), [&](size_t a, size_t b){ return dist[a] > dist[b]; });
+		std::map<size_t, std::vector<int3>> picked;
+		std::vector<float4> pos;
+		std::vector<float> val;
+		for (size_t q : branch){
+			int3 v = voxelOf(q);
+			bool nearPicked = false;
+			for (int c = -1; c <= 1 && !nearPicked; c++){
+				for (int b = -1; b <= 1 && !nearPicked; b++){
+					for (int a = -1; a <= 1 && !nearPicked; a++){
+						int3 cell = make_int3(v.x / step + a, v.y / step + b, v.z / step + c);
+						if (cell.x < 0 || cell.y < 0 || cell.z < 0)
+							continue;
+						auto it = picked.find(idx(cell.x, cell.y, cell.z));
+						if (it == picked.end())
+							continue;
+						for (int3 w : it->second){
+							int3 dv = w - v;
+							if (dv.x * dv.x + dv.y * dv.y + dv.z * dv.z < step * step){
+								nearPicked = true;
+								break;
+							}
+						}
+					}
+				}
+			}
+			if (nearPicked)
+				continue;
+			picked[cellOf(v)].push_back(v);
+			pos.push_back(make_float4((make_float3(v) + 0.5f) * spacing, 1.0f));
+			val.push_back(sqrtf(dist[q]));
+		}
+		res.push_back(std::make_shared<Particle>(pos, val));
+	}
+
+	std::cout << "skeleton views: " << res.size() << " branches" << std::endl;
+	return res;
+}
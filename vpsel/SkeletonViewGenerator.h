@@ -0,0 +1,31 @@
+#ifndef SKELETON_VIEW_GENERATOR_H
+#define SKELETON_VIEW_GENERATOR_H
+
+#include <memory>
+#include <vector>
+#include <vector_types.h>
+
+class Particle;
+class Volume;
+
+/*
+candidate views for ViewpointEvaluator::setViews(), from the curve skeleton of the free space of the volume, i.e. of the voxels below densityThr.
+the distance of every free voxel to the nearest dense voxel is computed by DistanceTransform. its ridge voxels, the ones that are a local max
+of the distance along most of the 13 directions to their neighbors, are grouped into 26-connected branches, and each branch gives one Particle of views.
+the views are at the centers of the voxels, in local coordinates, with the distance to the data as their value.
+generating again from the deformed values gives the views after a deformation
+*/
+class SkeletonViewGenerator
+{
+public:
+	float densityThr = 0.1; //voxels with values below it are free space
+	float minRadius = 2.0; //in local units. free space thinner than it has no views
+	int minBranchVoxels = 10; //smaller branches are dropped as noise
+	int sampleStep = 4; //in voxels, min distance between the views of a branch. the voxels farthest from the data are taken first
+
+	//the branches, largest first
+	std::vector<std::shared_ptr<Particle>> generate(const float* values, int3 size, float3 spacing);
+	std::vector<std::shared_ptr<Particle>> generate(std::shared_ptr<Volume> v);
+};
+
+#endif //SKELETON_VIEW_GENERATOR_H
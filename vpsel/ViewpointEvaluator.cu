@@ -2,6 +2,9 @@
 #include "ViewpointEvaluator.h"
 #include "TransformFunc.h"
 #include "Particle.h"
+#include "ThreadPool.h"
+#include <algorithm>
+#include <fstream>
 #include <thrust/device_vector.h>
 #include <thrust/count.h>
 #include <thrust/execution_policy.h>
@@ -9,20 +12,20 @@
 texture<float, 3, cudaReadModeElementType>  volumeVal;
 texture<unsigned short, 3, cudaReadModeElementType>  volumeLabel;
 
-texture<float4, 3, cudaReadModeElementType>  gradientTexOri;
-texture<float4, 3, cudaReadModeElementType>  gradientTexFiltered;
+//the bilateral filtered volume of Tao09Detail
+texture<float, 3, cudaReadModeElementType>  volumeValFiltered;
+
+//the normals of Tao09Detail are computed at each sample, by central differences over 2 voxels on both sides of the interpolated field,
+//instead of keeping two float4 gradient volumes (8 times the memory of the values). as in VolumeRenderableCUDAKernel.cu,
+//inside the volume this is the same as interpolating the gradient of Volume::computeGradient()
+#define CENTRAL_DIFFERENCE(tex, c) (make_float3( \
+	tex3D(tex, c.x + 2.0f, c.y, c.z) - tex3D(tex, c.x - 2.0f, c.y, c.z), \
+	tex3D(tex, c.x, c.y + 2.0f, c.z) - tex3D(tex, c.x, c.y - 2.0f, c.z), \
+	tex3D(tex, c.x, c.y, c.z + 2.0f) - tex3D(tex, c.x, c.y, c.z - 2.0f)) * 0.25f)
 
 ViewpointEvaluator::ViewpointEvaluator(std::shared_ptr<RayCastingParameters> _r, std::shared_ptr<Volume> v)
 {
 	rcp = std::make_shared<RayCastingParameters>();
-	rcp->la = _r->la, rcp->ld = _r->ld, rcp->ls = _r->ls;
-	rcp->transFuncP1 = _r->transFuncP1, rcp->transFuncP2 = _r->transFuncP2;
-	rcp->density = _r->density;
-	rcp->maxSteps = _r->maxSteps;
-	rcp->tstep = _r->tstep; rcp->brightness = _r->brightness;
-	rcp->useColor = _r->useColor;
-
-
 	volume = v;
 
 	volumeVal.normalized = false;
@@ -31,22 +34,56 @@ ViewpointEvaluator::ViewpointEvaluator(std::shared_ptr<RayCastingParameters> _r,
 	volumeVal.addressMode[1] = cudaAddressModeBorder;
 	volumeVal.addressMode[2] = cudaAddressModeBorder;
 
-	GPU_setConstants(&(rcp->transFuncP1), &(rcp->transFuncP2), &(rcp->la), &(rcp->ld), &(rcp->ls), &(volume->spacing));
+	setRayCastingParameters(_r);
 	GPU_setVolume(&(volume->volumeCuda));
 
-	rcp->tstep = 1.0; //generally don't need to sample beyond each voxel
-
 	cudaMalloc(&d_hist, sizeof(float)*nbins);
 
-	cubeFaceHists.resize(6);
-	for (int i = 0; i < 6; i++){
-		cudaMalloc(&cubeFaceHists[i], sizeof(float)*nbins);
-	}
+	cudaMalloc(&d_cubeHists, sizeof(float)* 6 * nbins);
+	cudaMalloc(&d_cubeEntropies, sizeof(float)* 6);
 
 	cubeInfo.resize(6);
 
 	sdkCreateTimer(&timer);
+	sdkCreateTimer(&castTimer);
+
+}
+
+void ViewpointEvaluator::setRayCastingParameters(std::shared_ptr<RayCastingParameters> _r)
+{
+	rcp->la = _r->la, rcp->ld = _r->ld, rcp->ls = _r->ls;
+	rcp->transFuncP1 = _r->transFuncP1, rcp->transFuncP2 = _r->transFuncP2;
+	rcp->density = _r->density;
+	rcp->maxSteps = _r->maxSteps;
+	rcp->brightness = _r->brightness;
+	rcp->useColor = _r->useColor;
+	rcp->tstep = 1.0; //generally don't need to sample beyond each voxel
 
+	GPU_setConstants(&(rcp->transFuncP1), &(rcp->transFuncP2), &(rcp->la), &(rcp->ld), &(rcp->ls), &(volume->spacing));
+}
+
+bool ViewpointEvaluator::EvaluationState::operator==(const EvaluationState &s) const
+{
+	return volumeVersion == s.volumeVersion
+		&& volumeSize.x == s.volumeSize.x && volumeSize.y == s.volumeSize.y && volumeSize.z == s.volumeSize.z
+		&& spacing.x == s.spacing.x && spacing.y == s.spacing.y && spacing.z == s.spacing.z
+		&& transFuncP1 == s.transFuncP1 && transFuncP2 == s.transFuncP2 && density == s.density && tstep == s.tstep
+		&& maxSteps == s.maxSteps && maxLabel == s.maxLabel;
+}
+
+ViewpointEvaluator::EvaluationState ViewpointEvaluator::currentEvaluationState()
+{
+	EvaluationState s;
+	s.volumeVersion = volume->volumeCuda.contentVersion;
+	s.volumeSize = volume->size;
+	s.spacing = volume->spacing;
+	s.transFuncP1 = rcp->transFuncP1;
+	s.transFuncP2 = rcp->transFuncP2;
+	s.density = rcp->density;
+	s.tstep = rcp->tstep;
+	s.maxSteps = rcp->maxSteps;
+	s.maxLabel = maxLabel;
+	return s;
 }
 
 void ViewpointEvaluator::createOneParticleFormOfViewSamples()
@@ -89,7 +126,9 @@ void ViewpointEvaluator::setLabel(std::shared_ptr<VolumeCUDA> v)
 
 	checkCudaErrors(cudaBindTextureToArray(volumeLabel, v->content, v->channelDesc));
 
+	labelVolume = v;
 	labelBeenSet = true;
+	labelBricksDirty = true;
 }
 
 void ViewpointEvaluator::initLabelVisibility()
@@ -132,47 +171,166 @@ void ViewpointEvaluator::initTao09Detail()
 	cudaMalloc(&d_r, sizeof(float)*numSphereSample);
 	
 	if (!noBilat){
-		float* gradient = 0;
-		volume->computeGradient(gradient);
-		volumeGradient.VolumeCUDA_deinit();
-		volumeGradient.VolumeCUDA_init(volume->size, gradient, 0, 4);
-		delete[] gradient;
-
-		float* bilateralVolumeRes = new float[volume->size.x*volume->size.y*volume->size.z];
-		FILE * fp = fopen((dataFolder + "/bilat.raw").c_str(), "rb");
-		fread(bilateralVolumeRes, sizeof(float), volume->size.x*volume->size.y*volume->size.z, fp);
-		fclose(fp);
-
-		float* bGradient = 0;
-		volume->computeGradient(bilateralVolumeRes, volume->size, bGradient);
-		filteredVolumeGradient.VolumeCUDA_deinit();
-		filteredVolumeGradient.VolumeCUDA_init(volume->size, bGradient, 0, 4);
-		delete[] bGradient;
+		float* bilateralVolumeRes = getBilateralVolume();
+		filteredVolume.VolumeCUDA_deinit();
+		filteredVolume.VolumeCUDA_init(volume->size, bilateralVolumeRes, 0, 1);
 		delete[] bilateralVolumeRes;
 	}
 
-	gradientTexOri.normalized = false;
-	gradientTexOri.filterMode = cudaFilterModeLinear;
-	gradientTexOri.addressMode[0] = cudaAddressModeBorder;
-	gradientTexOri.addressMode[1] = cudaAddressModeBorder;
-	gradientTexOri.addressMode[2] = cudaAddressModeBorder;
-	
-	gradientTexFiltered.normalized = false;
-	gradientTexFiltered.filterMode = cudaFilterModeLinear;
-	gradientTexFiltered.addressMode[0] = cudaAddressModeBorder;
-	gradientTexFiltered.addressMode[1] = cudaAddressModeBorder;
-	gradientTexFiltered.addressMode[2] = cudaAddressModeBorder;
+	volumeValFiltered.normalized = false;
+	volumeValFiltered.filterMode = cudaFilterModeLinear;
+	volumeValFiltered.addressMode[0] = cudaAddressModeBorder;
+	volumeValFiltered.addressMode[1] = cudaAddressModeBorder;
+	volumeValFiltered.addressMode[2] = cudaAddressModeBorder;
 	
 	Tao09DetailInited = true;
 	JS06SphereInited = false;
 	LabelVisibilityInited = false;
 }
 
-void ViewpointEvaluator::compute_UniformSampling(VPMethod m)
+//fnv-1a over 32 bit words
+struct Fnv1aHash
+{
+	unsigned long long h = 14695981039346656037ULL;
+	void add(unsigned int w){
+		h ^= w;
+		h *= 1099511628211ULL;
+	}
+	void add(float f){ add(*(const unsigned int*)&f); }
+	void add(int3 v){ add((unsigned int)v.x); add((unsigned int)v.y); add((unsigned int)v.z); }
+	void add(float3 v){ add(v.x); add(v.y); add(v.z); }
+	void addWords(const void* data, size_t numWords){
+		const unsigned int* words = (const unsigned int*)data;
+		for (size_t i = 0; i < numWords; i++)
+			add(words[i]);
+	}
+};
+
+//changed whenever Volume::computeBilateralFiltering() gives other results, so the files of the old filter are not read
+static const unsigned int bilateralFilterVersion = 2;
+
+//over the filter version, the size, the filter parameters and the voxel values
+static unsigned long long hashBilateralInput(const Volume* v, float sigs, float sigr)
+{
+	Fnv1aHash hash;
+	hash.add(bilateralFilterVersion);
+	hash.add(v->size);
+	hash.add(sigs); hash.add(sigr);
+	hash.addWords(v->values, (size_t)v->size.x*v->size.y*v->size.z);
+	return hash.h;
+}
+
+//the bilateral filtered volume, computed in process and cached in dataFolder under the hash of its input, so it is only computed once per volume
+float* ViewpointEvaluator::getBilateralVolume()
+{
+	size_t n = (size_t)volume->size.x*volume->size.y*volume->size.z;
+	float sigs = 2 * bilateralSigmaS * bilateralSigmaS, sigr = 2 * bilateralSigmaR * bilateralSigmaR;
+	char hashStr[32];
+	sprintf(hashStr, "%016llx", hashBilateralInput(volume.get(), sigs, sigr));
+	std::string cacheFile = (dataFolder.empty() ? std::string("") : dataFolder + "/") + "bilat_" + hashStr + ".raw";
+
+	float* bilateralVolumeRes = new float[n];
+	FILE * fp = fopen(cacheFile.c_str(), "rb");
+	if (fp != 0){
+		size_t numRead = fread(bilateralVolumeRes, sizeof(float), n, fp);
+		fclose(fp);
+		if (numRead == n)
+			return bilateralVolumeRes;
+	}
+	delete[] bilateralVolumeRes;
+
+	std::cout << "computing the bilateral filtered volume" << std::endl;
+	volume->computeBilateralFiltering(bilateralVolumeRes, sigs, sigr);
+	fp = fopen(cacheFile.c_str(), "wb");
+	if (fp != 0){
+		fwrite(bilateralVolumeRes, sizeof(float), n, fp);
+		fclose(fp);
+	}
+	else{
+		std::cout << "cannot write the bilateral cache file " << cacheFile << std::endl;
+	}
+	return bilateralVolumeRes;
+}
+
+//gradients of the volume and of its bilateral filtered version, as float4 tuples
+void ViewpointEvaluator::computeTao09Gradients(float* &gradient, float* &bGradient)
+{
+	volume->computeGradient(gradient);
+
+	float* bilateralVolumeRes = getBilateralVolume();
+	volume->computeGradient(bilateralVolumeRes, volume->size, bGradient);
+	delete[] bilateralVolumeRes;
+}
+
+//layout of the checkpoint file: the header, one flag per z slice of resVol, then the values of resVol
+struct UniformSamplingCheckpointHeader
+{
+	int magic;
+	int3 sampleSize;
+	int method;
+	unsigned long long inputHash; //see hashUniformSamplingInput()
+};
+static const int uniformSamplingCheckpointMagic = 0x56504632;
+
+//everything the values of resVol depend on: the volume, the label volume for LabelVisibility, the filter of Tao09Detail,
+//the ray casting parameters, the sphere samples and the eye positions of the grid
+unsigned long long ViewpointEvaluator::hashUniformSamplingInput(VPMethod m)
+{
+	Fnv1aHash hash;
+	hash.add(volume->size);
+	hash.add(volume->spacing);
+	hash.addWords(volume->values, (size_t)volume->size.x*volume->size.y*volume->size.z);
+	if (m == LabelVisibility){
+		hash.add((unsigned int)maxLabel);
+		size_t n = (size_t)volume->size.x*volume->size.y*volume->size.z;
+		if (labelValues != 0){
+			for (size_t i = 0; i < n; i++)
+				hash.add((unsigned int)labelValues[i]);
+		}
+		else if (labelVolume != 0){
+			//no host copy, so the device label volume is read back. 16 bit labels give the same hash as their host copy
+			cudaExtent size = labelVolume->size;
+			const cudaChannelFormatDesc &desc = labelVolume->channelDesc;
+			size_t voxelBytes = (desc.x + desc.y + desc.z + desc.w) / 8;
+			size_t numBytes = voxelBytes * size.width * size.height * size.depth;
+			std::vector<unsigned int> words((numBytes + sizeof(unsigned int) - 1) / sizeof(unsigned int), 0);
+			cudaMemcpy3DParms copyParams = { 0 };
+			copyParams.srcArray = labelVolume->content;
+			copyParams.dstPtr = make_cudaPitchedPtr(words.data(), size.width * voxelBytes, size.width, size.height);
+			copyParams.extent = size;
+			copyParams.kind = cudaMemcpyDeviceToHost;
+			checkCudaErrors(cudaMemcpy3D(&copyParams));
+			if (voxelBytes == sizeof(unsigned short) && numBytes == n * voxelBytes){
+				const unsigned short* labels = (const unsigned short*)words.data();
+				for (size_t i = 0; i < n; i++)
+					hash.add((unsigned int)labels[i]);
+			}
+			else{
+				hash.addWords(words.data(), words.size());
+			}
+		}
+	}
+	if (m == Tao09Detail){
+		hash.add(bilateralFilterVersion);
+		hash.add(bilateralSigmaS); hash.add(bilateralSigmaR);
+	}
+	hash.add(rcp->transFuncP1); hash.add(rcp->transFuncP2); hash.add(rcp->density);
+	hash.add(rcp->tstep); hash.add((unsigned int)rcp->maxSteps);
+	hash.add((unsigned int)nbins); hash.add(useHist ? 1u : 0u);
+	hash.add((unsigned int)numSphereSample);
+	hash.add(resVol->size);
+	hash.add(resVol->dataOrigin);
+	hash.add(resVol->spacing);
+	return hash.h;
+}
+
+bool ViewpointEvaluator::compute_UniformSampling(VPMethod m)
 {
 	maxEntropy = -999;
 	int3 sampleSize = resVol->size;
 	if (m == BS05){
+		cancelRequested = false;
+		return true;
 	}
 	else if (m == JS06Sphere){
 		//initJS06Sphere();
@@ -190,7 +348,102 @@ void ViewpointEvaluator::compute_UniformSampling(VPMethod m)
 		//		}
 		//	}
 		//}
+		cancelRequested = false;
+		return true;
+	}
+	if (m == Tao09Detail && noBilat){
+		cancelRequested = false;
+		return true;
+	}
+
+	//resume from the checkpoint if it was written for the same sampling of the same input
+	size_t sliceSize = (size_t)sampleSize.x * sampleSize.y;
+	std::vector<char> sliceDone(sampleSize.z, 0);
+	setSpherePoints();
+	UniformSamplingCheckpointHeader header = { uniformSamplingCheckpointMagic, sampleSize, (int)m, 0 };
+	std::fstream checkpoint;
+	if (!checkpointFile.empty()){
+		header.inputHash = hashUniformSamplingInput(m);
+		checkpoint.open(checkpointFile.c_str(), std::ios::in | std::ios::out | std::ios::binary);
+		UniformSamplingCheckpointHeader old;
+		bool resume = checkpoint.is_open() && checkpoint.read((char*)&old, sizeof(old))
+			&& old.magic == header.magic && old.method == header.method && old.inputHash == header.inputHash
+			&& old.sampleSize.x == sampleSize.x && old.sampleSize.y == sampleSize.y && old.sampleSize.z == sampleSize.z
+			&& checkpoint.read(&(sliceDone[0]), sampleSize.z)
+			&& checkpoint.read((char*)resVol->values, sizeof(float) * sliceSize * sampleSize.z);
+		if (!resume){
+			checkpoint.close();
+			sliceDone.assign(sampleSize.z, 0);
+			checkpoint.open(checkpointFile.c_str(), std::ios::in | std::ios::out | std::ios::binary | std::ios::trunc);
+			checkpoint.write((const char*)&header, sizeof(header));
+			checkpoint.write(&(sliceDone[0]), sampleSize.z);
+			checkpoint.write((const char*)resVol->values, sizeof(float) * sliceSize * sampleSize.z);
+			checkpoint.flush();
+		}
+		else{
+			std::cout << "resuming the viewpoint field from " << checkpointFile << " with " << std::count(sliceDone.begin(), sliceDone.end(), 1) << " of " << sampleSize.z << " slices done" << std::endl;
+		}
+	}
+
+	//one batch per slab of z slices, evaluated by computeSphereEntropies() on the gpu or on the cpu thread pool
+	int slab = std::max(slabSlices, 1);
+	for (int k0 = 0; k0 < sampleSize.z; k0 += slab){
+		if (cancelRequested.exchange(false)){
+			std::cout << "viewpoint field computation cancelled" << std::endl;
+			return false;
+		}
+		int k1 = std::min(k0 + slab, sampleSize.z);
+		std::vector<int> slices;
+		std::vector<float3> eyes;
+		for (int k = k0; k < k1; k++){
+			if (sliceDone[k])
+				continue;
+			slices.push_back(k);
+			for (int j = 0; j < sampleSize.y; j++){
+				for (int i = 0; i < sampleSize.x; i++){
+					eyes.push_back(indToLocal(i, j, k));
+				}
+			}
+		}
+		if (slices.size() == 0)
+			continue;
+
+		std::vector<float> entropies;
+		computeSphereEntropies(eyes, m, entropies);
+		for (int s = 0; s < slices.size(); s++){
+			std::copy(entropies.begin() + s * sliceSize, entropies.begin() + (s + 1) * sliceSize, resVol->values + slices[s] * sliceSize);
+		}
+
+		if (checkpoint.is_open()){
+			//the values are written before their flags, so an interrupted write never marks a slice as done
+			for (int s = 0; s < slices.size(); s++){
+				checkpoint.seekp(sizeof(header) + sampleSize.z + sizeof(float) * sliceSize * slices[s]);
+				checkpoint.write((const char*)(resVol->values + slices[s] * sliceSize), sizeof(float) * sliceSize);
+			}
+			checkpoint.flush();
+			for (int s = 0; s < slices.size(); s++){
+				sliceDone[slices[s]] = 1;
+				checkpoint.seekp(sizeof(header) + slices[s]);
+				checkpoint.write(&(sliceDone[slices[s]]), 1);
+			}
+			checkpoint.flush();
+		}
+		std::cout << "viewpoint field: slices " << k0 << " to " << k1 - 1 << " of " << sampleSize.z << " done" << std::endl;
 	}
+
+	for (int k = 0; k < sampleSize.z; k++){
+		for (int j = 0; j < sampleSize.y; j++){
+			for (int i = 0; i < sampleSize.x; i++){
+				float entroRes = resVol->values[k*sampleSize.y*sampleSize.x + j*sampleSize.x + i];
+				if (entroRes>maxEntropy){
+					maxEntropy = entroRes;
+					optimalEyeInLocal = indToLocal(i, j, k);
+				}
+			}
+		}
+	}
+	cancelRequested = false;
+	return true;
 }
 
 void ViewpointEvaluator::compute_NextSkelSampling(VPMethod m) // !!!NOTE !!! currently only work for m==Tao09
@@ -212,6 +465,9 @@ void ViewpointEvaluator::compute_SkelSampling(VPMethod m)
 
 	sdkResetTimer(&timer);
 	sdkStartTimer(&timer);
+	sdkResetTimer(&castTimer);
+	numRaysCast = 0;
+	castSeconds = 0;
 
 	maxEntropy = -999;
 	//int3 sampleSize = resVol->size;
@@ -229,53 +485,287 @@ void ViewpointEvaluator::compute_SkelSampling(VPMethod m)
 			}
 		}
 	}
-	else if (m == LabelVisibility){
-		initLabelVisibility();
-		for (int i = 0; i < skelViews.size(); i++){
-			for (int j = 0; j < skelViews[i]->numParticles; j++){
-				float3 eyeInLocal = make_float3(skelViews[i]->pos[j]);
-				float entroRes = computeLocalSphereEntropy(eyeInLocal, LabelVisibility);
-				if (entroRes>maxEntropy){
-					maxEntropy = entroRes;
-					optimalEyeInLocal = eyeInLocal;
-					lastSkelOfOptimal = i;
+	else if (m == LabelVisibility || m == Tao09Detail){
+		if (m == Tao09Detail && noBilat){
+			return;
+		}
+		skelSearched = true;
+		skelSearchMethod = m;
+
+		if (useHierarchicalSearch){
+			hierarchicalSkelSearch(m);
+		}
+		else{
+			//all the candidate eyes are evaluated in one batch
+			std::vector<float3> eyes;
+			std::vector<int> eyeSkel;
+			for (int i = 0; i < skelViews.size(); i++){
+				if (m == Tao09Detail && !skelViewsConsidered[i])
+					continue;
+				for (int j = 0; j < skelViews[i]->numParticles; j++){
+					eyes.push_back(make_float3(skelViews[i]->pos[j]));
+					eyeSkel.push_back(i);
+				}
+			}
+			std::vector<float> entropies;
+			computeSphereEntropies(eyes, m, entropies);
+			for (int e = 0; e < eyes.size(); e++){
+				if (entropies[e]>maxEntropy){
+					maxEntropy = entropies[e];
+					optimalEyeInLocal = eyes[e];
+					lastSkelOfOptimal = eyeSkel[e];
 				}
 			}
 		}
 	}
-	else if (m == Tao09Detail){
-		if (noBilat){
-			return;
-		}
 
-		initTao09Detail();
+	sdkStopTimer(&timer);
+
+	float timeCost = sdkGetAverageTimerValue(&timer) / 1000.f;
+	std::cout << "time cost for computing the global optimal: " << timeCost <<std::endl;
+	if (numRaysCast > 0){
+		std::cout << "sphere rays cast: " << numRaysCast << ", " << GetRaysPerSecond() << " rays/s";
+		if (m == LabelVisibility){
+			//useLabelBricks set to false gives the rays/s to compare with
+			std::cout << " (label bricks " << (useLabelBricks ? "on" : "off") << ")";
+		}
+		std::cout << std::endl;
+	}
 
-		checkCudaErrors(cudaBindTextureToArray(gradientTexOri, volumeGradient.content, volumeGradient.channelDesc));
-		checkCudaErrors(cudaBindTextureToArray(gradientTexFiltered, filteredVolumeGradient.content, filteredVolumeGradient.channelDesc));
+}
 
+//the candidates are first evaluated coarsely, then refined in the order of their coarse entropy, as long as their bound can beat the best refined entropy.
+//both results are kept per candidate, so searching again after excluding a skeleton only refines the candidates not refined yet, if any
+void ViewpointEvaluator::hierarchicalSkelSearch(VPMethod m)
+{
+	EvaluationState state = currentEvaluationState();
+	if (!candidateCache.valid || candidateCache.method != m || !(candidateCache.state == state)){
+		candidateCache.eyes.clear();
+		candidateCache.skel.clear();
 		for (int i = 0; i < skelViews.size(); i++){
-			if (!skelViewsConsidered[i])
-				continue; 
 			for (int j = 0; j < skelViews[i]->numParticles; j++){
-				float3 eyeInLocal = make_float3(skelViews[i]->pos[j]);
-				float entroRes = computeLocalSphereEntropy(eyeInLocal, Tao09Detail);
-				if (entroRes>maxEntropy){
-					maxEntropy = entroRes;
-					optimalEyeInLocal = eyeInLocal;
-					lastSkelOfOptimal = i;
-				}
+				candidateCache.eyes.push_back(make_float3(skelViews[i]->pos[j]));
+				candidateCache.skel.push_back(i);
 			}
 		}
-		
-		checkCudaErrors(cudaUnbindTexture(gradientTexOri));
-		checkCudaErrors(cudaUnbindTexture(gradientTexFiltered));
+		computeSphereEntropies(candidateCache.eyes, m, candidateCache.coarse, coarseSampleStride, coarseStepScale);
+		candidateCache.fine.assign(candidateCache.eyes.size(), -1);
+		candidateCache.tracked.assign(candidateCache.eyes.size(), 0);
+		candidateCache.rayBins.clear();
+		candidateCache.hists.clear();
+		candidateCache.method = m;
+		candidateCache.state = state;
+		candidateCache.valid = true;
 	}
 
-	sdkStopTimer(&timer);
+	std::vector<int> order;
+	for (int e = 0; e < candidateCache.eyes.size(); e++){
+		if (m == Tao09Detail && !skelViewsConsidered[candidateCache.skel[e]])
+			continue;
+		order.push_back(e);
+	}
+	std::sort(order.begin(), order.end(), [this](int a, int b){ return candidateCache.coarse[a] > candidateCache.coarse[b]; });
 
-	float timeCost = sdkGetAverageTimerValue(&timer) / 1000.f;
-	std::cout << "time cost for computing the global optimal: " << timeCost <<std::endl;
+	//no entropy can exceed the one of the uniform distribution
+	int binsUsed = (m == LabelVisibility) ? (maxLabel + 1) : nbins;
+	float maxPossible = log((float)binsUsed);
+	const int refineBatch = 64;
+
+	int best = -1;
+	for (int k = 0; k < order.size(); k++){
+		if (candidateCache.fine[order[k]] >= 0 && (best < 0 || candidateCache.fine[order[k]] > candidateCache.fine[best]))
+			best = order[k];
+	}
+
+	int numRefined = 0;
+	while (true){
+		//the next candidates in coarse order that are not refined and may still beat the best
+		std::vector<int> batch;
+		for (int k = 0; k < order.size() && batch.size() < refineBatch; k++){
+			int e = order[k];
+			float bound = std::min(candidateCache.coarse[e] + pruneMargin, maxPossible);
+			if (best >= 0 && bound <= candidateCache.fine[best])
+				break; //the following ones have lower coarse entropies
+			if (candidateCache.fine[e] < 0)
+				batch.push_back(e);
+		}
+		if (batch.size() == 0)
+			break;
 
+		std::vector<float3> eyes(batch.size());
+		for (int k = 0; k < batch.size(); k++)
+			eyes[k] = candidateCache.eyes[batch[k]];
+		std::vector<float> entropies;
+		if (trackRays)
+			refineTracked(batch, m, entropies);
+		else
+			computeSphereEntropies(eyes, m, entropies);
+		for (int k = 0; k < batch.size(); k++){
+			candidateCache.fine[batch[k]] = entropies[k];
+			if (best < 0 || entropies[k] > candidateCache.fine[best])
+				best = batch[k];
+		}
+		numRefined += batch.size();
+	}
+
+	if (best >= 0){
+		maxEntropy = candidateCache.fine[best];
+		optimalEyeInLocal = candidateCache.eyes[best];
+		lastSkelOfOptimal = candidateCache.skel[best];
+	}
+	std::cout << "hierarchical viewpoint search refined " << numRefined << " of " << order.size() << " candidates" << std::endl;
+}
+
+//full quality evaluation of the candidates, keeping the bin of each of their sphere rays and their histograms for updateChangedRegion()
+void ViewpointEvaluator::refineTracked(const std::vector<int> &candidates, VPMethod m, std::vector<float> &entropies)
+{
+	int numCandidates = candidateCache.eyes.size();
+	if (candidateCache.rayBins.size() == 0){
+		candidateCache.rayBins.resize((size_t)numCandidates * numSphereSample);
+		candidateCache.hists.resize((size_t)numCandidates * nbins);
+	}
+
+	std::vector<int2> rays;
+	for (int k = 0; k < candidates.size(); k++){
+		for (int r = 0; r < numSphereSample; r++)
+			rays.push_back(make_int2(candidates[k], r));
+	}
+	std::vector<unsigned char> bins;
+	castSphereRays(candidateCache.eyes, rays, m, bins);
+
+	int binsUsed = (m == LabelVisibility) ? (maxLabel + 1) : nbins;
+	entropies.resize(candidates.size());
+	for (int k = 0; k < candidates.size(); k++){
+		int e = candidates[k];
+		int* hist = &(candidateCache.hists[(size_t)e * nbins]);
+		std::fill(hist, hist + nbins, 0);
+		for (int r = 0; r < numSphereSample; r++){
+			unsigned char b = bins[(size_t)k * numSphereSample + r];
+			candidateCache.rayBins[(size_t)e * numSphereSample + r] = b;
+			hist[b]++;
+		}
+		candidateCache.tracked[e] = 1;
+		entropies[k] = histEntropy(hist, binsUsed);
+	}
+}
+
+//the part of a ray that is sampled is from 0.01 to the exit of the volume or to maxSteps steps
+bool ViewpointEvaluator::sphereRayCrossesBox(float3 eye, int r, float3 boxMin, float3 boxMax, float stepScale)
+{
+	float3 volumeMax = make_float3(volume->size) * volume->spacing;
+	float maxLength = 0.01f + rcp->maxSteps * rcp->tstep * stepScale;
+
+	float3 invR = make_float3(1.0f) / sphereSamples[r].p;
+	float3 tmaxVolume = fmaxf(invR * (volumeMax - eye), invR * (make_float3(0.0f) - eye));
+	float tEnd = fminf(fminf(fminf(tmaxVolume.x, tmaxVolume.y), tmaxVolume.z), maxLength);
+
+	float3 tbot = invR * (boxMin - eye);
+	float3 ttop = invR * (boxMax - eye);
+	float3 tmin = fminf(ttop, tbot);
+	float3 tmax = fmaxf(ttop, tbot);
+	float tnear = fmaxf(fmaxf(tmin.x, tmin.y), tmin.z);
+	float tfar = fminf(fminf(tmax.x, tmax.y), tmax.z);
+	return tnear <= tfar && tfar >= 0.01f && tnear <= tEnd;
+}
+
+void ViewpointEvaluator::updateChangedRegion(int3 voxelMin, int3 voxelMax)
+{
+	//the host copy of the cpu evaluation and the label index, if they are used
+	if (volumeValuesCPU.size() > 0)
+		updateVolumeValuesCPU(voxelMin, voxelMax);
+	if (d_labelBricks != 0)
+		buildLabelBricks(voxelMin, voxelMax);
+
+	if (!skelSearched)
+		return;
+	VPMethod m = skelSearchMethod;
+	if (m == Tao09Detail){
+		initTao09Detail();
+	}
+	else{
+		initLabelVisibility();
+	}
+
+	//without the kept rays, or with results of another search, every candidate is evaluated again
+	if (!useHierarchicalSearch || !trackRays || !candidateCache.valid || candidateCache.method != m || !(candidateCache.state == currentEvaluationState())){
+		candidateCache.valid = false;
+		compute_SkelSampling(m);
+		return;
+	}
+
+	//a sampled point of a ray inside the range can read voxels of the range, which are up to one voxel away
+	float3 boxMin = make_float3(voxelMin - 1) * volume->spacing;
+	float3 boxMax = make_float3(voxelMax + 2) * volume->spacing;
+
+	int numCandidates = candidateCache.eyes.size();
+	std::vector<std::vector<int2>> candidateRays(numCandidates);
+	std::vector<char> coarseCrossed(numCandidates, 0);
+	int stride = std::max(coarseSampleStride, 1);
+	ThreadPool::global().parallelFor(numCandidates, [&](int e){
+		float3 eye = candidateCache.eyes[e];
+		for (int r = 0; r < numSphereSample && !coarseCrossed[e]; r += stride){
+			if (sphereRayCrossesBox(eye, r, boxMin, boxMax, coarseStepScale))
+				coarseCrossed[e] = 1;
+		}
+		if (!candidateCache.tracked[e])
+			return;
+		for (int r = 0; r < numSphereSample; r++){
+			if (sphereRayCrossesBox(eye, r, boxMin, boxMax, 1.0f))
+				candidateRays[e].push_back(make_int2(e, r));
+		}
+	});
+
+	//the coarse entropies of the candidates seeing the range, which decide the order and the pruning of the refinement
+	std::vector<int> coarseCandidates;
+	std::vector<float3> coarseEyes;
+	for (int e = 0; e < numCandidates; e++){
+		if (coarseCrossed[e]){
+			coarseCandidates.push_back(e);
+			coarseEyes.push_back(candidateCache.eyes[e]);
+		}
+	}
+	if (coarseCandidates.size() > 0){
+		std::vector<float> coarse;
+		computeSphereEntropies(coarseEyes, m, coarse, coarseSampleStride, coarseStepScale);
+		for (int k = 0; k < coarseCandidates.size(); k++){
+			int e = coarseCandidates[k];
+			candidateCache.coarse[e] = coarse[k];
+			//a refined result without kept rays cannot be updated, so the candidate is refined again if still worth it
+			if (!candidateCache.tracked[e])
+				candidateCache.fine[e] = -1;
+		}
+	}
+
+	std::vector<int2> rays;
+	for (int e = 0; e < numCandidates; e++)
+		rays.insert(rays.end(), candidateRays[e].begin(), candidateRays[e].end());
+	if (rays.size() > 0){
+		std::vector<unsigned char> bins;
+		castSphereRays(candidateCache.eyes, rays, m, bins);
+
+		//replace the old contribution of each ray by the new one
+		std::vector<char> changed(numCandidates, 0);
+		for (int k = 0; k < rays.size(); k++){
+			int e = rays[k].x;
+			unsigned char &old = candidateCache.rayBins[(size_t)e * numSphereSample + rays[k].y];
+			if (old != bins[k]){
+				int* hist = &(candidateCache.hists[(size_t)e * nbins]);
+				hist[old]--;
+				hist[bins[k]]++;
+				old = bins[k];
+				changed[e] = 1;
+			}
+		}
+		int binsUsed = (m == LabelVisibility) ? (maxLabel + 1) : nbins;
+		for (int e = 0; e < numCandidates; e++){
+			if (changed[e])
+				candidateCache.fine[e] = histEntropy(&(candidateCache.hists[(size_t)e * nbins]), binsUsed);
+		}
+	}
+	std::cout << "viewpoint re-evaluation cast " << rays.size() << " rays and " << coarseCandidates.size() << " coarse evaluations for the changed region" << std::endl;
+
+	//the updated entropies may change which candidates are worth refining
+	hierarchicalSkelSearch(m);
 }
 
 void ViewpointEvaluator::saveResultVol(const char* fname)
@@ -405,6 +895,8 @@ __constant__ float3 spacing;
 void ViewpointEvaluator::GPU_setVolume(const VolumeCUDA *vol)
 {
 	checkCudaErrors(cudaBindTextureToArray(volumeVal, vol->content, vol->channelDesc));
+	candidateCache.valid = false;
+	labelBricksDirty = true;
 }
 
 
@@ -417,24 +909,104 @@ void ViewpointEvaluator::GPU_setConstants(float* _transFuncP1, float* _transFunc
 	checkCudaErrors(cudaMemcpyToSymbol(ls, _ls, sizeof(float)));
 
 	checkCudaErrors(cudaMemcpyToSymbol(spacing, _spacing, sizeof(float3)));
+	candidateCache.valid = false;
+	//the transparent bricks depend on the transfer function
+	labelBricksDirty = true;
 }
 
+//label index of LabelVisibility, see buildLabelBricks(). labelBricks is 0 when the index is not used
+__constant__ const unsigned int* labelBricks;
+__constant__ int3 labelBrickGridSize;
+__constant__ unsigned int maxLabelInVolume;
 
-struct functor_computeEntropy
+//one thread per brick of the range [brickMin, brickMax]
+__global__ void d_computeLabelBricks(unsigned int* bricks, int3 gridSize, int3 brickMin, int3 brickMax)
 {
-	float sum;
-	__device__ __host__ float operator() (float r)
-	{
-		if (r < 0.00001){
-			return 0;
-		}
-		else{
-			float qj = r / sum;
-			return -qj*log(qj);
+	int x = blockIdx.x*blockDim.x + threadIdx.x + brickMin.x;
+	int y = blockIdx.y*blockDim.y + threadIdx.y + brickMin.y;
+	int z = blockIdx.z*blockDim.z + threadIdx.z + brickMin.z;
+
+	if (x > brickMax.x || y > brickMax.y || z > brickMax.z)
+		return;
+
+	//same apron as MacroCellGrid. voxels outside of the volume read 0 by the border address mode.
+	//volumeVal is linearly filtered, which returns the voxel itself at its center
+	float vMin = 1e30f, vMax = -1e30f;
+	unsigned int maxLabel = 0;
+	for (int k = z * LABEL_BRICK_SIZE - 1; k <= (z + 1) * LABEL_BRICK_SIZE; k++){
+		for (int j = y * LABEL_BRICK_SIZE - 1; j <= (y + 1) * LABEL_BRICK_SIZE; j++){
+			for (int i = x * LABEL_BRICK_SIZE - 1; i <= (x + 1) * LABEL_BRICK_SIZE; i++){
+				float v = tex3D(volumeVal, i + 0.5, j + 0.5, k + 0.5);
+				vMin = fminf(vMin, v);
+				vMax = fmaxf(vMax, v);
+				maxLabel = max(maxLabel, (unsigned int)tex3D(volumeLabel, i + 0.5, j + 0.5, k + 0.5));
+			}
 		}
 	}
-	functor_computeEntropy(float s) : sum(s){}
-};
+	//the opacity clamp((v - transFuncP2) / (transFuncP1 - transFuncP2), 0, 1) is positive somewhere in [min, max]
+	bool occupied = (transFuncP1 > transFuncP2) ? (vMax > transFuncP2) : (vMin < transFuncP2);
+	bricks[(z * gridSize.y + y) * gridSize.x + x] = (maxLabel << 1) | (occupied ? 1 : 0);
+}
+
+void ViewpointEvaluator::buildLabelBricks(int3 voxelMin, int3 voxelMax)
+{
+	int3 gridSize = make_int3(iDivUp(volume->size.x, LABEL_BRICK_SIZE), iDivUp(volume->size.y, LABEL_BRICK_SIZE), iDivUp(volume->size.z, LABEL_BRICK_SIZE));
+	int numBricks = gridSize.x * gridSize.y * gridSize.z;
+	if (d_labelBricks == 0 || gridSize.x != labelBrickGridSize.x || gridSize.y != labelBrickGridSize.y || gridSize.z != labelBrickGridSize.z){
+		if (d_labelBricks != 0)
+			checkCudaErrors(cudaFree(d_labelBricks));
+		checkCudaErrors(cudaMalloc(&d_labelBricks, sizeof(unsigned int)* numBricks));
+		labelBrickGridSize = gridSize;
+		labelBricksDirty = true;
+	}
+	if (labelBricksDirty || labelBricksVersion != volume->volumeCuda.contentVersion){
+		voxelMin = make_int3(0, 0, 0);
+		voxelMax = volume->size - 1;
+	}
+
+	//a voxel also belongs to the apron of the neighboring bricks
+	int3 brickMin = make_int3(
+		std::max((voxelMin.x - 1) / LABEL_BRICK_SIZE, 0),
+		std::max((voxelMin.y - 1) / LABEL_BRICK_SIZE, 0),
+		std::max((voxelMin.z - 1) / LABEL_BRICK_SIZE, 0));
+	int3 brickMax = make_int3(
+		std::min((voxelMax.x + 1) / LABEL_BRICK_SIZE, gridSize.x - 1),
+		std::min((voxelMax.y + 1) / LABEL_BRICK_SIZE, gridSize.y - 1),
+		std::min((voxelMax.z + 1) / LABEL_BRICK_SIZE, gridSize.z - 1));
+	if (brickMin.x <= brickMax.x && brickMin.y <= brickMax.y && brickMin.z <= brickMax.z){
+		int3 n = brickMax - brickMin + 1;
+		dim3 blockSize(8, 8, 4);
+		dim3 gridSizeCuda(iDivUp(n.x, blockSize.x), iDivUp(n.y, blockSize.y), iDivUp(n.z, blockSize.z));
+		d_computeLabelBricks << <gridSizeCuda, blockSize >> >(d_labelBricks, gridSize, brickMin, brickMax);
+	}
+
+	//the max label of the volume, which ends the rays reaching it
+	std::vector<unsigned int> bricks(numBricks);
+	checkCudaErrors(cudaMemcpy(&(bricks[0]), d_labelBricks, sizeof(unsigned int)* numBricks, cudaMemcpyDeviceToHost));
+	maxLabelInVolume = 0;
+	for (int b = 0; b < numBricks; b++)
+		maxLabelInVolume = std::max(maxLabelInVolume, bricks[b] >> 1);
+
+	//the members of the same names hide the constants
+	checkCudaErrors(cudaMemcpyToSymbol(::labelBrickGridSize, &labelBrickGridSize, sizeof(int3)));
+	checkCudaErrors(cudaMemcpyToSymbol(::maxLabelInVolume, &maxLabelInVolume, sizeof(unsigned int)));
+	labelBricksDirty = false;
+	labelBricksVersion = volume->volumeCuda.contentVersion;
+	setLabelBricksEnabled(useLabelBricks);
+}
+
+void ViewpointEvaluator::prepareLabelBricks()
+{
+	if (useLabelBricks && (d_labelBricks == 0 || labelBricksDirty || labelBricksVersion != volume->volumeCuda.contentVersion))
+		buildLabelBricks(make_int3(0, 0, 0), volume->size - 1);
+	setLabelBricksEnabled(useLabelBricks);
+}
+
+void ViewpointEvaluator::setLabelBricksEnabled(bool enabled)
+{
+	const unsigned int* p = enabled ? d_labelBricks : 0;
+	checkCudaErrors(cudaMemcpyToSymbol(labelBricks, &p, sizeof(const unsigned int*)));
+}
 
 
 
@@ -503,8 +1075,8 @@ __global__ void d_computeSphereColor(float density, float brightness,
 
 		if (vpmethod == Tao09Detail){ //if not Tao09Detail, the sampled texture may not be prepared
 			float curDetail = 0;
-			float3 normalOri = make_float3(tex3D(gradientTexOri, coord.x, coord.y, coord.z)) / spacing;
-			float3 normalFiltered = make_float3(tex3D(gradientTexFiltered, coord.x, coord.y, coord.z)) / spacing;
+			float3 normalOri = CENTRAL_DIFFERENCE(volumeVal, coord) / spacing;
+			float3 normalFiltered = CENTRAL_DIFFERENCE(volumeValFiltered, coord) / spacing;
 			if (length(normalOri) > lightingThr){
 				if (length(normalFiltered) > lightingThr){
 					curDetail = 1 - dot(normalize(normalOri), normalize(normalFiltered));
@@ -570,20 +1142,16 @@ __global__ void d_computeSphereColor(float density, float brightness,
 	}
 }
 
-//for certain method color is not needed. only use density to control when to stop the integration
-__global__ void d_computeSphereNoColor(float density,
-	float3 eyeInLocal, int3 volumeSize, int maxSteps, float tstep, float * r, int numSphereSample, float *sphereSamples, float *hist, int nbins, bool useHist, VPMethod vpmethod)
+//for certain method color is not needed. only use density to control when to stop the integration.
+//returns the value of the ray used by the method: the detail descriptor for Tao09Detail, the max label before the ray gets opaque for LabelVisibility
+//stepScale is the ratio of tstep to the step of the full quality evaluation. the opacity of the samples is corrected for it
+__device__ float d_castSphereRayNoColor(float density, float3 eyeInLocal, float3 dir, int3 volumeSize, int maxSteps, float tstep, float stepScale, VPMethod vpmethod)
 {
-
-	int i = blockDim.x * blockIdx.x + threadIdx.x;
-	if (i >= numSphereSample)	return;
-
 	const float opacityThreshold = 0.95f;
 
-
 	Ray eyeRay;
 	eyeRay.o = eyeInLocal;
-	eyeRay.d = make_float3(sphereSamples[3 * i], sphereSamples[3 * i + 1], sphereSamples[3 * i + 2]);
+	eyeRay.d = dir;
 
 	float tnear, tfar;
 	const float3 boxMin = make_float3(0.0f, 0.0f, 0.0f);
@@ -602,9 +1170,36 @@ __global__ void d_computeSphereNoColor(float density,
 
 	float lightingThr = 0.000001; //used for the threshold of TaoDetail
 
+	const bool useLabelBricks = vpmethod == LabelVisibility && labelBricks != 0;
+
 	for (int i = 0; i<maxSteps; i++)
 	{
 		float3 coord = pos / spacing;
+
+		if (useLabelBricks){
+			int3 brick = make_int3((int)floorf(coord.x / LABEL_BRICK_SIZE), (int)floorf(coord.y / LABEL_BRICK_SIZE), (int)floorf(coord.z / LABEL_BRICK_SIZE));
+			if (brick.x >= 0 && brick.y >= 0 && brick.z >= 0 && brick.x < labelBrickGridSize.x && brick.y < labelBrickGridSize.y && brick.z < labelBrickGridSize.z){
+				unsigned int b = labelBricks[(brick.z * labelBrickGridSize.y + brick.y) * labelBrickGridSize.x + brick.x];
+				if (!(b & 1) && (b >> 1) <= label){
+					//the samples up to the exit of the brick are transparent and cannot raise the label, so they are skipped.
+					//the following samples stay at the same t as without skipping
+					float3 brickMin = make_float3(brick * LABEL_BRICK_SIZE) * spacing;
+					float3 brickMax = brickMin + make_float3((float)LABEL_BRICK_SIZE) * spacing;
+					float3 invR = make_float3(1.0f) / eyeRay.d;
+					float3 tmax = fmaxf(invR * (brickMin - eyeRay.o), invR * (brickMax - eyeRay.o));
+					float tExit = fminf(fminf(tmax.x, tmax.y), tmax.z);
+					int n = max((int)ceilf((tExit - t) / tstep), 1);
+					i += n - 1;
+					t += n * tstep;
+					if (t > tfar){
+						break;
+					}
+					pos = eyeRay.o + eyeRay.d*t;
+					continue;
+				}
+			}
+		}
+
 		float sample = tex3D(volumeVal, coord.x, coord.y, coord.z);
 		float funcRes = clamp((sample - transFuncP2) / (transFuncP1 - transFuncP2), 0.0, 1.0);
 
@@ -612,6 +1207,8 @@ __global__ void d_computeSphereNoColor(float density,
 		float4 col = make_float4(0, 0, 0, colDensity); //(0,0,0) as fake color
 
 		col.w *= density;
+		if (stepScale != 1.0f)
+			col.w = 1.0f - powf(1.0f - fminf(col.w, 1.0f), stepScale);
 
 		float visibility = 1.0f - sum.w;
 
@@ -620,8 +1217,8 @@ __global__ void d_computeSphereNoColor(float density,
 
 		if (vpmethod == Tao09Detail){ //if not Tao09Detail, the sampled texture may not be prepared
 			float curDetail = 0;
-			float3 normalOri = make_float3(tex3D(gradientTexOri, coord.x, coord.y, coord.z)) / spacing;
-			float3 normalFiltered = make_float3(tex3D(gradientTexFiltered, coord.x, coord.y, coord.z)) / spacing;
+			float3 normalOri = CENTRAL_DIFFERENCE(volumeVal, coord) / spacing;
+			float3 normalFiltered = CENTRAL_DIFFERENCE(volumeValFiltered, coord) / spacing;
 			if (length(normalOri) > lightingThr){
 				if (length(normalFiltered) > lightingThr){
 					curDetail = 1 - dot(normalize(normalOri), normalize(normalFiltered));
@@ -643,6 +1240,10 @@ __global__ void d_computeSphereNoColor(float density,
 			{
 				label = curlabel;
 			}
+			//no later sample can raise the label
+			if (useLabelBricks && label >= maxLabelInVolume){
+				break;
+			}
 		}
 
 		t += tstep;
@@ -655,28 +1256,209 @@ __global__ void d_computeSphereNoColor(float density,
 	}
 
 	if (vpmethod == Tao09Detail)
-	{
-		float uv = detailDescriptor;
-		r[i] = uv;
+		return detailDescriptor;
+	else if (vpmethod == LabelVisibility)
+		return label;
+	else
+		return -789; //should be error. for debug
+}
+
+//bin of the histogram of the ray value returned by d_castSphereRayNoColor()
+__host__ __device__ inline int sphereRayBin(float uv, int nbins, VPMethod vpmethod)
+{
+	if (vpmethod == Tao09Detail){
 		// !!! this is true only when we know uv is in [0,2] !!!
-		int bin = min((int)((uv / 2)*nbins), nbins - 1);
-		atomicAdd(hist + bin, 1);
+		return min((int)((uv / 2)*nbins), nbins - 1);
 	}
-	else if (vpmethod == LabelVisibility){
-		r[i] = label;
-		if (useHist){
-			int bin;
-			bin = label;
-			//if (label > 0)
-			//	bin = 1;
-			//else
-			//	bin = 0;
-			atomicAdd(hist + bin, 1);
-		}
+	else{
+		return min((int)uv, nbins - 1);
+	}
+}
+
+__global__ void d_computeSphereNoColor(float density,
+	float3 eyeInLocal, int3 volumeSize, int maxSteps, float tstep, float * r, int numSphereSample, float *sphereSamples, float *hist, int nbins, bool useHist, VPMethod vpmethod)
+{
+
+	int i = blockDim.x * blockIdx.x + threadIdx.x;
+	if (i >= numSphereSample)	return;
+
+	float3 dir = make_float3(sphereSamples[3 * i], sphereSamples[3 * i + 1], sphereSamples[3 * i + 2]);
+	float uv = d_castSphereRayNoColor(density, eyeInLocal, dir, volumeSize, maxSteps, tstep, 1.0f, vpmethod);
+	r[i] = uv;
+
+	if (vpmethod == Tao09Detail || (vpmethod == LabelVisibility && useHist)){
+		atomicAdd(hist + sphereRayBin(uv, nbins, vpmethod), 1);
+	}
+}
+
+//one block per eye. the histogram of the eye is accumulated in shared memory, and written once to its segment of hists.
+//only every sampleStride-th sphere sample is cast
+__global__ void d_computeSphereHistBatch(float density, const float3 *eyes, int numEyes, int3 volumeSize, int maxSteps, float tstep, float stepScale,
+	int numSphereSample, int sampleStride, const float *sphereSamples, float *hists, int nbins, VPMethod vpmethod)
+{
+	extern __shared__ unsigned int s_hist[];
+
+	int e = blockIdx.x;
+	if (e >= numEyes)	return;
+
+	for (int b = threadIdx.x; b < nbins; b += blockDim.x)
+		s_hist[b] = 0;
+	__syncthreads();
+
+	float3 eyeInLocal = eyes[e];
+	for (int i = threadIdx.x * sampleStride; i < numSphereSample; i += blockDim.x * sampleStride){
+		float3 dir = make_float3(sphereSamples[3 * i], sphereSamples[3 * i + 1], sphereSamples[3 * i + 2]);
+		float uv = d_castSphereRayNoColor(density, eyeInLocal, dir, volumeSize, maxSteps, tstep, stepScale, vpmethod);
+		atomicAdd(s_hist + sphereRayBin(uv, nbins, vpmethod), 1);
+	}
+	__syncthreads();
+
+	for (int b = threadIdx.x; b < nbins; b += blockDim.x)
+		hists[e * nbins + b] = s_hist[b];
+}
+
+//one thread per ray of the list, given as (index of the eye, index of the sphere sample). writes the bin of the ray
+__global__ void d_castSphereRayList(float density, const float3 *eyes, const int2 *rays, int numRays, int3 volumeSize, int maxSteps, float tstep,
+	const float *sphereSamples, unsigned char *bins, int nbins, VPMethod vpmethod)
+{
+	int k = blockDim.x * blockIdx.x + threadIdx.x;
+	if (k >= numRays)	return;
+
+	int2 ray = rays[k];
+	float3 dir = make_float3(sphereSamples[3 * ray.y], sphereSamples[3 * ray.y + 1], sphereSamples[3 * ray.y + 2]);
+	float uv = d_castSphereRayNoColor(density, eyes[ray.x], dir, volumeSize, maxSteps, tstep, 1.0f, vpmethod);
+	bins[k] = sphereRayBin(uv, nbins, vpmethod);
+}
+
+void ViewpointEvaluator::castSphereRays(const std::vector<float3> &eyes, const std::vector<int2> &rays, VPMethod m, std::vector<unsigned char> &bins)
+{
+	bins.resize(rays.size());
+	if (rays.size() == 0)
+		return;
+	sdkStartTimer(&castTimer);
+	numRaysCast += rays.size();
+	if (useCPU){
+		castSphereRaysCPU(eyes, rays, m, bins);
 	}
 	else{
-//should be error
-		r[i] = -789; //for debug
+		castSphereRaysGPU(eyes, rays, m, bins);
+	}
+	sdkStopTimer(&castTimer);
+	castSeconds = sdkGetTimerValue(&castTimer) / 1000.0;
+}
+
+void ViewpointEvaluator::castSphereRaysGPU(const std::vector<float3> &eyes, const std::vector<int2> &rays, VPMethod m, std::vector<unsigned char> &bins)
+{
+	if (m == LabelVisibility){
+		prepareLabelBricks();
+	}
+
+	if (m == Tao09Detail){
+		checkCudaErrors(cudaBindTextureToArray(volumeValFiltered, filteredVolume.content, filteredVolume.channelDesc));
+	}
+
+	float3 *d_eyes;
+	int2 *d_rays;
+	unsigned char *d_bins;
+	checkCudaErrors(cudaMalloc(&d_eyes, sizeof(float3)*eyes.size()));
+	checkCudaErrors(cudaMalloc(&d_rays, sizeof(int2)*rays.size()));
+	checkCudaErrors(cudaMalloc(&d_bins, rays.size()));
+	checkCudaErrors(cudaMemcpy(d_eyes, &(eyes[0]), sizeof(float3)*eyes.size(), cudaMemcpyHostToDevice));
+	checkCudaErrors(cudaMemcpy(d_rays, &(rays[0]), sizeof(int2)*rays.size(), cudaMemcpyHostToDevice));
+
+	int threadsPerBlock = 256;
+	int blocksPerGrid = (rays.size() + threadsPerBlock - 1) / threadsPerBlock;
+	d_castSphereRayList << <blocksPerGrid, threadsPerBlock >> >(rcp->density, d_eyes, d_rays, rays.size(), volume->size, rcp->maxSteps, rcp->tstep,
+		d_sphereSamples, d_bins, nbins, m);
+	checkCudaErrors(cudaMemcpy(&(bins[0]), d_bins, rays.size(), cudaMemcpyDeviceToHost));
+
+	checkCudaErrors(cudaFree(d_eyes));
+	checkCudaErrors(cudaFree(d_rays));
+	checkCudaErrors(cudaFree(d_bins));
+
+	if (m == Tao09Detail){
+		checkCudaErrors(cudaUnbindTexture(volumeValFiltered));
+	}
+}
+
+//segmented entropy: one thread per histogram, over its first binsUsed bins. same as computeVectorEntropy()
+__global__ void d_computeHistEntropies(const float *hists, int numHists, int nbins, int binsUsed, float *entropies)
+{
+	int e = blockDim.x * blockIdx.x + threadIdx.x;
+	if (e >= numHists)	return;
+
+	entropies[e] = histEntropy(hists + e * nbins, binsUsed);
+}
+
+void ViewpointEvaluator::computeSphereEntropies(const std::vector<float3> &eyes, VPMethod m, std::vector<float> &entropies, int sampleStride, float stepScale)
+{
+	sampleStride = std::max(sampleStride, 1);
+	entropies.assign(eyes.size(), 0);
+	if (eyes.size() == 0)
+		return;
+
+	if (m == Tao09Detail){
+		initTao09Detail();
+	}
+	else if (m == LabelVisibility){
+		initLabelVisibility();
+	}
+	else{
+		std::cout << "batched evaluation not defined for this method! " << std::endl;
+		return;
+	}
+
+	sdkStartTimer(&castTimer);
+	numRaysCast += (long long)eyes.size() * ((numSphereSample + sampleStride - 1) / sampleStride);
+	if (useCPU){
+		computeSphereEntropiesCPU(eyes, m, entropies, sampleStride, stepScale);
+	}
+	else{
+		computeSphereEntropiesGPU(eyes, m, entropies, sampleStride, stepScale);
+	}
+	sdkStopTimer(&castTimer);
+	castSeconds = sdkGetTimerValue(&castTimer) / 1000.0;
+}
+
+void ViewpointEvaluator::computeSphereEntropiesGPU(const std::vector<float3> &eyes, VPMethod m, std::vector<float> &entropies, int sampleStride, float stepScale)
+{
+	if (m == LabelVisibility){
+		prepareLabelBricks();
+	}
+
+	if (m == Tao09Detail){
+		checkCudaErrors(cudaBindTextureToArray(volumeValFiltered, filteredVolume.content, filteredVolume.channelDesc));
+	}
+
+	//the eyes are processed in batches, to bound the memory of the histograms and the size of the grid
+	const int batchSize = 8192;
+	int batch = std::min((int)eyes.size(), batchSize);
+	int binsUsed = (m == LabelVisibility) ? (maxLabel + 1) : nbins;
+	float3 *d_eyes;
+	float *d_hists, *d_entropies;
+	checkCudaErrors(cudaMalloc(&d_eyes, sizeof(float3)*batch));
+	checkCudaErrors(cudaMalloc(&d_hists, sizeof(float)*batch*nbins));
+	checkCudaErrors(cudaMalloc(&d_entropies, sizeof(float)*batch));
+
+	for (int first = 0; first < eyes.size(); first += batch){
+		int n = std::min(batch, (int)eyes.size() - first);
+		checkCudaErrors(cudaMemcpy(d_eyes, &(eyes[first]), sizeof(float3)*n, cudaMemcpyHostToDevice));
+
+		int threadsPerBlock = 128;
+		d_computeSphereHistBatch << <n, threadsPerBlock, sizeof(unsigned int)*nbins >> >(rcp->density, d_eyes, n, volume->size, rcp->maxSteps, rcp->tstep * stepScale, stepScale,
+			numSphereSample, sampleStride, d_sphereSamples, d_hists, nbins, m);
+
+		int blocksPerGrid = (n + threadsPerBlock - 1) / threadsPerBlock;
+		d_computeHistEntropies << <blocksPerGrid, threadsPerBlock >> >(d_hists, n, nbins, binsUsed, d_entropies);
+		checkCudaErrors(cudaMemcpy(&(entropies[first]), d_entropies, sizeof(float)*n, cudaMemcpyDeviceToHost));
+	}
+
+	checkCudaErrors(cudaFree(d_eyes));
+	checkCudaErrors(cudaFree(d_hists));
+	checkCudaErrors(cudaFree(d_entropies));
+
+	if (m == Tao09Detail){
+		checkCudaErrors(cudaUnbindTexture(volumeValFiltered));
 	}
 }
 
@@ -696,6 +1478,9 @@ float ViewpointEvaluator::computeLocalSphereEntropy(float3 eyeInLocal, VPMethod
 	int blocksPerGrid = (numSphereSample + threadsPerBlock - 1) / threadsPerBlock;
 
 	cudaMemset(d_hist, 0, sizeof(float)*nbins);
+	if (m == LabelVisibility){
+		prepareLabelBricks();
+	}
 
 	//d_computeSphereColor << <blocksPerGrid, threadsPerBlock >> >(rcp->density, rcp->brightness, eyeInLocal, volume->size, rcp->maxSteps, rcp->tstep, rcp->useColor, d_r, numSphereSample, d_sphereSamples, d_hist, nbins, useHist, m);
 	d_computeSphereNoColor << <blocksPerGrid, threadsPerBlock >> >(rcp->density, eyeInLocal, volume->size, rcp->maxSteps, rcp->tstep, d_r, numSphereSample, d_sphereSamples, d_hist, nbins, useHist, m);
@@ -720,10 +1505,6 @@ float ViewpointEvaluator::computeVectorEntropy(float* ary, int size)
 {
 	thrust::device_vector< float > iVec(ary, ary + size);
 
-	//for debug
-	std::vector<float> stl_vector(size);
-	thrust::copy(iVec.begin(), iVec.end(), stl_vector.begin());
-
 	float sum = thrust::reduce(iVec.begin(), iVec.end(), (float)0, thrust::plus<float>());
 	thrust::transform(iVec.begin(), iVec.end(), iVec.begin(), functor_computeEntropy(sum));
 	return thrust::reduce(iVec.begin(), iVec.end(), (float)0, thrust::plus<float>());
@@ -793,8 +1574,8 @@ __global__ void d_computeCubeColorHist(float density, float brightness,
 
 		if (vpmethod == Tao09Detail){ //if not Tao09Detail, the sampled texture may not be prepared
 			float curDetail = 0;
-			float3 normalOri = make_float3(tex3D(gradientTexOri, coord.x, coord.y, coord.z)) / spacing;
-			float3 normalFiltered = make_float3(tex3D(gradientTexFiltered, coord.x, coord.y, coord.z)) / spacing;
+			float3 normalOri = CENTRAL_DIFFERENCE(volumeVal, coord) / spacing;
+			float3 normalFiltered = CENTRAL_DIFFERENCE(volumeValFiltered, coord) / spacing;
 			if (length(normalOri) > lightingThr){
 				if (length(normalFiltered) > lightingThr){
 					curDetail = 1 - dot(normalize(normalOri), normalize(normalFiltered));
@@ -884,209 +1665,94 @@ __global__ void d_computeCubeColorHist(float density, float brightness,
 }
 
 
-__global__ void d_computeCubeNoColorHist(float density, float3 eyeInLocal, float3 viewVec, float3 upVec, int3 volumeSize, int maxSteps, float tstep, float * r, int numSphereSample, float *sphereSamples, float *hist0, float *hist1, float *hist2, float *hist3, float *hist4, float *hist5, int nbins, bool useHist, VPMethod vpmethod)
+//face of the cube around the eye that a ray goes through: 0 front, 1 back, 2 left, 3 right, 4 up, 5 below
+//suppose x coord is along viewVew, suppose upVec and viewVew are normalized and perpendicular
+__device__ inline int d_cubeFace(float3 dir, float3 viewVec, float3 upVec)
 {
-	int i = blockDim.x * blockIdx.x + threadIdx.x;
-	if (i >= numSphereSample)	return;
-
-	const float opacityThreshold = 0.95f;
-
-	Ray eyeRay;
-	eyeRay.o = eyeInLocal;
-	eyeRay.d = make_float3(sphereSamples[3 * i], sphereSamples[3 * i + 1], sphereSamples[3 * i + 2]);
-
-	float tnear, tfar;
-	const float3 boxMin = make_float3(0.0f, 0.0f, 0.0f);
-	const float3 boxMax = spacing*make_float3(volumeSize);
-	intersectBox2(eyeRay, boxMin, boxMax, &tnear, &tfar);
-	tnear = 0.01f;	//!!!NOTE!!! this tnear is not in the clip space but in the original space
-
-	// march along ray from front to back, accumulating color
-	float t = tnear;
-	float3 pos = eyeRay.o + eyeRay.d*tnear;
-	float3 step = eyeRay.d*tstep;
-
-	float4 sum = make_float4(0.0f); //for JS
-	unsigned short label = 0; //for label count
-	float detailDescriptor = 0; //for TaoDetail
-
-	float lightingThr = 0.000001; //used for the threshold of TaoDetail
-
-
-	for (int i = 0; i<maxSteps; i++)
-	{
-		float3 coord = pos / spacing;
-		float sample = tex3D(volumeVal, coord.x, coord.y, coord.z);
-		float funcRes = clamp((sample - transFuncP2) / (transFuncP1 - transFuncP2), 0.0, 1.0);
-
-		float colDensity = funcRes;
-		float4 col = make_float4(0,0,0, colDensity);
-
-		col.w *= density;
-
-		float visibility = 1.0f - sum.w;
-
-		sum = sum + col*(1.0f - sum.w);
-
-		if (vpmethod == Tao09Detail){ //if not Tao09Detail, the sampled texture may not be prepared
-			float curDetail = 0;
-			float3 normalOri = make_float3(tex3D(gradientTexOri, coord.x, coord.y, coord.z)) / spacing;
-			float3 normalFiltered = make_float3(tex3D(gradientTexFiltered, coord.x, coord.y, coord.z)) / spacing;
-			if (length(normalOri) > lightingThr){
-				if (length(normalFiltered) > lightingThr){
-					curDetail = 1 - dot(normalize(normalOri), normalize(normalFiltered));
-				}
-				else{
-					curDetail = 1;
-				}
-			}
-			detailDescriptor = detailDescriptor + curDetail*col.w*visibility;
-		}
-
-		// exit early if opaque
-		if (sum.w > opacityThreshold){
-			break;
-		}
-		else if (vpmethod == LabelVisibility){
-			unsigned short curlabel = tex3D(volumeLabel, coord.x, coord.y, coord.z);
-			if (curlabel > label)
-			{
-				label = curlabel;
-			}
-		}
-
-		t += tstep;
-		if (t > tfar){
-			break;
-		}
-		pos += step;
-	}
-
-	int bin;
-
-	if (vpmethod == Tao09Detail)
-	{
-		float uv = detailDescriptor;
-		r[i] = uv;
-		// !!! this is true only when we know uv is in [0,2] !!!
-		bin = min((int)((uv / 2)*nbins), nbins - 1);
-	}
-	else if (vpmethod == LabelVisibility){
-		r[i] = label;
-		if (useHist){
-			//if (label > 0)
-			//	bin = 1;
-			//else
-			//	bin = 0;
-			bin = label;
-		}
-	}
-	else{
-		//should be error
-	}
-
-	//suppose x coord is along viewVew, suppose upVec and viewVew are normalized and perpendicular
 	float3 sidevec = cross(upVec, viewVec);
-	float rayz = dot(eyeRay.d, upVec), rayx = dot(eyeRay.d, viewVec), rayy = dot(eyeRay.d, sidevec);
+	float rayz = dot(dir, upVec), rayx = dot(dir, viewVec), rayy = dot(dir, sidevec);
 
 	float xabs = abs(rayx), yabs = abs(rayy), zabs = abs(rayz);
 	if (xabs > yabs && xabs > zabs){
-		if (rayx > 0){ //front
-			atomicAdd(hist0 + bin, 1);
-		}
-		else{ //back
-			atomicAdd(hist1 + bin, 1);
-		}
+		return rayx > 0 ? 0 : 1;
 	}
 	else if (yabs > xabs && yabs > zabs){
-		if (rayy > 0){ //left
-			atomicAdd(hist2 + bin, 1);
-		}
-		else{ //right
-			atomicAdd(hist3 + bin, 1);
-		}
+		return rayy > 0 ? 2 : 3;
 	}
 	else{ //zabs is the max
-		if (rayz > 0){ //up
-			atomicAdd(hist4 + bin, 1);
-		}
-		else{ //below
-			atomicAdd(hist5 + bin, 1);
-		}
+		return rayz > 0 ? 4 : 5;
 	}
 }
 
-void ViewpointEvaluator::computeCubeEntropy(float3 eyeInLocal, float3 viewDir, float3 upDir, VPMethod m)
+//the histograms of the six faces are one tensor of 6*nbins bins. each block accumulates its rays in a private copy in shared memory,
+//which is added once to hists
+__global__ void d_computeCubeHists(float density, float3 eyeInLocal, float3 viewVec, float3 upVec, int3 volumeSize, int maxSteps, float tstep, float * r,
+	int numSphereSample, const float *sphereSamples, float *hists, int nbins, VPMethod vpmethod)
 {
-	if (m == Tao09Detail){
-		if (noBilat){
-			return;
-		}
-
-		initTao09Detail();
-
-		int threadsPerBlock = 64;
-		int blocksPerGrid = (numSphereSample + threadsPerBlock - 1) / threadsPerBlock;
-
-		for (int i = 0; i < 6; i++){
-			cudaMemset(cubeFaceHists[i], 0, sizeof(float)*nbins);
-		}
+	extern __shared__ unsigned int s_hist[];
 
-		checkCudaErrors(cudaBindTextureToArray(gradientTexOri, volumeGradient.content, volumeGradient.channelDesc));
-		checkCudaErrors(cudaBindTextureToArray(gradientTexFiltered, filteredVolumeGradient.content, filteredVolumeGradient.channelDesc));
+	for (int b = threadIdx.x; b < 6 * nbins; b += blockDim.x)
+		s_hist[b] = 0;
+	__syncthreads();
 
-	//	d_computeCubeColorHist << <blocksPerGrid, threadsPerBlock >> >(rcp->density, rcp->brightness, eyeInLocal, viewDir, upDir, volume->size, rcp->maxSteps, rcp->tstep, rcp->useColor, d_r, numSphereSample, d_sphereSamples, cubeFaceHists[0], cubeFaceHists[1], cubeFaceHists[2], cubeFaceHists[3], cubeFaceHists[4], cubeFaceHists[5], nbins, useHist, m);
-		d_computeCubeNoColorHist << <blocksPerGrid, threadsPerBlock >> >(rcp->density, eyeInLocal, viewDir, upDir, volume->size, rcp->maxSteps, rcp->tstep, d_r, numSphereSample, d_sphereSamples, cubeFaceHists[0], cubeFaceHists[1], cubeFaceHists[2], cubeFaceHists[3], cubeFaceHists[4], cubeFaceHists[5], nbins, useHist, m);
+	for (int i = blockDim.x * blockIdx.x + threadIdx.x; i < numSphereSample; i += blockDim.x * gridDim.x){
+		float3 dir = make_float3(sphereSamples[3 * i], sphereSamples[3 * i + 1], sphereSamples[3 * i + 2]);
+		float uv = d_castSphereRayNoColor(density, eyeInLocal, dir, volumeSize, maxSteps, tstep, 1.0f, vpmethod);
+		r[i] = uv;
+		atomicAdd(s_hist + d_cubeFace(dir, viewVec, upVec) * nbins + sphereRayBin(uv, nbins, vpmethod), 1);
+	}
+	__syncthreads();
 
-		checkCudaErrors(cudaUnbindTexture(gradientTexOri));
-		checkCudaErrors(cudaUnbindTexture(gradientTexFiltered));
+	for (int b = threadIdx.x; b < 6 * nbins; b += blockDim.x){
+		if (s_hist[b] > 0)
+			atomicAdd(hists + b, (float)s_hist[b]);
+	}
+}
 
-		for (int i = 0; i < 6; i++){
-			if (useHist){
-				if (m == LabelVisibility){
-					cubeInfo[i] = computeVectorEntropy(cubeFaceHists[i], maxLabel + 1);
-				}
-				else{
-					cubeInfo[i] = computeVectorEntropy(cubeFaceHists[i], nbins);
-				}
-			}
-			else{
-				std::cout << "entropy computation not defined! " << std::endl;
-				exit(0);
-			}
+const std::vector<float>& ViewpointEvaluator::computeCubeEntropy(float3 eyeInLocal, float3 viewDir, float3 upDir, VPMethod m)
+{
+	if (m == Tao09Detail){
+		if (noBilat){
+			return cubeInfo;
 		}
+		initTao09Detail();
 	}
 	else if (m == LabelVisibility){
 		initLabelVisibility();
+	}
+	else{
+		return cubeInfo;
+	}
+	if (!useHist){
+		std::cout << "entropy computation not defined! " << std::endl;
+		exit(0);
+	}
 
-		int threadsPerBlock = 64;
-		int blocksPerGrid = (numSphereSample + threadsPerBlock - 1) / threadsPerBlock;
-
-		for (int i = 0; i < 6; i++){
-			cudaMemset(cubeFaceHists[i], 0, sizeof(float)*nbins);
-		}
-
-		//	d_computeCubeColorHist << <blocksPerGrid, threadsPerBlock >> >(rcp->density, rcp->brightness, eyeInLocal, viewDir, upDir, volume->size, rcp->maxSteps, rcp->tstep, rcp->useColor, d_r, numSphereSample, d_sphereSamples, cubeFaceHists[0], cubeFaceHists[1], cubeFaceHists[2], cubeFaceHists[3], cubeFaceHists[4], cubeFaceHists[5], nbins, useHist, m);
-		d_computeCubeNoColorHist << <blocksPerGrid, threadsPerBlock >> >(rcp->density, eyeInLocal, viewDir, upDir, volume->size, rcp->maxSteps, rcp->tstep, d_r, numSphereSample, d_sphereSamples, cubeFaceHists[0], cubeFaceHists[1], cubeFaceHists[2], cubeFaceHists[3], cubeFaceHists[4], cubeFaceHists[5], nbins, useHist, m);
+	int binsUsed = (m == LabelVisibility) ? (maxLabel + 1) : nbins;
+	if (useCPU){
+		computeCubeEntropyCPU(eyeInLocal, viewDir, upDir, m, binsUsed);
+		return cubeInfo;
+	}
 
-		for (int i = 0; i < 6; i++){
-			if (useHist){
-				if (m == LabelVisibility){
-					cubeInfo[i] = computeVectorEntropy(cubeFaceHists[i], maxLabel + 1);
-				}
-				else{
-					cubeInfo[i] = computeVectorEntropy(cubeFaceHists[i], nbins);
-				}
-			}
-			else{
-				std::cout << "entropy computation not defined! " << std::endl;
-				exit(0);
-			}
-		}
+	if (m == Tao09Detail){
+		checkCudaErrors(cudaBindTextureToArray(volumeValFiltered, filteredVolume.content, filteredVolume.channelDesc));
 	}
 	else{
-		return;
+		prepareLabelBricks();
 	}
 
+	//few blocks, so that the private histograms are added to the global ones only a few times
+	int threadsPerBlock = 128;
+	int blocksPerGrid = std::min((numSphereSample + threadsPerBlock - 1) / threadsPerBlock, 16);
+	checkCudaErrors(cudaMemset(d_cubeHists, 0, sizeof(float)* 6 * nbins));
+	d_computeCubeHists << <blocksPerGrid, threadsPerBlock, sizeof(unsigned int)* 6 * nbins >> >(rcp->density, eyeInLocal, viewDir, upDir, volume->size, rcp->maxSteps, rcp->tstep,
+		d_r, numSphereSample, d_sphereSamples, d_cubeHists, nbins, m);
+	d_computeHistEntropies << <1, 32 >> >(d_cubeHists, 6, nbins, binsUsed, d_cubeEntropies);
+	checkCudaErrors(cudaMemcpy(&(cubeInfo[0]), d_cubeEntropies, sizeof(float)* 6, cudaMemcpyDeviceToHost));
+
+	if (m == Tao09Detail){
+		checkCudaErrors(cudaUnbindTexture(volumeValFiltered));
+	}
+	return cubeInfo;
 }
 
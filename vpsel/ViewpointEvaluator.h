@@ -5,6 +5,8 @@
 #include <cmath>
 #include <memory>
 #include <vector>
+#include <string>
+#include <atomic>
 #include <helper_timer.h>
 
 #include "Volume.h"
@@ -12,6 +14,9 @@
 
 class Particle;
 
+//edge length in voxels of a brick of the label index used by LabelVisibility
+#define LABEL_BRICK_SIZE 8
+
 enum VPMethod{
 	BS05,
 	JS06Sphere,
@@ -19,6 +24,36 @@ enum VPMethod{
 	LabelVisibility
 };
 
+struct functor_computeEntropy
+{
+	float sum;
+	__device__ __host__ float operator() (float r)
+	{
+		if (r < 0.00001){
+			return 0;
+		}
+		else{
+			float qj = r / sum;
+			return -qj*log(qj);
+		}
+	}
+	__device__ __host__ functor_computeEntropy(float s) : sum(s){}
+};
+
+//entropy of a histogram over its first binsUsed bins, same as computeVectorEntropy(). shared by the gpu kernels and the cpu evaluation
+template <typename T>
+__device__ __host__ inline float histEntropy(const T* hist, int binsUsed)
+{
+	float sum = 0;
+	for (int b = 0; b < binsUsed; b++)
+		sum += hist[b];
+	functor_computeEntropy f(sum);
+	float entropy = 0;
+	for (int b = 0; b < binsUsed; b++)
+		entropy += f(hist[b]);
+	return entropy;
+}
+
 struct SpherePoint {
 	//float info[2];//info[0]:lat, info[1]:lon
 	float3 p;
@@ -38,16 +73,23 @@ class ViewpointEvaluator
 {
 public:
 	ViewpointEvaluator(std::shared_ptr<RayCastingParameters> _r, std::shared_ptr<Volume> v);
+	//copy the transfer function and lighting parameters of _r, and clear the cached results
+	void setRayCastingParameters(std::shared_ptr<RayCastingParameters> _r);
 	~ViewpointEvaluator(){
 		if (d_r != 0){
 			cudaFree(d_r); d_r = 0;
 		};
-		for (int i = 0; i < cubeFaceHists.size(); i++){
-			if (cubeFaceHists[i] != 0){
-				cudaFree(cubeFaceHists[i]);
-			}
+		if (d_cubeHists != 0){
+			cudaFree(d_cubeHists); d_cubeHists = 0;
+		}
+		if (d_cubeEntropies != 0){
+			cudaFree(d_cubeEntropies); d_cubeEntropies = 0;
+		}
+		if (d_labelBricks != 0){
+			cudaFree(d_labelBricks); d_labelBricks = 0;
 		}
 		sdkDeleteTimer(&timer);
+		sdkDeleteTimer(&castTimer);
 	};
 
 	VPMethod currentMethod = Tao09Detail;
@@ -55,7 +97,14 @@ public:
 	void setSpherePoints(int n = 2048);
 	void setLabel(std::shared_ptr<VolumeCUDA> labelVol);
 	void initDownSampledResultVolume(int3 sampleSize);	
-	void compute_UniformSampling(VPMethod m);
+	//entropy of every eye position of the sampling grid of resVol, for Tao09Detail or LabelVisibility. the grid is evaluated in slabs of slabSlices z slices.
+	//if checkpointFile is set, every finished slab is saved in it, and a later call resumes from it if the grid, the method, the volume,
+	//the labels of LabelVisibility, the ray casting parameters and the sphere samples are the same.
+	//returns false if cancelled by cancel(), which can be called from another thread. a cancel() before the call cancels the next call
+	bool compute_UniformSampling(VPMethod m);
+	std::string checkpointFile;
+	int slabSlices = 1;
+	void cancel(){ cancelRequested = true; }
 	void compute_SkelSampling(VPMethod m);
 	void compute_NextSkelSampling(VPMethod m);
 	void saveResultVol(const char*);
@@ -63,11 +112,14 @@ public:
 	float maxEntropy;
 	float3 optimalEyeInLocal;
 
+	//entropy of the sphere rays through each face of the cube around the eye, in the order front, back, left, right, up, below.
+	//all six come from one pass over the sphere samples, cheap enough to be queried every frame. returns cubeInfo
 	std::vector<float> cubeInfo;
-	void computeCubeEntropy(float3 eyeInLocal, float3 viewDir, float3 upDir, VPMethod m);
+	const std::vector<float>& computeCubeEntropy(float3 eyeInLocal, float3 viewDir, float3 upDir, VPMethod m);
 	void setViews(std::vector<std::shared_ptr<Particle>> v){
 		skelViews = v;
 		skelViewsConsidered.assign(v.size(), true);
+		candidateCache.valid = false;
 	};
 	std::vector<std::shared_ptr<Particle>> skelViews;
 	std::vector<bool> skelViewsConsidered;
@@ -75,19 +127,59 @@ public:
 	std::shared_ptr<Particle> allViewSamples = 0;
 	void createOneParticleFormOfViewSamples();
 
+	//entropy of the sphere rays of each eye, for Tao09Detail or LabelVisibility. on the gpu all the eyes are cast by one launch per batch,
+	//with one histogram per eye in a contiguous buffer reduced by one segmented entropy launch. on the cpu the eyes are distributed on the thread pool
+	//sampleStride > 1 casts only every sampleStride-th sphere sample, and stepScale enlarges tstep, for a coarse evaluation
+	void computeSphereEntropies(const std::vector<float3> &eyes, VPMethod m, std::vector<float> &entropies, int sampleStride = 1, float stepScale = 1);
+	//evaluate on the cpu instead of the gpu. LabelVisibility then needs labelValues
+	bool useCPU = false;
+	const unsigned short* labelValues = 0; //host copy of the label volume, same size as the volume
+
+	//optional coarse-to-fine search of the skeleton views for Tao09Detail and LabelVisibility. the coarse pass uses every coarseSampleStride-th sphere sample
+	//and coarseStepScale times tstep. a candidate is refined only if its coarse entropy plus pruneMargin can beat the best refined entropy.
+	//the margin is a heuristic, since a sampled entropy does not bound the full one, so the search may miss the optimal view; off by default.
+	//the results are cached per candidate until the views, the method, the volume content or the ray casting parameters change
+	bool useHierarchicalSearch = false;
+	int coarseSampleStride = 8;
+	float coarseStepScale = 2;
+	float pruneMargin = 0.1;
+	//call when the volume changed in a way not seen by VolumeCUDA::contentVersion, e.g. by a deformation, without updateChangedRegion()
+	void clearCandidateCache(){ candidateCache.valid = false; }
+
+	//re-evaluation of the last skeleton search when the volume changed only in the voxel range [voxelMin, voxelMax], e.g. the one given by
+	//PositionBasedDeformProcessor::getChangedVolumeRegion(). with useHierarchicalSearch and trackRays set before the search, the bin of every sphere ray
+	//of the refined candidates is kept, and only the rays crossing the range are cast again, replacing their old contribution to the histograms.
+	//the coarse entropies of the candidates with a coarse ray crossing the range are computed again. otherwise all the candidates are evaluated again.
+	//the optimal view is then selected again
+	bool trackRays = false;
+	void updateChangedRegion(int3 voxelMin, int3 voxelMax);
+
+	//for LabelVisibility, a sphere ray skips the bricks of LABEL_BRICK_SIZE^3 voxels that are transparent and cannot raise its label,
+	//and stops once it reached the max label of the volume. the result is the same as without the index.
+	//the index is rebuilt when the label volume, the transfer function or the volume content version change,
+	//and in the changed range by updateChangedRegion(), which has to be called after a deformation
+	bool useLabelBricks = true;
+	//statistics of the sphere rays cast by the batched evaluations since the last compute_SkelSampling()
+	long long numRaysCast = 0;
+	double castSeconds = 0;
+	double GetRaysPerSecond(){ return castSeconds > 0 ? numRaysCast / castSeconds : 0; }
+
 	bool useHist = true;  //most papers do not use histogram to compute entropy. however we mostly use histogram. if true, each bin will be computed a probability; if false, each pixel will be computed a probability
 	int maxLabel = 2; //!! data dependant
 	//generally maxLabel needs to be less than nbins. or else may have segmentation fault
 
-	std::string dataFolder;
+	std::string dataFolder; //where the bilateral filtered volume is cached
 	bool noBilat = false;//only true for colon
+	//standard deviations of the spatial and the range gaussian of the bilateral filter of Tao09Detail, in voxels and for values normalized to [0,1].
+	//they are not taken from the paper: sigma 1 voxel matches the 3x3x3 support of the filter, and 0.1 of the value range is a usual width of the range kernel
+	float bilateralSigmaS = 1.0f, bilateralSigmaR = 0.1f;
 
 private:
 	std::shared_ptr<Volume> volume;
 	std::shared_ptr<RayCastingParameters> rcp;
 	
-	VolumeCUDA volumeGradient;
-	VolumeCUDA filteredVolumeGradient;
+	//bilateral filtered volume of Tao09Detail. the normals of both volumes are computed on the fly
+	VolumeCUDA filteredVolume;
 
 	float computeVectorEntropy(float* ary, int size);
 
@@ -100,7 +192,9 @@ private:
 
 	const int nbins = 32;
 	float* d_hist;
-	std::vector<float*> cubeFaceHists;
+	float* d_cubeHists = 0; //6*nbins, the histograms of the faces one after the other
+	float* d_cubeEntropies = 0;
+	void computeCubeEntropyCPU(float3 eyeInLocal, float3 viewDir, float3 upDir, VPMethod m, int binsUsed);
 
 	std::shared_ptr<Volume> resVol = 0;
 
@@ -116,9 +210,79 @@ private:
 
 	float computeLocalSphereEntropy(float3 eyeInLocal, VPMethod m);
 
+	float* getBilateralVolume();
+	void computeTao09Gradients(float* &gradient, float* &bGradient);
+	//host copies of the gradients for the cpu evaluation of Tao09Detail, as float4 tuples. only computed when first needed
+	std::vector<float> gradientOriCPU, gradientFilteredCPU;
+	//host copy of volume->volumeCuda for the cpu evaluation, since the deformations only change the device volume.
+	//read back at the first use, when the content version changed, and in the changed range by updateChangedRegion()
+	std::vector<float> volumeValuesCPU;
+	unsigned int volumeValuesCPUVersion = 0;
+	void updateVolumeValuesCPU(int3 voxelMin, int3 voxelMax);
+	void computeSphereEntropiesGPU(const std::vector<float3> &eyes, VPMethod m, std::vector<float> &entropies, int sampleStride, float stepScale);
+	void computeSphereEntropiesCPU(const std::vector<float3> &eyes, VPMethod m, std::vector<float> &entropies, int sampleStride, float stepScale);
+	bool prepareCPU(VPMethod m);
+	int castSphereRayCPU(float3 eye, float3 dir, VPMethod m, float stepScale);
+	//bin of each ray, given as (index in eyes, index of the sphere sample)
+	void castSphereRays(const std::vector<float3> &eyes, const std::vector<int2> &rays, VPMethod m, std::vector<unsigned char> &bins);
+	void castSphereRaysGPU(const std::vector<float3> &eyes, const std::vector<int2> &rays, VPMethod m, std::vector<unsigned char> &bins);
+	void castSphereRaysCPU(const std::vector<float3> &eyes, const std::vector<int2> &rays, VPMethod m, std::vector<unsigned char> &bins);
+
+	//what the entropies depend on besides the candidates and the method
+	struct EvaluationState
+	{
+		unsigned int volumeVersion = 0;
+		int3 volumeSize = make_int3(0, 0, 0);
+		float3 spacing = make_float3(0, 0, 0);
+		float transFuncP1 = 0, transFuncP2 = 0, density = 0, tstep = 0;
+		int maxSteps = 0, maxLabel = 0;
+		bool operator==(const EvaluationState &s) const;
+	};
+	EvaluationState currentEvaluationState();
+
+	struct CandidateCache
+	{
+		bool valid = false;
+		VPMethod method;
+		EvaluationState state;
+		std::vector<float3> eyes;
+		std::vector<int> skel; //index of the skeleton view of each candidate
+		std::vector<float> coarse;
+		std::vector<float> fine; //-1 if not refined yet
+		//for trackRays: per refined candidate, the bin of each sphere ray and the histogram
+		std::vector<char> tracked;
+		std::vector<unsigned char> rayBins;
+		std::vector<int> hists;
+	};
+	CandidateCache candidateCache;
+	//method of the last compute_SkelSampling() of Tao09Detail or LabelVisibility, for updateChangedRegion()
+	bool skelSearched = false;
+	VPMethod skelSearchMethod;
+	void hierarchicalSkelSearch(VPMethod m);
+	//whether the sphere ray r of the eye, sampled with stepScale times tstep, reaches the box [boxMin, boxMax] in local coordinates
+	bool sphereRayCrossesBox(float3 eye, int r, float3 boxMin, float3 boxMax, float stepScale);
+	void refineTracked(const std::vector<int> &candidates, VPMethod m, std::vector<float> &entropies);
+
 	bool labelBeenSet = false;
+	std::shared_ptr<VolumeCUDA> labelVolume; //kept to hash its content when there is no labelValues
+
+	//per brick of the label index, the max label over the brick and its one voxel apron, shifted left by one,
+	//with bit 0 set if the opacity may be positive somewhere in the brick. the apron covers the trilinear reads of the volume
+	unsigned int* d_labelBricks = 0;
+	int3 labelBrickGridSize = make_int3(0, 0, 0);
+	unsigned int maxLabelInVolume = 0;
+	//rebuild the bricks overlapping the voxel range [voxelMin, voxelMax], or all of them if the index is stale, and upload the index to the constants of the ray casting
+	void buildLabelBricks(int3 voxelMin, int3 voxelMax);
+	bool labelBricksDirty = true;
+	unsigned int labelBricksVersion = 0; //VolumeCUDA::contentVersion of the volume the index was built from
+	//rebuild the index if it is stale, before a LabelVisibility launch
+	void prepareLabelBricks();
+	void setLabelBricksEnabled(bool enabled);
+	StopWatchInterface *castTimer = 0;
 
 	float3 indToLocal(int i, int j, int k);
+	unsigned long long hashUniformSamplingInput(VPMethod m);
+	std::atomic<bool> cancelRequested{ false }; //cleared when a computation stops on it or finishes
 	bool spherePointSet = false;
 
 	StopWatchInterface *timer = 0;
@@ -0,0 +1,236 @@
+#include "ViewpointEvaluator.h"
+#include "ThreadPool.h"
+
+#include <helper_math.h>
+#include <algorithm>
+
+//host versions of the texture reads of the gpu evaluation: unnormalized coordinates, border address mode
+static float sampleLinear(const float* v, int3 size, float3 c)
+{
+	float3 p = c - 0.5f;
+	int3 i0 = make_int3(floorf(p.x), floorf(p.y), floorf(p.z));
+	float3 f = p - make_float3(i0);
+	float res = 0;
+	for (int k = 0; k < 2; k++){
+		for (int j = 0; j < 2; j++){
+			for (int i = 0; i < 2; i++){
+				int x = i0.x + i, y = i0.y + j, z = i0.z + k;
+				if (x < 0 || y < 0 || z < 0 || x >= size.x || y >= size.y || z >= size.z)
+					continue;
+				float w = (i ? f.x : 1 - f.x) * (j ? f.y : 1 - f.y) * (k ? f.z : 1 - f.z);
+				res += w * v[(z * size.y + y) * size.x + x];
+			}
+		}
+	}
+	return res;
+}
+
+static float3 sampleLinear3(const float* v4, int3 size, float3 c)
+{
+	float3 p = c - 0.5f;
+	int3 i0 = make_int3(floorf(p.x), floorf(p.y), floorf(p.z));
+	float3 f = p - make_float3(i0);
+	float3 res = make_float3(0, 0, 0);
+	for (int k = 0; k < 2; k++){
+		for (int j = 0; j < 2; j++){
+			for (int i = 0; i < 2; i++){
+				int x = i0.x + i, y = i0.y + j, z = i0.z + k;
+				if (x < 0 || y < 0 || z < 0 || x >= size.x || y >= size.y || z >= size.z)
+					continue;
+				float w = (i ? f.x : 1 - f.x) * (j ? f.y : 1 - f.y) * (k ? f.z : 1 - f.z);
+				const float* g = v4 + 4 * ((z * size.y + y) * size.x + x);
+				res += w * make_float3(g[0], g[1], g[2]);
+			}
+		}
+	}
+	return res;
+}
+
+static unsigned short samplePoint(const unsigned short* v, int3 size, float3 c)
+{
+	int x = floorf(c.x), y = floorf(c.y), z = floorf(c.z);
+	if (x < 0 || y < 0 || z < 0 || x >= size.x || y >= size.y || z >= size.z)
+		return 0;
+	return v[(z * size.y + y) * size.x + x];
+}
+
+//host data needed by the method. returns false if it is missing
+bool ViewpointEvaluator::prepareCPU(VPMethod m)
+{
+	if (volumeValuesCPU.size() == 0 || volumeValuesCPUVersion != volume->volumeCuda.contentVersion)
+		updateVolumeValuesCPU(make_int3(0, 0, 0), volume->size - 1);
+	if (m == Tao09Detail && gradientOriCPU.size() == 0){
+		float* gradient = 0;
+		float* bGradient = 0;
+		computeTao09Gradients(gradient, bGradient);
+		int n = volume->size.x * volume->size.y * volume->size.z * 4;
+		gradientOriCPU.assign(gradient, gradient + n);
+		gradientFilteredCPU.assign(bGradient, bGradient + n);
+		delete[] gradient;
+		delete[] bGradient;
+	}
+	if (m == LabelVisibility && labelValues == 0){
+		std::cout << "host label volume not set for the cpu viewpoint evaluator! " << std::endl;
+		return false;
+	}
+	return true;
+}
+
+void ViewpointEvaluator::updateVolumeValuesCPU(int3 voxelMin, int3 voxelMax)
+{
+	size_t n = (size_t)volume->size.x * volume->size.y * volume->size.z;
+	if (volume->volumeCuda.content == 0){
+		volumeValuesCPU.assign(volume->values, volume->values + n);
+		return;
+	}
+	if (volumeValuesCPU.size() != n || volumeValuesCPUVersion != volume->volumeCuda.contentVersion){
+		volumeValuesCPU.resize(n);
+		voxelMin = make_int3(0, 0, 0);
+		voxelMax = volume->size - 1;
+	}
+	voxelMin = clamp(voxelMin, make_int3(0, 0, 0), volume->size - 1);
+	voxelMax = clamp(voxelMax, make_int3(0, 0, 0), volume->size - 1);
+	if (voxelMin.x <= voxelMax.x && voxelMin.y <= voxelMax.y && voxelMin.z <= voxelMax.z)
+		volume->volumeCuda.VolumeCUDA_readRegion(volumeValuesCPU.data(), volume->size, voxelMin, voxelMax - voxelMin + 1);
+	volumeValuesCPUVersion = volume->volumeCuda.contentVersion;
+}
+
+//same as d_castSphereRayNoColor() followed by sphereRayBin()
+int ViewpointEvaluator::castSphereRayCPU(float3 eye, float3 dir, VPMethod m, float stepScale)
+{
+	const int3 volumeSize = volume->size;
+	const float3 spacing = volume->spacing;
+	const float3 boxMax = spacing*make_float3(volumeSize);
+	const RayCastingParameters &r = *rcp;
+	const float tstep = r.tstep * stepScale;
+
+	float3 invR = make_float3(1.0f) / dir;
+	float3 tbot = invR * (make_float3(0.0f) - eye);
+	float3 ttop = invR * (boxMax - eye);
+	float3 tmax = fmaxf(ttop, tbot);
+	float tfar = fminf(fminf(tmax.x, tmax.y), fminf(tmax.x, tmax.z));
+
+	float t = 0.01f;
+	float3 pos = eye + dir*t;
+	float3 step = dir*tstep;
+	float sumW = 0;
+	unsigned short label = 0;
+	float detailDescriptor = 0;
+	const float lightingThr = 0.000001;
+
+	for (int i = 0; i < r.maxSteps; i++){
+		float3 coord = pos / spacing;
+		float sample = sampleLinear(volumeValuesCPU.data(), volumeSize, coord);
+		float a = clamp((sample - r.transFuncP2) / (r.transFuncP1 - r.transFuncP2), 0.0f, 1.0f) * r.density;
+		if (stepScale != 1.0f)
+			a = 1.0f - powf(1.0f - std::min(a, 1.0f), stepScale);
+		float visibility = 1.0f - sumW;
+		sumW = sumW + a*(1.0f - sumW);
+
+		if (m == Tao09Detail){
+			float curDetail = 0;
+			float3 normalOri = sampleLinear3(gradientOriCPU.data(), volumeSize, coord) / spacing;
+			float3 normalFiltered = sampleLinear3(gradientFilteredCPU.data(), volumeSize, coord) / spacing;
+			if (length(normalOri) > lightingThr){
+				if (length(normalFiltered) > lightingThr){
+					curDetail = 1 - dot(normalize(normalOri), normalize(normalFiltered));
+				}
+				else{
+					curDetail = 1;
+				}
+			}
+			detailDescriptor = detailDescriptor + curDetail*a*visibility;
+		}
+
+		if (sumW > 0.95f){
+			break;
+		}
+		else if (m == LabelVisibility){
+			label = std::max(label, samplePoint(labelValues, volumeSize, coord));
+		}
+
+		t += tstep;
+		if (t > tfar){
+			break;
+		}
+		pos += step;
+	}
+
+	if (m == Tao09Detail)
+		return std::min((int)((detailDescriptor / 2)*nbins), nbins - 1);
+	else
+		return std::min((int)label, nbins - 1);
+}
+
+void ViewpointEvaluator::computeSphereEntropiesCPU(const std::vector<float3> &eyes, VPMethod m, std::vector<float> &entropies, int sampleStride, float stepScale)
+{
+	if (!prepareCPU(m))
+		return;
+	const int binsUsed = (m == LabelVisibility) ? (maxLabel + 1) : nbins;
+
+	ThreadPool::global().parallelFor(eyes.size(), [&](int e){
+		std::vector<float> hist(nbins, 0);
+		for (int s = 0; s < numSphereSample; s += sampleStride){
+			hist[castSphereRayCPU(eyes[e], sphereSamples[s].p, m, stepScale)] += 1;
+		}
+
+		entropies[e] = histEntropy(hist.data(), binsUsed);
+	});
+}
+
+void ViewpointEvaluator::castSphereRaysCPU(const std::vector<float3> &eyes, const std::vector<int2> &rays, VPMethod m, std::vector<unsigned char> &bins)
+{
+	if (!prepareCPU(m))
+		return;
+	//in chunks of rays, since a task per ray would cost more than the ray
+	const int chunk = 256;
+	ThreadPool::global().parallelFor((rays.size() + chunk - 1) / chunk, [&](int c){
+		for (int k = c * chunk; k < std::min((int)rays.size(), (c + 1) * chunk); k++){
+			bins[k] = castSphereRayCPU(eyes[rays[k].x], sphereSamples[rays[k].y].p, m, 1.0f);
+		}
+	});
+}
+
+//same as d_cubeFace()
+static int cubeFace(float3 dir, float3 viewVec, float3 upVec)
+{
+	float3 sidevec = cross(upVec, viewVec);
+	float rayz = dot(dir, upVec), rayx = dot(dir, viewVec), rayy = dot(dir, sidevec);
+
+	float xabs = fabsf(rayx), yabs = fabsf(rayy), zabs = fabsf(rayz);
+	if (xabs > yabs && xabs > zabs){
+		return rayx > 0 ? 0 : 1;
+	}
+	else if (yabs > xabs && yabs > zabs){
+		return rayy > 0 ? 2 : 3;
+	}
+	else{
+		return rayz > 0 ? 4 : 5;
+	}
+}
+
+void ViewpointEvaluator::computeCubeEntropyCPU(float3 eyeInLocal, float3 viewDir, float3 upDir, VPMethod m, int binsUsed)
+{
+	if (!prepareCPU(m))
+		return;
+	//each chunk of rays fills its own copy of the six histograms, which are summed at the end
+	const int chunk = 256;
+	int numChunks = (numSphereSample + chunk - 1) / chunk;
+	std::vector<int> chunkHists((size_t)numChunks * 6 * nbins, 0);
+	ThreadPool::global().parallelFor(numChunks, [&](int c){
+		int* hist = &(chunkHists[(size_t)c * 6 * nbins]);
+		for (int s = c * chunk; s < std::min(numSphereSample, (c + 1) * chunk); s++){
+			float3 dir = sphereSamples[s].p;
+			hist[cubeFace(dir, viewDir, upDir) * nbins + castSphereRayCPU(eyeInLocal, dir, m, 1.0f)]++;
+		}
+	});
+
+	for (int f = 0; f < 6; f++){
+		std::vector<float> hist(binsUsed, 0);
+		for (int c = 0; c < numChunks; c++){
+			for (int b = 0; b < binsUsed; b++)
+				hist[b] += chunkHists[((size_t)c * 6 + f) * nbins + b];
+		}
+		cubeInfo[f] = histEntropy(hist.data(), binsUsed);
+	}
+}